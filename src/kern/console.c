@@ -9,17 +9,67 @@
 #include "string.h"
 #include "intr.h"
 #include "uart.h"
+#include "smp.h"
+#include "thread.h"
+
+//           COMPILE-TIME PARAMETERS
+//           
+
+// LOG_RING_SIZE is the size in bytes of each hart's log ring; it must be a
+// power of two. Define CONSOLE_SYNC to write each message out before kprintf
+// returns, which helps when debugging a hang with interrupts disabled.
+
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 4096
+#endif
+
+//           INTERNAL TYPE DEFINITIONS
+//           
+
+// Console output is appended to the log ring of the hart producing it. Only the
+// owning hart writes to its ring, with interrupts disabled, so appending takes
+// no lock. A message is published by advancing /tail/ once it is complete, so
+// messages from different harts are not interleaved. Published bytes are
+// drained to UART0 by its transmit interrupt once uart.c has set that up (see
+// com0_start_tx), and by polling before then, when a ring is full, and when
+// the console is flushed. Only one hart drains at a time (log_draining), and
+// it empties one ring before moving on to the next.
+
+struct log_ring {
+	unsigned int head; // next byte to drain, advanced by drainer
+	unsigned int tail; // end of published bytes, advanced by owner
+	unsigned int pos; // end of appended bytes (owner only)
+	int depth; // nesting of log_begin calls (owner only)
+	int saved_intr_state; // from outermost log_begin
+	char cprev; // previous character, for newline conversion
+	char buf[LOG_RING_SIZE];
+};
 
 //           INTERNAL FUNCTION DECLARATIONS
 //           
 
 static void vprintf_putc(char c, void * aux);
 
+static struct log_ring * log_begin(void);
+static void log_end(struct log_ring * ring);
+static void log_putc(struct log_ring * ring, char c);
+static void log_putc_raw(struct log_ring * ring, char c);
+static int log_getc(char * cptr);
+static int log_empty(void);
+static void log_drain_polled(void);
+
 //           EXPORTED GLOBAL VARIABLES
 //          
 
 int console_initialized = 0;
 
+//           INTERNAL GLOBAL VARIABLES
+//           
+
+static struct log_ring log_rings[NCPU];
+static char log_draining; // set while a hart drains
+static int log_cur; // ring being drained (drainer only)
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
@@ -30,23 +80,10 @@ void console_init(void) {
 }
 
 void console_putchar(char c) {
-	static char cprev = '\0';
+	struct log_ring * const ring = log_begin();
 
-	switch (c) {
-	case '\r':
-		com0_putc(c);
-    	com0_putc('\n');
-    	break;
-	case '\n':
-		if (cprev != '\r')
-			com0_putc('\r');
-		//           nobreak
-	default:
-		com0_putc(c);
-		break;
-	}
-
-	cprev = c;
+	log_putc(ring, c);
+	log_end(ring);
 }
 
 char console_getchar(void) {
@@ -68,9 +105,53 @@ char console_getchar(void) {
 }
 
 void console_puts(const char * str) {
+	struct log_ring * const ring = log_begin();
+
 	while (*str != '\0')
-		console_putchar(*str++);
-	console_putchar('\n');
+		log_putc(ring, *str++);
+	log_putc(ring, '\n');
+	log_end(ring);
+}
+
+void console_flush(void) {
+	while (!log_empty())
+		log_drain_polled();
+}
+
+void console_tx_intr(void) {
+	int room;
+	char c;
+
+	// If another hart is draining by polling, it will empty the rings.
+
+	if (__atomic_exchange_n(&log_draining, 1, __ATOMIC_ACQUIRE)) {
+		com0_stop_tx();
+		return;
+	}
+
+	// Fill the transmit FIFO each time it empties.
+
+	while ((room = com0_tx_room()) != 0) {
+		while (room-- != 0) {
+			if (!log_getc(&c)) {
+				// A hart may publish a message between our check and
+				// stopping the interrupt, after its own com0_start_tx.
+				// Check again.
+
+				com0_stop_tx();
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+				if (!log_empty())
+					com0_start_tx();
+				goto done;
+			}
+
+			com0_tx(c);
+		}
+	}
+
+done:
+	__atomic_store_n(&log_draining, 0, __ATOMIC_RELEASE);
 }
 
 char * console_getsn(char * buf, size_t n) {
@@ -135,18 +216,12 @@ size_t kprintf(const char * fmt, ...)
 	__attribute__ ((alias("console_printf")));
 
 size_t console_vprintf(const char * fmt, va_list ap) {
-	int saved_intr_state;
-  size_t nout;
-
-  if (intr_initialized)
-    saved_intr_state = intr_disable();
+	struct log_ring * const ring = log_begin();
+	size_t nout;
 
-	nout = vgprintf(vprintf_putc, NULL, fmt, ap);
-
-  if (intr_initialized)
-    intr_restore(saved_intr_state);
-  
-  return nout;
+	nout = vgprintf(vprintf_putc, ring, fmt, ap);
+	log_end(ring);
+	return nout;
 }
 
 void console_labeled_printf (
@@ -155,27 +230,140 @@ void console_labeled_printf (
     int src_lineno,
     const char * fmt, ...)
 {
-	int saved_intr_state;
-  va_list ap;
-
-  if (intr_initialized)
-    saved_intr_state = intr_disable();
+	struct log_ring * const ring = log_begin();
+	va_list ap;
 
 	console_printf("%s: %s:%d: ", label, src_flname, src_lineno);
 
 	va_start(ap, fmt);
 	console_vprintf(fmt, ap);
-	console_putchar('\n');
+	log_putc(ring, '\n');
 	va_end(ap);
 
-  if (intr_initialized)
-    intr_restore(saved_intr_state);
+	log_end(ring);
 }
 
 
 //           INTERNAL FUNCTION DEFINITIONS
 //          
 
-void vprintf_putc(char c, void * __attribute__ ((unused)) aux) {
-	console_putchar(c);
-}
\ No newline at end of file
+void vprintf_putc(char c, void * aux) {
+	log_putc(aux, c);
+}
+
+// Starts or continues a message on this hart's log ring. Interrupts stay
+// disabled until the matching log_end.
+
+struct log_ring * log_begin(void) {
+	const int saved_intr_state = intr_disable();
+	struct log_ring * const ring = &log_rings[running_hart()];
+
+	if (ring->depth++ == 0)
+		ring->saved_intr_state = saved_intr_state;
+	
+	return ring;
+}
+
+// Ends a message. The outermost call publishes it and gets it drained.
+
+void log_end(struct log_ring * ring) {
+	if (--ring->depth != 0)
+		return;
+
+	__atomic_store_n(&ring->tail, ring->pos, __ATOMIC_RELEASE);
+
+#ifndef CONSOLE_SYNC
+	if (!com0_start_tx())
+#endif
+		log_drain_polled();
+
+	intr_restore(ring->saved_intr_state);
+}
+
+// Appends a character, converting \n to \r\n and \r to \r\n.
+
+void log_putc(struct log_ring * ring, char c) {
+	switch (c) {
+	case '\r':
+		log_putc_raw(ring, c);
+		log_putc_raw(ring, '\n');
+		break;
+	case '\n':
+		if (ring->cprev != '\r')
+			log_putc_raw(ring, '\r');
+		// nobreak
+	default:
+		log_putc_raw(ring, c);
+		break;
+	}
+
+	ring->cprev = c;
+}
+
+void log_putc_raw(struct log_ring * ring, char c) {
+	// If the ring is full, publish what we have so far and make room by
+	// draining it ourselves.
+
+	while (ring->pos - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+		LOG_RING_SIZE)
+	{
+		__atomic_store_n(&ring->tail, ring->pos, __ATOMIC_RELEASE);
+		log_drain_polled();
+	}
+
+	ring->buf[ring->pos % LOG_RING_SIZE] = c;
+	ring->pos += 1;
+}
+
+// Takes the next published character. Must hold log_draining.
+
+int log_getc(char * cptr) {
+	struct log_ring * ring;
+	unsigned int head;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		ring = &log_rings[log_cur];
+		head = ring->head;
+
+		if (head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+			*cptr = ring->buf[head % LOG_RING_SIZE];
+			__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+			return 1;
+		}
+
+		log_cur = (log_cur + 1) % NCPU;
+	}
+
+	return 0;
+}
+
+int log_empty(void) {
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		if (__atomic_load_n(&log_rings[i].head, __ATOMIC_RELAXED) !=
+			__atomic_load_n(&log_rings[i].tail, __ATOMIC_ACQUIRE))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Drains all rings by polling UART0, unless another hart is already draining.
+
+void log_drain_polled(void) {
+	char c;
+
+	do {
+		if (__atomic_exchange_n(&log_draining, 1, __ATOMIC_ACQUIRE))
+			return;
+
+		while (log_getc(&c))
+			com0_putc(c);
+
+		__atomic_store_n(&log_draining, 0, __ATOMIC_RELEASE);
+	} while (!log_empty());
+}
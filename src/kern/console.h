@@ -13,6 +13,14 @@ extern int console_initialized;
 extern void console_putchar(char c);
 extern char console_getchar(void);
 extern void console_puts(const char * str);
+
+// Output is buffered in per-hart log rings and written to UART0 in the
+// background (see console.c). console_flush waits until all of it is out; it
+// is called before the system halts. console_tx_intr is called by the UART0
+// interrupt handler when the transmitter is ready for more.
+
+extern void console_flush(void);
+extern void console_tx_intr(void);
 extern size_t console_printf(const char * fmt, ...);
 extern size_t console_vprintf(const char * fmt, va_list ap);
 
@@ -25,6 +33,28 @@ extern void console_labeled_printf (
     int src_lineno,
     const char * fmt, ...);
 
+// Log levels. Messages above LOG_LEVEL are compiled out, so klog may be used
+// on fast paths; e.g. make CFLAGS+=-DLOG_LEVEL=LOG_DEBUG for all messages.
+
+#define LOG_ERR     1
+#define LOG_WARN    2
+#define LOG_INFO    3
+#define LOG_DEBUG   4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define klog(level, ...) do { \
+    if ((level) <= LOG_LEVEL) \
+        kprintf(__VA_ARGS__); \
+} while (0)
+
+#define kerr(...) klog(LOG_ERR, __VA_ARGS__)
+#define kwarn(...) klog(LOG_WARN, __VA_ARGS__)
+#define kinfo(...) klog(LOG_INFO, __VA_ARGS__)
+#define kdebug(...) klog(LOG_DEBUG, __VA_ARGS__)
+
 #ifdef DEBUG
 #define debug(...) console_labeled_printf("DEBUG", __FILE__, __LINE__, __VA_ARGS__)
 #else
@@ -43,5 +73,15 @@ extern void com0_init(void);
 extern void com0_putc(char c);
 extern char com0_getc(void);
 
+// Interrupt-driven output on UART0. com0_start_tx enables the transmit
+// interrupt and returns 1, or returns 0 if the interrupt handler is not set up
+// yet. com0_tx_room returns how many characters may be written with com0_tx
+// without waiting (the depth of the transmit FIFO when it is empty, else 0).
+
+extern int com0_start_tx(void);
+extern void com0_stop_tx(void);
+extern int com0_tx_room(void);
+extern void com0_tx(char c);
+
 //           _CONSOLE_H_
 #endif
@@ -137,6 +137,19 @@ static inline void csrw_stvec(void (*handler)(void)) {
     asm inline ("csrw stvec, %0" :: "r" (handler));
 }
 
+// stimecmp (Sstc extension; CSR 0x14d, since older assemblers lack the name)
+
+static inline void csrw_stimecmp(uint64_t val) {
+    asm inline ("csrw 0x14d, %0" :: "r" (val));
+}
+
+static inline uint64_t csrr_stimecmp(void) {
+    uint64_t val;
+
+    asm inline ("csrr %0, 0x14d" : "=r" (val));
+    return val;
+}
+
 // mie
 
 #define RISCV_MIE_SSIE (1 << 1)
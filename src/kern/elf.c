@@ -141,8 +141,8 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)){
     // 4. Set the entry point function pointer
     *entryptr = (void (*)(void))elf_header.e_entry;
 
-    console_printf("current tid: %u\n", current_process()->tid);
-    console_printf("ELF loaded successfully. Entryptr: %p \n", (void*)*entryptr);
+    kdebug("current tid: %u\n", current_process()->tid);
+    kdebug("ELF loaded successfully. Entryptr: %p \n", (void*)*entryptr);
 
     return 0; // Success
 }
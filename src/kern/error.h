@@ -14,5 +14,8 @@
 #define EACCESS     8
 #define EBADFD      9
 #define EMFILE     10
+#define EAGAIN     11
+#define ETIMEDOUT  12
+#define EFAULT     13
 
 #endif // _ERROR_H_
@@ -22,11 +22,28 @@ extern void umode_excp_handler(unsigned int code, struct trap_frame * tfr);
 static void __attribute__ ((noreturn)) default_excp_handler (
     unsigned int code, const struct trap_frame * tfr);
 
+static int uaccess_fixup(struct trap_frame * tfr);
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct uaccess_extable_entry {
+    uintptr_t start; // first guarded instruction
+    uintptr_t end; // end of guarded instructions
+    uintptr_t fixup; // where to resume after a fault
+};
+
 // IMPORTED FUNCTION DECLARATIONS
 //
 
 extern void syscall_handler(struct trap_frame * tfr); // syscall.c
 
+// IMPORTED VARIABLE DECLARATIONS
+//
+
+extern const struct uaccess_extable_entry _uaccess_extable[]; // uaccess.s
+extern const struct uaccess_extable_entry _uaccess_extable_end[];
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -50,6 +67,19 @@ static const char * const excp_names[] = {
 //
 
 void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
+    switch (code) {
+    case RISCV_SCAUSE_LOAD_ACCESS_FAULT:
+    case RISCV_SCAUSE_STORE_ACCESS_FAULT:
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+    case RISCV_SCAUSE_STORE_PAGE_FAULT:
+        // A copy to or from user memory hit a bad user address
+        if (uaccess_fixup(tfr))
+            return;
+        break;
+    default:
+        break;
+    }
+
 	default_excp_handler(code, tfr);
 }
 /**
@@ -76,7 +106,7 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     case RISCV_SCAUSE_INSTR_PAGE_FAULT: // instruction page fault
     case RISCV_SCAUSE_LOAD_PAGE_FAULT: // load page fault
     case RISCV_SCAUSE_STORE_PAGE_FAULT: // store/amo page fault
-        console_printf("page fault in supervisor mode\n");
+        kdebug("page fault in user mode\n");
         memory_handle_page_fault((void *)csrr_stval());
         break;
     case RISCV_SCAUSE_ECALL_FROM_UMODE:
@@ -88,6 +118,22 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     }
 }
 
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int uaccess_fixup(struct trap_frame * tfr) {
+    const struct uaccess_extable_entry * ent;
+
+    for (ent = _uaccess_extable; ent < _uaccess_extable_end; ent++) {
+        if (ent->start <= tfr->sepc && tfr->sepc < ent->end) {
+            tfr->sepc = ent->fixup;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 void default_excp_handler (
     unsigned int code, const struct trap_frame * tfr)
 {
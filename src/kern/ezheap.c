@@ -19,6 +19,8 @@
 #include "string.h"
 #include "halt.h"
 #include "memory.h"
+#include "intr.h"
+#include "spinlock.h"
 
 #include <stdint.h>
 
@@ -32,6 +34,8 @@ char heap_initialized = 0;
 
 static void * heap_start;
 static void * heap_end;
+static struct spinlock heap_lock =
+    SPINLOCK_INITIALIZER("heap", SPINLOCK_ORDER_HEAP);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -45,7 +49,9 @@ void heap_init(void * start, void * end) {
 }
 
 void * kmalloc(size_t size) {
+    int saved_intr_state;
     void * new_block;
+    void * block;
 
     trace("%s(%zu)", __func__, size);
 
@@ -55,18 +61,27 @@ void * kmalloc(size_t size) {
     if (PAGE_SIZE < size)
         panic("heap alloc request too large");
     
+    saved_intr_state = intr_disable();
+    spin_acquire(&heap_lock);
+
     // If the request fits in the current heap block, allocate from it.
 
     if (size <= heap_end - heap_start) {
         heap_end -= size;
-        return heap_end;
+        block = heap_end;
+        goto done;
     }
 
     // The request is no more than a page, but we don't have room for it in the
     // current block of heap memory. Get a direct-mapped page of physical memory
-    // from the memory manager.
+    // from the memory manager, or fail if there is none.
+
+    new_block = memory_try_alloc_page();
 
-    new_block = memory_alloc_page();
+    if (new_block == NULL) {
+        block = NULL;
+        goto done;
+    }
 
     // Do we have more free space left if we abandon the current block and
     // switch to the new one, or just use the new block for this request and
@@ -76,9 +91,14 @@ void * kmalloc(size_t size) {
         // switch to new block
         heap_start = new_block;
         heap_end = new_block + PAGE_SIZE - size;
-        return heap_end;
+        block = heap_end;
     } else
-        return new_block;
+        block = new_block;
+
+done:
+    spin_release(&heap_lock);
+    intr_restore(saved_intr_state);
+    return block;
 }
 
 void * kcalloc(size_t n, size_t size) {
@@ -90,7 +110,10 @@ void * kcalloc(size_t n, size_t size) {
         panic("heap alloc request too large");
 
     ptr = kmalloc(n * size);
-    memset(ptr, 0, n * size);
+
+    if (ptr != NULL)
+        memset(ptr, 0, n * size);
+
     return ptr;
 }
 
@@ -14,6 +14,8 @@ extern int fs_open(const char * name, struct io_intf ** ioptr);
 void fs_close(struct io_intf *io);
 long fs_read(struct io_intf *io, void *buf, unsigned long n);
 long fs_write(struct io_intf *io, const void *buf, unsigned long n);
+long fs_readat(struct io_intf *io, uint64_t pos, void *buf, unsigned long n);
+long fs_writeat(struct io_intf *io, uint64_t pos, const void *buf, unsigned long n);
 int fs_ioctl(struct io_intf *io, int cmd, void *arg);
 //int fs_getlen(struct file_struct *fd, void *arg) {
 //int fs_getpos(struct file_struct *fd, void *arg) {
@@ -11,11 +11,13 @@
 // terminate. Will not work on real hardware.
 
 void halt_success(void) {
+	console_flush();
 	*(int*)0x100000 = 0x5555; // success
 	for (;;) continue; // just in case
 }
 
 void halt_failure(void) {
+	console_flush();
 	*(int*)0x100000 = 0x3333; // failure
 	for (;;) continue; // just in case
 }
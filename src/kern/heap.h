@@ -11,6 +11,8 @@
 extern void heap_init(void * start, void * end);
 extern char heap_initialized;
 
+//           kmalloc and kcalloc return NULL if there is no free memory.
+
 extern void * kmalloc(size_t size);
 extern void * kcalloc(size_t n, size_t size);
 extern void * krealloc(void * ptr, size_t size);
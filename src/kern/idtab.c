@@ -0,0 +1,147 @@
+// idtab.c - Tables of objects indexed by small integer IDs
+//
+
+#include "idtab.h"
+#include "heap.h"
+#include "halt.h"
+#include "error.h"
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// Returns the chunk holding ID /id/, allocating it if needed, or NULL if
+// there is no memory for it.
+
+static void ** get_chunk(struct idtab * tab, int id);
+
+// Marks ID /id/ used and maps it to /ptr/.
+
+static void set_id(struct idtab * tab, void ** chunk, int id, void * ptr);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void idtab_init(struct idtab * tab) {
+    int i;
+
+    for (i = 0; i < IDTAB_NCHUNK; i++) {
+        tab->chunk[i] = NULL;
+        tab->used[i] = 0;
+    }
+
+    for (i = 0; i < IDTAB_CHUNK; i++)
+        tab->first[i] = NULL;
+
+    tab->full = 0;
+    tab->chunk[0] = tab->first;
+}
+
+int idtab_alloc(struct idtab * tab, void * ptr) {
+    void ** chunk;
+    int word;
+    int id;
+
+    // The lowest chunk with a free ID, then the lowest free ID in it. Chunks
+    // beyond IDTAB_NCHUNK have their bit in full clear, so check the range.
+
+    if (tab->full == UINT64_MAX)
+        return -EAGAIN;
+
+    word = __builtin_ctzll(~tab->full);
+
+    if (IDTAB_NCHUNK <= word)
+        return -EAGAIN;
+
+    id = word * IDTAB_CHUNK + __builtin_ctzll(~tab->used[word]);
+    chunk = get_chunk(tab, id);
+
+    if (chunk == NULL)
+        return -EAGAIN;
+
+    set_id(tab, chunk, id, ptr);
+    return id;
+}
+
+int idtab_insert(struct idtab * tab, int id, void * ptr) {
+    void ** chunk;
+
+    if (id < 0 || IDTAB_MAXID <= id)
+        return -EINVAL;
+
+    if (tab->used[id / IDTAB_CHUNK] & (1ULL << (id % IDTAB_CHUNK)))
+        return -EBUSY;
+
+    chunk = get_chunk(tab, id);
+
+    if (chunk == NULL)
+        return -EAGAIN;
+
+    set_id(tab, chunk, id, ptr);
+    return 0;
+}
+
+void idtab_free(struct idtab * tab, int id) {
+    const int word = id / IDTAB_CHUNK;
+    const uint64_t bit = 1ULL << (id % IDTAB_CHUNK);
+
+    assert (0 <= id && id < IDTAB_MAXID);
+    assert (tab->used[word] & bit);
+
+    __atomic_store_n(&tab->chunk[word][id % IDTAB_CHUNK], NULL,
+        __ATOMIC_RELEASE);
+
+    tab->used[word] &= ~bit;
+    tab->full &= ~(1ULL << word);
+}
+
+int idtab_next(const struct idtab * tab, int id) {
+    uint64_t bits;
+    int word;
+
+    if (id < 0)
+        id = 0;
+
+    for (word = id / IDTAB_CHUNK; word < IDTAB_NCHUNK; word++) {
+        bits = tab->used[word];
+
+        if (word == id / IDTAB_CHUNK)
+            bits &= ~0ULL << (id % IDTAB_CHUNK);
+
+        if (bits != 0)
+            return word * IDTAB_CHUNK + __builtin_ctzll(bits);
+    }
+
+    return -1;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void ** get_chunk(struct idtab * tab, int id) {
+    const int word = id / IDTAB_CHUNK;
+    void ** chunk;
+
+    chunk = tab->chunk[word];
+
+    if (chunk == NULL) {
+        chunk = kcalloc(IDTAB_CHUNK, sizeof(void *));
+
+        // The chunk is zeroed before idtab_get can see it.
+
+        if (chunk != NULL)
+            __atomic_store_n(&tab->chunk[word], chunk, __ATOMIC_RELEASE);
+    }
+
+    return chunk;
+}
+
+void set_id(struct idtab * tab, void ** chunk, int id, void * ptr) {
+    const int word = id / IDTAB_CHUNK;
+
+    tab->used[word] |= 1ULL << (id % IDTAB_CHUNK);
+
+    if (tab->used[word] == UINT64_MAX)
+        tab->full |= 1ULL << word;
+
+    __atomic_store_n(&chunk[id % IDTAB_CHUNK], ptr, __ATOMIC_RELEASE);
+}
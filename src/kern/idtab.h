@@ -0,0 +1,106 @@
+// idtab.h - Tables of objects indexed by small integer IDs
+//
+
+#ifndef _IDTAB_H_
+#define _IDTAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An ID table maps IDs in [0,IDTAB_MAXID) to object pointers, e.g. thread IDs
+// to struct thread and process IDs to struct process. Free IDs are tracked in a
+// two-level bitmap, so idtab_alloc finds the lowest free ID with two
+// count-trailing-zeros operations, and IDs are reused as soon as they are
+// freed. The pointer table is allocated in chunks of IDTAB_CHUNK entries as
+// IDs are handed out, so a table only takes space for the IDs in use (plus the
+// embedded first chunk).
+//
+// The table does no locking of its own: the caller must serialize idtab_alloc,
+// idtab_insert and idtab_free. Chunks are never freed, so idtab_get may be
+// called without holding the caller's lock; it then returns either the old or
+// the new pointer of an ID being changed concurrently.
+
+// COMPILE-TIME PARAMETERS
+//
+
+// IDTAB_MAXID is the number of IDs in a table. It may not exceed
+// IDTAB_CHUNK*IDTAB_CHUNK, since one word summarizes which chunks are full.
+
+#ifndef IDTAB_MAXID
+#define IDTAB_MAXID 4096
+#endif
+
+#define IDTAB_CHUNK 64 // IDs per chunk and per bitmap word
+
+#define IDTAB_NCHUNK (IDTAB_MAXID / IDTAB_CHUNK)
+
+#if IDTAB_MAXID % IDTAB_CHUNK != 0 || IDTAB_CHUNK < IDTAB_NCHUNK
+#error "IDTAB_MAXID must be a multiple of 64 and at most 4096"
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct idtab {
+    void ** chunk[IDTAB_NCHUNK]; // chunk[i] holds IDs i*IDTAB_CHUNK and up
+    uint64_t used[IDTAB_NCHUNK]; // bit set if ID allocated
+    uint64_t full; // bit i set if used[i] has all bits set
+    void * first[IDTAB_CHUNK]; // storage for chunk[0]
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void idtab_init(struct idtab * tab)
+// Initializes an empty ID table.
+
+extern void idtab_init(struct idtab * tab);
+
+// int idtab_alloc(struct idtab * tab, void * ptr)
+// Allocates the lowest free ID and maps it to /ptr/. Returns the ID, or -EAGAIN
+// if all IDs are in use.
+
+extern int idtab_alloc(struct idtab * tab, void * ptr);
+
+// int idtab_insert(struct idtab * tab, int id, void * ptr)
+// Allocates a specific ID and maps it to /ptr/. Returns 0 on success, -EINVAL
+// if /id/ is out of range, -EBUSY if it is in use, or -EAGAIN if there is no
+// memory for its chunk.
+
+extern int idtab_insert(struct idtab * tab, int id, void * ptr);
+
+// void idtab_free(struct idtab * tab, int id)
+// Frees an allocated ID for reuse.
+
+extern void idtab_free(struct idtab * tab, int id);
+
+// int idtab_next(const struct idtab * tab, int id)
+// Returns the lowest allocated ID not below /id/, or -1 if there is none. Like
+// idtab_alloc, it finds it in the bitmap rather than trying every ID, so the
+// caller can walk the table in order under one hold of its lock.
+
+extern int idtab_next(const struct idtab * tab, int id);
+
+// void * idtab_get(const struct idtab * tab, int id)
+// Returns the pointer mapped to /id/, or NULL if /id/ is out of range or free.
+
+static inline void * idtab_get(const struct idtab * tab, int id);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void * idtab_get(const struct idtab * tab, int id) {
+    void ** chunk;
+
+    if (id < 0 || IDTAB_MAXID <= id)
+        return NULL;
+
+    chunk = __atomic_load_n(&tab->chunk[id / IDTAB_CHUNK], __ATOMIC_ACQUIRE);
+
+    if (chunk == NULL)
+        return NULL;
+
+    return __atomic_load_n(&chunk[id % IDTAB_CHUNK], __ATOMIC_ACQUIRE);
+}
+
+#endif // _IDTAB_H_
@@ -54,11 +54,19 @@ void intr_init(void) {
     plic_init();
 
     csrw_sip(0); // clear all pending interrupts
-    csrw_sie(RISCV_SIE_SEIE); //enable interrupts from plic
+    // enable interrupts from plic and IPIs relayed by M mode
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE);
 
     intr_initialized = 1;
 }
 
+void intr_hart_init(void) {
+    trace("%s()", __func__);
+
+    csrw_sip(0);
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE);
+}
+
 void intr_register_isr (
     int irqno, int prio,
     void (*isr)(int irqno, void * aux),
@@ -94,18 +102,39 @@ void intr_handler(int code, struct trap_frame * tfr) {
     switch (code) {
     case RISCV_SCAUSE_INTR_EXCODE_STI:
         timer_intr_handler(tfr);
+        break;
     case RISCV_SCAUSE_INTR_EXCODE_SEI:
         extern_intr_handler();
         break;
+    case RISCV_SCAUSE_INTR_EXCODE_SSI:
+        // Inter-processor interrupt relayed by the M-mode trap handler. The
+        // sender only wants us to notice new work on our run queue, which the
+        // preemption check below takes care of, and to restart our tick if
+        // it was stopped.
+        csrc_sip(RISCV_SIP_SSIP);
+        timer_restart_tick();
+        break;
     default:
         panic("unhandled interrupt");
         break;
     }
 
-    // If we were running user mode, yield thread.
+    // Preempt the interrupted thread if the scheduler decided its time slice
+    // is used up or a thread with less virtual runtime became ready. Threads
+    // interrupted in U mode can always be preempted. Kernel code assumes it is
+    // only switched out when it blocks, so threads interrupted in S mode are
+    // only preempted when compiled with KERNEL_PREEMPT, and only if they were
+    // running with interrupts enabled.
+
+    if (!thread_preempt_pending())
+        return;
 
     if ((tfr->sstatus & RISCV_SSTATUS_SPP) == 0)
         thread_yield();
+#ifdef KERNEL_PREEMPT
+    else if (tfr->sstatus & RISCV_SSTATUS_SPIE)
+        thread_yield();
+#endif
 }
 
 // INTERNAL FUNCTION DEFINITIONS
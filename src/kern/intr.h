@@ -23,6 +23,11 @@ extern char intr_initialized;
 
 extern void intr_init(void);
 
+// Initializes interrupt handling on a secondary hart. Must be called on the
+// hart being initialized, after intr_init has run on the boot hart.
+
+extern void intr_hart_init(void);
+
 static inline int intr_enable(void);
 static inline int intr_disable(void);
 static inline void intr_restore(int saved);
@@ -68,6 +68,52 @@ long iowrite(struct io_intf * io, const void * buf, unsigned long n) {
     return acc;
 }
 
+long ioreadat(struct io_intf * io, uint64_t pos, void * buf, unsigned long n) {
+    uint64_t oldpos;
+    long result;
+    int rc;
+
+    if (io->ops->readat != NULL)
+        return io->ops->readat(io, pos, buf, n);
+
+    if (io->ops->read == NULL)
+        return -ENOTSUP;
+
+    rc = ioctl(io, IOCTL_GETPOS, &oldpos);
+    if (rc == 0)
+        rc = ioseek(io, pos);
+    if (rc != 0)
+        return rc;
+
+    result = io->ops->read(io, buf, n);
+    ioseek(io, oldpos);
+    return result;
+}
+
+long iowriteat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long n)
+{
+    uint64_t oldpos;
+    long result;
+    int rc;
+
+    if (io->ops->writeat != NULL)
+        return io->ops->writeat(io, pos, buf, n);
+
+    if (io->ops->write == NULL)
+        return -ENOTSUP;
+
+    rc = ioctl(io, IOCTL_GETPOS, &oldpos);
+    if (rc == 0)
+        rc = ioseek(io, pos);
+    if (rc != 0)
+        return rc;
+
+    result = io->ops->write(io, buf, n);
+    ioseek(io, oldpos);
+    return result;
+}
+
 //           Initialize an io_lit. This function should be called with an io_lit, a buffer, and the size of the device.
 //           It should set up all fields within the io_lit struct so that I/O operations can be performed on the io_lit
 //           through the io_intf interface. This function should return a pointer to an io_intf object that can be used 
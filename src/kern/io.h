@@ -22,12 +22,19 @@ struct io_intf; // forward decl.
 // allowed to write fewer than /n/ bytes, but must write at least one. A return
 // value of 0 from /write/ indicates an end-of-file condition (for files that
 // cannot grow).
+//
+// The optional /readat/ and /writeat/ functions behave like /read/ and /write/,
+// but transfer at position /pos/ and leave the current position unchanged.
 
 struct io_ops {
 	void (*close)(struct io_intf * io);
 	long (*read)(struct io_intf * io, void * buf, unsigned long bufsz);
 	long (*write)(struct io_intf * io, const void * buf, unsigned long n);
 	int (*ctl)(struct io_intf * io, int cmd, void * arg);
+	long (*readat)(struct io_intf * io,
+		uint64_t pos, void * buf, unsigned long bufsz);
+	long (*writeat)(struct io_intf * io,
+		uint64_t pos, const void * buf, unsigned long n);
 };
 
 struct io_intf {
@@ -111,6 +118,21 @@ extern long
 __attribute__ ((nonnull(1,2)))
 iowrite(struct io_intf * io, const void * buf, unsigned long n);
 
+// The ioreadat and iowriteat functions transfer up to /n/ bytes at position
+// /pos/ without changing the current position, like single calls to the
+// object's /read/ and /write/ operations. If the object has no /readat/ or
+// /writeat/ operation, they fall back to seeking to /pos/, calling /read/ or
+// /write/, and seeking back, which is not atomic with respect to other users
+// of the object. Objects that cannot seek return an error.
+
+extern long
+__attribute__ ((nonnull(1,3)))
+ioreadat(struct io_intf * io, uint64_t pos, void * buf, unsigned long n);
+
+extern long
+__attribute__ ((nonnull(1,3)))
+iowriteat(struct io_intf * io, uint64_t pos, const void * buf, unsigned long n);
+
 // The ioctl function invokes special functions on the I/O object. See the IOCTL
 // numbers defined above.
 
@@ -195,10 +217,10 @@ static inline void ioclose(struct io_intf * io) {
     if (io->refcnt == 0) {
         return;
     }
-    console_printf("refcnt pre decrement: %d\n", io->refcnt);
+    kdebug("refcnt pre decrement: %d\n", io->refcnt);
     // decrement reference count
     io->refcnt -= 1;
-    console_printf("refcnt post decrement: %d\n", io->refcnt);
+    kdebug("refcnt post decrement: %d\n", io->refcnt);
     // call the close operation only if the reference count is 0
     if (io->refcnt == 0 && io->ops->close != NULL) {
         io->ops->close(io);
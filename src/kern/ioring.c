@@ -0,0 +1,365 @@
+// ioring.c - Batched asynchronous system calls
+//
+
+#ifdef IORING_TRACE
+#define TRACE
+#endif
+
+#ifdef IORING_DEBUG
+#define DEBUG
+#endif
+
+#include "ioring.h"
+#include "../user/ioring.h"
+#include "process.h"
+#include "thread.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "heap.h"
+#include "intr.h"
+#include "halt.h"
+#include "console.h"
+#include "error.h"
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A request taken from a submission ring. Requests are copied out of user
+// memory when they are queued, so the process cannot change them afterwards.
+
+struct ioring_req {
+    struct ioring_req * next; // next in work queue or free list
+    struct ioring * ring;
+    struct ring_sqe sqe;
+};
+
+// Kernel side of a process's ring. nr_pending counts the requests that are
+// queued or being carried out. Requests come from reqs, so there are never more
+// than RING_ENTRIES of them and a ring needs no memory after setup.
+//
+// The ring in user memory is only accessed with copy_from_user and
+// copy_to_user, since the process may write anything there or, if another of
+// its threads changes its mappings, leave it unmapped. The kernel keeps its own
+// cq_tail and only copies it out; if an access faults, the process loses its
+// own requests or completions, and ioring_enter returns -EFAULT.
+
+struct ioring {
+    struct spinlock lock; // protects the fields below
+    struct condition cq_cond; // broadcast when a request completes
+    struct process * proc;
+    struct ring * uring; // in memory of proc
+    unsigned int cq_tail; // copied to uring->cq_tail
+    unsigned int nr_pending;
+    struct ioring_req * free_list;
+    struct ioring_req reqs[RING_ENTRIES];
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// The work queue holds the requests of all rings in FIFO order. work_ready is
+// initialized when the workers are started.
+
+static struct spinlock work_lock =
+    SPINLOCK_INITIALIZER("ioring.work", SPINLOCK_ORDER_OUTER);
+static struct condition work_ready;
+static struct ioring_req * work_head;
+static struct ioring_req * work_tail;
+static char workers_started;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void start_workers(void);
+static void worker_func(void * arg);
+static unsigned int cq_used(struct ioring * ring);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int ioring_setup(struct ring * uring) {
+    struct process * const proc = current_process();
+    struct ioring * expected = NULL;
+    struct ioring * ring;
+    int i;
+
+    trace("%s(%p)", __func__, uring);
+
+    if ((uintptr_t)uring % sizeof(uint64_t) != 0)
+        return -EINVAL;
+
+    if (memory_fault_in_user(uring, sizeof(struct ring),
+        PTE_R | PTE_W | PTE_U) != 0)
+    {
+        return -EFAULT;
+    }
+
+    ring = kcalloc(1, sizeof(struct ioring));
+
+    if (ring == NULL)
+        return -EAGAIN;
+
+    spinlock_init(&ring->lock, "ioring", SPINLOCK_ORDER_OUTER);
+    condition_init(&ring->cq_cond, "ioring.cq");
+    ring->proc = proc;
+    ring->uring = uring;
+    copy_from_user(&ring->cq_tail, (void *)&uring->cq_tail,
+        sizeof(ring->cq_tail));
+
+    for (i = 0; i < RING_ENTRIES; i++) {
+        ring->reqs[i].ring = ring;
+        ring->reqs[i].next = ring->free_list;
+        ring->free_list = &ring->reqs[i];
+    }
+
+    if (!__atomic_compare_exchange_n(&proc->ring, &expected, ring,
+        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        kfree(ring);
+        return -EBUSY;
+    }
+
+    start_workers();
+    return 0;
+}
+
+int ioring_enter(unsigned int to_submit, unsigned int min_complete) {
+    struct ioring * const ring = current_process()->ring;
+    struct ioring_req * head = NULL;
+    struct ioring_req * last = NULL;
+    struct ioring_req * req;
+    int saved_intr_state;
+    unsigned int sq_head;
+    unsigned int sq_tail;
+    struct ring * ur;
+    int result = 0;
+    int n = 0;
+
+    trace("%s(%u,%u)", __func__, to_submit, min_complete);
+
+    if (ring == NULL)
+        return -EINVAL;
+
+    ur = ring->uring;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&ring->lock);
+
+    // Take requests as long as there is room in the completion ring for all
+    // requests in flight. The process may have scribbled over its side of the
+    // ring, but that can only make it lose its own completions.
+
+    if (copy_from_user(&sq_head, (void *)&ur->sq_head, sizeof(sq_head)) != 0 ||
+        copy_from_user(&sq_tail, (void *)&ur->sq_tail, sizeof(sq_tail)) != 0)
+    {
+        result = -EFAULT;
+        sq_head = sq_tail = 0;
+    }
+
+    while (n < to_submit && sq_head != sq_tail && ring->free_list != NULL &&
+        ring->nr_pending + cq_used(ring) < RING_ENTRIES)
+    {
+        req = ring->free_list;
+
+        if (copy_from_user(&req->sqe, &ur->sq[sq_head % RING_ENTRIES],
+            sizeof(struct ring_sqe)) != 0)
+        {
+            result = -EFAULT;
+            break;
+        }
+
+        ring->free_list = req->next;
+        req->next = NULL;
+
+        if (last != NULL)
+            last->next = req;
+        else
+            head = req;
+
+        last = req;
+        ring->nr_pending += 1;
+        sq_head += 1;
+        n += 1;
+    }
+
+    if (n != 0 &&
+        copy_to_user((void *)&ur->sq_head, &sq_head, sizeof(sq_head)) != 0)
+    {
+        result = -EFAULT;
+    }
+
+    spin_release(&ring->lock);
+
+    // Queue the requests for the workers. The work lock has the same rank as
+    // the ring lock, so we may not hold both.
+
+    if (head != NULL) {
+        spin_acquire(&work_lock);
+
+        if (work_tail != NULL)
+            work_tail->next = head;
+        else
+            work_head = head;
+
+        work_tail = last;
+        condition_broadcast(&work_ready);
+        spin_release(&work_lock);
+    }
+
+    spin_acquire(&ring->lock);
+
+    while (ring->nr_pending != 0 && cq_used(ring) < min_complete)
+        condition_wait_locked(&ring->cq_cond, &ring->lock);
+
+    spin_release(&ring->lock);
+    intr_restore(saved_intr_state);
+
+    debug("ioring_enter: queued %d requests", n);
+    return (n == 0 && result != 0) ? result : n;
+}
+
+void ioring_release(struct process * proc) {
+    struct ioring * const ring = proc->ring;
+    int saved_intr_state;
+
+    if (ring == NULL)
+        return;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&ring->lock);
+
+    while (ring->nr_pending != 0)
+        condition_wait_locked(&ring->cq_cond, &ring->lock);
+
+    spin_release(&ring->lock);
+    intr_restore(saved_intr_state);
+
+    proc->ring = NULL;
+    kfree(ring);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void start_workers(void) {
+    int saved_intr_state;
+    int first;
+    int i;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&work_lock);
+
+    first = !workers_started;
+
+    if (first) {
+        condition_init(&work_ready, "ioring.work");
+        workers_started = 1;
+    }
+
+    spin_release(&work_lock);
+    intr_restore(saved_intr_state);
+
+    if (!first)
+        return;
+
+    for (i = 0; i < IORING_NWORKERS; i++) {
+        if (thread_spawn("ioring", &worker_func, NULL) < 0) {
+            kprintf("ioring: started only %d workers\n", i);
+            break;
+        }
+    }
+}
+
+// A worker takes on the process of each request while it carries it out, so
+// that the system call it makes sees the process's open files and memory. It
+// drops the process and its memory space again before it completes the
+// request, after which the process may exit and the ring go away.
+
+void worker_func(void * arg __attribute__ ((unused))) {
+    const int tid = running_thread();
+    struct ioring_req * req;
+    struct ioring * ring;
+    int saved_intr_state;
+    struct ring_cqe cqe;
+    struct ring * ur;
+    unsigned int tail;
+    int64_t result;
+
+    // We inherited the process of the thread that started us.
+
+    thread_set_process(tid, NULL);
+    memory_space_switch(main_mtag);
+
+    for (;;) {
+        saved_intr_state = intr_disable();
+        spin_acquire(&work_lock);
+
+        while (work_head == NULL)
+            condition_wait_locked(&work_ready, &work_lock);
+
+        req = work_head;
+        work_head = req->next;
+
+        if (work_head == NULL)
+            work_tail = NULL;
+
+        spin_release(&work_lock);
+        intr_restore(saved_intr_state);
+
+        ring = req->ring;
+        ur = ring->uring;
+
+        thread_set_process(tid, ring->proc);
+        memory_space_switch(ring->proc->mtag);
+
+        result = syscall_ring_op(req->sqe.op,
+            req->sqe.arg[0], req->sqe.arg[1], req->sqe.arg[2]);
+
+        debug("ioring: op %lu returned %ld", req->sqe.op, (long)result);
+
+        saved_intr_state = intr_disable();
+        spin_acquire(&ring->lock);
+
+        // The process sees the completion once cq_tail moves past it. If
+        // either copy faults, the completion is lost.
+
+        tail = ring->cq_tail++;
+        cqe.data = req->sqe.data;
+        cqe.result = result;
+
+        if (copy_to_user(&ur->cq[tail % RING_ENTRIES], &cqe, sizeof(cqe)) == 0)
+        {
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            copy_to_user((void *)&ur->cq_tail, &ring->cq_tail,
+                sizeof(ring->cq_tail));
+        }
+
+        thread_set_process(tid, NULL);
+        memory_space_switch(main_mtag);
+
+        req->next = ring->free_list;
+        ring->free_list = req;
+        ring->nr_pending -= 1;
+        condition_broadcast(&ring->cq_cond);
+
+        spin_release(&ring->lock); // ring may be gone after this
+        intr_restore(saved_intr_state);
+    }
+}
+
+// Returns the number of completions the process has not consumed yet, counting
+// them all as unconsumed if its cq_head cannot be read or is out of range.
+// Called with the ring lock held.
+
+unsigned int cq_used(struct ioring * ring) {
+    const struct ring * const ur = ring->uring;
+    unsigned int cq_head;
+
+    if (copy_from_user(&cq_head, (void *)&ur->cq_head, sizeof(cq_head)) != 0 ||
+        RING_ENTRIES < ring->cq_tail - cq_head)
+    {
+        return RING_ENTRIES;
+    }
+
+    return ring->cq_tail - cq_head;
+}
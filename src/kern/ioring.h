@@ -0,0 +1,67 @@
+// ioring.h - Batched asynchronous system calls
+//
+
+#ifndef _KIORING_H_
+#define _KIORING_H_
+
+#include <stdint.h>
+
+// A process may register one ioring (see user/ioring.h), a submission ring and
+// a completion ring in its memory. ioring_enter copies requests from the
+// submission ring to a work queue shared by all processes, from which a pool of
+// IORING_NWORKERS kernel threads takes them. A worker carries out a request in
+// the memory space of the process that submitted it, as the corresponding
+// system call would, and posts the result on the process's completion ring.
+
+// COMPILE-TIME PARAMETERS
+//
+
+// IORING_NWORKERS is the number of worker threads. They are started when the
+// first ring is set up. A request that sleeps (for example, a read from a
+// device with no data) occupies its worker until it completes.
+
+#ifndef IORING_NWORKERS
+#define IORING_NWORKERS 4
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct process;
+struct ring;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// int ioring_setup(struct ring * uring)
+// Registers the ring at user address /uring/ as the current process's ioring.
+// Faults in the pages of the ring the process has not touched yet. Returns 0,
+// -EINVAL if /uring/ is misaligned, -EFAULT if the ring is not writable user
+// memory, or -EBUSY if the process already has a ring.
+
+extern int ioring_setup(struct ring * uring);
+
+// int ioring_enter(unsigned int to_submit, unsigned int min_complete)
+// Queues up to /to_submit/ requests from the current process's submission ring,
+// as long as there is room for their completions, and waits until at least
+// /min_complete/ completions are available or none are pending. Returns the
+// number of requests queued, -EINVAL if the process has no ring, or -EFAULT if
+// no requests were queued because the ring could not be accessed.
+
+extern int ioring_enter(unsigned int to_submit, unsigned int min_complete);
+
+// void ioring_release(struct process * proc)
+// Waits for all requests of /proc/ to complete and releases its ring, if it
+// has one. Called before the process's memory space goes away.
+
+extern void ioring_release(struct process * proc);
+
+// int64_t syscall_ring_op (
+//     unsigned int nr, uint64_t a0, uint64_t a1, uint64_t a2)
+// Carries out system call /nr/ with arguments /a0/-/a2/ for a worker (defined
+// in syscall.c). Returns -EINVAL for system calls not supported on a ring.
+
+extern int64_t syscall_ring_op (
+    unsigned int nr, uint64_t a0, uint64_t a1, uint64_t a2);
+
+#endif // _KIORING_H_
@@ -10,11 +10,13 @@
 #include "error.h"
 #include "memory.h"
 #include "lock.h"
+#include "heap.h"
 
 // constant definitions
 #define FS_BLKSZ      4096
 #define FS_NAMELEN    32
 #define FS_MAXOPEN    32
+#define FS_MAXBLKS    1023  // data block numbers per inode
 
 
 // internal type definitions
@@ -40,7 +42,7 @@ typedef struct boot_block_t{
 
 typedef struct inode_t{
     uint32_t byte_len;
-    uint32_t data_block_num[1023];
+    uint32_t data_block_num[FS_MAXBLKS];
 }__attribute((packed)) inode_t;
 
 
@@ -54,6 +56,7 @@ typedef struct data_block_t{
 
 struct file_struct {
     struct io_intf io;
+    struct lock lock;   // protects file_position, held across a transfer
     uint64_t file_position;
     uint64_t file_size;
     uint64_t inode_number;
@@ -67,11 +70,17 @@ int fs_open(const char* name, struct io_intf** ioptr);
 void fs_close(struct io_intf* io);
 long fs_write(struct io_intf* io, const void* buf, unsigned long n);
 long fs_read(struct io_intf* io, void* buf, unsigned long n);
+long fs_writeat(struct io_intf* io, uint64_t pos, const void* buf, unsigned long n);
+long fs_readat(struct io_intf* io, uint64_t pos, void* buf, unsigned long n);
 int fs_ioctl(struct io_intf* io, int cmd, void* arg);
 int fs_getlen(struct file_struct* fd, void* arg);
 int fs_getpos(struct file_struct* fd, void* arg);
 int fs_setpos(struct file_struct* fd, void* arg);
 int fs_getblksz(struct file_struct* fd, void* arg);
+static long fs_blkread(uint64_t pos, void* buf, unsigned long n);
+static long fs_blkwrite(uint64_t pos, const void* buf, unsigned long n);
+static long fs_pwrite(struct file_struct* file, uint64_t pos, const void* buf, unsigned long n);
+static long fs_pread(struct file_struct* file, uint64_t pos, void* buf, unsigned long n);
 
 
 // struct that contains the pointers to our fs functions
@@ -79,7 +88,9 @@ static const struct io_ops fs_io_ops = {
     .close = fs_close,
     .read = fs_read,
     .write = fs_write,
-    .ctl = fs_ioctl
+    .ctl = fs_ioctl,
+    .readat = fs_readat,
+    .writeat = fs_writeat
 };
 
 
@@ -88,9 +99,22 @@ struct io_intf * vioblk_io;
 char fs_initialized;
 struct boot_block_t boot_block;
 struct file_struct file_structs[FS_MAXOPEN];
-inode_t inode;
-data_block_t data_block;
+
+// Locking: fs_lock protects the directory lookup and the open file table and
+// is only held by fs_open and fs_close, never across device I/O. Each open
+// file has its own lock for its position, and each inode has a reader-writer
+// lock: fs_read takes it in read mode and fs_write in write mode, so a write
+// appears atomic to readers of the same file while transfers on different
+// files proceed concurrently. The lock order is file lock, then inode lock,
+// then blk_lock.
+//
+// blk_lock serializes access to the block device, whose position is shared
+// by all transfers. It is only held across a single seek-and-transfer (see
+// fs_blkread and fs_blkwrite).
+
 static struct lock fs_lock;
+static struct rwlock * inode_locks; // boot_block.num_inodes entries
+static struct lock blk_lock;
 
 /**
  * fs_mount - Initializes the filesystem for use.
@@ -101,8 +125,9 @@ static struct lock fs_lock;
  *                      Errors include already initialized filesystem or I/O issues.
  */
 int fs_mount(struct io_intf* blkio) {
-    // Initialize lock 
+    // Initialize locks
     lock_init(&fs_lock, "Filesystem Lock");
+    lock_init(&blk_lock, "Filesystem Block Lock");
     
     // store the block device interface
     vioblk_io = blkio;
@@ -110,7 +135,7 @@ int fs_mount(struct io_intf* blkio) {
 
     // check if fs has already been initialized
     if (fs_initialized) {
-        console_printf("fs_is already initialized\n");
+        kwarn("fs_is already initialized\n");
         return -1;
     }
 
@@ -118,19 +143,30 @@ int fs_mount(struct io_intf* blkio) {
     // set position to the beginning of io device
     uint64_t offset = 0;
     if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &offset) != 0) {
-        console_printf("issue setting block device offset to 0\n");
+        kerr("issue setting block device offset to 0\n");
         return -1;
     }
 
 
     // attempt to read bootblock
     if (ioread(blkio, (void *)&boot_block, FS_BLKSZ) < 0) {
-        console_printf("error: failed to read bootblock\n");
+        kerr("error: failed to read bootblock\n");
         return -1;
     }
 
 
-    console_printf("boot block read successfully, inodes: %u, data blocks: %u\n", boot_block.num_inodes, boot_block.num_data);
+    kinfo("boot block read successfully, inodes: %u, data blocks: %u\n", boot_block.num_inodes, boot_block.num_data);
+
+
+    // allocate one lock per inode
+    inode_locks = kcalloc(boot_block.num_inodes, sizeof(struct rwlock));
+    if (inode_locks == NULL) {
+        kerr("error: failed to allocate inode locks\n");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < boot_block.num_inodes; i++)
+        rwlock_init(&inode_locks[i], "Inode Lock");
 
 
     // mark fs as initialized
@@ -162,7 +198,7 @@ int fs_open(const char* name, struct io_intf** ioptr) {
 
     // check if file system is initialized before calling open
     if (!fs_initialized) {
-        console_printf("filesystem not initialized\n");
+        kerr("filesystem not initialized\n");
         lock_release(&fs_lock); // Release the lock before returning 
         return -1;
     }
@@ -175,7 +211,7 @@ int fs_open(const char* name, struct io_intf** ioptr) {
     for (int i = 0; i < FS_MAXOPEN; i++) {
         if (file_structs[i].flags == 0) {
             file = &file_structs[i];
-            console_printf("found available slot at index %d\n", i);
+            kdebug("found available slot at index %d\n", i);
             break;
         }
     }
@@ -183,7 +219,7 @@ int fs_open(const char* name, struct io_intf** ioptr) {
 
     // check if we found a valid file slot
     if (file == NULL) {
-        console_printf("no available file slots\n");
+        kwarn("no available file slots\n");
         lock_release(&fs_lock);
         return -1;
     }
@@ -207,49 +243,50 @@ int fs_open(const char* name, struct io_intf** ioptr) {
     }
 
 
-    if (!dentry) {
-        console_printf("file not found in directory entries\n");
+    if (!dentry || dentry->inode >= boot_block.num_inodes) {
+        kdebug("file not found in directory entries\n");
         lock_release(&fs_lock);
         return -1;
     }
 
 
+    // claim the file slot, so we can drop fs_lock while reading the inode
+    file->flags = 1;                        // mark file as in use
+    lock_release(&fs_lock);
+
+
     // set file position
+    lock_init(&file->lock, "File Lock");
     file->file_position = 0;
     file->inode_number = dentry->inode;
 
 
-    // set position to inode start
+    // read the file length from the inode
     uint64_t inode_pos = FS_BLKSZ + file->inode_number * FS_BLKSZ;
-    if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_pos) != 0) {
-        console_printf("can't set file position\n");
-        lock_release(&fs_lock); 
-        return -1;
-    }
-
+    uint32_t byte_len;
 
-    // read inode data
-    uint64_t bytes_read = vioblk_io->ops->read(vioblk_io, &inode, sizeof(struct inode_t));
-    if (bytes_read != sizeof(struct inode_t)) {
-        console_printf("can't read inode\n");
+    if (fs_blkread(inode_pos + offsetof(inode_t, byte_len),
+        &byte_len, sizeof(byte_len)) != sizeof(byte_len))
+    {
+        kerr("can't read inode\n");
+        lock_acquire(&fs_lock);
+        file->flags = 0;
         lock_release(&fs_lock);
         return -1;
     }
 
 
     // initialize file structure with inode data
-    file->file_size = inode.byte_len;
-    file->flags = 1;                        // mark file as in use
+    file->file_size = byte_len;
     file->io.ops = &fs_io_ops;
     *ioptr = &file->io;
 
     (*ioptr)->refcnt = 1;
    
     // succesfully opened file return 0
-    console_printf("file opened successfully. file position: %d file size: %d inode number: %d\n",
+    kdebug("file opened successfully. file position: %d file size: %d inode number: %d\n",
                                     file->file_position, file->file_size, file->inode_number);
 
-    lock_release(&fs_lock);
     return 0;
 }
 
@@ -266,6 +303,8 @@ int fs_open(const char* name, struct io_intf** ioptr) {
  * @return              None. Marks the associated file struct as unused.
  */
 void fs_close(struct io_intf* io) {
+    lock_acquire(&fs_lock);
+
     for (int i = 0; i < FS_MAXOPEN; i++) {
         if (&file_structs[i].io == io) {
             file_structs[i].flags = 0;
@@ -273,7 +312,7 @@ void fs_close(struct io_intf* io) {
         }
     }
 
-
+    lock_release(&fs_lock);
     return;
 }
 
@@ -294,12 +333,65 @@ void fs_close(struct io_intf* io) {
  *                      does not extend the file size or create new files.
  */
 long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
-    // Acquire lock
-    lock_acquire(&fs_lock);
+    // make sure the parameters are valid
+    if (!io || !buf) {
+        return -1;
+    }
+
+
+    // retrieve file struct from io_intf
+    struct file_struct* file = (struct file_struct*)((char*)io - offsetof(struct file_struct, io));
 
+
+    // ensure the file struct is valid and in use
+    if (file->flags == 0) {
+        return -2;
+    }
+
+
+    // make sure the file system is initialized
+    if (!fs_initialized) {
+        return -3;
+    }
+
+
+    // the file lock keeps the position stable for the whole transfer
+    lock_acquire(&file->lock);
+
+    long result = fs_pwrite(file, file->file_position, buf, n);
+
+    // update file position
+    if (result > 0) {
+        file->file_position += result;
+    }
+
+    lock_release(&file->lock);
+
+    // return the number of bytes written
+    return result;
+}
+
+
+
+
+
+
+/**
+ * fs_writeat - Writes data to an open file at a given position.
+ *
+ * @param io            Pointer to the file's io_intf.
+ * @param pos           Position in the file to write at.
+ * @param buf           Pointer to the buffer containing data to write.
+ * @param n             Number of bytes to write.
+ *
+ * @return              Returns the number of bytes written on success,
+ *                      or a negative error code on failure. The file
+ *                      position is neither used nor changed, so the file
+ *                      lock is not taken.
+ */
+long fs_writeat(struct io_intf* io, uint64_t pos, const void* buf, unsigned long n) {
     // make sure the parameters are valid
     if (!io || !buf) {
-        lock_release(&fs_lock); // Release lock before returning
         return -1;
     }
 
@@ -310,28 +402,140 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
 
     // ensure the file struct is valid and in use
     if (file->flags == 0) {
-        lock_release(&fs_lock); // Release lock before returning
         return -2;
     }
 
 
     // make sure the file system is initialized
     if (!fs_initialized) {
-        lock_release(&fs_lock); // Release lock before returning
         return -3;
     }
 
 
+    return fs_pwrite(file, pos, buf, n);
+}
+
+
+
+
+
+
+/**
+ * fs_read - Reads data from an open file.
+ *
+ * @param io            Pointer to the file's io_intf.
+ * @param buf           Pointer to the buffer to store the read data.
+ * @param n             Number of bytes to read.
+ *
+ * @return              Returns the number of bytes read on success,
+ *                      or a negative error code on failure. Updates
+ *                      the file's read position accordingly.
+ */
+long fs_read(struct io_intf* io, void* buf, unsigned long n)
+{
+    // make sure the parameters are valid
+    if (!io || !buf) {
+        return -1;
+    }
+
+
+    // retrieve file struct from io_intf
+    struct file_struct* file = (struct file_struct*)((char*)io - offsetof(struct file_struct, io));
+
+
+    // ensure the file struct is valid and in use
+    if (file->flags == 0) {
+        return -1;
+    }
+
+
+    // make sure the file system is initialized
+    if (!fs_initialized) {
+        return -1;
+    }
+
+
+    // the file lock keeps the position stable for the whole transfer
+    lock_acquire(&file->lock);
+
+    long result = fs_pread(file, file->file_position, buf, n);
+
+    // update file position
+    if (result > 0) {
+        file->file_position += result;
+    }
+
+    lock_release(&file->lock);
+
+    // return the number of bytes read
+    return result;
+}
+
+
+
+
+
+
+/**
+ * fs_readat - Reads data from an open file at a given position.
+ *
+ * @param io            Pointer to the file's io_intf.
+ * @param pos           Position in the file to read from.
+ * @param buf           Pointer to the buffer to store the read data.
+ * @param n             Number of bytes to read.
+ *
+ * @return              Returns the number of bytes read on success,
+ *                      or a negative error code on failure. The file
+ *                      position is neither used nor changed, so the file
+ *                      lock is not taken.
+ */
+long fs_readat(struct io_intf* io, uint64_t pos, void* buf, unsigned long n) {
+    // make sure the parameters are valid
+    if (!io || !buf) {
+        return -1;
+    }
+
+
+    // retrieve file struct from io_intf
+    struct file_struct* file = (struct file_struct*)((char*)io - offsetof(struct file_struct, io));
+
+
+    // ensure the file struct is valid and in use and the file system is initialized
+    if (file->flags == 0 || !fs_initialized) {
+        return -1;
+    }
+
+
+    return fs_pread(file, pos, buf, n);
+}
+
+
+
+
+
+
+/**
+ * fs_pwrite - Transfers data to a file at a given position.
+ *
+ * @param file          Pointer to the open file.
+ * @param pos           Position in the file to write at.
+ * @param buf           Pointer to the buffer containing data to write.
+ * @param n             Number of bytes to write.
+ *
+ * @return              Returns the number of bytes written, 0 at the end of
+ *                      the file, or a negative error code on failure. Takes
+ *                      the inode lock in write mode.
+ */
+static long fs_pwrite(struct file_struct* file, uint64_t pos, const void* buf, unsigned long n) {
     // check if we are at the end of a file
-    if (file->file_position >= file->file_size) {
-        lock_release(&fs_lock); // Release lock before returning
+    if (pos >= file->file_size) {
         return 0;
     }
 
 
     // make sure n does not exceed the number of bytes in the file
-    if (file->file_position + n > file->file_size) {
-        n = file->file_size - file->file_position;
+    if (n > file->file_size - pos) {
+        n = file->file_size - pos;
     }
 
 
@@ -343,24 +547,18 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     uint64_t inode_offset = FS_BLKSZ + (inode_number * FS_BLKSZ);
 
 
-    // read the inode
-    if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_offset) != 0) {
-    lock_release(&fs_lock); // Release lock before returning
-        return -1; // Error setting position
-    }
+    // the data block numbers are read from the inode one at a time
+    uint32_t data_block_num;
 
 
-    long bytes_read = vioblk_io->ops->read(vioblk_io, &inode, sizeof(inode_t));
-    if (bytes_read != sizeof(inode_t)) {
-    lock_release(&fs_lock);
-        return -5;
-    }
+    // lock the inode for the duration of the transfer
+    rwlock_acquire_write(&inode_locks[inode_number]);
 
 
     // initialize variables for reading the data
     unsigned long total_bytes_written = 0;
     unsigned long bytes_to_write = n;
-    uint64_t file_pos = file->file_position;
+    uint64_t file_pos = pos;
     long bytes_written;
 
 
@@ -371,13 +569,19 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
 
 
         // check if block index exceeds the max number of blocks allowed
-        if (block_index >= sizeof(struct inode_t)) {
+        if (block_index >= FS_MAXBLKS) {
             break;
         }
 
 
         // get the data block number
-        uint32_t data_block_num = inode.data_block_num[block_index];
+        if (fs_blkread(inode_offset + offsetof(inode_t, data_block_num)
+            + block_index * sizeof(uint32_t), &data_block_num,
+            sizeof(data_block_num)) != sizeof(data_block_num))
+        {
+            rwlock_release_write(&inode_locks[inode_number]);
+            return -5;
+        }
 
 
         // calculate the offset of the data block in the filesystem
@@ -387,25 +591,16 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
                                    + block_offset;                        // mem offset
 
 
-        // write to the data block
-        if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &data_block_offset) != 0) {
-            lock_release(&fs_lock);
-            return -6;
-        }
-
-
         // calculate how many bytes we can write to this block
         unsigned long bytes_available = FS_BLKSZ - block_offset;
         unsigned long bytes_this_write = (bytes_to_write < bytes_available) ? bytes_to_write : bytes_available;
 
 
-        // copy the data to the buffer
-        memcpy(data_block.data, (char*)buf + total_bytes_written, bytes_this_write);
-
-
-        bytes_written = vioblk_io->ops->write(vioblk_io, &data_block, bytes_this_write);
+        // write to the data block
+        bytes_written = fs_blkwrite(data_block_offset,
+            (const char*)buf + total_bytes_written, bytes_this_write);
         if (bytes_written != bytes_this_write) {
-            lock_release(&fs_lock);
+            rwlock_release_write(&inode_locks[inode_number]);
             return -7;
         }
 
@@ -417,12 +612,10 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     }
 
 
-    // update file position
-    file->file_position = file_pos;
+    rwlock_release_write(&inode_locks[inode_number]);
 
-    lock_release(&fs_lock);
 
-    // return the number of bytes read
+    // return the number of bytes written
     return total_bytes_written;
 }
 
@@ -432,56 +625,27 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
 
 
 /**
- * fs_read - Reads data from an open file.
+ * fs_pread - Transfers data from a file at a given position.
  *
- * @param io            Pointer to the file's io_intf.
+ * @param file          Pointer to the open file.
+ * @param pos           Position in the file to read from.
  * @param buf           Pointer to the buffer to store the read data.
  * @param n             Number of bytes to read.
  *
- * @return              Returns the number of bytes read on success,
- *                      or a negative error code on failure. Updates
- *                      the file's read position accordingly.
+ * @return              Returns the number of bytes read, 0 at the end of
+ *                      the file, or a negative error code on failure. Takes
+ *                      the inode lock in read mode.
  */
-long fs_read(struct io_intf* io, void* buf, unsigned long n)
-{
-    // Acquire lock
-    lock_acquire(&fs_lock);
-
-    // make sure the parameters are valid
-    if (!io || !buf) {
-        lock_release(&fs_lock);
-        return -1;
-    }
-
-
-    // retrieve file struct from io_intf
-    struct file_struct* file = (struct file_struct*)((char*)io - offsetof(struct file_struct, io));
-
-
-    // ensure the file struct is valid and in use
-    if (file->flags == 0) {
-        lock_release(&fs_lock); // Release lock before returning
-        return -1;
-    }
-
-
-    // make sure the file system is initialized
-    if (!fs_initialized) {
-        lock_release(&fs_lock); // Release lock before returning
-        return -1;
-    }
-
-
+static long fs_pread(struct file_struct* file, uint64_t pos, void* buf, unsigned long n) {
     // check if we are at the end of a file
-    if (file->file_position >= file->file_size) {
-        lock_release(&fs_lock); // Release lock before returning
+    if (pos >= file->file_size) {
         return 0;
     }
 
 
     // make sure n does not exceed the number of bytes in the file
-    if (file->file_position + n > file->file_size) {
-        n = file->file_size - file->file_position;
+    if (n > file->file_size - pos) {
+        n = file->file_size - pos;
     }
 
 
@@ -493,24 +657,18 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
     uint64_t inode_offset = FS_BLKSZ + (inode_number * FS_BLKSZ);
 
 
-    // read the inode
-    if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_offset) != 0) {
-        lock_release(&fs_lock);
-        return -1; // Error setting position
-    }
+    // the data block numbers are read from the inode one at a time
+    uint32_t data_block_num;
 
 
-    long bytes_read = vioblk_io->ops->read(vioblk_io, &inode, sizeof(inode_t));
-    if (bytes_read != sizeof(inode_t)) {
-        lock_release(&fs_lock);
-        return -1;
-    }
+    // lock the inode for the duration of the transfer
+    rwlock_acquire_read(&inode_locks[inode_number]);
 
 
     // initialize variables for reading the data
     unsigned long total_bytes_read = 0;
     unsigned long bytes_to_read = n;
-    uint64_t file_pos = file->file_position;
+    uint64_t file_pos = pos;
 
 
     while (bytes_to_read > 0) {
@@ -520,26 +678,26 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
 
 
         // check if block index exceeds the max number of blocks allowed
-        if (block_index >= sizeof(struct inode_t)) {
+        if (block_index >= FS_MAXBLKS) {
             break;
         }
 
 
         // get the data block number
-        uint32_t data_block_num = inode.data_block_num[block_index];
+        if (fs_blkread(inode_offset + offsetof(inode_t, data_block_num)
+            + block_index * sizeof(uint32_t), &data_block_num,
+            sizeof(data_block_num)) != sizeof(data_block_num))
+        {
+            rwlock_release_read(&inode_locks[inode_number]);
+            return -1;
+        }
 
 
         // calculate the offset of the data block in the filesystem
         uint64_t data_block_offset = FS_BLKSZ                             // boot block size
                                    + (boot_block.num_inodes * FS_BLKSZ)   // total inode size
-                                   + (data_block_num * FS_BLKSZ);         // data block offset
-
-
-        // read the data block
-        if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &data_block_offset) != 0) {
-            lock_release(&fs_lock);
-            return -1;
-        }
+                                   + (data_block_num * FS_BLKSZ)          // data block offset
+                                   + block_offset;                        // mem offset
 
 
         // calculate how many bytes we can read from this block
@@ -547,17 +705,15 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
         unsigned long bytes_this_read = (bytes_to_read < bytes_available) ? bytes_to_read : bytes_available;
 
 
-        bytes_read = vioblk_io->ops->read(vioblk_io, &data_block, sizeof(data_block_t));
-        if (bytes_read != sizeof(data_block_t)) {
-            lock_release(&fs_lock);
+        // read the data block directly into the caller's buffer
+        long bytes_read = fs_blkread(data_block_offset,
+            (char*)buf + total_bytes_read, bytes_this_read);
+        if (bytes_read != bytes_this_read) {
+            rwlock_release_read(&inode_locks[inode_number]);
             return -1;
         }
 
 
-        // copy the data to the buffer
-        memcpy(buf + total_bytes_read, data_block.data + block_offset, bytes_this_read);
-
-
         // update counters
         total_bytes_read += bytes_this_read;
         bytes_to_read -= bytes_this_read;
@@ -565,10 +721,8 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
     }
 
 
-    // update file position
-    file->file_position = file_pos;
+    rwlock_release_read(&inode_locks[inode_number]);
 
-    lock_release(&fs_lock); // Release lock before returning
 
     // return the number of bytes read
     return total_bytes_read;
@@ -590,19 +744,18 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
  *                      or a negative error code for unsupported commands.
  */
 int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
-    lock_acquire(&fs_lock);
-
     // retrieve file struct from io_intf
     struct file_struct* file = (struct file_struct*)((char*)io - offsetof(struct file_struct, io));
 
 
     // check if the file is valid and open
     if (!file || !file->flags) {
-        lock_release(&fs_lock);
         return -1;
     }
 
     int result;
+    lock_acquire(&file->lock);
+
     // route the command to the appropriate helper function
     switch(cmd) {
         case IOCTL_GETLEN:
@@ -620,10 +773,11 @@ int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
             result = fs_getblksz(file, arg);
             break;
         default:
-            return -ENOTSUP;
+            result = -ENOTSUP;
+            break;
     }
     
-    lock_release(&fs_lock);
+    lock_release(&file->lock);
     return result;
 }
 
@@ -737,3 +891,59 @@ int fs_getblksz(struct file_struct* fd, void* arg) {
     return 0;
 }
 
+
+
+
+
+/**
+ * fs_blkread - Reads from the block device at a given position.
+ *
+ * @param pos           Byte offset on the block device.
+ * @param buf           Pointer to the buffer to store the read data.
+ * @param n             Number of bytes to read.
+ *
+ * @return              Returns the number of bytes read on success,
+ *                      or a negative error code on failure. The seek and
+ *                      the read are done together under blk_lock.
+ */
+static long fs_blkread(uint64_t pos, void* buf, unsigned long n) {
+    long result;
+
+    lock_acquire(&blk_lock);
+
+    result = vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &pos);
+    if (result == 0)
+        result = ioread_full(vioblk_io, buf, n);
+
+    lock_release(&blk_lock);
+    return result;
+}
+
+
+
+
+
+
+/**
+ * fs_blkwrite - Writes to the block device at a given position.
+ *
+ * @param pos           Byte offset on the block device.
+ * @param buf           Pointer to the buffer containing data to write.
+ * @param n             Number of bytes to write.
+ *
+ * @return              Returns the number of bytes written on success,
+ *                      or a negative error code on failure. The seek and
+ *                      the write are done together under blk_lock.
+ */
+static long fs_blkwrite(uint64_t pos, const void* buf, unsigned long n) {
+    long result;
+
+    lock_acquire(&blk_lock);
+
+    result = vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &pos);
+    if (result == 0)
+        result = iowrite(vioblk_io, buf, n);
+
+    lock_release(&blk_lock);
+    return result;
+}
@@ -0,0 +1,85 @@
+// ktrace.c - Binary event tracing
+//
+
+#ifdef KTRACE_TRACE
+#define TRACE
+#endif
+
+#ifdef KTRACE_DEBUG
+#define DEBUG
+#endif
+
+#include "ktrace.h"
+#include "recdev.h"
+#include "timer.h"
+#include "thread.h"
+#include "intr.h"
+#include "config.h"
+#include "console.h"
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char ktrace_enabled;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void ktrace_start(void);
+static void ktrace_stop(void);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct ktrace_event ktrace_buf[NCPU][KTRACE_RING_SIZE];
+
+static struct recdev ktrace_dev =
+    RECDEV_INITIALIZER("ktrace", ktrace_buf, ktrace_start, ktrace_stop);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void ktrace_init(void) {
+    recdev_register(&ktrace_dev);
+}
+
+void ktrace_record(unsigned int event, uint64_t arg0, uint64_t arg1) {
+    struct ktrace_event * ev;
+    int saved_intr_state;
+    int hart;
+
+    // With interrupts disabled, we cannot move to another hart, and no
+    // tracepoint in an interrupt handler can run between claiming and
+    // publishing the slot.
+
+    saved_intr_state = intr_disable();
+    hart = running_hart();
+    ev = recdev_claim(&ktrace_dev, hart);
+
+    if (ev != NULL) {
+        ev->time = timer_get_mtime();
+        ev->event = event;
+        ev->tid = running_thread();
+        ev->hart = hart;
+        ev->arg[0] = arg0;
+        ev->arg[1] = arg1;
+        recdev_publish(&ktrace_dev, hart);
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// The tracepoints are on while the device is open.
+
+void ktrace_start(void) {
+    trace("%s()", __func__);
+    __atomic_store_n(&ktrace_enabled, 1, __ATOMIC_RELEASE);
+}
+
+void ktrace_stop(void) {
+    trace("%s()", __func__);
+    __atomic_store_n(&ktrace_enabled, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,90 @@
+// ktrace.h - Binary event tracing
+//
+// Tracepoints in the scheduler, condition variables, alarms, the block device
+// and system call dispatch record struct ktrace_event records: the mtime at the
+// event, the event id, the hart and thread, and two event-specific arguments.
+// They are read from the "ktrace" record device (see recdev.h). Tracepoints
+// cost a load and a branch while the device is closed.
+//
+// util/ktracedump decodes the records into a timeline and prints latency
+// histograms of block requests, sleeps and system calls.
+//
+
+#ifndef _KTRACE_H_
+#define _KTRACE_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// KTRACE_RING_SIZE is the number of events buffered per hart and must be a
+// power of two.
+
+#ifndef KTRACE_RING_SIZE
+#define KTRACE_RING_SIZE 1024
+#endif
+
+// EXPORTED CONSTANTS
+//
+
+// Event ids and their arguments. Block request types are VIRTIO_BLK_T_IN (0)
+// for reads and VIRTIO_BLK_T_OUT (1) for writes.
+
+#define KTRACE_SWITCH           1   // next tid, state of switching thread
+#define KTRACE_COND_WAIT        2   // condition address
+#define KTRACE_COND_BCAST       3   // condition address
+#define KTRACE_BLK_SUBMIT       4   // sector, request type
+#define KTRACE_BLK_COMPLETE     5   // sector, request type
+#define KTRACE_ALARM_SLEEP      6   // wake-up time
+#define KTRACE_ALARM_WAKE       7   // wake-up time
+#define KTRACE_SYSCALL_ENTER    8   // system call number, first argument
+#define KTRACE_SYSCALL_EXIT     9   // system call number, result
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct ktrace_event {
+    uint64_t time; // mtime
+    uint16_t event;
+    int16_t tid;
+    uint8_t hart;
+    uint8_t _reserved[3];
+    uint64_t arg[2];
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+// ktrace_enabled is set while the "ktrace" device is open.
+
+extern char ktrace_enabled;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void ktrace_init(void)
+// Registers the "ktrace" device. Must be called after devmgr_init.
+
+extern void ktrace_init(void);
+
+// void ktrace_record(unsigned int event, uint64_t arg0, uint64_t arg1)
+// Appends an event to the current hart's ring. Safe to call from interrupt
+// handlers and with any lock held. Use ktrace below instead.
+
+extern void ktrace_record(unsigned int event, uint64_t arg0, uint64_t arg1);
+
+static inline void ktrace(unsigned int event, uint64_t arg0, uint64_t arg1);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void ktrace(unsigned int event, uint64_t arg0, uint64_t arg1) {
+    if (__builtin_expect(
+        __atomic_load_n(&ktrace_enabled, __ATOMIC_RELAXED), 0))
+    {
+        ktrace_record(event, arg0, arg1);
+    }
+}
+
+#endif // _KTRACE_H_
@@ -0,0 +1,236 @@
+// lock.c - Sleep lock contention statistics
+//
+// Only compiled in when LOCK_STATS is defined; the locks themselves are
+// implemented in lock.h.
+//
+
+#ifdef LOCK_STATS
+
+#ifdef LOCK_TRACE
+#define TRACE
+#endif
+
+#ifdef LOCK_DEBUG
+#define DEBUG
+#endif
+
+#include "lock.h"
+#include "timer.h"
+#include "device.h"
+#include "string.h"
+#include "console.h"
+#include "error.h"
+#include "io.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define LOCK_STATS_LINEMAX 128
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// The last entry of lock_stats_tab counts the locks whose names did not fit.
+// Entries are only added, under lock_stats_lock, which is a leaf lock and so
+// not ranked. Counters are updated with atomics, since locks with the same name
+// may be used on different harts at the same time.
+
+static struct lock_stats lock_stats_tab[LOCK_STATS_MAX] = {
+    [LOCK_STATS_MAX-1] = { .name = "(other)" }
+};
+
+static int lock_stats_cnt; // entries in use, not counting "(other)"
+
+static struct spinlock lock_stats_lock =
+    SPINLOCK_INITIALIZER("lock_stats", SPINLOCK_ORDER_NONE);
+
+static struct io_intf lock_stats_io;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int lock_stats_open(struct io_intf ** ioptr, void * aux);
+static long lock_stats_read (
+    struct io_intf * io, void * buf, unsigned long bufsz);
+
+static size_t format_line(char * line, const struct lock_stats * st);
+static void update_max(uint64_t * max, uint64_t val);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void lock_stats_init(void) {
+    static const struct io_ops lock_stats_ops = {
+        .read = lock_stats_read
+    };
+
+    lock_stats_io.ops = &lock_stats_ops;
+    device_register("lockstat", &lock_stats_open, NULL);
+}
+
+struct lock_stats * lock_stats_register(const char * name) {
+    struct lock_stats * st = &lock_stats_tab[LOCK_STATS_MAX-1];
+    int saved_intr_state;
+    int i;
+
+    if (name == NULL)
+        return st;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&lock_stats_lock);
+
+    for (i = 0; i < lock_stats_cnt; i++) {
+        if (strcmp(lock_stats_tab[i].name, name) == 0)
+            break;
+    }
+
+    if (i < lock_stats_cnt)
+        st = &lock_stats_tab[i];
+    else if (lock_stats_cnt < LOCK_STATS_MAX-1) {
+        st = &lock_stats_tab[lock_stats_cnt];
+        st->name = name;
+        __atomic_store_n(&lock_stats_cnt, lock_stats_cnt+1, __ATOMIC_RELEASE);
+    }
+
+    spin_release(&lock_stats_lock);
+    intr_restore(saved_intr_state);
+    return st;
+}
+
+uint64_t lock_stats_acquired(struct lock_stats * st, uint64_t wait_start) {
+    const uint64_t now = timer_get_mtime();
+
+    __atomic_fetch_add(&st->acquisitions, 1, __ATOMIC_RELAXED);
+
+    if (wait_start != 0) {
+        __atomic_fetch_add(&st->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&st->wait_time, now - wait_start, __ATOMIC_RELAXED);
+        update_max(&st->max_wait, now - wait_start);
+    }
+
+    return now;
+}
+
+void lock_stats_released(struct lock_stats * st, uint64_t acquired) {
+    const uint64_t held = timer_get_mtime() - acquired;
+
+    __atomic_fetch_add(&st->hold_time, held, __ATOMIC_RELAXED);
+    update_max(&st->max_hold, held);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// The device may be opened any number of times and needs no cleanup when it is
+// closed. Every read takes a new snapshot, so it has no position.
+
+int lock_stats_open(struct io_intf ** ioptr, void * aux) {
+    trace("%s()", __func__);
+
+    ioref(&lock_stats_io);
+    *ioptr = &lock_stats_io;
+    return 0;
+}
+
+// Fills /buf/ with a text table of the lock statistics, one line per lock name,
+// longest total wait first. Times are in microseconds. Lines that do not fit in
+// /buf/ are left out. Returns the number of bytes read.
+
+long lock_stats_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    const int cnt = __atomic_load_n(&lock_stats_cnt, __ATOMIC_ACQUIRE);
+    unsigned char order[LOCK_STATS_MAX];
+    char line[LOCK_STATS_LINEMAX];
+    const struct lock_stats * prev;
+    unsigned long pos = 0;
+    uint64_t wait;
+    size_t len;
+    int n = 0;
+    int i, j;
+
+    trace("%s(buf=%p,bufsz=%ld)", __func__, buf, bufsz);
+
+    // Insertion sort by total wait time. Only names with acquisitions are
+    // listed.
+
+    for (i = 0; i < LOCK_STATS_MAX; i++) {
+        if (cnt <= i && i != LOCK_STATS_MAX-1)
+            continue;
+
+        if (__atomic_load_n(&lock_stats_tab[i].acquisitions,
+            __ATOMIC_RELAXED) == 0)
+        {
+            continue;
+        }
+
+        wait = __atomic_load_n(&lock_stats_tab[i].wait_time, __ATOMIC_RELAXED);
+
+        for (j = n; 0 < j; j--) {
+            prev = &lock_stats_tab[order[j-1]];
+
+            if (wait <= __atomic_load_n(&prev->wait_time, __ATOMIC_RELAXED))
+                break;
+
+            order[j] = order[j-1];
+        }
+
+        order[j] = i;
+        n += 1;
+    }
+
+    // A header line, then one line per name
+
+    for (i = -1; i < n; i++) {
+        len = format_line(line, (i < 0) ? NULL : &lock_stats_tab[order[i]]);
+
+        if (bufsz - pos < len)
+            break;
+
+        memcpy(buf + pos, line, len);
+        pos += len;
+    }
+
+    return pos;
+}
+
+// Formats the line of /st/ into /line/, which holds LOCK_STATS_LINEMAX bytes,
+// or the header line if /st/ is NULL. Returns the length of the line. Each
+// counter is loaded atomically, though other harts may update some of them
+// while the line is formatted.
+
+size_t format_line(char * line, const struct lock_stats * st) {
+    const uint64_t tpus = TIMER_FREQ / 1000000; // ticks per microsecond
+    size_t len;
+
+    if (st == NULL) {
+        len = snprintf(line, LOCK_STATS_LINEMAX,
+            "%24s %8s %8s %10s %8s %10s %8s\n",
+            "LOCK", "ACQ", "CONT", "WAIT", "MAXWAIT", "HOLD", "MAXHOLD");
+    } else {
+        len = snprintf(line, LOCK_STATS_LINEMAX,
+            "%24s %8lu %8lu %10lu %8lu %10lu %8lu\n", st->name,
+            __atomic_load_n(&st->acquisitions, __ATOMIC_RELAXED),
+            __atomic_load_n(&st->contended, __ATOMIC_RELAXED),
+            (unsigned long)(__atomic_load_n(&st->wait_time,
+                __ATOMIC_RELAXED) / tpus),
+            (unsigned long)(__atomic_load_n(&st->max_wait,
+                __ATOMIC_RELAXED) / tpus),
+            (unsigned long)(__atomic_load_n(&st->hold_time,
+                __ATOMIC_RELAXED) / tpus),
+            (unsigned long)(__atomic_load_n(&st->max_hold,
+                __ATOMIC_RELAXED) / tpus));
+    }
+
+    return (len < LOCK_STATS_LINEMAX) ? len : LOCK_STATS_LINEMAX - 1;
+}
+
+void update_max(uint64_t * max, uint64_t val) {
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while (old < val && !__atomic_compare_exchange_n(max, &old, val,
+        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        continue;
+    }
+}
+
+#endif // LOCK_STATS
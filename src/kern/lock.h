@@ -16,30 +16,139 @@
 #include "halt.h"
 #include "console.h"
 #include "intr.h"
+#include "spinlock.h"
+#include "error.h"
+
+#ifdef LOCK_STATS
+#include "timer.h"
+#endif
+
+// COMPILE-TIME PARAMETERS
+//
+
+// LOCK_SPIN_COUNT is the number of times lock_acquire polls a lock held by a
+// thread running on another hart before it goes to sleep. Critical sections
+// protected by sleep locks are often short, and polling avoids two context
+// switches if the lock is released in the meantime. Spinning is useless on a
+// single hart, so it is off (0) unless configured.
+
+#ifndef LOCK_SPIN_COUNT
+#define LOCK_SPIN_COUNT 0
+#endif
+
+// LOCK_STATS enables contention statistics for sleep locks. Locks are grouped
+// by the name they were initialized with, so that, e.g., all per-file locks
+// add up to one entry. For each name, lock.c counts acquisitions and those that
+// had to wait, the total and longest wait, and the total and longest time the
+// lock was held (for rwlocks, held for writing). The "lockstat" device reads
+// out a table of all names, longest total wait first.
+
+#ifdef LOCK_STATS
+
+// LOCK_STATS_MAX is the number of distinct lock names tracked. Locks with
+// names beyond that are counted together under "(other)".
+
+#ifndef LOCK_STATS_MAX
+#define LOCK_STATS_MAX 64
+#endif
+
+// Times are in timer ticks (see timer_get_mtime). The counters are updated
+// from many harts at once, so they are only accessed atomically.
+
+struct lock_stats {
+    const char * name;
+    unsigned long acquisitions;
+    unsigned long contended; // acquisitions that had to wait
+    uint64_t wait_time;
+    uint64_t max_wait;
+    uint64_t hold_time;
+    uint64_t max_hold;
+};
+
+#endif
+
+// A sleep lock. Waiting threads are queued on /cond/ in FIFO order. When the
+// lock is released while threads are waiting, ownership passes directly to the
+// thread that has waited longest, and only that thread is woken.
 
 struct lock {
     struct condition cond;
+    struct spinlock guard; // protects tid against other harts
     int tid; // thread holding lock or -1
+#ifdef LOCK_STATS
+    struct lock_stats * stats; // shared by locks with the same name
+    uint64_t acquired; // when holder acquired the lock
+#endif
+};
+
+// A reader-writer sleep lock. Any number of readers may hold it at the same
+// time, or a single writer. Writers take precedence: once a writer is waiting,
+// new readers wait until it has had its turn, so a steady stream of readers
+// cannot starve writers. Threads that cannot get the lock sleep.
+
+struct rwlock {
+    struct spinlock guard; // protects the fields below
+    struct condition readers_ok; // broadcast when readers may proceed
+    struct condition writer_ok; // signalled when a writer may proceed
+    int readers; // number of readers holding the lock
+    int writer; // thread holding the lock for writing or -1
+    int writers_waiting;
+#ifdef LOCK_STATS
+    struct lock_stats * stats; // shared by locks with the same name
+    uint64_t acquired; // when writer acquired the lock
+#endif
 };
 
 static inline void lock_init(struct lock * lk, const char * name);
 static inline void lock_acquire(struct lock * lk);
 static inline void lock_release(struct lock * lk);
 
+// Like lock_acquire, but gives up at time /twake/ (in timer ticks, see
+// timer_get_mtime). Returns 0 if the lock was acquired and -ETIMEDOUT if not.
+
+static inline int lock_acquire_until(struct lock * lk, uint64_t twake);
+
+static inline void rwlock_init(struct rwlock * rw, const char * name);
+static inline void rwlock_acquire_read(struct rwlock * rw);
+static inline void rwlock_release_read(struct rwlock * rw);
+static inline void rwlock_acquire_write(struct rwlock * rw);
+static inline void rwlock_release_write(struct rwlock * rw);
+
+// Lock statistics hooks (lock.c). lock_stats_init registers the "lockstat"
+// device. lock_stats_register returns the statistics of the locks named
+// /name/. lock_stats_acquired is called once a lock is held, with the time the
+// caller started waiting for it, or 0 if it did not wait, and returns the
+// current time. lock_stats_released is called before releasing a lock, with the
+// time it was acquired.
+
+#ifdef LOCK_STATS
+extern void lock_stats_init(void);
+extern struct lock_stats * lock_stats_register(const char * name);
+extern uint64_t lock_stats_acquired (
+    struct lock_stats * st, uint64_t wait_start);
+extern void lock_stats_released(struct lock_stats * st, uint64_t acquired);
+#endif
+
 // INLINE FUNCTION DEFINITIONS
 //
 
 static inline void lock_init(struct lock * lk, const char * name) {
     trace("%s(<%s:%p>", __func__, name, lk);
     condition_init(&lk->cond, name);
+    spinlock_init(&lk->guard, name, SPINLOCK_ORDER_OUTER);
     lk->tid = -1;
+#ifdef LOCK_STATS
+    lk->stats = lock_stats_register(name);
+#endif
 }
 
 /**
  * lock_acquire - Acquires a lock, ensuring mutual exclusion.
  *
  * This function attempts to acquire the given lock. If the lock is already held,
- * the calling thread is put to sleep until the lock becomes available.
+ * the calling thread is put to sleep until the lock is handed to it by
+ * lock_release. If LOCK_SPIN_COUNT is non-zero and the holder is running on
+ * another hart, the lock is polled for a while before going to sleep.
  *
  * @param lk: Pointer to the lock to acquire.
  */
@@ -47,34 +156,245 @@ static inline void lock_init(struct lock * lk, const char * name) {
 static inline void lock_acquire(struct lock * lk) {
     trace("%s(<%s:%p>)", __func__, lk->cond.name, lk);
 
-    while(1){
-        int intr_state = intr_disable();
+    const int me = running_thread();
+    int intr_state;
+#ifdef LOCK_STATS
+    uint64_t wait_start = 0;
+#endif
+
+#if LOCK_SPIN_COUNT > 0
+    int holder;
+    int spins;
 
-        if(lk->tid == -1) {
-            lk->tid = running_thread();
-            intr_restore(intr_state);
-            debug("Thread <%s:%d> acquired lock <%s:%p>", 
-                thread_name(running_thread()), running_thread(),
-                lk->cond.name, lk);
-            return;
-        }
+    for (spins = 0; spins < LOCK_SPIN_COUNT; spins++) {
+        holder = __atomic_load_n(&lk->tid, __ATOMIC_RELAXED);
 
-        // Wait if lock is held
-        condition_wait(&lk->cond);
+        if (holder == -1 || !thread_running(holder))
+            break;
     }
+#endif
+
+    intr_state = intr_disable();
+    spin_acquire(&lk->guard);
+
+    // If the lock is held, wait until lock_release makes us the owner. The
+    // guard is released while we sleep and reacquired before we re-check.
+
+    if (lk->tid == -1)
+        lk->tid = me;
+    else {
+#ifdef LOCK_STATS
+        wait_start = timer_get_mtime();
+#endif
+        while (lk->tid != me)
+            condition_wait_locked(&lk->cond, &lk->guard);
+    }
+
+    spin_release(&lk->guard);
+    intr_restore(intr_state);
+
+#ifdef LOCK_STATS
+    lk->acquired = lock_stats_acquired(lk->stats, wait_start);
+#endif
+
+    debug("Thread <%s:%d> acquired lock <%s:%p>", 
+        thread_name(running_thread()), running_thread(),
+        lk->cond.name, lk);
+}
+
+static inline int lock_acquire_until(struct lock * lk, uint64_t twake) {
+    trace("%s(<%s:%p>,%lu)", __func__, lk->cond.name, lk, twake);
+
+    const int me = running_thread();
+    int intr_state;
+    int result = 0;
+#ifdef LOCK_STATS
+    uint64_t wait_start = 0;
+#endif
+
+    intr_state = intr_disable();
+    spin_acquire(&lk->guard);
+
+    // As in lock_acquire. A waiter that times out is no longer on the wait
+    // list, so lock_release cannot hand it the lock afterwards.
+
+    if (lk->tid == -1)
+        lk->tid = me;
+    else {
+#ifdef LOCK_STATS
+        wait_start = timer_get_mtime();
+#endif
+        while (lk->tid != me && result == 0)
+            result = condition_wait_until(&lk->cond, &lk->guard, twake);
+
+        if (lk->tid == me)
+            result = 0;
+    }
+
+    spin_release(&lk->guard);
+    intr_restore(intr_state);
+
+    if (result == 0) {
+#ifdef LOCK_STATS
+        lk->acquired = lock_stats_acquired(lk->stats, wait_start);
+#endif
+        debug("Thread <%s:%d> acquired lock <%s:%p>",
+            thread_name(running_thread()), running_thread(),
+            lk->cond.name, lk);
+    }
+
+    return result;
 }
 
 static inline void lock_release(struct lock * lk) {
     trace("%s(<%s:%p>", __func__, lk->cond.name, lk);
 
+    int intr_state;
+
     assert (lk->tid == running_thread());
-    
-    lk->tid = -1;
-    condition_broadcast(&lk->cond);
+
+#ifdef LOCK_STATS
+    lock_stats_released(lk->stats, lk->acquired);
+#endif
+
+    intr_state = intr_disable();
+    spin_acquire(&lk->guard);
+
+    // Hand the lock to the longest waiting thread, if any. It owns the lock
+    // as soon as we release the guard, so no other thread can take the lock
+    // from it before it runs.
+
+    lk->tid = condition_signal(&lk->cond);
+
+    spin_release(&lk->guard);
+    intr_restore(intr_state);
 
     debug("Thread <%s:%d> released lock <%s:%p>",
         thread_name(running_thread()), running_thread(),
         lk->cond.name, lk);
 }
 
+static inline void rwlock_init(struct rwlock * rw, const char * name) {
+    trace("%s(<%s:%p>", __func__, name, rw);
+    spinlock_init(&rw->guard, name, SPINLOCK_ORDER_OUTER);
+    condition_init(&rw->readers_ok, name);
+    condition_init(&rw->writer_ok, name);
+    rw->readers = 0;
+    rw->writer = -1;
+    rw->writers_waiting = 0;
+#ifdef LOCK_STATS
+    rw->stats = lock_stats_register(name);
+#endif
+}
+
+static inline void rwlock_acquire_read(struct rwlock * rw) {
+    int intr_state;
+#ifdef LOCK_STATS
+    uint64_t wait_start = 0;
+#endif
+
+    trace("%s(<%s:%p>)", __func__, rw->guard.name, rw);
+
+    intr_state = intr_disable();
+    spin_acquire(&rw->guard);
+
+    // Wait while a writer holds the lock or is waiting for it.
+
+#ifdef LOCK_STATS
+    if (rw->writer != -1 || rw->writers_waiting != 0)
+        wait_start = timer_get_mtime();
+#endif
+
+    while (rw->writer != -1 || rw->writers_waiting != 0)
+        condition_wait_locked(&rw->readers_ok, &rw->guard);
+
+    rw->readers += 1;
+
+    spin_release(&rw->guard);
+    intr_restore(intr_state);
+
+#ifdef LOCK_STATS
+    lock_stats_acquired(rw->stats, wait_start);
+#endif
+}
+
+static inline void rwlock_release_read(struct rwlock * rw) {
+    int intr_state;
+
+    trace("%s(<%s:%p>)", __func__, rw->guard.name, rw);
+
+    intr_state = intr_disable();
+    spin_acquire(&rw->guard);
+
+    assert (0 < rw->readers);
+    rw->readers -= 1;
+
+    // The last reader out lets a waiting writer in.
+
+    if (rw->readers == 0 && rw->writers_waiting != 0)
+        condition_signal(&rw->writer_ok);
+
+    spin_release(&rw->guard);
+    intr_restore(intr_state);
+}
+
+static inline void rwlock_acquire_write(struct rwlock * rw) {
+    int intr_state;
+#ifdef LOCK_STATS
+    uint64_t wait_start = 0;
+#endif
+
+    trace("%s(<%s:%p>)", __func__, rw->guard.name, rw);
+
+    intr_state = intr_disable();
+    spin_acquire(&rw->guard);
+
+    rw->writers_waiting += 1;
+
+#ifdef LOCK_STATS
+    if (rw->writer != -1 || rw->readers != 0)
+        wait_start = timer_get_mtime();
+#endif
+
+    while (rw->writer != -1 || rw->readers != 0)
+        condition_wait_locked(&rw->writer_ok, &rw->guard);
+
+    rw->writers_waiting -= 1;
+    rw->writer = running_thread();
+
+    spin_release(&rw->guard);
+    intr_restore(intr_state);
+
+#ifdef LOCK_STATS
+    rw->acquired = lock_stats_acquired(rw->stats, wait_start);
+#endif
+}
+
+static inline void rwlock_release_write(struct rwlock * rw) {
+    int intr_state;
+
+    trace("%s(<%s:%p>)", __func__, rw->guard.name, rw);
+
+    assert (rw->writer == running_thread());
+
+#ifdef LOCK_STATS
+    lock_stats_released(rw->stats, rw->acquired);
+#endif
+
+    intr_state = intr_disable();
+    spin_acquire(&rw->guard);
+
+    rw->writer = -1;
+
+    // Writers first; readers only get in once no writer is waiting.
+
+    if (rw->writers_waiting != 0)
+        condition_signal(&rw->writer_ok);
+    else
+        condition_broadcast(&rw->readers_ok);
+
+    spin_release(&rw->guard);
+    intr_restore(intr_state);
+}
+
 #endif // _LOCK_H_
\ No newline at end of file
@@ -26,6 +26,11 @@
 #include "string.h"
 #include "process.h"
 #include "config.h"
+#include "smp.h"
+#include "prof.h"
+#include "ktrace.h"
+#include "stats.h"
+#include "lock.h"
 
 
 void main(void) {
@@ -42,6 +47,7 @@ void main(void) {
     thread_init();
     procmgr_init();
     timer_init();
+    smp_init();
 
     // Attach NS16550a serial devices
 
@@ -59,6 +65,13 @@ void main(void) {
         virtio_attach(mmio_base, VIRT0_IRQNO+i);
     }
 
+    prof_init();
+    ktrace_init();
+    stats_init();
+#ifdef LOCK_STATS
+    lock_stats_init();
+#endif
+
     intr_enable();
 
     result = device_open(&blkio, "blk", 0);
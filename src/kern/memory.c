@@ -24,9 +24,25 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "intr.h"
+#include "spinlock.h"
+#include "smp.h"
 
 #include <stdint.h>
 
+// COMPILE-TIME PARAMETERS
+//
+
+// PAGE_CACHE_SIZE is the number of free pages each hart keeps for itself. Page
+// allocations and frees are served from the hart's cache when possible. Each
+// cache has its own lock, which only another hart that has run out of pages
+// contends for; the global free list and its lock are only used when the cache
+// is empty or full.
+
+#ifndef PAGE_CACHE_SIZE
+#define PAGE_CACHE_SIZE 8
+#endif
+
 // EXPORTED VARIABLE DEFINITIONS
 //
 
@@ -95,10 +111,24 @@ static inline struct pte null_pte(void);
 
 static inline void sfence_vma(void);
 
+static union linked_page * reclaim_cached_pages(void);
+static void free_space(struct pte * root);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
 static union linked_page * free_list;
+static struct spinlock free_list_lock =
+    SPINLOCK_INITIALIZER("free_list", SPINLOCK_ORDER_PAGE);
+
+// Per-hart page caches. Other harts only take a cache's lock to empty it when
+// the free list has run out (see reclaim_cached_pages).
+
+static struct page_cache {
+    struct spinlock lock;
+    union linked_page * head;
+    int cnt;
+} page_cache[NCPU];
 
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
@@ -107,9 +137,6 @@ static struct pte main_pt1_0x80000[PTE_CNT]
 static struct pte main_pt0_0x80000[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 
-// EXPORTED VARIABLE DEFINITIONS
-//
-
 // EXPORTED FUNCTION DEFINITIONS
 // 
 
@@ -134,6 +161,7 @@ void memory_init(void) {
     size_t page_cnt;
     uintptr_t pma;
     const void * pp;
+    int i;
 
     trace("%s()", __func__);
 
@@ -224,11 +252,10 @@ void memory_init(void) {
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
 
-    free_list = heap_end; // heap_end is page aligned
     page_cnt = (RAM_END - heap_end) / PAGE_SIZE;
 
     kprintf("Page allocator: [%p,%p): %lu pages free\n",
-        free_list, RAM_END, page_cnt);
+        heap_end, RAM_END, page_cnt); // heap_end is page aligned
 
     // Put free pages on the free page list
     // TODO: FIXME implement this (must work with your implementation of
@@ -238,6 +265,10 @@ void memory_init(void) {
     // assigning linked pages and updating the head of the list - free_list
     // this needs the heap_end and RAN_END to be page alligned which heap_end for sure is 
     // uintptr_t aligned_ram_end = round_down_addr((uintptr_t)RAM_END, PAGE_SIZE);
+    for (i = 0; i < NCPU; i++)
+        spinlock_init(&page_cache[i].lock, "page_cache", SPINLOCK_ORDER_PAGE);
+
+    free_list = NULL;
     for(pp = heap_end; pp<RAM_END; pp+=PAGE_SIZE){
         page = (union linked_page *)pp;
         page->next = free_list;
@@ -254,25 +285,82 @@ void memory_init(void) {
     memory_initialized = 1;
 }
 
+/**
+ * Enables paging on a secondary hart, using the main memory space set up by
+ * memory_init on the boot hart, and gives the hart access to user memory.
+ */
+void memory_hart_init(void) {
+    csrw_satp(main_mtag);
+    sfence_vma();
+    csrs_sstatus(RISCV_SSTATUS_SUM);
+}
+
 
 
 /**
  * Allocates a zeroed memory page from the free list.
  * 
- * @return Pointer to the allocated memory page, or NULL on failure.
+ * @return Pointer to the allocated memory page. Panics if there is none.
  */
 void *memory_alloc_page(void) {
-    union linked_page *page;
+    void * page;
+
+    page = memory_try_alloc_page();
 
-    // Ensure the free list exists
-    if (free_list == NULL) {
+    if (page == NULL)
         panic("no free pages in free_list: memory_alloc_page");
-        return NULL;
+
+    return page;
+}
+
+/**
+ * Allocates a zeroed memory page from this hart's cache, the free list, or
+ * the caches of other harts, in that order.
+ * 
+ * @return Pointer to the allocated memory page, or NULL if there are no free
+ *         pages.
+ */
+void *memory_try_alloc_page(void) {
+    struct page_cache * cache;
+    union linked_page *page;
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    cache = &page_cache[running_hart()];
+
+    // Take a page from this hart's cache
+
+    spin_acquire(&cache->lock);
+    page = cache->head;
+
+    if (page != NULL) {
+        cache->head = page->next;
+        cache->cnt -= 1;
     }
 
-    // Remove the first page from the free list
-    page = free_list;
-    free_list = free_list->next;
+    spin_release(&cache->lock);
+
+    // Otherwise remove the first page from the free list
+
+    if (page == NULL) {
+        spin_acquire(&free_list_lock);
+        page = free_list;
+
+        if (page != NULL)
+            free_list = page->next;
+
+        spin_release(&free_list_lock);
+    }
+
+    // The free list may be empty while other harts still cache pages
+
+    if (page == NULL)
+        page = reclaim_cached_pages();
+
+    intr_restore(saved_intr_state);
+
+    if (page == NULL)
+        return NULL;
 
     // Zero out the page
     memset((void *)page, 0, PAGE_SIZE);
@@ -292,7 +380,9 @@ void *memory_alloc_page(void) {
  */
 
 void memory_free_page(void * pp){
+    struct page_cache * cache;
     union linked_page *page;
+    int saved_intr_state;
 
     // Ensure the input page is valid and page-aligned
     if ((uintptr_t)pp % PAGE_SIZE != 0 || pp == NULL) {
@@ -306,9 +396,29 @@ void memory_free_page(void * pp){
     // Cast the page pointer to the linked_page structure
     page = (union linked_page *)pp;
 
-    // Add the page back to the free list
-    page->next = free_list;
-    free_list = page;
+    // Add the page to this hart's cache, or back to the free list if the
+    // cache is full
+    saved_intr_state = intr_disable();
+    cache = &page_cache[running_hart()];
+    spin_acquire(&cache->lock);
+
+    if (cache->cnt < PAGE_CACHE_SIZE) {
+        page->next = cache->head;
+        cache->head = page;
+        cache->cnt += 1;
+        page = NULL;
+    }
+
+    spin_release(&cache->lock);
+
+    if (page != NULL) {
+        spin_acquire(&free_list_lock);
+        page->next = free_list;
+        free_list = page;
+        spin_release(&free_list_lock);
+    }
+
+    intr_restore(saved_intr_state);
 }
 
 
@@ -328,7 +438,7 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
 
     // Ensure the virtual pointer is page-aligned
     if ((uintptr_t)vp % PAGE_SIZE != 0) {
-        kprintf("vp not page alligned in memory_set_page_flags");
+        kwarn("vp not page alligned in memory_set_page_flags");
         return;
     }
 
@@ -337,7 +447,7 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
                                                      // create missing tables
     // checks for a valid pte
     if (pte == NULL || !(pte->flags & PTE_V)) {
-        kprintf("pte is null or not valid in memory_set_page_flags");
+        kwarn("pte is null or not valid in memory_set_page_flags");
         return;
     }
 
@@ -366,42 +476,28 @@ void memory_space_reclaim(void) {
     // retrieve the current satp value (ie the old mem space)
     uintptr_t old_satp = active_space_mtag();
 
-    // extract the root page table pointer
-    struct pte* old_root_pa = mtag_to_root(old_satp);
-
     // switch to the main mem space
     csrw_satp(main_mtag);
 
     // flush the tlb
     sfence_vma();
 
-    // reclaim the old memory space's page tables and pages
-    for (uintptr_t vaddr = USER_START_VMA; vaddr < USER_END_VMA; vaddr += PAGE_SIZE) {
-        // walk the pt
-        struct pte* pte = walk_pt(old_root_pa, vaddr, 0);
-        
-        // check if pte is valid
-        if (!pte) continue;
-
-        // check if valid flag is set
-        if (!(pte->flags & PTE_V)) continue; 
-
-        // skip global mappings
-        if (pte->flags & PTE_G) continue;
-
-        // free the physical page if its a leaf pte
-        if (pte->flags & (PTE_R | PTE_W | PTE_X)) {
-            // free the phyical page
-            uintptr_t pa = (uintptr_t)(pte->ppn) << 12;
-            memory_free_page((void *)pa);
+    free_space(mtag_to_root(old_satp));
+}
 
-            // invalidate the pte
-            memset(pte, 0, sizeof(struct pte));
-        }
-    }
+/**
+ * memory_space_free - reclaims a memory space that is not active on any hart.
+ *
+ * Used to give back a cloned memory space that was never run, and the space of
+ * an exited process, without switching to it. The main memory space only
+ * loses its user mappings.
+ *
+ * @param mtag  memory space tag returned by memory_space_clone
+ */
 
-    // can't free the old root pt itself
-    // since it might contain global or shared mappings
+void memory_space_free(uintptr_t mtag) {
+    assert (mtag == main_mtag || mtag != active_space_mtag());
+    free_space(mtag_to_root(mtag));
 }
 
 
@@ -446,7 +542,7 @@ void * memory_alloc_and_map_range (uintptr_t vma, size_t size, uint_fast8_t rwxu
                 memory_free_page((void *)rollback_vma);
             }
 
-            kprintf("something went wrong when allocating a page, rolling back each allocated page\n");
+            kwarn("something went wrong when allocating a page, rolling back each allocated page\n");
             return NULL;
         }
     }
@@ -595,11 +691,11 @@ void memory_handle_page_fault(const void * vptr){
     uintptr_t va = (uintptr_t) vptr;
     struct pte * root_pt, * pa_pte, * new_pp;
     
-    console_printf("handling page fault at virtual address: 0x%lx\n", va);
+    kdebug("handling page fault at virtual address: 0x%lx\n", va);
 
     // check if the virtual address is within the user mem space
     if (va < USER_START_VMA || va >= USER_END_VMA) {
-        console_printf("memory_handle_page_fault: 0x%lx is outside user space\n", va);
+        kerr("memory_handle_page_fault: 0x%lx is outside user space\n", va);
         panic("page fault in invalid address space");
     }
 
@@ -607,31 +703,45 @@ void memory_handle_page_fault(const void * vptr){
     va = round_down_addr(va, PAGE_SIZE);
     
     if (!aligned_addr(va, PAGE_SIZE)) {
-        console_printf("memory_handle_page_fault: 0x%lx is not page-aligned\n", va);
+        kerr("memory_handle_page_fault: 0x%lx is not page-aligned\n", va);
         panic("page fault at non-aligned address");
     }
 
+    // threads of the same process may fault on the same page at the same time
+    lock_acquire(&current_process()->mem_lock);
+
     // get the root page table for the active memory space and get to the pte for the va
     root_pt = active_space_root();
     pa_pte = walk_pt(root_pt, va, 1);
 
     if (pa_pte == NULL) {
-        console_printf("memory_handle_page_fault: pte not found for address 0x%lx\n", va);
+        kerr("memory_handle_page_fault: pte not found for address 0x%lx\n", va);
         panic("Page fault: PTE not found");
     }
 
+    // another thread of the process may have mapped the page already
+    if ((pa_pte->flags & (PTE_V | PTE_R | PTE_W | PTE_U)) ==
+        (PTE_V | PTE_R | PTE_W | PTE_U))
+    {
+        lock_release(&current_process()->mem_lock);
+        sfence_vma();
+        return;
+    }
+
     // allocate new pp
     new_pp = (struct pte *) memory_alloc_and_map_page(va, PTE_R | PTE_W | PTE_U);
 
     if (new_pp == NULL) {
-        console_printf("memory_handle_page_fault: failed to allocate physical page for address 0x%lx\n", va);
+        kerr("memory_handle_page_fault: failed to allocate physical page for address 0x%lx\n", va);
         panic("Page fault: Memory allocation failed");
     }
 
+    lock_release(&current_process()->mem_lock);
+
     // flush tlb
     sfence_vma();
 
-    console_printf("memory_handle_page_fault: successfully handled page fault at address 0x%lx\n", va);
+    kdebug("memory_handle_page_fault: successfully handled page fault at address 0x%lx\n", va);
 }
 
 
@@ -649,16 +759,13 @@ void memory_handle_page_fault(const void * vptr){
 
 int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_flags){
     // Validate the ptr and len are well-formed
-    if (!wellformed_vma((uintptr_t)vp) || len == 0){
+    if (!wellformed_vma((uintptr_t)vp) || len == 0 || (uintptr_t)vp + len < (uintptr_t)vp){
         return -1;
     }
 
-    uintptr_t start_vma = (uintptr_t)vp;
-    uintptr_t end_vma = start_vma + len;
-
     // make sure the start and end addresses are page aligned
-    round_down_addr(start_vma, PAGE_SIZE);
-    round_up_addr(end_vma, PAGE_SIZE);
+    uintptr_t start_vma = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    uintptr_t end_vma = round_up_addr((uintptr_t)vp + len, PAGE_SIZE);
 
     // Traverse all pages within the range [start_vma, end_vma)
     for(uintptr_t current_vma = start_vma; current_vma < end_vma; current_vma += PAGE_SIZE){
@@ -679,6 +786,46 @@ int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_fl
 
 
 
+/**
+ * memory_fault_in_user - maps the missing pages of a user range.
+ *
+ * @param vp            pointer to the start of the user range
+ * @param len           length of the range in bytes
+ * @param rwxug_flags   flags every page of the range must have
+ *
+ * @return              0, or -EFAULT if the range is not in user space or a
+ *                      page lacks the flags
+ */
+
+int memory_fault_in_user (
+    const void * vp, size_t len, uint_fast8_t rwxug_flags)
+{
+    const uintptr_t end = (uintptr_t)vp + len;
+    struct pte * pte;
+    uintptr_t va;
+
+    if (!user_range_ok(vp, len))
+        return -EFAULT;
+
+    va = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+
+    for (; va < end; va += PAGE_SIZE) {
+        pte = walk_pt(active_space_root(), va, 0);
+
+        if (pte == NULL || !(pte->flags & PTE_V)) {
+            memory_handle_page_fault((const void *)va);
+            pte = walk_pt(active_space_root(), va, 0);
+        }
+
+        if (pte == NULL || (pte->flags & rwxug_flags) != rwxug_flags)
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+
 /**
  * validates virtual memory string is well formed and accesible
  * 
@@ -734,7 +881,8 @@ int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
  * 
  * @param asid      address space identifier for the child's address space unused for this MP
  * 
- * @return          returns the mtag of the newly cloned memory space
+ * @return          returns the mtag of the newly cloned memory space, or 0 if
+ *                  there are not enough free pages
  */
 uintptr_t memory_space_clone(uint_fast16_t asid){
     // get parent mtag 
@@ -744,12 +892,17 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
     struct pte* parent_root_pt = mtag_to_root(parent_mtag);
 
     // allocate new root page 
-    struct pte *new_root = memory_alloc_page();
+    struct pte *new_root = memory_try_alloc_page();
     if (!new_root) 
         return 0; // Allocation failure
 
     struct pte *child_root = new_root;
 
+    // construct new mtag with given asid 
+    uintptr_t new_mtag = ((uintptr_t) RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
+                         ((uintptr_t) asid << RISCV_SATP_ASID_shift) |
+                         pageptr_to_pagenum(child_root);
+
     memset(new_root, 0, PAGE_SIZE); // Zero out the new root table
 
     for (int i = 0; i < PTE_CNT; i++) {
@@ -770,7 +923,10 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
         struct pte *child_pte = walk_pt(child_root, vma, 1);
 
         // allocate the page that the child pte points to 
-        void* child_pt = memory_alloc_page();
+        void* child_pt = (child_pte != NULL) ? memory_try_alloc_page() : NULL;
+
+        if (child_pt == NULL)
+            goto out_of_memory;
 
         // set the ppn of the child pte to the newly allocated page
         child_pte->ppn = pageptr_to_pagenum(child_pt);
@@ -784,12 +940,12 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
         memcpy(child_phys_page, parent_phys_page, PAGE_SIZE);
     }
 
-    // construct new mtag with given asid 
-    uintptr_t new_mtag = ((uintptr_t) RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
-                         ((uintptr_t) asid << RISCV_SATP_ASID_shift) |
-                         pageptr_to_pagenum(child_root);
-
     return new_mtag;
+
+out_of_memory:
+    // give back the pages and page tables cloned so far
+    free_space(child_root);
+    return 0;
 }
 
 
@@ -839,9 +995,12 @@ struct pte * walk_pt(struct pte* root, uintptr_t vma, int create) {
         } else if (create) {
             // entry isn't valid create the entry
             // allocate a new page table
-            struct pte* new_pt = (struct pte*)memory_alloc_page(); // should panic if no pages available
+            struct pte* new_pt = (struct pte*)memory_try_alloc_page();
+
+            if (new_pt == NULL)
+                return NULL;
 
-            console_printf("new pt address: 0x%x\n", new_pt);
+            kdebug("new pt address: 0x%x\n", new_pt);
 
             pt[vpn[level]].ppn = (uint64_t)new_pt >> PAGE_ORDER;
             pt[vpn[level]].flags = PTE_V;
@@ -966,3 +1125,86 @@ static inline struct pte null_pte(void) {
 static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
+
+// Empties the page caches of all harts. Returns one of the pages and puts the
+// rest on the free list, or returns NULL if all caches were empty. Called with
+// interrupts disabled. The cache locks and free_list_lock are never held at
+// the same time.
+
+union linked_page * reclaim_cached_pages(void) {
+    union linked_page * result = NULL;
+    union linked_page * head;
+    union linked_page * tail;
+    int i;
+
+    for (i = 0; i < NCPU; i++) {
+        spin_acquire(&page_cache[i].lock);
+        head = page_cache[i].head;
+        page_cache[i].head = NULL;
+        page_cache[i].cnt = 0;
+        spin_release(&page_cache[i].lock);
+
+        if (head == NULL)
+            continue;
+
+        if (result == NULL) {
+            result = head;
+            head = head->next;
+
+            if (head == NULL)
+                continue;
+        }
+
+        for (tail = head; tail->next != NULL; tail = tail->next)
+            continue;
+
+        spin_acquire(&free_list_lock);
+        tail->next = free_list;
+        free_list = head;
+        spin_release(&free_list_lock);
+    }
+
+    return result;
+}
+
+// Frees the user pages and user page tables of the memory space with root page
+// table /root/, and /root/ itself unless it is the main root. The other root
+// entries are global mappings shared with the main memory space. The space
+// must not be active on any hart.
+
+void free_space(struct pte * root) {
+    struct pte * pte;
+    struct pte * pt1;
+    uintptr_t vaddr;
+    int i, j;
+
+    for (vaddr = USER_START_VMA; vaddr < USER_END_VMA; vaddr += PAGE_SIZE) {
+        pte = walk_pt(root, vaddr, 0);
+
+        if (pte == NULL || !(pte->flags & PTE_V) || (pte->flags & PTE_G))
+            continue;
+
+        if (pte->flags & (PTE_R | PTE_W | PTE_X)) {
+            memory_free_page(pagenum_to_pageptr(pte->ppn));
+            *pte = null_pte();
+        }
+    }
+
+    for (i = VPN2(USER_START_VMA); i <= VPN2(USER_END_VMA - 1); i++) {
+        if ((root[i].flags & (PTE_V | PTE_G)) != PTE_V)
+            continue;
+
+        pt1 = pagenum_to_pageptr(root[i].ppn);
+
+        for (j = 0; j < PTE_CNT; j++) {
+            if (pt1[j].flags & PTE_V)
+                memory_free_page(pagenum_to_pageptr(pt1[j].ppn));
+        }
+
+        memory_free_page(pt1);
+        root[i] = null_pte();
+    }
+
+    if (root != main_pt2)
+        memory_free_page(root);
+}
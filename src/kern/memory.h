@@ -5,6 +5,8 @@
 #define _MEMORY_H_
 
 #include "csr.h"
+#include "config.h"
+#include "error.h"
 
 #include <stddef.h> // size_t
 #include <stdint.h> // uint_fast32_t
@@ -73,6 +75,12 @@ extern uintptr_t memory_space_clone(uint_fast16_t asid);
 
 extern void memory_init(void);
 extern char memory_initialized;
+
+// void memory_hart_init(void)
+// Enables paging on a secondary hart using the main memory space. Must be
+// called on each secondary hart before it accesses user memory.
+
+extern void memory_hart_init(void);
 extern struct pte * active_space_root(void);
 
 // uintptr_t memory_space_create(void)
@@ -88,10 +96,18 @@ extern uintptr_t memory_space_create(uint_fast16_t asid);
 // void memory_space_reclaim(uintptr_t mtag)
 // Switches the active memory space to the main memory space and reclaims the
 // memory space that was active on entry. All physical pages mapped by a user
-// mapping are reclaimed.
+// mapping, and the page tables of the user mappings, are reclaimed.
 
 extern void memory_space_reclaim(void);
 
+// void memory_space_free(uintptr_t mtag)
+// Reclaims a memory space returned by memory_space_clone that is not active
+// on any hart, without switching to it. All physical pages mapped by a user
+// mapping, and the page tables of the space, are reclaimed. For the main
+// memory space, only the user mappings and their page tables are reclaimed.
+
+extern void memory_space_free(uintptr_t mtag);
+
 // uintptr_t active_memory_space(void)
 // Returns the memory space tag of the current memory space.
 
@@ -109,6 +125,12 @@ extern uintptr_t memory_space_switch(uintptr_t mtag);
 
 extern void * memory_alloc_page(void);
 
+// void * memory_try_alloc_page(void)
+// Like memory_alloc_page, but returns NULL if there are no free pages. Used
+// where running out of memory should fail a request rather than the kernel.
+
+extern void * memory_try_alloc_page(void);
+
 // void memory_free_page(void * ptr)
 // Returns a physical memory page to the physical page allocator. The page must
 // have been previously allocated by memory_alloc_page.
@@ -167,6 +189,19 @@ extern void memory_set_range_flags (
 extern int memory_validate_vptr_len (
     const void * vp, size_t len, uint_fast8_t rwxug_flags);
 
+// int memory_fault_in_user (
+//     const void * vp, size_t len, uint_fast8_t rwxug_flags)
+// Makes every page of a user range present, mapping a page wherever a user
+// access would have memory_handle_page_fault map one, and checks that all have
+// at least the specified flags. Returns 0, or -EFAULT if the range lies
+// outside user space or a page lacks the flags. The fixups of copy_to_user and
+// copy_from_user do not map pages, so system calls call this first for user
+// memory the process may not have touched yet. Must not be called with a
+// spinlock held.
+
+extern int memory_fault_in_user (
+    const void * vp, size_t len, uint_fast8_t rwxug_flags);
+
 // int memory_validate_vstr (
 //     const char * vs, uint_fast8_t ug_flags)
 // Checks if the virtual pointer points to a mapped range containing a
@@ -178,6 +213,23 @@ extern int memory_validate_vptr_len (
 extern int memory_validate_vstr (
     const char * vs, uint_fast8_t ug_flags);
 
+// int copy_from_user(void * kdst, const void * usrc, size_t n)
+// int copy_to_user(void * udst, const void * ksrc, size_t n)
+// Copy /n/ bytes between kernel memory and user memory in the active memory
+// space. Return 0, or -EFAULT if the user range lies outside user space or is
+// not mapped with the needed permission. The user range need not be validated
+// first: faults during the copy are caught (see uaccess.s), so these are the
+// cheap way to move small system call arguments.
+//
+// long strncpy_from_user(char * kdst, const char * usrc, size_t n)
+// Copies a null-terminated string of at most /n/ bytes, including the null
+// byte, from user memory. Returns the length of the string, -EINVAL if it does
+// not fit, or -EFAULT as above.
+
+static inline int copy_from_user(void * kdst, const void * usrc, size_t n);
+static inline int copy_to_user(void * udst, const void * ksrc, size_t n);
+static inline long strncpy_from_user(char * kdst, const char * usrc, size_t n);
+
 // Called from excp.c to handle a page fault at the specified address. Either
 // maps a page containing the faulting address, or calls process_exit().
 
@@ -190,4 +242,41 @@ struct pte * walk_pt(struct pte* root, uintptr_t vma, int create);
 // INLINE FUNCTION DEFINITIONS
 //
 
+extern long _copy_user(void * dst, const void * src, size_t n); // uaccess.s
+extern long _strncpy_user(char * dst, const char * src, size_t n); // uaccess.s
+
+static inline int user_range_ok(const void * up, size_t n) {
+    const uintptr_t start = (uintptr_t)up;
+
+    return (USER_START_VMA <= start && start <= USER_END_VMA &&
+        n <= USER_END_VMA - start);
+}
+
+static inline int copy_from_user(void * kdst, const void * usrc, size_t n) {
+    if (!user_range_ok(usrc, n))
+        return -EFAULT;
+    return _copy_user(kdst, usrc, n);
+}
+
+static inline int copy_to_user(void * udst, const void * ksrc, size_t n) {
+    if (!user_range_ok(udst, n))
+        return -EFAULT;
+    return _copy_user(udst, ksrc, n);
+}
+
+static inline long strncpy_from_user(char * kdst, const char * usrc, size_t n) {
+    long len;
+
+    if (!user_range_ok(usrc, 1))
+        return -EFAULT;
+
+    // The string may end just below the end of user space.
+
+    if (USER_END_VMA - (uintptr_t)usrc < n)
+        n = USER_END_VMA - (uintptr_t)usrc;
+
+    len = _strncpy_user(kdst, usrc, n);
+    return (len == n) ? -EINVAL : len;
+}
+
 #endif // _MEMORY_H_
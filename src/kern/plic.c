@@ -3,6 +3,8 @@
 
 #include "plic.h"
 #include "console.h"
+#include "thread.h" // for running_hart
+#include "smp.h"
 
 #include <stdint.h>
 
@@ -17,7 +19,12 @@
 #endif
 
 #define PLIC_SRCCNT 0x400
-#define PLIC_CTXCNT 1
+#define PLIC_CTXCNT (2*NCPU)
+
+// On the QEMU virt machine, each hart has an M-mode context (2*hart) and an
+// S-mode context (2*hart+1).
+
+#define PLIC_SCTX(hart) (2*(hart)+1)
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -33,9 +40,9 @@ extern void plic_set_context_threshold(uint32_t ctxno, uint32_t level);
 extern uint32_t plic_claim_context_interrupt(uint32_t ctxno);
 extern void plic_complete_context_interrupt(uint32_t ctxno, uint32_t srcno);
 
-// Currently supports only single-hart operation. The low-level PLIC functions
-// already understand contexts, so we only need to modify the high-level
-// functions (plic_init, plic_claim, plic_complete).
+// All sources are routed to the S-mode context of the boot hart, so device
+// ISRs only ever run there. Claim and complete use the context of the running
+// hart, which keeps them correct should sources be routed elsewhere.
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -44,11 +51,11 @@ void plic_init(void) {
     int i;
 
     // Disable all sources by setting priority to 0, enable all sources for
-    // context 0 (M mode on hart 0).
+    // the S-mode context of the boot hart.
 
     for (i = 0; i < PLIC_SRCCNT; i++) {
         plic_set_source_priority(i, 0);
-        plic_enable_source_for_context(1, i); // changed context no
+        plic_enable_source_for_context(PLIC_SCTX(BOOT_HART), i);
     }
 }
 
@@ -65,15 +72,13 @@ extern void plic_disable_irq(int irqno) {
 }
 
 extern int plic_claim_irq(void) {
-    // Hardwired context 0 (M mode on hart 0)
     trace("%s()", __func__);
-    return plic_claim_context_interrupt(1); // changed context no
+    return plic_claim_context_interrupt(PLIC_SCTX(running_hart()));
 }
 
 extern void plic_close_irq(int irqno) {
-    // Hardwired context 0 (M mode on hart 0)
     trace("%s(irqno=%d)", __func__, irqno);
-    plic_complete_context_interrupt(1, irqno); // changed context no
+    plic_complete_context_interrupt(PLIC_SCTX(running_hart()), irqno);
 }
 
 // INTERNAL FUNCTION DEFINITIONS
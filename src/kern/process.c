@@ -2,6 +2,11 @@
 //
 
 #include "process.h"
+#include "idtab.h"
+#include "heap.h"
+#include "intr.h"
+#include "spinlock.h"
+#include "ioring.h"
 
 #ifdef PROCESS_TRACE
 #define TRACE
@@ -12,17 +17,14 @@
 #endif
 
 
-// COMPILE-TIME PARAMETERS
+// INTERNAL FUNCTION DECLARATIONS
 //
 
-// NPROC is the maximum number of processes
-
-#ifndef NPROC
-#define NPROC 16
-#endif
+// Copies the usage counters of /proc/, which the caller keeps in proctab by
+// holding proctab_lock.
 
-// INTERNAL FUNCTION DECLARATIONS
-//
+static void get_usage (
+    const struct process * proc, struct process_usage * usage);
 
 // INTERNAL GLOBAL VARIABLES
 //
@@ -33,11 +35,19 @@
 
 static struct process main_proc;
 
-// A table of pointers to all user processes in the system
+// A table of pointers to all user processes in the system, indexed by process
+// id. The maximum number of processes is IDTAB_MAXID.
 
-struct process * proctab[NPROC] = {
-    [MAIN_PID] = &main_proc
-};
+static struct idtab proctab;
+
+static struct spinlock proctab_lock =
+    SPINLOCK_INITIALIZER("proctab", SPINLOCK_ORDER_OUTER);
+
+// Freed process structs, linked through next_free
+
+static struct process * free_procs;
+static struct spinlock free_procs_lock =
+    SPINLOCK_INITIALIZER("free_procs", SPINLOCK_ORDER_NONE);
 
 // EXPORTED GLOBAL VARIABLES
 //
@@ -58,9 +68,15 @@ void procmgr_init(void) {
     // initialize the main user process struct
     // init proc id
     main_proc.id = MAIN_PID;
+    idtab_init(&proctab);
+
+    if (idtab_insert(&proctab, MAIN_PID, &main_proc) != 0)
+        panic("procmgr_init: proctab");
     
     // init tid
     main_proc.tid = running_thread();
+    main_proc.nthr = 1;
+    lock_init(&main_proc.mem_lock, "main_proc.mem_lock");
 
     // init mem space identifier
     main_proc.mtag = active_memory_space();
@@ -76,6 +92,137 @@ void procmgr_init(void) {
 
 
 
+struct process * process_alloc(void) {
+    struct process * proc;
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&free_procs_lock);
+    proc = free_procs;
+
+    if (proc != NULL)
+        free_procs = proc->next_free;
+
+    spin_release(&free_procs_lock);
+    intr_restore(saved_intr_state);
+
+    if (proc != NULL)
+        memset(proc, 0, sizeof(struct process));
+    else
+        proc = kcalloc(1, sizeof(struct process));
+
+    return proc;
+}
+
+
+
+void process_free(struct process * proc) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&free_procs_lock);
+    proc->next_free = free_procs;
+    free_procs = proc;
+    spin_release(&free_procs_lock);
+    intr_restore(saved_intr_state);
+}
+
+
+
+/**
+ * assigns a process id to a new process
+ * 
+ * @param proc      pointer to the new process
+ * 
+ * @return          returns the process id, or -EAGAIN if there are too many processes
+ */
+
+int process_alloc_pid(struct process * proc) {
+    int saved_intr_state;
+    int pid;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&proctab_lock);
+    pid = idtab_alloc(&proctab, proc);
+    spin_release(&proctab_lock);
+    intr_restore(saved_intr_state);
+
+    if (pid >= 0)
+        proc->id = pid;
+
+    return pid;
+}
+
+
+
+/**
+ * removes a process from the process table
+ * 
+ * @param pid       process id of the process
+ */
+
+void process_free_pid(int pid) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&proctab_lock);
+    idtab_free(&proctab, pid);
+    spin_release(&proctab_lock);
+    intr_restore(saved_intr_state);
+}
+
+
+
+int process_get_usage(int pid, struct process_usage * usage) {
+    const struct process * proc;
+    int saved_intr_state;
+    int result = -ENOENT;
+
+    // A process is removed from proctab before it is freed, so it stays valid
+    // while we hold proctab_lock.
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&proctab_lock);
+    proc = idtab_get(&proctab, pid);
+
+    if (proc != NULL) {
+        get_usage(proc, usage);
+        result = 0;
+    }
+
+    spin_release(&proctab_lock);
+    intr_restore(saved_intr_state);
+    return result;
+}
+
+int process_get_usages(int * pids, struct process_usage * usages, int max) {
+    const struct process * proc;
+    int saved_intr_state;
+    int pid = 0;
+    int n = 0;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&proctab_lock);
+
+    while (n < max && (pid = idtab_next(&proctab, pid)) >= 0) {
+        proc = idtab_get(&proctab, pid);
+
+        if (proc != NULL) {
+            pids[n] = pid;
+            get_usage(proc, &usages[n]);
+            n += 1;
+        }
+
+        pid += 1;
+    }
+
+    spin_release(&proctab_lock);
+    intr_restore(saved_intr_state);
+    return n;
+}
+
+
+
 /**
  * executes a program referred to by the I/O interface passed in as an argument
  * 
@@ -98,6 +245,14 @@ int process_exec(struct io_intf * exeio) {
     struct thread_stack_anchor* stack_anchor;
     uintptr_t usp;
 
+    // other threads of the process are still using the memory space
+    if (current_process()->nthr != 1) {
+        return -EBUSY;
+    }
+
+    // ioring requests may still refer to the old image
+    ioring_release(current_process());
+
     // (a) unmap any virtual memory mappings begongin to other user processes
     memory_unmap_and_free_user();
 
@@ -108,13 +263,13 @@ int process_exec(struct io_intf * exeio) {
     result = elf_load(exeio, &entry_point);
 
     if (result < 0) {
-        kprintf("process_exec: elf load failed\n");
+        kerr("process_exec: elf load failed\n");
         return -1;
     }
 
     // ensure entry point is within the user mem space
     if ((uintptr_t) entry_point < USER_START_VMA || (uintptr_t) entry_point >= USER_END_VMA) {
-        console_printf("process_exec: start address is not within the valid range\n");
+        kerr("process_exec: start address is not within the valid range\n");
         return -1;
     }
 
@@ -144,11 +299,33 @@ int process_exec(struct io_intf * exeio) {
 
 void __attribute__ ((noreturn)) process_exit(void) {
     struct process* current_proc = current_process();
+    int saved_intr_state;
 
     if (!current_proc) panic("prcess_exit: current process doesn't exist, ::confused_face_emoji\n");
 
-    // reclaim the memory space
-    memory_space_reclaim();
+    // The last thread to exit frees the process, so stop charging our CPU
+    // time to it (see update_curr in thread.c) before dropping our count.
+    // We also leave its memory space before dropping our count, so that when
+    // the last thread frees the root page table, no other hart can still have
+    // it loaded. Interrupts stay disabled until the process is set again.
+
+    saved_intr_state = intr_disable();
+    thread_set_process(running_thread(), NULL);
+    memory_space_switch(main_mtag);
+
+    // other threads still need the memory space and open files
+    if (__atomic_sub_fetch(&current_proc->nthr, 1, __ATOMIC_ACQ_REL) != 0) {
+        thread_exit();
+    }
+
+    thread_set_process(running_thread(), current_proc);
+    intr_restore(saved_intr_state);
+
+    // ioring workers may still be using the memory space
+    ioring_release(current_proc);
+
+    // reclaim the memory space (we switched to the main space above)
+    memory_space_free(current_proc->mtag);
 
     // close open io device
     for (int i = 0; i < PROCESS_IOMAX; i++) {
@@ -158,9 +335,28 @@ void __attribute__ ((noreturn)) process_exit(void) {
         }
     }
 
+    // release the process id and struct (the main process is static)
+    if (current_proc != &main_proc) {
+        thread_set_process(running_thread(), NULL);
+        process_free_pid(current_proc->id);
+        process_free(current_proc);
+    }
+
     // terminate the associated thread
     thread_exit();
 
     // thread_exit should not return
     panic("process_exit: thread_exit() returned ::confused_face_emoji\n");
-}
\ No newline at end of file
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void get_usage (
+    const struct process * proc, struct process_usage * usage)
+{
+    usage->nthr = __atomic_load_n(&proc->nthr, __ATOMIC_RELAXED);
+    usage->cpu_time = __atomic_load_n(&proc->cpu_time, __ATOMIC_RELAXED);
+    usage->nvcsw = __atomic_load_n(&proc->nvcsw, __ATOMIC_RELAXED);
+    usage->nivcsw = __atomic_load_n(&proc->nivcsw, __ATOMIC_RELAXED);
+}
@@ -15,31 +15,95 @@
 #include "elf.h"
 #include "console.h"
 #include "halt.h"
+#include "lock.h"
 #include <stdint.h>
 #include <string.h>
 
 // EXPORTED TYPE DEFINITIONS
 //
 
+// A process has one or more threads (see thread_create_user), which share its
+// memory space and open files. /tid/ is the thread the process started with.
+// The memory space and files are released when the last thread exits.
+
+struct ioring;
+
 struct process {
     int id; // process id of this process
     int tid; // thread id of associated thread
+    int nthr; // number of threads that have not exited
     uintptr_t mtag; // memory space identifier
+    struct lock mem_lock; // serializes changes to the memory space
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct ioring * ring; // see ioring.h
+    uint64_t cpu_time; // CPU time used by its threads, in timer ticks
+    unsigned long nvcsw; // times its threads blocked or exited
+    unsigned long nivcsw; // times its threads were preempted or yielded
+    struct process * next_free; // see process_free
+};
+
+// A snapshot of the CPU usage of a process (see process_get_usage and
+// process_get_usages).
+
+struct process_usage {
+    int nthr;
+    uint64_t cpu_time;
+    unsigned long nvcsw;
+    unsigned long nivcsw;
 };
 
 // EXPORTED VARIABLES DECLARATIONS
 //
 
 extern char procmgr_initialized;
-extern struct process * proctab[];
 
 // EXPORTED FUNCTION DECLARATIONS
 //
 
 extern void procmgr_init(void);
+
+// struct process * process_alloc(void)
+// Returns a zeroed struct process, reusing one given back by process_free if
+// there is one. Returns NULL if there is not enough memory.
+//
+// void process_free(struct process * proc)
+// Keeps /proc/ for reuse by process_alloc, since kfree does not return memory
+// to the heap. The process must have been removed from the process table.
+
+extern struct process * process_alloc(void);
+extern void process_free(struct process * proc);
+
+// int process_alloc_pid(struct process * proc)
+// Assigns the lowest free process id to /proc/ (setting proc->id) and enters
+// it in the process table. Returns the process id, or -EAGAIN if all process
+// ids are in use (see IDTAB_MAXID in idtab.h).
+
+extern int process_alloc_pid(struct process * proc);
+
+// void process_free_pid(int pid)
+// Removes a process from the process table, making its id available for reuse.
+
+extern void process_free_pid(int pid);
+
+// int process_get_usage(int pid, struct process_usage * usage)
+// Fills in /usage/ for process /pid/. Returns 0 on success, or -ENOENT if
+// there is no such process.
+
+extern int process_get_usage(int pid, struct process_usage * usage);
+
+// int process_get_usages(int * pids, struct process_usage * usages, int max)
+// Fills in the ids and usage of up to /max/ processes, lowest pid first, and
+// returns how many it filled in. Walks the process table under one hold of its
+// lock, visiting only the ids in use.
+
+extern int process_get_usages (
+    int * pids, struct process_usage * usages, int max);
 extern int process_exec(struct io_intf * exeio);
 
+// void process_exit(void)
+// Terminates the current thread. If it is the last thread of its process,
+// also releases the memory space and closes the open files of the process.
+
 extern void __attribute__ ((noreturn)) process_exit(void);
 
 extern void process_terminate(int pid);
@@ -0,0 +1,166 @@
+// prof.c - Sampling profiler
+//
+
+#ifdef PROF_TRACE
+#define TRACE
+#endif
+
+#ifdef PROF_DEBUG
+#define DEBUG
+#endif
+
+#include "prof.h"
+#include "recdev.h"
+#include "trap.h"
+#include "timer.h"
+#include "thread.h"
+#include "process.h"
+#include "memory.h"
+#include "intr.h"
+#include "smp.h"
+#include "csr.h"
+#include "config.h"
+#include "console.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// Kernel frame pointers further than PROF_KSTACK_MAX above the interrupted sp
+// are not followed, as they cannot be on the same stack.
+
+#define PROF_KSTACK_MAX (16 * PAGE_SIZE)
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+uint64_t prof_period;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void prof_start(void);
+static void prof_stop(void);
+
+static int walk_kernel_frames(struct prof_sample * s, uint64_t fp, uint64_t sp);
+static int walk_user_frames(struct prof_sample * s, uint64_t fp);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct prof_sample prof_buf[NCPU][PROF_RING_SIZE];
+
+static struct recdev prof_dev =
+    RECDEV_INITIALIZER("prof", prof_buf, prof_start, prof_stop);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void prof_init(void) {
+    recdev_register(&prof_dev);
+}
+
+void prof_sample(const struct trap_frame * tfr, uint64_t now) {
+    const int hart = running_hart();
+    const struct process * proc;
+    struct prof_sample * s;
+    int tid;
+
+    s = recdev_claim(&prof_dev, hart);
+
+    if (s == NULL)
+        return;
+
+    tid = running_thread();
+    proc = thread_process(tid);
+
+    s->time = now;
+    s->hart = hart;
+    s->smode = ((tfr->sstatus & RISCV_SSTATUS_SPP) != 0);
+    s->tid = tid;
+    s->pid = (proc != NULL) ? proc->id : -1;
+    s->pc[0] = tfr->sepc;
+
+    if (s->smode)
+        s->depth = walk_kernel_frames(s, tfr->x[TFR_S0], tfr->x[TFR_SP]);
+    else
+        s->depth = walk_user_frames(s, tfr->x[TFR_S0]);
+
+    recdev_publish(&prof_dev, hart);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Opening the device starts sampling on all harts. Harts whose timer is
+// stopped are woken with an IPI to start theirs (see timer_restart_tick).
+
+void prof_start(void) {
+    const int self = running_hart();
+    int saved_intr_state;
+    int h;
+
+    trace("%s()", __func__);
+
+    __atomic_store_n(&prof_period, TIMER_FREQ / PROF_FREQ, __ATOMIC_RELEASE);
+
+    saved_intr_state = intr_disable();
+    timer_restart_tick();
+    intr_restore(saved_intr_state);
+
+    for (h = 0; h < smp_ncpu; h++)
+        if (h != self)
+            smp_send_ipi(h);
+}
+
+// Closing the device stops sampling. Each hart stops at its next sample.
+
+void prof_stop(void) {
+    trace("%s()", __func__);
+    __atomic_store_n(&prof_period, 0, __ATOMIC_RELEASE);
+}
+
+// Follows the frame pointer chain of the interrupted kernel code. With
+// -fno-omit-frame-pointer, fp points just above the frame, with the return
+// address saved at fp-8 and the caller's fp at fp-16. The chain ends when fp
+// leaves the stack, which is in RAM and grows down.
+
+int walk_kernel_frames(struct prof_sample * s, uint64_t fp, uint64_t sp) {
+    const uint64_t * frame;
+    int depth = 1;
+
+    while (depth < PROF_DEPTH && fp % 8 == 0 && sp < fp &&
+        fp - sp <= PROF_KSTACK_MAX &&
+        RAM_START_PMA + 16 <= fp && fp <= RAM_END_PMA)
+    {
+        frame = (const uint64_t *)fp;
+        s->pc[depth++] = frame[-1];
+
+        if (frame[-2] <= fp)
+            break;
+
+        fp = frame[-2];
+    }
+
+    return depth;
+}
+
+// Same for user code. The frames are read with copy_from_user, so that a bad
+// frame pointer ends the walk instead of faulting.
+
+int walk_user_frames(struct prof_sample * s, uint64_t fp) {
+    uint64_t frame[2]; // caller's fp, return address
+    int depth = 1;
+
+    while (depth < PROF_DEPTH && fp % 8 == 0 &&
+        copy_from_user(frame, (const void *)(fp - 16), sizeof(frame)) == 0)
+    {
+        s->pc[depth++] = frame[1];
+
+        if (frame[0] <= fp)
+            break;
+
+        fp = frame[0];
+    }
+
+    return depth;
+}
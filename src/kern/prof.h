@@ -0,0 +1,78 @@
+// prof.h - Sampling profiler
+//
+// While the "prof" device is open, the timer interrupt on each hart takes a
+// sample every 1/PROF_FREQ seconds: the interrupted pc, the return addresses
+// found by walking the frame pointer chain (kernel and user code are built with
+// -fno-omit-frame-pointer), the thread and process, and whether the hart was in
+// U or S mode. The samples are read as struct prof_sample records from the
+// "prof" record device (see recdev.h).
+//
+// util/profsym symbolizes the records against kernel.elf and user programs and
+// prints stacks in the folded format of flamegraph.pl.
+//
+
+#ifndef _PROF_H_
+#define _PROF_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// PROF_FREQ is the sampling frequency per hart, independent of TICK_FREQ. The
+// default is prime so that samples do not fall in step with the tick.
+// PROF_RING_SIZE is the number of samples buffered per hart and must be a
+// power of two. PROF_DEPTH is the most pcs recorded per sample.
+
+#ifndef PROF_FREQ
+#define PROF_FREQ 997
+#endif
+
+#ifndef PROF_RING_SIZE
+#define PROF_RING_SIZE 256
+#endif
+
+#define PROF_DEPTH 16
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// pc[0] is the interrupted pc and pc[1] to pc[depth-1] are return addresses,
+// innermost first. pid is -1 for threads without a process.
+
+struct prof_sample {
+    uint64_t time; // mtime
+    uint8_t hart;
+    uint8_t smode; // 1 if interrupted in S mode
+    uint8_t depth; // number of entries of pc used
+    uint8_t _reserved;
+    int16_t tid;
+    int16_t pid;
+    uint64_t pc[PROF_DEPTH];
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+// prof_period is the number of timer ticks between samples, or 0 while the
+// profiler is off.
+
+extern uint64_t prof_period;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+struct trap_frame;
+
+// void prof_init(void)
+// Registers the "prof" device. Must be called after devmgr_init.
+
+extern void prof_init(void);
+
+// void prof_sample(const struct trap_frame * tfr, uint64_t now)
+// Records a sample of the context interrupted by the timer, as saved in /tfr/,
+// in the current hart's ring. Called from timer_intr_handler.
+
+extern void prof_sample(const struct trap_frame * tfr, uint64_t now);
+
+#endif // _PROF_H_
@@ -0,0 +1,134 @@
+// recdev.c - Devices that read records from per-hart rings
+//
+
+#ifdef RECDEV_TRACE
+#define TRACE
+#endif
+
+#ifdef RECDEV_DEBUG
+#define DEBUG
+#endif
+
+#include "recdev.h"
+#include "timer.h"
+#include "device.h"
+#include "console.h"
+#include "string.h"
+#include "error.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// A reader finding no records polls again after RECDEV_POLL_MS.
+
+#define RECDEV_POLL_MS 10
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int recdev_open(struct io_intf ** ioptr, void * aux);
+static void recdev_close(struct io_intf * io);
+static long recdev_read(struct io_intf * io, void * buf, unsigned long bufsz);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void recdev_register(struct recdev * dev) {
+    static const struct io_ops recdev_ops = {
+        .close = recdev_close,
+        .read = recdev_read
+    };
+
+    dev->io.ops = &recdev_ops;
+    device_register(dev->name, &recdev_open, dev);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Opening the device clears the rings, then lets the owner start adding
+// records.
+
+int recdev_open(struct io_intf ** ioptr, void * aux) {
+    struct recdev * const dev = aux;
+    int h;
+
+    trace("%s(%s)", __func__, dev->name);
+
+    if (__atomic_exchange_n(&dev->opened, 1, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+
+    for (h = 0; h < NCPU; h++) {
+        dev->ring[h].head = 0;
+        dev->ring[h].tail = 0;
+        dev->ring[h].dropped = 0;
+    }
+
+    dev->start();
+
+    *ioptr = &dev->io;
+    dev->io.refcnt = 1;
+    return 0;
+}
+
+void recdev_close(struct io_intf * io) {
+    struct recdev * const dev = (void *)io - offsetof(struct recdev, io);
+    uint64_t dropped = 0;
+    int h;
+
+    trace("%s(%s)", __func__, dev->name);
+
+    dev->stop();
+
+    for (h = 0; h < NCPU; h++)
+        dropped += dev->ring[h].dropped;
+
+    if (dropped != 0)
+        kprintf("%s: %lu records dropped\n", dev->name, (unsigned long)dropped);
+
+    __atomic_store_n(&dev->opened, 0, __ATOMIC_RELEASE);
+}
+
+// Reads whole records from the rings of all harts. Sleeps until at least one
+// record is available. Records from different harts are not merged by time.
+// Returns the number of bytes read, or -EINVAL if /buf/ cannot hold a record.
+
+long recdev_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct recdev * const dev = (void *)io - offsetof(struct recdev, io);
+    const unsigned long max = bufsz / dev->recsz;
+    struct recring * ring;
+    struct alarm al;
+    unsigned long n = 0;
+    unsigned int head;
+    int h;
+
+    trace("%s(%s,buf=%p,bufsz=%ld)", __func__, dev->name, buf, bufsz);
+
+    if (max == 0)
+        return -EINVAL;
+
+    alarm_init(&al, dev->name);
+
+    for (;;) {
+        for (h = 0; h < NCPU && n < max; h++) {
+            ring = &dev->ring[h];
+            head = ring->head;
+
+            while (n < max &&
+                head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+            {
+                memcpy(buf + n * dev->recsz, recdev_slot(dev, h, head),
+                    dev->recsz);
+                n += 1;
+                head += 1;
+            }
+
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        }
+
+        if (n != 0)
+            return n * dev->recsz;
+
+        alarm_sleep_ms(&al, RECDEV_POLL_MS);
+    }
+}
@@ -0,0 +1,109 @@
+// recdev.h - Devices that read records from per-hart rings
+//
+// A record device buffers fixed-size records in a ring per hart and hands them
+// out, whole and oldest first within each hart, from a device that one reader
+// at a time may open. Opening the device clears the rings and closing it
+// reports how many records were dropped because a ring was full. The "ktrace"
+// and "prof" devices are record devices.
+//
+// Only the owning hart adds records to its ring, with interrupts disabled, and
+// only the device's reader removes them, so the rings need no lock. A record
+// is added by filling the slot returned by recdev_claim and then calling
+// recdev_publish.
+//
+// The headers that define record formats (ktrace.h, prof.h) are also included
+// by the decoders in util/, so they only use <stdint.h>. The user programs
+// tracedump and profdump copy the records to a serial port to get them out of
+// the machine.
+//
+
+#ifndef _RECDEV_H_
+#define _RECDEV_H_
+
+#include "io.h"
+#include "smp.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct recring {
+    unsigned int head; // next record to read
+    unsigned int tail; // next record to write
+    uint64_t dropped; // records lost because ring was full
+};
+
+struct recdev {
+    struct io_intf io;
+    const char * name; // device name
+    void (*start)(void); // called when opened, after the rings are cleared
+    void (*stop)(void); // called when closed
+    char * buf; // NCPU rings of nrec records of recsz bytes
+    size_t recsz;
+    unsigned int nrec; // power of two
+    char opened;
+    struct recring ring[NCPU];
+};
+
+// RECDEV_INITIALIZER(name, buf, start, stop) initializes a struct recdev named
+// /name/ whose rings are /buf/, an array of NCPU arrays of records.
+
+#define RECDEV_INITIALIZER(n, b, start_fn, stop_fn) { \
+    .name = (n), .start = (start_fn), .stop = (stop_fn), \
+    .buf = (char *)(b), .recsz = sizeof((b)[0][0]), \
+    .nrec = sizeof((b)[0]) / sizeof((b)[0][0]) }
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void recdev_register(struct recdev * dev)
+// Registers /dev/ as a device. Must be called after devmgr_init.
+
+extern void recdev_register(struct recdev * dev);
+
+// void * recdev_slot(const struct recdev * dev, int hart, unsigned int i)
+// Returns the slot for the /i/-th record added to the ring of /hart/.
+
+static inline void * recdev_slot(const struct recdev * dev, int hart,
+    unsigned int i);
+
+// void * recdev_claim(struct recdev * dev, int hart)
+// void recdev_publish(struct recdev * dev, int hart)
+// recdev_claim returns the next free slot of the ring of /hart/, which must be
+// the running hart, or NULL if the ring is full. recdev_publish makes the
+// record filled into that slot visible to the reader.
+
+static inline void * recdev_claim(struct recdev * dev, int hart);
+static inline void recdev_publish(struct recdev * dev, int hart);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void * recdev_slot(const struct recdev * dev, int hart,
+    unsigned int i)
+{
+    return dev->buf +
+        ((size_t)hart * dev->nrec + (i & (dev->nrec - 1))) * dev->recsz;
+}
+
+static inline void * recdev_claim(struct recdev * dev, int hart) {
+    struct recring * const ring = &dev->ring[hart];
+    const unsigned int tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == dev->nrec) {
+        ring->dropped += 1;
+        return NULL;
+    }
+
+    return recdev_slot(dev, hart, tail);
+}
+
+static inline void recdev_publish(struct recdev * dev, int hart) {
+    struct recring * const ring = &dev->ring[hart];
+
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif // _RECDEV_H_
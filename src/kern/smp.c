@@ -0,0 +1,115 @@
+// smp.c - Multiprocessor (multi-hart) support
+//
+
+#ifdef SMP_TRACE
+#define TRACE
+#endif
+
+#ifdef SMP_DEBUG
+#define DEBUG
+#endif
+
+#include "smp.h"
+#include "thread.h"
+#include "memory.h"
+#include "intr.h"
+#include "timer.h"
+#include "console.h"
+#include "halt.h"
+
+#include <stdint.h>
+
+// INTERNAL COMPILE-TIME CONSTANT DEFINITIONS
+//
+
+#define CLINT_MSIP_ADDR 0x2000000 // one 32-bit msip register per hart
+
+// How long smp_init waits for secondary harts to come online, in microseconds.
+
+#ifndef SMP_BOOT_TIMEOUT_US
+#define SMP_BOOT_TIMEOUT_US 100000
+#endif
+
+// EXPORTED GLOBAL VARIABLE DEFINITIONS
+//
+
+char smp_initialized = 0;
+int smp_ncpu = 1;
+
+// The following are used by start.s and trapasm.s, which cannot include C
+// headers. smp_ncpu_max is NCPU. smp_mmode_scratch is a save area for the
+// M-mode trap handler, one per hart. A secondary hart waits in start.s until
+// its entry in smp_boot_sp is set, and then starts executing on that stack.
+
+const int smp_ncpu_max = NCPU;
+uint64_t smp_mmode_scratch[NCPU][4];
+void * volatile smp_boot_sp[NCPU];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// void smp_secondary_main(int hartid)
+// Entry point of a secondary hart in S mode, called from start.s with tp set
+// to the hart's idle thread.
+
+extern void smp_secondary_main(int hartid) __attribute__ ((noreturn));
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void smp_init(void) {
+    uint64_t deadline;
+    void * sp;
+    int hartid;
+
+    trace("%s()", __func__);
+
+    for (hartid = 0; hartid < NCPU; hartid++) {
+        if (hartid == BOOT_HART)
+            continue;
+        
+        sp = thread_create_idle(hartid);
+
+        // Make sure the idle thread is visible to the hart before it sees its
+        // stack pointer. The IPI wakes it from wfi.
+
+        __sync_synchronize();
+        smp_boot_sp[hartid] = sp;
+        smp_send_ipi(hartid);
+    }
+
+    deadline = timer_get_mtime() + SMP_BOOT_TIMEOUT_US * (TIMER_FREQ / 1000000);
+
+    while (__atomic_load_n(&smp_ncpu, __ATOMIC_ACQUIRE) < NCPU) {
+        if (deadline < timer_get_mtime())
+            break;
+    }
+
+    kprintf("           SMP: %d of %d harts online\n", smp_ncpu, NCPU);
+
+    smp_initialized = 1;
+}
+
+void smp_send_ipi(int hartid) {
+    volatile uint32_t * const msip = (volatile uint32_t *)CLINT_MSIP_ADDR;
+
+    trace("%s(hartid=%d)", __func__, hartid);
+
+    __sync_synchronize();
+    msip[hartid] = 1;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void smp_secondary_main(int hartid) {
+    debug("Hart %d starting", hartid);
+
+    memory_hart_init();
+    intr_hart_init();
+    timer_hart_init();
+
+    __atomic_fetch_add(&smp_ncpu, 1, __ATOMIC_RELEASE);
+
+    thread_start_hart();
+}
@@ -0,0 +1,40 @@
+// smp.h - Multiprocessor (multi-hart) support
+//
+
+#ifndef _SMP_H_
+#define _SMP_H_
+
+// NCPU is the maximum number of harts the kernel uses. Harts with a hart ID of
+// NCPU or greater are parked at boot (see start.s). The boot hart runs main;
+// the other harts are started by smp_init.
+
+#ifndef NCPU
+#define NCPU 1
+#endif
+
+#define BOOT_HART 0
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+extern char smp_initialized;
+extern int smp_ncpu; // number of harts online
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void smp_init(void)
+// Starts the secondary harts. Must be called on the boot hart after the memory,
+// interrupt, thread, and timer managers have been initialized. Returns once all
+// harts are online, or after a timeout if the machine has fewer than NCPU harts.
+
+extern void smp_init(void);
+
+// void smp_send_ipi(int hartid)
+// Sends an inter-processor interrupt to a hart, using its CLINT msip register.
+// The M-mode trap handler forwards it to S mode as a supervisor software
+// interrupt (see _mmode_trap_entry and intr_handler).
+
+extern void smp_send_ipi(int hartid);
+
+#endif // _SMP_H_
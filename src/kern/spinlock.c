@@ -0,0 +1,105 @@
+// spinlock.c - Spinlock lock-order checking
+//
+// Only compiled in when SPINLOCK_DEBUG is defined; the locks themselves are
+// implemented in spinlock.h.
+//
+
+#ifdef SPINLOCK_DEBUG
+
+#include "spinlock.h"
+#include "thread.h" // for running_hart
+#include "smp.h"
+#include "halt.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// SPINLOCK_DEBUG_MAXHELD is the maximum number of spinlocks a hart may hold at
+// the same time.
+
+#ifndef SPINLOCK_DEBUG_MAXHELD
+#define SPINLOCK_DEBUG_MAXHELD 8
+#endif
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Locks held by each hart, in the order they were acquired. Only accessed by
+// the hart itself, with interrupts disabled.
+
+static struct {
+    const struct spinlock * lk[SPINLOCK_DEBUG_MAXHELD];
+    int cnt;
+} held[NCPU];
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void spinlock_check_acquire(const struct spinlock * lk) {
+    const int hartid = running_hart();
+    const struct spinlock * other;
+    int i;
+
+    if (lk->holder == hartid + 1) {
+        kprintf("Spinlock %s acquired twice on hart %d\n", lk->name, hartid);
+        panic("recursive spinlock acquisition");
+    }
+
+    if (lk->order == SPINLOCK_ORDER_NONE)
+        return;
+
+    for (i = 0; i < held[hartid].cnt; i++) {
+        other = held[hartid].lk[i];
+
+        if (lk->order <= other->order) {
+            kprintf("Hart %d acquiring %s (rank %d) while holding %s "
+                "(rank %d)\n", hartid, lk->name, (int)lk->order,
+                other->name, (int)other->order);
+            panic("lock order violation");
+        }
+    }
+}
+
+void spinlock_acquired(struct spinlock * lk) {
+    const int hartid = running_hart();
+
+    if (held[hartid].cnt == SPINLOCK_DEBUG_MAXHELD)
+        panic("too many spinlocks held");
+
+    held[hartid].lk[held[hartid].cnt++] = lk;
+    lk->holder = hartid + 1;
+}
+
+// Locks need not be released in the reverse order of acquisition; for example,
+// condition_wait_locked releases the caller's lock while holding a wait list
+// lock. The scheduler's run queue lock is acquired by one thread and released
+// by another, but always on the same hart.
+
+void spinlock_check_release(struct spinlock * lk) {
+    const int hartid = running_hart();
+    int i;
+
+    if (lk->holder != hartid + 1) {
+        kprintf("Spinlock %s released on hart %d, held by hart %d\n",
+            lk->name, hartid, lk->holder - 1);
+        panic("spinlock released by wrong hart");
+    }
+
+    for (i = held[hartid].cnt - 1; 0 <= i; i--) {
+        if (held[hartid].lk[i] == lk)
+            break;
+    }
+
+    assert (0 <= i);
+
+    held[hartid].cnt -= 1;
+
+    while (i < held[hartid].cnt) {
+        held[hartid].lk[i] = held[hartid].lk[i+1];
+        i += 1;
+    }
+
+    lk->holder = 0;
+}
+
+#endif // SPINLOCK_DEBUG
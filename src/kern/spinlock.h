@@ -0,0 +1,176 @@
+// spinlock.h - A busy-waiting lock for multiprocessor synchronization
+//
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include "halt.h"
+#include "intr.h"
+
+// A spinlock protects data shared between harts. Unlike struct lock (lock.h),
+// a thread waiting for a spinlock does not sleep, so spinlocks may be used in
+// ISRs and by the scheduler itself. Disabling interrupts only protects against
+// code running on the same hart; code that shares data with an ISR or with
+// threads running on other harts must disable interrupts *and* hold a
+// spinlock. Spinlocks are not recursive and must only be held for short
+// periods with interrupts disabled:
+//
+//     saved_intr_state = intr_disable();
+//     spin_acquire(&lk);
+//     ...
+//     spin_release(&lk);
+//     intr_restore(saved_intr_state);
+//
+// Spinlocks are ticket locks: an acquiring hart takes a ticket with a single
+// amoadd and waits until the lock serves that ticket, so harts acquire a
+// contended lock in FIFO order and none of them starves. A zero-initialized
+// spinlock is unlocked.
+//
+// Each lock has a rank in the global lock order (enum spinlock_order). A hart
+// may only acquire a lock whose rank is greater than that of every ranked lock
+// it already holds; spin_tryacquire is exempt, since it cannot deadlock. When
+// compiled with SPINLOCK_DEBUG, spinlock.c checks this order as well as
+// recursive acquisition and releases by a hart that does not hold the lock, and
+// panics on a violation. Locks of rank SPINLOCK_ORDER_NONE are not checked
+// against the order (this is the rank of a zero-initialized lock).
+
+// COMPILE-TIME PARAMETERS
+//
+
+// SPINLOCK_DEBUG enables lock-order checking (see above).
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+enum spinlock_order {
+    SPINLOCK_ORDER_NONE = 0,
+    SPINLOCK_ORDER_OUTER,   // sleep lock guards, device locks
+    SPINLOCK_ORDER_TIMER,   // timing wheel (timer.c)
+    SPINLOCK_ORDER_THRTAB,  // thread table and parent links (thread.c)
+    SPINLOCK_ORDER_COND,    // condition variable wait lists
+    SPINLOCK_ORDER_RQ,      // per-hart run queues (thread.c)
+    SPINLOCK_ORDER_PAGE,    // page allocator (memory.c)
+    SPINLOCK_ORDER_HEAP     // kernel heap (ezheap.c)
+};
+
+struct spinlock {
+    volatile unsigned int next; // next ticket to hand out
+    volatile unsigned int owner; // ticket being served
+    const char * name;
+    enum spinlock_order order;
+#ifdef SPINLOCK_DEBUG
+    int holder; // 1 + hart ID of hart holding the lock, 0 if none
+#endif
+};
+
+#define SPINLOCK_INITIALIZER(nm,ord) { .name = (nm), .order = (ord) }
+
+static inline void spinlock_init (
+    struct spinlock * lk, const char * name, enum spinlock_order order);
+
+static inline void spin_acquire(struct spinlock * lk);
+
+// int spin_tryacquire(struct spinlock * lk)
+// Acquires the lock if it is free and returns 1; otherwise returns 0 at once.
+// May be used to take a lock out of order.
+
+static inline int spin_tryacquire(struct spinlock * lk);
+
+static inline void spin_release(struct spinlock * lk);
+
+// int spin_locked(const struct spinlock * lk)
+// Returns non-zero if the lock is held (by any hart). Meant for assertions.
+
+static inline int spin_locked(const struct spinlock * lk);
+
+// Lock-order checking hooks (spinlock.c). spinlock_check_acquire is called
+// before waiting for a lock, spinlock_acquired once the lock is held, and
+// spinlock_check_release before releasing it.
+
+#ifdef SPINLOCK_DEBUG
+extern void spinlock_check_acquire(const struct spinlock * lk);
+extern void spinlock_acquired(struct spinlock * lk);
+extern void spinlock_check_release(struct spinlock * lk);
+#endif
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void spinlock_init (
+    struct spinlock * lk, const char * name, enum spinlock_order order)
+{
+    lk->next = 0;
+    lk->owner = 0;
+    lk->name = name;
+    lk->order = order;
+#ifdef SPINLOCK_DEBUG
+    lk->holder = 0;
+#endif
+}
+
+static inline void spin_acquire(struct spinlock * lk) {
+    unsigned int ticket;
+
+    assert (intr_disabled());
+
+#ifdef SPINLOCK_DEBUG
+    spinlock_check_acquire(lk);
+#endif
+
+    // The fetch-and-add compiles to amoadd.w. The acquire load of owner orders
+    // the critical section after the hand-off from the previous holder.
+
+    ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket)
+        continue;
+
+#ifdef SPINLOCK_DEBUG
+    spinlock_acquired(lk);
+#endif
+}
+
+static inline int spin_tryacquire(struct spinlock * lk) {
+    unsigned int ticket;
+
+    assert (intr_disabled());
+
+    // The lock is free if the next ticket would be served at once. Take that
+    // ticket with an lr.w/sc.w compare-and-swap, which fails if another hart
+    // took a ticket in the meantime.
+
+    ticket = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+
+    if (lk->next != ticket)
+        return 0;
+
+    if (!__atomic_compare_exchange_n(&lk->next, &ticket, ticket + 1,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+
+#ifdef SPINLOCK_DEBUG
+    spinlock_acquired(lk);
+#endif
+
+    return 1;
+}
+
+static inline void spin_release(struct spinlock * lk) {
+    assert (spin_locked(lk));
+
+#ifdef SPINLOCK_DEBUG
+    spinlock_check_release(lk);
+#endif
+
+    // Only the holder writes owner, so a plain increment is fine.
+
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline int spin_locked(const struct spinlock * lk) {
+    return (lk->owner != lk->next);
+}
+
+#endif // _SPINLOCK_H_
@@ -1,4 +1,12 @@
         .section	.text
+
+        # All harts start here. Harts with a hart ID of NCPU or greater are
+        # parked. We keep the hart ID in s1.
+
+        csrr    s1, mhartid
+        la      t0, smp_ncpu_max # from smp.c
+        lw      t0, 0(t0)
+        bgeu    s1, t0, park
         
         # Delegate to S mode all S mode interrupts and all exceptions except
         # ecall from S mode and M mode; ecalls from S mode are used to provide
@@ -8,6 +16,26 @@
         csrw    medeleg, t0
         li      t0, 0x222
         csrw    mideleg, t0
+
+        # If the hart implements the Sstc extension, let S mode use stimecmp
+        # (CSR 0x14d) by setting STCE (bit 63) in menvcfg (CSR 0x30a), and
+        # record it in timer_sstc[hartid] (see timer.c). On a hart without
+        # menvcfg, the access traps to the temporary handler at 5, which skips
+        # the rest. STCE is WARL, so reading it back tells us if it stuck. This
+        # must come before we set MIE and mtvec.
+
+        la      t0, 5f
+        csrw    mtvec, t0
+        li      t0, 1
+        slli    t0, t0, 63      # STCE
+        csrs    0x30a, t0
+        csrr    t1, 0x30a
+        srli    t1, t1, 63
+        la      t0, timer_sstc  # from timer.c
+        add     t0, t0, s1
+        sb      t1, 0(t0)
+        .balign 4
+5:
         csrs    mstatus, 4 # MIE
 
         # Give S mode access to the entire physical address space
@@ -28,6 +56,21 @@
         csrs    mcounteren, 7
         csrs    scounteren, 7
 
+        # Point mscratch to this hart's save area for the M mode trap handler
+        # (see _mmode_trap_entry in trapasm.s).
+
+        la      t0, smp_mmode_scratch # from smp.c
+        slli    t1, s1, 5       # 4*8 bytes per hart
+        add     t0, t0, t1
+        csrw    mscratch, t0
+
+        # Enable M mode software interrupts, used for IPIs between harts
+
+        li      t0, 0x8         # MSIE
+        csrs    mie, t0
+
+        bnez    s1, secondary_wait
+
         # Switch to S mode
 
         li      t0, 0x1080 # bits to clear in mstatus (MPP=01,MPIE=0)
@@ -51,6 +94,53 @@
         bnez    a0, halt_failure
         j       halt_success
 
+secondary_wait:
+        # Wait in M mode until smp_init gives us a stack in smp_boot_sp[hartid].
+        # smp_init sends an IPI after setting it, which wakes us from wfi. We
+        # clear MIE first so that the IPI is not taken as a trap (it would go
+        # to _mmode_trap_entry and leave SSIP set); wfi still wakes on it since
+        # MSIE is set in mie. We clear msip ourselves.
+
+        csrc    mstatus, 0x8    # MIE
+        la      t0, smp_boot_sp # from smp.c
+        slli    t1, s1, 3
+        add     t0, t0, t1
+        li      t2, 0x2000000   # CLINT msip registers
+        slli    t1, s1, 2
+        add     t2, t2, t1
+2:
+        ld      t1, 0(t0)
+        bnez    t1, 3f
+        wfi
+        sw      zero, 0(t2)
+        j       2b
+3:
+        sw      zero, 0(t2)
+        fence
+        mv      sp, t1
+
+        # Switch to S mode, same as the boot hart
+
+        li      t0, 0x1080 # bits to clear in mstatus (MPP=01,MPIE=0)
+        li      t1, 0x0800 # bits to set in mstatus (MPP=01)
+        csrc    mstatus, t0
+        csrs    mstatus, t1
+        la      t0, 4f
+        csrw    mepc, t0
+        mret
+4:
+        # The stack anchor sp points to holds our idle thread pointer (see
+        # thread_create_idle in thread.c).
+
+        ld      tp, 0(sp)
+        mv      fp, zero
+        mv      a0, s1
+        call    smp_secondary_main
+
+park:
+        wfi
+        j       park
+
         .section        .data.stack, "wa", @progbits
         .balign		16
         
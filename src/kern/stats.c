@@ -0,0 +1,249 @@
+// stats.c - System call and process statistics
+//
+
+#ifdef STATS_TRACE
+#define TRACE
+#endif
+
+#ifdef STATS_DEBUG
+#define DEBUG
+#endif
+
+#include "stats.h"
+#include "../user/stats.h"
+#include "timer.h"
+#include "thread.h"
+#include "process.h"
+#include "device.h"
+#include "smp.h"
+#include "console.h"
+#include "error.h"
+#include "io.h"
+#include "lock.h"
+#include "memory.h"
+#include "string.h"
+
+#include <stddef.h>
+
+// The read system call passes the driver a large buffer a page at a time (see
+// syscall.c), so a snapshot, which is larger than a page, must be readable in
+// pieces. Each open of the device therefore has its own snapshot, taken when a
+// read starts at its beginning and handed out by that read and the following
+// ones. Page allocations are not contiguous, so it is kept in STATS_NPAGES
+// separate pages. The struct stats_file itself takes another page, which also
+// has room for the process usage take_snapshot gathers, off the kernel stack.
+
+#define STATS_NPAGES ((sizeof(struct stats) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+struct stats_file {
+    struct io_intf io;
+    struct lock lock; // serializes reads through a shared descriptor
+    unsigned long pos; // next byte of the snapshot to read, 0 to take one
+    char * page[STATS_NPAGES];
+    int pid[STATS_NPROC]; // filled by process_get_usages
+    struct process_usage usage[STATS_NPROC];
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Each hart counts the system calls that return on it in its own table, so
+// harts do not contend for the counters. A thread may move to another hart
+// while it updates them, so the updates are still atomic.
+
+static struct stats_syscall stats_syscalls[NCPU][STATS_NSYSCALLS];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int stats_open(struct io_intf ** ioptr, void * aux);
+static void stats_close(struct io_intf * io);
+static long stats_read(struct io_intf * io, void * buf, unsigned long bufsz);
+
+static void take_snapshot(struct stats_file * sf);
+static void snapshot_copy (
+    struct stats_file * sf, unsigned long pos, void * buf, size_t n, int put);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void stats_init(void) {
+    device_register("stats", &stats_open, NULL);
+}
+
+void stats_syscall(int nr, uint64_t start) {
+    const uint64_t ticks = timer_get_mtime() - start;
+    const uint64_t us = ticks / STATS_TICKS_PER_US;
+    struct stats_syscall * sc;
+    int b;
+
+    if (nr < 0 || STATS_NSYSCALLS <= nr)
+        return;
+
+    b = (us != 0) ? 64 - __builtin_clzl(us) : 0;
+
+    if (STATS_NBUCKETS <= b)
+        b = STATS_NBUCKETS - 1;
+
+    sc = &stats_syscalls[running_hart()][nr];
+    __atomic_fetch_add(&sc->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sc->time, ticks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sc->hist[b], 1, __ATOMIC_RELAXED);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// The device may be opened any number of times, each open getting its own
+// snapshot pages. Returns -EAGAIN if there are not enough free pages.
+
+int stats_open(struct io_intf ** ioptr, void * aux) {
+    static const struct io_ops stats_ops = {
+        .close = stats_close,
+        .read = stats_read
+    };
+
+    struct stats_file * sf;
+    int i;
+
+    trace("%s()", __func__);
+
+    sf = memory_try_alloc_page();
+
+    if (sf == NULL)
+        return -EAGAIN;
+
+    for (i = 0; i < STATS_NPAGES; i++) {
+        sf->page[i] = memory_try_alloc_page();
+
+        if (sf->page[i] == NULL) {
+            while (0 < i--)
+                memory_free_page(sf->page[i]);
+            memory_free_page(sf);
+            return -EAGAIN;
+        }
+    }
+
+    sf->io.ops = &stats_ops;
+    sf->io.refcnt = 1;
+    lock_init(&sf->lock, "stats");
+    sf->pos = 0;
+    *ioptr = &sf->io;
+    return 0;
+}
+
+void stats_close(struct io_intf * io) {
+    struct stats_file * const sf = (void *)io - offsetof(struct stats_file, io);
+    int i;
+
+    trace("%s()", __func__);
+
+    for (i = 0; i < STATS_NPAGES; i++)
+        memory_free_page(sf->page[i]);
+
+    memory_free_page(sf);
+}
+
+// Fills /buf/ with the next /bufsz/ bytes of the snapshot, taking a new one
+// first if the last was read to its end. Returns the number of bytes read,
+// which is less than /bufsz/ only at the end of the snapshot, so reading
+// sizeof(struct stats) bytes at once (or in pieces) returns a whole snapshot.
+
+long stats_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct stats_file * const sf = (void *)io - offsetof(struct stats_file, io);
+    unsigned long n;
+
+    trace("%s(buf=%p,bufsz=%ld)", __func__, buf, bufsz);
+
+    lock_acquire(&sf->lock);
+
+    if (sf->pos == 0)
+        take_snapshot(sf);
+
+    n = sizeof(struct stats) - sf->pos;
+
+    if (bufsz < n)
+        n = bufsz;
+
+    snapshot_copy(sf, sf->pos, buf, n, 0);
+    sf->pos += n;
+
+    if (sf->pos == sizeof(struct stats))
+        sf->pos = 0;
+
+    lock_release(&sf->lock);
+    return n;
+}
+
+// Takes a snapshot into the pages of /sf/. The counters of a system call are
+// read one at a time, so they may disagree slightly if calls return while the
+// snapshot is taken.
+
+void take_snapshot(struct stats_file * sf) {
+    struct stats_syscall sc;
+    struct stats_proc sp;
+    uint64_t time = timer_get_mtime();
+    unsigned int ncpu = smp_ncpu;
+    unsigned int nproc, i;
+    int nr, h, b;
+
+    for (nr = 0; nr < STATS_NSYSCALLS; nr++) {
+        memset(&sc, 0, sizeof(sc));
+
+        for (h = 0; h < NCPU; h++) {
+            sc.count += __atomic_load_n(
+                &stats_syscalls[h][nr].count, __ATOMIC_RELAXED);
+            sc.time += __atomic_load_n(
+                &stats_syscalls[h][nr].time, __ATOMIC_RELAXED);
+
+            for (b = 0; b < STATS_NBUCKETS; b++)
+                sc.hist[b] += __atomic_load_n(
+                    &stats_syscalls[h][nr].hist[b], __ATOMIC_RELAXED);
+        }
+
+        snapshot_copy(sf, offsetof(struct stats, syscall[nr]),
+            &sc, sizeof(sc), 1);
+    }
+
+    nproc = process_get_usages(sf->pid, sf->usage, STATS_NPROC);
+
+    for (i = 0; i < nproc; i++) {
+        sp.pid = sf->pid[i];
+        sp.nthr = sf->usage[i].nthr;
+        sp.cpu_time = sf->usage[i].cpu_time;
+        sp.nvcsw = sf->usage[i].nvcsw;
+        sp.nivcsw = sf->usage[i].nivcsw;
+        snapshot_copy(sf, offsetof(struct stats, proc[i]),
+            &sp, sizeof(sp), 1);
+    }
+
+    snapshot_copy(sf, offsetof(struct stats, time),
+        &time, sizeof(time), 1);
+    snapshot_copy(sf, offsetof(struct stats, ncpu),
+        &ncpu, sizeof(ncpu), 1);
+    snapshot_copy(sf, offsetof(struct stats, nproc),
+        &nproc, sizeof(nproc), 1);
+}
+
+// Copies /n/ bytes between /buf/ and the snapshot at /pos/: into the snapshot
+// if /put/ is nonzero, out of it otherwise.
+
+void snapshot_copy (
+    struct stats_file * sf, unsigned long pos, void * buf, size_t n, int put)
+{
+    size_t off, len;
+
+    while (n != 0) {
+        off = pos % PAGE_SIZE;
+        len = (n < PAGE_SIZE - off) ? n : PAGE_SIZE - off;
+
+        if (put)
+            memcpy(sf->page[pos / PAGE_SIZE] + off, buf, len);
+        else
+            memcpy(buf, sf->page[pos / PAGE_SIZE] + off, len);
+
+        pos += len;
+        buf += len;
+        n -= len;
+    }
+}
@@ -0,0 +1,28 @@
+// stats.h - System call and process statistics
+//
+// Counts the calls to each system call and their latency in per-hart tables,
+// and serves snapshots of those and of the CPU usage of each process (see
+// process_get_usages) from the "stats" device. The snapshot format is struct
+// stats in user/stats.h; user/top displays it.
+//
+
+#ifndef _KSTATS_H_
+#define _KSTATS_H_
+
+#include <stdint.h>
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void stats_init(void)
+// Registers the "stats" device. Must be called after devmgr_init.
+
+extern void stats_init(void);
+
+// void stats_syscall(int nr, uint64_t start)
+// Counts a return from system call /nr/, dispatched at mtime /start/. Numbers
+// outside the system call table are ignored. Called from syscall.c.
+
+extern void stats_syscall(int nr, uint64_t start);
+
+#endif // _KSTATS_H_
@@ -4,6 +4,7 @@
 
 #include "../user/scnum.h"
 #include "../user/syscall.h"
+#include "../user/ioring.h"
 #include "console.h"
 #include "memory.h"
 #include "process.h"
@@ -13,6 +14,64 @@
 #include "io.h"
 #include "timer.h"
 #include "heap.h"
+#include "intr.h"
+#include "spinlock.h"
+#include "ioring.h"
+#include "ktrace.h"
+#include "stats.h"
+
+// Number of buckets in the futex wait table. Waiters on different addresses
+// that hash to the same bucket still work correctly, but may see spurious
+// wakeups.
+
+#ifndef FUTEX_TABLE_SIZE
+#define FUTEX_TABLE_SIZE 64
+#endif
+
+// Longest device or file name, and longest message, that system calls copy
+// from user memory, including the null byte. Longer messages are truncated.
+
+#define SYSCALL_NAMEMAX 64
+#define SYSCALL_MSGMAX 256
+
+// Transfers of at most SYSCALL_BOUNCEMIN bytes are bounced through a buffer on
+// the kernel stack, larger ones through the thread's scratch page (see
+// bounce_init).
+
+#define SYSCALL_BOUNCEMIN 128
+
+// A futex bucket holds the threads waiting on any user address that hashes to
+// it. Buckets are keyed by physical address, so two processes only share a
+// futex if they share the page. /key/ is the physical address all current
+// waiters wait on, or 0 if the bucket holds waiters on different addresses.
+
+struct futex_bucket {
+    struct spinlock lock;       // protects the fields below
+    struct condition cond;      // signalled by sysfutex_wake
+    uintptr_t key;
+    int nwaiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_TABLE_SIZE] = {
+    [0 ... FUTEX_TABLE_SIZE-1] = {
+        .lock = SPINLOCK_INITIALIZER("futex", SPINLOCK_ORDER_OUTER)
+    }
+};
+
+// The read and write system calls move data between user buffers and the
+// driver through a kernel bounce buffer, so drivers never touch user memory,
+// which another thread of the process may unmap at any time. A bad buffer then
+// makes copy_to_user or copy_from_user fail with -EFAULT instead of faulting in
+// a driver. Transfers larger than the bounce buffer are made in chunks of its
+// size. The user pages of a chunk are faulted in (see memory_fault_in_user)
+// before it is read, so that data read from a device is not lost because the
+// buffer had not been touched yet.
+
+struct bounce {
+    char * buf;
+    size_t size;
+    char small[SYSCALL_BOUNCEMIN];
+};
 
 /**
  * sysexit - Exits the current process
@@ -39,21 +98,24 @@ static int sysexit(void){
  * 
  * @param msg       pointer to a null-terminated string to be printed
  * 
- * @return          returns 0 on success, or -1 if pointer is invalid
+ * @return          returns 0 on success, or -EFAULT if pointer is invalid
  */
 static int sysmsgout(const char *msg){
-    int result;
+    char buf[SYSCALL_MSGMAX];
+    long result;
 
     trace("%s(msg=%p)", __func__, msg);
 
-    // Validate the pointer to ensure it's valid user memory and null-terminated
-    result = memory_validate_vstr(msg, PTE_U);
-    if (result != 0) {
+    // Copy the message, faulting on invalid user memory instead of validating it
+    result = strncpy_from_user(buf, msg, sizeof(buf));
+    if (result == -EINVAL) {
+        buf[sizeof(buf) - 1] = '\0'; // truncate long message
+    } else if (result < 0) {
         return result;
-    } 
+    }
     
     // Print message along w thread info
-    kprintf("Thread <%s:%d> says: %s\n", thread_name(running_thread()), running_thread(), msg);
+    kprintf("Thread <%s:%d> says: %s\n", thread_name(running_thread()), running_thread(), buf);
 
     return 0;
 }
@@ -70,21 +132,25 @@ static int sysmsgout(const char *msg){
  * @param instno    Instance number of the device to open.
  * 
  * @return          0 on success, -EMFILE(-10) if fd is out of range,
- *                  -EINVAL(-1) if device name is invalid or memory validation fails,
+ *                  -EINVAL(-1) if device name is too long,
+ *                  -EFAULT if it is not in user memory,
  *                  negative value from 'device_open' if device can't be opened
  */
 static int sysdevopen(int fd, const char *name, int instno){
+    char kname[SYSCALL_NAMEMAX];
+
     if (fd < 0 || fd >= PROCESS_IOMAX){
         return -EMFILE; //FD out of range
     }
-    // Attempt to open device name string 
-    if (memory_validate_vstr(name, PTE_U) != 0){
-        return -EINVAL; //invalid file name
+    // Copy device name string 
+    int result = strncpy_from_user(kname, name, sizeof(kname));
+    if (result < 0){
+        return result; // -EINVAL if too long, -EFAULT if not user memory
     } 
 
     struct io_intf *dev_io = NULL;
     // Attempt to open the device 
-    int result = device_open(&dev_io, name, instno);
+    result = device_open(&dev_io, kname, instno);
     if(result < 0){
         return result; // return error code from device open 
     }
@@ -104,19 +170,23 @@ static int sysdevopen(int fd, const char *name, int instno){
  * @param name      Null-terminated string representing file name
  * 
  * @return          0 on success, -EMFILE if fd is out of range, 
- *                  -EINVAL if file name pointer is invalid or fails memory validation.
+ *                  -EINVAL if file name is too long, -EFAULT if it is not in
+ *                  user memory.
  *                  Negative value from fs_open if file cannot be opened
  */
 static int sysfsopen(int fd, const char *name){
+    char kname[SYSCALL_NAMEMAX];
+
     if (fd < 0 || fd >= PROCESS_IOMAX){
         return -EMFILE; // Invalid file name
     }
-    if(memory_validate_vstr(name, PTE_U | PTE_A) != 0){
-        return -EINVAL; // Invalid file name
+    int result = strncpy_from_user(kname, name, sizeof(kname));
+    if(result < 0){
+        return result; // Invalid file name
     }
 
     struct io_intf *fs_io = NULL;
-    int result = fs_open(name, &fs_io);
+    result = fs_open(kname, &fs_io);
     if(result < 0){
         return result;
     }
@@ -151,11 +221,134 @@ static int sysclose(int fd){
     return 0;
 }
 
+/**
+ * bounce_init - Sets up a bounce buffer for a transfer of `len` bytes.
+ *
+ * Uses the buffer inside `b` for small transfers, or if no page is free, so
+ * that a transfer never fails for lack of memory, only takes more chunks.
+ * Larger transfers use the thread's scratch page, which is kept between
+ * calls, so the hot path neither allocates nor clears a page.
+ *
+ * @param b     Bounce buffer to set up.
+ * @param len   Total length of the transfer.
+ */
+static void bounce_init(struct bounce *b, size_t len){
+    b->buf = NULL;
+
+    if (SYSCALL_BOUNCEMIN < len)
+        b->buf = thread_scratch_page();
+
+    if (b->buf != NULL) {
+        b->size = PAGE_SIZE;
+    } else {
+        b->buf = b->small;
+        b->size = sizeof(b->small);
+    }
+}
+
+/**
+ * bounce_read - Reads into a user buffer through a bounce buffer.
+ *
+ * Reads `len` bytes at `*pos`, or at the current position if `pos` is NULL,
+ * one chunk at a time, stopping early at a short read.
+ *
+ * @param io    I/O object to read from.
+ * @param pos   Position to read at, advanced past the data read, or NULL.
+ * @param ubuf  User buffer to fill.
+ * @param len   Number of bytes to read.
+ * @param b     Bounce buffer to read through.
+ *
+ * @return      Number of bytes read, or -EFAULT if `ubuf` is not writable
+ *              user memory or a negative error code from the driver if
+ *              nothing was read.
+ */
+static long bounce_read(struct io_intf *io, uint64_t *pos,
+    void *ubuf, size_t len, struct bounce *b)
+{
+    size_t acc = 0, n;
+    long cnt;
+
+    while (acc < len) {
+        n = (len - acc < b->size) ? len - acc : b->size;
+
+        if (memory_fault_in_user(ubuf + acc, n, PTE_W | PTE_U) != 0)
+            return (acc != 0) ? acc : -EFAULT;
+
+        if (pos != NULL)
+            cnt = ioreadat(io, *pos, b->buf, n);
+        else
+            cnt = ioread(io, b->buf, n);
+
+        if (cnt < 0)
+            return (acc != 0) ? acc : cnt;
+
+        if (copy_to_user(ubuf + acc, b->buf, cnt) != 0)
+            return (acc != 0) ? acc : -EFAULT; // unmapped since faulted in
+
+        if (pos != NULL)
+            *pos += cnt;
+
+        acc += cnt;
+
+        if (cnt < n)
+            break;
+    }
+
+    return acc;
+}
+
+/**
+ * bounce_write - Writes from a user buffer through a bounce buffer.
+ *
+ * Like bounce_read, but copies each chunk in from `ubuf` and writes it.
+ *
+ * @return      Number of bytes written, or a negative error code if nothing
+ *              was written.
+ */
+static long bounce_write(struct io_intf *io, uint64_t *pos,
+    const void *ubuf, size_t len, struct bounce *b)
+{
+    size_t acc = 0, n;
+    long cnt;
+
+    while (acc < len) {
+        n = (len - acc < b->size) ? len - acc : b->size;
+
+        // Fault in pages the process has not touched yet and try again
+
+        if (copy_from_user(b->buf, ubuf + acc, n) != 0 &&
+            (memory_fault_in_user(ubuf + acc, n, PTE_R | PTE_U) != 0 ||
+            copy_from_user(b->buf, ubuf + acc, n) != 0))
+        {
+            return (acc != 0) ? acc : -EFAULT;
+        }
+
+        if (pos != NULL)
+            cnt = iowriteat(io, *pos, b->buf, n);
+        else
+            cnt = iowrite(io, b->buf, n);
+
+        if (cnt < 0)
+            return (acc != 0) ? acc : cnt;
+
+        if (pos != NULL)
+            *pos += cnt;
+
+        acc += cnt;
+
+        if (cnt < n)
+            break;
+    }
+
+    return acc;
+}
+
 /**
  * sysread - Reads data from a file descriptor.
  *
  * Validates the file descriptor and buffer, then reads up to `bufsz` bytes 
- * into `buf`.
+ * into `buf` through a bounce buffer. A read larger than the bounce buffer
+ * goes on while the driver fills each chunk, like sysreadv across buffers.
  *
  * @param fd    File descriptor to read from.
  * @param buf   Buffer to store the data.
@@ -165,16 +358,18 @@ static int sysclose(int fd){
  */
 static long sysread(int fd, void *buf, size_t bufsz){
     struct process *proc = current_process();
+    struct bounce b;
 
     if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
         return -EBADFD; // invalid file descriptor
     }
 
-    if (memory_validate_vptr_len(buf, bufsz, PTE_W | PTE_U) != 0){
+    if (!user_range_ok(buf, bufsz)){
         return -EINVAL; // invalid buf pointers
     }
 
-    return proc->iotab[fd]->ops->read(proc->iotab[fd], buf, bufsz);
+    bounce_init(&b, bufsz);
+    return bounce_read(proc->iotab[fd], NULL, buf, bufsz, &b);
 }
 
 
@@ -182,7 +377,7 @@ static long sysread(int fd, void *buf, size_t bufsz){
  * syswrite - Writes data to a file descriptor.
  *
  * Validates the file descriptor and buffer, then writes up to `len` bytes 
- * from `buf`.
+ * from `buf` through a bounce buffer.
  *
  * @param fd    File descriptor to write to.
  * @param buf   Buffer containing the data to write.
@@ -192,16 +387,18 @@ static long sysread(int fd, void *buf, size_t bufsz){
  */
 static long syswrite(int fd, const void *buf, size_t len){
     struct process *proc = current_process();
+    struct bounce b;
 
     if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
         return -EBADFD; // invalid file descriptor
     }
 
-    if(memory_validate_vptr_len(buf, len, PTE_R | PTE_U) != 0){
+    if (!user_range_ok(buf, len)){
         return -EINVAL; // invalid buf pointer
     }
 
-    return proc->iotab[fd]->ops->write(proc->iotab[fd], buf, len);
+    bounce_init(&b, len);
+    return bounce_write(proc->iotab[fd], NULL, buf, len, &b);
 }
 
 
@@ -219,34 +416,238 @@ static long syswrite(int fd, const void *buf, size_t len){
  */
 static int sysioctl(int fd, int cmd, void *arg){
     struct process *proc = current_process();
+    uint64_t karg;
+    int result;
 
     if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
         return -EBADFD;
     }
 
+    // The argument is copied through karg, so a bad pointer makes the copy
+    // fail with -EFAULT instead of faulting in the driver.
+
     switch (cmd) {
         case IOCTL_GETLEN:
         case IOCTL_GETPOS:
         case IOCTL_GETBLKSZ:
-            // These commands only require read access to `arg`
-            if (arg && (memory_validate_vptr_len(arg, sizeof(uint64_t), PTE_W | PTE_U) != 0)) {
-                return -EINVAL; // Invalid or inaccessible `arg` pointer
+            // These commands only write `arg`
+            if (arg == NULL) {
+                return ioctl(proc->iotab[fd], cmd, NULL);
             }
-            break;
+
+            result = ioctl(proc->iotab[fd], cmd, &karg);
+            if (result == 0 && copy_to_user(arg, &karg, sizeof(uint64_t)) != 0) {
+                return -EFAULT; // Invalid or inaccessible `arg` pointer
+            }
+            return result;
 
         case IOCTL_SETPOS:
-            // This command requires both read and write access to `arg`
-            if (arg && memory_validate_vptr_len(arg, sizeof(uint64_t), PTE_R | PTE_W | PTE_U) != 0) {
-                return -EINVAL; // Invalid or inaccessible `arg` pointer
+            // This command only reads `arg`
+            if (arg == NULL) {
+                return ioctl(proc->iotab[fd], cmd, NULL);
             }
-            break;
+
+            if (copy_from_user(&karg, arg, sizeof(uint64_t)) != 0) {
+                return -EFAULT; // Invalid or inaccessible `arg` pointer
+            }
+            return ioctl(proc->iotab[fd], cmd, &karg);
 
         default:
             return -ENOTSUP; // Unsupported command
     }
+}
+
+
+/**
+ * syspread - Reads data from a file descriptor at a given position.
+ *
+ * Like sysread, but reads at `pos` and leaves the file position unchanged,
+ * so that threads and processes sharing the file need not seek first.
+ *
+ * @param fd    File descriptor to read from.
+ * @param buf   Buffer to store the data.
+ * @param bufsz Maximum number of bytes to read.
+ * @param pos   Position in the file to read from.
+ *
+ * @return      Number of bytes read, or a negative error code.
+ */
+static long syspread(int fd, void *buf, size_t bufsz, uint64_t pos){
+    struct process *proc = current_process();
+    struct bounce b;
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
+        return -EBADFD;
+    }
 
-    return proc->iotab[fd]->ops->ctl(proc->iotab[fd], cmd, arg);
+    if (!user_range_ok(buf, bufsz)){
+        return -EINVAL;
+    }
 
+    bounce_init(&b, bufsz);
+    return bounce_read(proc->iotab[fd], &pos, buf, bufsz, &b);
+}
+
+
+/**
+ * syspwrite - Writes data to a file descriptor at a given position.
+ *
+ * Like syswrite, but writes at `pos` and leaves the file position unchanged.
+ *
+ * @param fd    File descriptor to write to.
+ * @param buf   Buffer containing the data to write.
+ * @param len   Number of bytes to write.
+ * @param pos   Position in the file to write at.
+ *
+ * @return      Number of bytes written, or a negative error code.
+ */
+static long syspwrite(int fd, const void *buf, size_t len, uint64_t pos){
+    struct process *proc = current_process();
+    struct bounce b;
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
+        return -EBADFD;
+    }
+
+    if (!user_range_ok(buf, len)){
+        return -EINVAL;
+    }
+
+    bounce_init(&b, len);
+    return bounce_write(proc->iotab[fd], &pos, buf, len, &b);
+}
+
+
+/**
+ * sysreadv - Reads data from a file descriptor into several buffers.
+ *
+ * Validates the descriptor, copies in the iovec array, checks that every
+ * buffer in it lies in user space, then fills the buffers in order through
+ * one bounce buffer. Stops early at a short read, so a return value less
+ * than the total length means the rest of the data was not available yet
+ * (or the end of the file was reached).
+ *
+ * @param fd     File descriptor to read from.
+ * @param iov    Array of buffers to fill.
+ * @param iovcnt Number of entries in `iov`, at most IOV_MAX.
+ *
+ * @return       Total number of bytes read, or a negative error code if
+ *               nothing was read.
+ */
+static long sysreadv(int fd, const struct iovec *iov, int iovcnt){
+    struct process *proc = current_process();
+    struct iovec kiov[IOV_MAX];
+    size_t len = 0;
+    struct bounce b;
+    long cnt, acc = 0;
+    int i;
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
+        return -EBADFD;
+    }
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX){
+        return -EINVAL;
+    }
+
+    if (copy_from_user(kiov, iov, iovcnt * sizeof(struct iovec)) != 0){
+        return -EFAULT;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (!user_range_ok(kiov[i].iov_base, kiov[i].iov_len))
+            return -EINVAL;
+
+        len += kiov[i].iov_len;
+    }
+
+    bounce_init(&b, len);
+
+    for (i = 0; i < iovcnt; i++) {
+        if (kiov[i].iov_len == 0)
+            continue;
+
+        cnt = bounce_read(proc->iotab[fd], NULL,
+            kiov[i].iov_base, kiov[i].iov_len, &b);
+
+        if (cnt < 0) {
+            if (acc == 0)
+                acc = cnt;
+            break;
+        }
+
+        acc += cnt;
+
+        if (cnt < kiov[i].iov_len)
+            break;
+    }
+
+    return acc;
+}
+
+
+/**
+ * syswritev - Writes data from several buffers to a file descriptor.
+ *
+ * Validates the descriptor, copies in the iovec array, checks that every
+ * buffer in it lies in user space, then writes the buffers in order through
+ * one bounce buffer, stopping early at a short write.
+ *
+ * @param fd     File descriptor to write to.
+ * @param iov    Array of buffers to write.
+ * @param iovcnt Number of entries in `iov`, at most IOV_MAX.
+ *
+ * @return       Total number of bytes written, or a negative error code if
+ *               nothing was written.
+ */
+static long syswritev(int fd, const struct iovec *iov, int iovcnt){
+    struct process *proc = current_process();
+    struct iovec kiov[IOV_MAX];
+    size_t len = 0;
+    struct bounce b;
+    long cnt, acc = 0;
+    int i;
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL){
+        return -EBADFD;
+    }
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX){
+        return -EINVAL;
+    }
+
+    if (copy_from_user(kiov, iov, iovcnt * sizeof(struct iovec)) != 0){
+        return -EFAULT;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (!user_range_ok(kiov[i].iov_base, kiov[i].iov_len))
+            return -EINVAL;
+
+        len += kiov[i].iov_len;
+    }
+
+    bounce_init(&b, len);
+
+    for (i = 0; i < iovcnt; i++) {
+        if (kiov[i].iov_len == 0)
+            continue;
+
+        cnt = bounce_write(proc->iotab[fd], NULL,
+            kiov[i].iov_base, kiov[i].iov_len, &b);
+
+        if (cnt < 0) {
+            if (acc == 0)
+                acc = cnt;
+            break;
+        }
+
+        acc += cnt;
+
+        if (cnt < kiov[i].iov_len)
+            break;
+    }
+
+    return acc;
 }
 
 
@@ -320,37 +721,59 @@ static int sysusleep(unsigned long us){
     return 0;
 }
 
+/**
+ * @brief Puts the calling thread to sleep for a specified amount of time in nanoseconds.
+ *
+ * The time is rounded up to whole timer ticks (100 ns at 10 MHz). The alarm
+ * is programmed into the timer compare register directly, so the thread wakes
+ * at the requested time rather than at the next scheduler tick.
+ *
+ * @param ns The duration of the sleep in nanoseconds. Must be greater than 0.
+ * @return 0 on success, or -EINVAL if the input is invalid.
+ */
+static int sysnanosleep(unsigned long ns){
+    const unsigned long ns_per_tick = 1000000000UL / TIMER_FREQ;
+    struct alarm al;
+
+    if (ns == 0){
+        return -EINVAL;
+    }
+
+    alarm_init(&al, "sysnanosleep");
+    alarm_sleep(&al, ns / ns_per_tick + (ns % ns_per_tick != 0));
+    return 0;
+}
+
 
 /**
  * @brief Creates a new child process by forking the current process's state.
  *
  * @param tfr A pointer to the trap frame representing the current process's state.
- * @return The ID of the newly created child process to the parent, or -1 if the operation fails.
+ * @return The ID of the newly created child process to the parent, or a negative error code
+ *         if the operation fails (-EAGAIN if there are too many processes or threads).
  */
 static int sysfork(const struct trap_frame *tfr){
-    //make a child process
+    struct process *current_proc = current_process();
     struct process *child_proc;
-    for(int i = 0; i < 16; i++){ //16 is NPROC, the number of processes
-        if(proctab[i] == NULL){
-            child_proc = kmalloc(sizeof(struct process));
-            proctab[i] = child_proc;
-            break;
-        }
-    }
+
+    //make a child process
+    child_proc = process_alloc();
+
     // ensure child proc is not null and is properly allocated
     if(!child_proc){
-        return -1;
+        return -EAGAIN;
     }
-    // find the index into proctab array that child proc lives and set that as the tid for child
-    struct process *current_proc = current_process();
-    for(int i = 0; i < 16; i++){
-        if(proctab[i] == child_proc){
-            child_proc->id = i;
-            break;
-        }
+
+    // find a free process id for the child
+    if(process_alloc_pid(child_proc) < 0){
+        process_free(child_proc);
+        return -EAGAIN;
     }
+
     child_proc->tid = -1; // Will be set by thread_fork_to_user
+    child_proc->nthr = 1;
     child_proc->mtag = 0; // Will be set by memory_space_clone in thread_fork_to_user
+    lock_init(&child_proc->mem_lock, "proc.mem_lock");
 
     // copy over iotab array to child, incrementing refcnt if io_intf exists
     for(int j = 0; j < PROCESS_IOMAX; j++){
@@ -363,10 +786,10 @@ static int sysfork(const struct trap_frame *tfr){
     // call thread fork to user to finish forking
     int result = thread_fork_to_user(child_proc, tfr);
 
-    // if it fails, set the memory assigned to child proc to 0 and decrement the refcnt
+    // if it fails, release the child's process id and decrement the refcnt
     if(result<0){
-        memset(child_proc, 0, sizeof(struct process));
-        proctab[child_proc->id] = NULL;
+        process_free_pid(child_proc->id);
+        process_free(child_proc);
 
         //decrement refcnt
         for(int j = 0; j < PROCESS_IOMAX; j++){
@@ -382,6 +805,312 @@ static int sysfork(const struct trap_frame *tfr){
 }
 
 
+/**
+ * @brief Creates another thread in the current process.
+ *
+ * The new thread shares the memory space and open files of the process and
+ * starts in user mode at /upc/ with stack pointer /usp/ and /arg0/ and /arg1/
+ * in a0 and a1. Its other registers are copied from the caller. It is a child
+ * of the calling thread, which can wait for it with _wait.
+ *
+ * @param upc  User address at which the thread starts.
+ * @param usp  Initial user stack pointer; must be 16-byte aligned.
+ * @param arg0 Initial value of a0.
+ * @param arg1 Initial value of a1.
+ * @param tfr  Trap frame of the calling thread.
+ * @return The thread id of the new thread, -EINVAL if upc or usp is invalid, or
+ *         -EAGAIN if there are too many threads.
+ */
+static int systhread_create(uintptr_t upc, uintptr_t usp,
+    uint64_t arg0, uint64_t arg1, const struct trap_frame *tfr)
+{
+    struct process *proc = current_process();
+    struct trap_frame child_tfr;
+    int tid;
+
+    trace("%s(upc=%p,usp=%p)", __func__, (void *)upc, (void *)usp);
+
+    if (upc < USER_START_VMA || USER_END_VMA <= upc)
+        return -EINVAL;
+
+    if (usp <= USER_START_VMA || USER_END_VMA < usp || usp % 16 != 0)
+        return -EINVAL;
+
+    memcpy(&child_tfr, tfr, sizeof(struct trap_frame));
+    child_tfr.sepc = upc;
+    child_tfr.x[TFR_SP] = usp;
+    child_tfr.x[TFR_RA] = 0;
+    child_tfr.x[TFR_A0] = arg0;
+    child_tfr.x[TFR_A1] = arg1;
+
+    // Count the thread before it can run and exit.
+
+    __atomic_add_fetch(&proc->nthr, 1, __ATOMIC_ACQ_REL);
+    tid = thread_create_user(&child_tfr);
+
+    if (tid < 0)
+        __atomic_sub_fetch(&proc->nthr, 1, __ATOMIC_ACQ_REL);
+
+    return tid;
+}
+
+
+/**
+ * futex_key - Finds the physical address of a user futex word.
+ *
+ * Faults in the page holding the word if the process has not touched it yet.
+ * The key is only a name for the word; the word itself is always accessed
+ * with copy_from_user, since another thread may unmap it at any time.
+ *
+ * @param addr  User virtual address of the futex word.
+ * @param key   Set to the physical address of the word.
+ * @return      0 on success, -EINVAL if addr is misaligned, or -EFAULT if it
+ *              is not mapped readable and writable by the user.
+ */
+static int futex_key(volatile int *addr, uintptr_t *key){
+    const uintptr_t vma = (uintptr_t)addr;
+    struct pte *pte;
+
+    if (vma % sizeof(int) != 0)
+        return -EINVAL;
+
+    if (memory_fault_in_user((const void *)vma, sizeof(int), PTE_R | PTE_W | PTE_U) != 0)
+        return -EFAULT;
+
+    pte = walk_pt(active_space_root(), vma, 0);
+    if (pte == NULL || !(pte->flags & PTE_V))
+        return -EFAULT; // unmapped by another thread
+
+    *key = ((uintptr_t)pte->ppn << PAGE_ORDER) | (vma & (PAGE_SIZE - 1));
+    return 0;
+}
+
+
+/**
+ * futex_bucket - Returns the wait table bucket for a futex key.
+ */
+static struct futex_bucket *futex_bucket(uintptr_t key){
+    return &futex_table[(key / sizeof(int)) % FUTEX_TABLE_SIZE];
+}
+
+
+/**
+ * sysfutex_wait - Sleeps on a user address if it holds an expected value.
+ *
+ * The value is checked with the bucket lock held, and sysfutex_wake takes the
+ * same lock, so a wakeup issued after the user changed *addr cannot be missed.
+ *
+ * @param addr  User address of an aligned int.
+ * @param val   Value *addr is expected to hold.
+ * @return      0 once woken up (possibly spuriously), -EAGAIN if *addr does
+ *              not equal val, -EINVAL if addr is misaligned, or -EFAULT if it
+ *              is not in user memory.
+ */
+static int sysfutex_wait(volatile int *addr, int val){
+    struct futex_bucket *fb;
+    int saved_intr_state;
+    uintptr_t key;
+    int result;
+    int cur;
+
+    trace("%s(addr=%p,val=%d)", __func__, addr, val);
+
+    result = futex_key(addr, &key);
+    if (result != 0)
+        return result;
+
+    fb = futex_bucket(key);
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&fb->lock);
+
+    if (copy_from_user(&cur, (const void *)addr, sizeof(int)) != 0) {
+        result = -EFAULT;
+    } else if (cur != val) {
+        result = -EAGAIN;
+    } else {
+        if (fb->nwaiters++ == 0)
+            fb->key = key;
+        else if (fb->key != key)
+            fb->key = 0; // waiters on different addresses
+
+        condition_wait_locked(&fb->cond, &fb->lock);
+
+        if (--fb->nwaiters == 0)
+            fb->key = 0;
+    }
+
+    spin_release(&fb->lock);
+    intr_restore(saved_intr_state);
+    return result;
+}
+
+
+/**
+ * sysfutex_wake - Wakes threads sleeping on a user address.
+ *
+ * If every thread in the bucket waits on addr, wakes up to n of them in the
+ * order they started waiting. Otherwise wakes the whole bucket and lets the
+ * other waiters recheck their futex words.
+ *
+ * @param addr  User address of an aligned int.
+ * @param n     Maximum number of threads to wake.
+ * @return      0 on success, -EINVAL if addr is misaligned, or -EFAULT if it
+ *              is not in user memory.
+ */
+static int sysfutex_wake(volatile int *addr, int n){
+    struct futex_bucket *fb;
+    int saved_intr_state;
+    uintptr_t key;
+    int result;
+
+    trace("%s(addr=%p,n=%d)", __func__, addr, n);
+
+    result = futex_key(addr, &key);
+    if (result != 0)
+        return result;
+
+    fb = futex_bucket(key);
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&fb->lock);
+
+    if (fb->nwaiters != 0) {
+        if (fb->key == key) {
+            while (0 < n-- && condition_signal(&fb->cond) != -1)
+                continue;
+        } else
+            condition_broadcast(&fb->cond);
+    }
+
+    spin_release(&fb->lock);
+    intr_restore(saved_intr_state);
+    return 0;
+}
+
+
+// System calls are dispatched through syscall_table, indexed by SYSCALL_*
+// number. Each entry converts the argument registers to its handler's
+// parameter types (truncating and sign-extending int arguments as a C call
+// would). Unused numbers map to sysnosys_entry. Each entry records the
+// KTRACE_SYSCALL_ENTER and KTRACE_SYSCALL_EXIT events (see ktrace.h), with -1
+// as the number for sysnosys, and counts the call and its latency (see
+// stats.h).
+//
+// trapasm.s calls entries directly from its fast syscall path, which does not
+// save a full trap frame and passes NULL for /tfr/. Handlers that need the
+// caller's registers have their bit set in syscall_slow_mask and are always
+// called through syscall_handler instead. SYSCALL_TABLE_SIZE must match
+// trapasm.s.
+
+#define SYSCALL_TABLE_SIZE 64
+
+typedef int64_t syscall_fn (
+    uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3,
+    struct trap_frame * tfr);
+
+#define SYSCALL_ENTRY(nr, name, call) \
+    static int64_t name##_entry ( \
+        uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, \
+        struct trap_frame * tfr) \
+    { \
+        uint64_t start; \
+        int64_t result; \
+        ktrace(KTRACE_SYSCALL_ENTER, (nr), a0); \
+        start = timer_get_mtime(); \
+        result = (call); \
+        stats_syscall((nr), start); \
+        ktrace(KTRACE_SYSCALL_EXIT, (nr), result); \
+        return result; \
+    }
+
+SYSCALL_ENTRY(-1, sysnosys, -EINVAL)
+SYSCALL_ENTRY(SYSCALL_EXIT, sysexit, sysexit())
+SYSCALL_ENTRY(SYSCALL_MSGOUT, sysmsgout, sysmsgout((const char *)a0))
+SYSCALL_ENTRY(SYSCALL_DEVOPEN, sysdevopen, sysdevopen(a0, (const char *)a1, a2))
+SYSCALL_ENTRY(SYSCALL_FSOPEN, sysfsopen, sysfsopen(a0, (const char *)a1))
+SYSCALL_ENTRY(SYSCALL_CLOSE, sysclose, sysclose(a0))
+SYSCALL_ENTRY(SYSCALL_READ, sysread, sysread(a0, (void *)a1, (size_t)a2))
+SYSCALL_ENTRY(SYSCALL_WRITE, syswrite,
+    syswrite(a0, (const void *)a1, (size_t)a2))
+SYSCALL_ENTRY(SYSCALL_IOCTL, sysioctl, sysioctl(a0, a1, (void *)a2))
+SYSCALL_ENTRY(SYSCALL_READV, sysreadv,
+    sysreadv(a0, (const struct iovec *)a1, a2))
+SYSCALL_ENTRY(SYSCALL_WRITEV, syswritev,
+    syswritev(a0, (const struct iovec *)a1, a2))
+SYSCALL_ENTRY(SYSCALL_PREAD, syspread, syspread(a0, (void *)a1, (size_t)a2, a3))
+SYSCALL_ENTRY(SYSCALL_PWRITE, syspwrite,
+    syspwrite(a0, (const void *)a1, (size_t)a2, a3))
+SYSCALL_ENTRY(SYSCALL_EXEC, sysexec, sysexec(a0))
+SYSCALL_ENTRY(SYSCALL_FORK, sysfork, sysfork(tfr))
+SYSCALL_ENTRY(SYSCALL_THREAD_CREATE, systhread_create,
+    systhread_create(a0, a1, a2, a3, tfr))
+SYSCALL_ENTRY(SYSCALL_USLEEP, sysusleep, sysusleep(a0))
+SYSCALL_ENTRY(SYSCALL_WAIT, syswait, syswait(a0))
+SYSCALL_ENTRY(SYSCALL_NANOSLEEP, sysnanosleep, sysnanosleep(a0))
+SYSCALL_ENTRY(SYSCALL_FUTEX_WAIT, sysfutex_wait,
+    sysfutex_wait((volatile int *)a0, a1))
+SYSCALL_ENTRY(SYSCALL_FUTEX_WAKE, sysfutex_wake,
+    sysfutex_wake((volatile int *)a0, a1))
+SYSCALL_ENTRY(SYSCALL_RING_SETUP, sysring_setup,
+    ioring_setup((struct ring *)a0))
+SYSCALL_ENTRY(SYSCALL_RING_ENTER, sysring_enter, ioring_enter(a0, a1))
+
+syscall_fn * const syscall_table[SYSCALL_TABLE_SIZE] = {
+    [0 ... SYSCALL_TABLE_SIZE-1] = &sysnosys_entry,
+    [SYSCALL_EXIT] = &sysexit_entry,
+    [SYSCALL_MSGOUT] = &sysmsgout_entry,
+    [SYSCALL_DEVOPEN] = &sysdevopen_entry,
+    [SYSCALL_FSOPEN] = &sysfsopen_entry,
+    [SYSCALL_CLOSE] = &sysclose_entry,
+    [SYSCALL_READ] = &sysread_entry,
+    [SYSCALL_WRITE] = &syswrite_entry,
+    [SYSCALL_IOCTL] = &sysioctl_entry,
+    [SYSCALL_READV] = &sysreadv_entry,
+    [SYSCALL_WRITEV] = &syswritev_entry,
+    [SYSCALL_PREAD] = &syspread_entry,
+    [SYSCALL_PWRITE] = &syspwrite_entry,
+    [SYSCALL_EXEC] = &sysexec_entry,
+    [SYSCALL_FORK] = &sysfork_entry,
+    [SYSCALL_THREAD_CREATE] = &systhread_create_entry,
+    [SYSCALL_USLEEP] = &sysusleep_entry,
+    [SYSCALL_WAIT] = &syswait_entry,
+    [SYSCALL_NANOSLEEP] = &sysnanosleep_entry,
+    [SYSCALL_FUTEX_WAIT] = &sysfutex_wait_entry,
+    [SYSCALL_FUTEX_WAKE] = &sysfutex_wake_entry,
+    [SYSCALL_RING_SETUP] = &sysring_setup_entry,
+    [SYSCALL_RING_ENTER] = &sysring_enter_entry
+};
+
+// Building with -DSYSCALL_NO_FAST_PATH sends every system call through
+// syscall_handler, to compare the two paths (see user/bench_syscall.c).
+
+#ifndef SYSCALL_NO_FAST_PATH
+const uint64_t syscall_slow_mask =
+    (1UL << SYSCALL_FORK) | (1UL << SYSCALL_THREAD_CREATE);
+#else
+const uint64_t syscall_slow_mask = UINT64_MAX;
+#endif
+
+// System calls that an ioring worker may carry out (see ioring.c). They take at
+// most three arguments and do not need the caller's registers.
+
+static const uint64_t syscall_ring_mask =
+    (1UL << SYSCALL_READ) | (1UL << SYSCALL_WRITE) |
+    (1UL << SYSCALL_IOCTL) | (1UL << SYSCALL_FSOPEN) |
+    (1UL << SYSCALL_READV) | (1UL << SYSCALL_WRITEV) |
+    (1UL << SYSCALL_CLOSE) | (1UL << SYSCALL_USLEEP) |
+    (1UL << SYSCALL_NANOSLEEP);
+
+int64_t syscall_ring_op (
+    unsigned int nr, uint64_t a0, uint64_t a1, uint64_t a2)
+{
+    if (SYSCALL_TABLE_SIZE <= nr || !(syscall_ring_mask & (1UL << nr)))
+        return -EINVAL;
+
+    return syscall_table[nr](a0, a1, a2, 0, NULL);
+}
+
 /**
  * syscall - Dispatches the appropriate system call.
  *
@@ -390,54 +1119,19 @@ static int sysfork(const struct trap_frame *tfr){
  */
 int64_t syscall(struct trap_frame * tfr){
     const uint64_t * const a = tfr->x + TFR_A0;
-    switch(a[7]){
-        case SYSCALL_EXIT:
-            return sysexit();
-            break;
-        case SYSCALL_MSGOUT:
-            return sysmsgout((const char*) a[0]);
-            break;
-        case SYSCALL_DEVOPEN:
-            return sysdevopen(a[0], (const char*)a[1], a[2]);
-            break;
-        case SYSCALL_FSOPEN:
-            return sysfsopen(a[0], (const char*)a[1]);
-            break;
-        case SYSCALL_CLOSE:
-            return sysclose(a[0]);
-            break;
-        case SYSCALL_READ:
-            return sysread(a[0], (void *)a[1], (size_t)a[2]);
-            break;
-        case SYSCALL_WRITE:
-            return syswrite(a[0], (const void *)a[1], (size_t)a[2]);
-            break;
-        case SYSCALL_IOCTL:
-            return sysioctl(a[0], a[1], (void *)a[2]);
-            break;
-        case SYSCALL_EXEC:
-            return sysexec(a[0]);
-            break;
-        case SYSCALL_WAIT:
-            return syswait(a[0]);
-            break;
-        case SYSCALL_USLEEP:
-            return sysusleep(a[0]);
-            break;
-        case SYSCALL_FORK:
-            return sysfork((const struct trap_frame *)tfr);
-            break;
-        default:
-            return -EINVAL; // Invalid syscall
-            break;
-    } 
+
+    if (SYSCALL_TABLE_SIZE <= a[7])
+        return -EINVAL; // Invalid syscall
+    
+    return syscall_table[a[7]](a[0], a[1], a[2], a[3], tfr);
 }
 
 /**
  * syscall_handler - Handles system calls.
  *
  * Determines the system call from the trap frame and dispatches it to
- * the appropriate handler.
+ * the appropriate handler. Called for the system calls that trapasm.s does
+ * not handle on its fast path (see syscall_table).
  *
  * @param tfr   Trap frame containing syscall information.
  */
@@ -99,7 +99,8 @@ _thread_swtch:
         # The currently running thread is suspended and resuming_thread is
         # restored to execution. swtch returns when execution is switched back
         # to the calling thread. The return value is the previously executing
-        # thread. Interrupts are enabled when swtch returns.
+        # thread. Interrupts must be disabled and stay disabled across the
+        # switch; see suspend_self in thread.c.
         #
         # tp = pointer to struct thread of current thread (to be suspended)
         # a0 = pointer to struct thread of thread to be resumed
@@ -120,6 +121,7 @@ _thread_swtch:
         sd      ra, 12*8(tp)
         sd      sp, 13*8(tp)
 
+        mv      t0, tp          # remember suspended thread to return it
         mv      tp, a0
 
         ld      sp, 13*8(tp)
@@ -136,7 +138,8 @@ _thread_swtch:
         ld      s2, 2*8(tp)
         ld      s1, 1*8(tp)
         ld      s0, 0*8(tp)
-                
+
+        mv      a0, t0
         ret
 
         .global _thread_setup
@@ -169,6 +172,11 @@ _thread_setup:
 
         # The glue code below is executed when we first switch into the new thread
 
+        # _thread_swtch returned here with a0 = previous thread, interrupts
+        # disabled and the scheduler lock held; thread_startup releases it.
+
+        call    thread_startup
+        csrsi   sstatus, 2      # enable interrupts
         la      ra, thread_exit # child will return to thread_exit
         mv      a0, s0          # get arg argument to child from s0
         mv      a1, s1          # get arg argument to child from s0
@@ -247,45 +255,28 @@ _thread_finish_jump:
         .global _thread_finish_fork
         .type   _thread_finish_fork, @function
 
-# extern void _thread_finish_fork
-#         (struct thread *child, 
-#         const struct trap_frame *parent_tfr); 
+# void __attribute__ ((noreturn)) _thread_finish_fork (
+#         const struct trap_frame * tfr);
 
 /**
- * _thread_finish_fork - Completes a thread fork and transitions to user mode.
+ * _thread_finish_fork - Returns a forked child thread to user mode.
  *
- * Saves the current thread context, switches to the child thread, sets parent and 
- * child return values, restores the trap frame, and enters user mode using `sret`.
+ * Entry point (see _thread_setup) of a thread created by thread_fork_to_user.
+ * Restores the trap frame, which is a copy of the parent's trap frame made at
+ * the time of the fork, and enters user mode using `sret`.
  *
  * Parameters:
- *   - a0: Pointer to the child thread.
- *   - a1: Pointer to the parent trap frame.
+ *   - a0: Pointer to the trap frame, located just below the stack anchor.
  */
 
 _thread_finish_fork:
-        # this function saves the current running thread, switches to the new 
-        # child process thread and back to the u mode interrupt handler, it 
-        # then restroes the saved trap frame which is a duplicate of the parent tfr
-        
-        # save the current running thread
-        save_current_thread_context
+        # The _thread_setup glue enabled interrupts. Disable them, so that a
+        # trap cannot clobber sepc and sstatus before we sret.
 
-        # switch to the new child process thread
-        mv      tp, a0
+        csrci   sstatus, 2
+        mv      a1, a0
 
-        # put child tid as the return value of parent tfr
-        ld      t6, 0*8(a0)
-        sd      t6, 10*8(a1)
-
-        li      a0, 0
-
-        # restore the saved trap frame 
-        restore_trap_frame_except_t6_and_a1
-
-        # restore a1 and t6
-        restore_sepc_and_sstatus
-
-        # set sscratch
+        # set sscratch to point to our stack anchor while in U mode
         ld      t6, 15*8(tp)
         csrw    sscratch, t6
 
@@ -293,6 +284,11 @@ _thread_finish_fork:
         la      t6, _trap_entry_from_umode
         csrw    stvec, t6
 
+        # restore the saved trap frame
+        restore_sepc_and_sstatus
+        restore_trap_frame_except_t6_and_a1
+
+        ld      x10, 10*8(a1)   # x10 is a0
         ld      x31, 31*8(a1)   # x31 is t6
         ld      x11, 11*8(a1)   # x11 is a1
 
@@ -14,16 +14,52 @@
 #include "intr.h"
 #include "process.h"
 #include "memory.h"
+#include "timer.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "idtab.h"
+#include "error.h"
+#include "ktrace.h"
 
 // COMPILE-TIME PARAMETERS
 //
 
-// NTHR is the maximum number of threads
+// The maximum number of threads is IDTAB_MAXID (see idtab.h), including one
+// idle thread per hart.
 
-#ifndef NTHR
-#define NTHR 16
+#if IDTAB_MAXID <= NCPU
+#error "IDTAB_MAXID must be greater than NCPU (one idle thread per hart)"
 #endif
 
+// SCHED_LATENCY_US is the period, in microseconds, within which every ready
+// thread should get to run once. SCHED_MIN_GRANULARITY_US is the shortest time
+// a thread runs before it can be preempted, which bounds the switch rate when
+// many threads are ready. Preemption is only considered on timer interrupts,
+// so quanta shorter than the timer tick period (see TICK_FREQ in timer.c)
+// are rounded up to it.
+
+#ifndef SCHED_LATENCY_US
+#define SCHED_LATENCY_US 20000
+#endif
+
+#ifndef SCHED_MIN_GRANULARITY_US
+#define SCHED_MIN_GRANULARITY_US 4000
+#endif
+
+// SCHED_MIGRATION_COST_US is how long, in microseconds, a thread's working set
+// is assumed to stay in the cache of the hart it last ran on. An idle hart
+// does not steal threads that ran more recently than that, since refilling
+// the cache on another hart would cost more than waiting for the next slice.
+
+#ifndef SCHED_MIGRATION_COST_US
+#define SCHED_MIGRATION_COST_US 500
+#endif
+
+#define SCHED_LATENCY (SCHED_LATENCY_US * (TIMER_FREQ / 1000000))
+#define SCHED_MIN_GRANULARITY (SCHED_MIN_GRANULARITY_US * (TIMER_FREQ / 1000000))
+#define SCHED_MIGRATION_COST \
+    (SCHED_MIGRATION_COST_US * (TIMER_FREQ / 1000000))
+
 #define SATP_ASID_MASK 0xFFFF0000000000ULL
 
 // EXPORTED GLOBAL VARIABLES
@@ -43,6 +79,33 @@ enum thread_state {
     THREAD_EXITED
 };
 
+// Each hart has a struct cpu, which holds its run queue. The ready-to-run list
+// of each hart is kept sorted by virtual runtime, with the hart's idle thread
+// always last. nr_ready counts the threads on it other than the idle thread.
+// min_vruntime tracks (monotonically) the smallest virtual runtime of any
+// runnable thread on the hart and is used to place new and waking threads.
+// The counters at the end record work stealing by this hart: threads stolen,
+// and steal attempts that found work but only cache-hot threads.
+//
+// The run queue lock protects the ready-to-run list, curr, and the scheduling
+// state (state, cpu, vruntime, need_resched) of the threads that are running
+// or ready on the hart. It is held across a context switch: the thread
+// switching away acquires it, and the thread being switched to releases it.
+
+struct cpu {
+    struct spinlock lock; // run queue lock
+    int hartid;
+    char online; // hart is scheduling threads
+    struct thread * curr; // thread running on this hart
+    struct thread * idle; // idle thread of this hart
+    struct thread_list ready_list;
+    int nr_ready;
+    uint64_t min_vruntime;
+    char tick_stopped; // no scheduler tick pending (see thread_tick)
+    unsigned long nr_steals;
+    unsigned long nr_steals_hot;
+};
+
 struct thread_context {
     uint64_t s[12];
     void (*ra)(uint64_t);
@@ -54,43 +117,87 @@ struct thread {
     const char * name;
     void * stack_base;
     size_t stack_size;
+    void * scratch; // see thread_scratch_page, freed with the stack
     enum thread_state state;
     int id;
     struct process * proc;
     struct thread * parent;
+    struct thread * children; // first child (linked through sibling)
+    struct thread * sibling; // next child of parent
     struct thread * list_next;
     struct condition * wait_cond;
     struct condition child_exit;
+    struct cpu * cpu; // hart the thread is running or queued on
+    uint64_t vruntime; // virtual runtime, orders the ready-to-run list
+    uint64_t sum_runtime; // total CPU time used, in timer ticks
+    uint64_t exec_start; // time runtime was last charged while running
+    uint64_t slice_start; // sum_runtime when thread was last scheduled
+    uint64_t last_ran; // time thread was last switched out
+    unsigned long nr_migrations; // times stolen by another hart
+    unsigned long nvcsw; // times switched out because it blocked or exited
+    unsigned long nivcsw; // times switched out while still runnable
+    char need_resched; // set by scheduler to request preemption
+    volatile char on_cpu; // running, or not yet fully switched out
 };
 
 // INTERNAL GLOBAL VARIABLES
 //
 
 #define MAIN_TID 0
-#define IDLE_TID (NTHR-1)
+#define IDLE_TID(hartid) (IDTAB_MAXID-1-(hartid))
+
+// cputab is indexed by hart ID.
+
+static struct cpu cputab[NCPU];
+
+// The main thread is running on the boot hart from the start, so that spinlocks
+// (which need running_hart) can be used before thread_init.
 
 struct thread main_thread = {
     .name = "main",
     .id = MAIN_TID,
     .state = THREAD_RUNNING,
+    .cpu = &cputab[BOOT_HART],
+    .on_cpu = 1,
     .child_exit = {
-        .name = "main.child_exit"
+        .name = "main.child_exit",
+        .lock = SPINLOCK_INITIALIZER("main.child_exit", SPINLOCK_ORDER_COND)
     }
 };
 
+// Idle thread of the boot hart. The idle threads of the other harts are created
+// by thread_create_idle. Idle threads never exit, so they have main as their
+// parent but are not on its list of children.
+
 struct thread idle_thread = {
     .name = "idle",
-    .id = IDLE_TID,
+    .id = IDLE_TID(BOOT_HART),
     .state = THREAD_READY,
-    .parent = &main_thread
+    .parent = &main_thread,
+    .cpu = &cputab[BOOT_HART]
 };
 
-static struct thread * thrtab[NTHR] = {
-    [MAIN_TID] = &main_thread,
-    [IDLE_TID] = &idle_thread
-};
+// thrtab maps thread ids to threads. The idle threads have the highest ids, so
+// the ids of other threads are handed out from the bottom of the table.
+//
+// thrtab_lock protects thrtab (though thrtab may be read without it, see
+// idtab.h), the parent and child links of all threads, and the transition of a
+// thread to THREAD_EXITED. The wait list of a condition is protected by its own
+// lock, and each run queue by its run queue lock. The lock order is
+// thrtab_lock, then condition locks, then run queue locks; a hart never holds
+// two run queue locks except through spin_tryacquire.
+
+static struct idtab thrtab;
+
+static struct spinlock thrtab_lock =
+    SPINLOCK_INITIALIZER("thrtab", SPINLOCK_ORDER_THRTAB);
 
-static struct thread_list ready_list;
+// Freed struct threads, linked through sibling. free_threads_lock is a leaf
+// lock, so it may be taken with thrtab_lock held.
+
+static struct thread * free_threads;
+static struct spinlock free_threads_lock =
+    SPINLOCK_INITIALIZER("free_threads", SPINLOCK_ORDER_NONE);
 
 // INTERNAL MACRO DEFINITIONS
 // 
@@ -109,6 +216,10 @@ static struct thread_list ready_list;
 
 #define CURTHR ((struct thread*)__builtin_thread_pointer())
 
+// Run queue of the hart we are running on.
+
+#define THIS_CPU (CURTHR->cpu)
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -131,21 +242,101 @@ static const char * thread_state_name(enum thread_state state)
     __attribute__ ((unused));
 
 // void recycle_thread(int tid)
-// Reclaims a thread's slot in thrtab and makes its parent the parent of its
-// children. Frees the struct thread of the thread.
+// Frees a thread's id for reuse, removes it from its parent's children, and
+// makes its parent the parent of its children. Frees the struct thread of the
+// thread, once the exited thread has finished switching away on its hart. Must
+// be called with thrtab_lock held.
 
 static void recycle_thread(int tid);
 
+// void wait_child_exit(void)
+// Waits for a child of the current thread to exit. Must be called with
+// interrupts disabled and thrtab_lock held, which is released while waiting and
+// held again on return.
+
+static void wait_child_exit(void);
+
+// int start_user_thread (
+//     const char * name, struct process * proc,
+//     const struct trap_frame * tfr)
+// Creates a thread of process /proc/ that enters user mode with a copy of the
+// trap frame /tfr/ and makes it ready to run on the least loaded hart. The new
+// thread is a child of the current thread and continues with its virtual
+// runtime. Returns the thread id of the new thread, or -EAGAIN if there are
+// too many threads or not enough memory. Used by thread_fork_to_user and
+// thread_create_user.
+
+static int start_user_thread (
+    const char * name, struct process * proc,
+    const struct trap_frame * tfr);
+
+// int add_thread(struct thread * thr)
+// Assigns a free thread id to /thr/, enters it in thrtab and adds it to the
+// children of its parent. Returns the thread id, or -EAGAIN if all ids are in
+// use. Must be called with thrtab_lock held.
+
+static int add_thread(struct thread * thr);
+
+// struct thread * alloc_thread(void)
+// Returns a zeroed struct thread, reusing one given back by free_thread if
+// there is one. Returns NULL if there is not enough memory.
+//
+// void free_thread(struct thread * thr)
+// Keeps /thr/ for reuse by alloc_thread, since kfree does not return memory
+// to the heap.
+
+static struct thread * alloc_thread(void);
+static void free_thread(struct thread * thr);
+
 // void suspend_self(void)
 // Suspends the currently running thread and resumes the next thread on the
-// ready-to-run list using _thread_swtch (in threasm.s). Must be called with
-// interrupts enabled. Returns when the current thread is next scheduled for
-// execution. If the current thread is RUNNING, it is marked READY and placed
-// on the ready-to-run list. Note that suspend_self will only return if the
-// current thread becomes READY.
+// ready-to-run list of the current hart using _thread_swtch (in threasm.s).
+// Must be called with interrupts disabled and the run queue lock of the current
+// hart held. Returns when the current thread is next scheduled for execution,
+// with the run queue lock of the hart it is then running on held; this may be
+// a different hart. If the current thread is RUNNING, it is marked READY and
+// placed on the ready-to-run list. Note that suspend_self will only return if
+// the current thread becomes READY.
 
 static void suspend_self(void);
 
+// void finish_switch(struct thread * prev)
+// Cleans up after the thread we switched away from and marks it as no longer
+// on a hart. Called by the resumed thread after _thread_swtch returns, with the
+// run queue lock held.
+
+static void finish_switch(struct thread * prev);
+
+// void sched_wait(struct condition * cond, struct spinlock * lk)
+// void broadcast_locked(struct condition * cond)
+// Versions of condition_wait and condition_broadcast that must be called with
+// interrupts disabled and the lock of /cond/ held. Once the thread is on the
+// wait list, sched_wait releases /lk/ (if not NULL) and the lock of /cond/, and
+// returns without either.
+
+static void sched_wait(struct condition * cond, struct spinlock * lk);
+static void broadcast_locked(struct condition * cond);
+
+// A timed wait (see condition_wait_until) arms an alarm that calls
+// wait_timeout, which takes the waiting thread off the wait list and wakes it
+// if it is still waiting. /state/ tells the two sides how far the other got; it
+// is protected by the condition's lock.
+
+enum timed_wait_state {
+    TIMED_WAIT_ARMED = 0, // alarm set, thread not on wait list yet
+    TIMED_WAIT_WAITING, // thread on wait list (or woken by a signal)
+    TIMED_WAIT_EXPIRED // alarm went off first
+};
+
+struct timed_wait {
+    struct alarm al; // must be first
+    struct thread * thr;
+    struct condition * cond;
+    enum timed_wait_state state;
+};
+
+static void wait_timeout(struct alarm * al);
+
 // The following functions manipulate a thread list (struct thread_list). Note
 // that threads form a linked list via the list_next member of each thread
 // structure. Thread lists are used for the ready-to-run list (ready_list) and
@@ -157,9 +348,50 @@ static void tlclear(struct thread_list * list);
 static int tlempty(const struct thread_list * list);
 static void tlinsert(struct thread_list * list, struct thread * thr);
 static struct thread * tlremove(struct thread_list * list);
-static void tlappend(struct thread_list * l0, struct thread_list * l1);
+static void tlunlink(struct thread_list * list, struct thread * thr);
 
-static void idle_thread_func(void * arg);
+// Scheduler helpers operating on the run queues and the running thread. Unless
+// noted otherwise, these must be called with interrupts disabled and the run
+// queue lock of the hart they operate on held (for update_curr, the current
+// hart).
+//
+// rq_enqueue inserts a thread into a hart's ready list in order of virtual
+// runtime and rq_dequeue removes the thread with the smallest virtual runtime.
+// update_curr charges the running thread for CPU time used up to /now/.
+// place_thread sets the virtual runtime of a new or waking thread relative to
+// min_vruntime. migrate_vruntime translates a virtual runtime from a run queue
+// whose min_vruntime is /from_min/ to another hart's run queue. enqueue_thread
+// adds a READY thread to a run queue and requests preemption of the thread
+// running there (sending an IPI if the hart is not ours) if the new thread
+// should run first; it also restarts the hart's tick if it was stopped.
+// wake_thread makes a waiting thread ready on the hart it
+// last ran on; it takes that hart's run queue lock itself. select_cpu picks the
+// hart on which to start a new thread; it reads the run queues without locking
+// them, so its answer is only a hint. steal_work moves a thread from the
+// busiest other hart's run queue to /cpu/'s, for use when /cpu/ has nothing to
+// run; it only takes the other run queue's lock if it is free.
+
+static void rq_enqueue(struct cpu * cpu, struct thread * thr);
+static struct thread * rq_dequeue(struct cpu * cpu);
+static void rq_remove (
+    struct cpu * cpu, struct thread * thr, struct thread * prev);
+static void update_curr(uint64_t now);
+static void update_min_vruntime(struct cpu * cpu);
+static void place_thread(struct cpu * cpu, struct thread * thr, int wakeup);
+static uint64_t migrate_vruntime (
+    uint64_t vruntime, uint64_t from_min, const struct cpu * to);
+static void enqueue_thread(struct cpu * cpu, struct thread * thr);
+static void wake_thread(struct thread * thr);
+static struct cpu * select_cpu(void);
+static int steal_work(struct cpu * cpu, uint64_t now);
+
+static void idle_thread_func(void * arg) __attribute__ ((noreturn));
+
+// void thread_startup(struct thread * prev)
+// Called by the _thread_setup glue (thrasm.s) when a new thread first runs, in
+// place of the code following the call to _thread_swtch in suspend_self.
+
+extern void thread_startup(struct thread * prev);
 
 // IMPORTED FUNCTION DECLARATIONS
 // defined in thrasm.s
@@ -174,6 +406,12 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
         struct thread_stack_anchor * stack_anchor,
         uintptr_t usp, uintptr_t upc, ...);
 
+// Entry point of a thread created by start_user_thread. Returns to user mode
+// using the trap frame /tfr/.
+
+extern void __attribute__ ((noreturn)) _thread_finish_fork (
+        const struct trap_frame * tfr);
+
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -183,11 +421,12 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
  * 
  * this function performs the following steps:
  * -allocate new memeory for the child process
- * -setup a new thread struct
- * -initialize stack anchor
- * -child thread process
- * -switch into child's memory space
- * -set up the thread by calling _thread_setup and add it to ready to run list
+ * -set up a thread for the child that returns to user mode with a copy of the
+ *  parent's trap frame, through _thread_finish_fork
+ * -add it to the ready to run list of the least loaded hart
+ * 
+ * The parent continues running; the child's fork returns 0 once it is
+ * scheduled.
  * 
  * @param child_proc    pointer to the child process structure
  * @param parent_tfr    pointer to the parent's trap frame
@@ -196,10 +435,7 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
  */
 
 int thread_fork_to_user(struct process *child_proc, const struct trap_frame *parent_tfr){
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
-    struct thread * child;
-    int saved_intr_state;
+    struct trap_frame child_tfr;
     int tid;
 
     if (!child_proc || !parent_tfr) {
@@ -211,73 +447,52 @@ int thread_fork_to_user(struct process *child_proc, const struct trap_frame *par
     uintptr_t child_mtag = memory_space_clone(child_proc_asid);
 
     if (!child_mtag) {
-        return -2; // memory space clone failed 
+        return -EAGAIN; // not enough memory to clone the memory space
     } 
 
     child_proc->mtag = child_mtag;
 
-    // set up a new thread struct
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
-    
-    if (tid == NTHR)
-        panic("Too many threads");
-
-    // Allocate a struct thread and a stack
-
-    child = kmalloc(sizeof(struct thread));
-
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
-
-    thrtab[tid] = child;
-
-    child->id = tid;
-    child->name = "forked_process";
-    child->parent = CURTHR;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
-
-    // // Allocate space for the trap frame just below the stack anchor
-    // struct trap_frame *child_tfr = (struct trap_frame *)( (uintptr_t)stack_anchor - sizeof(struct trap_frame) );
-
-    // // Copy parent trap frame to child trap frame
-    // memcpy(child_tfr, parent_tfr, sizeof(struct trap_frame));
+    // The child's fork returns 0.
 
-    // // Set return value in child's trap frame
-    // child_tfr->x[10] = 0;
+    memcpy(&child_tfr, parent_tfr, sizeof(struct trap_frame));
+    child_tfr.x[TFR_A0] = 0;
 
-    // child->stack_base = child_tfr;
+    tid = start_user_thread("forked_process", child_proc, &child_tfr);
 
-    set_thread_state(CURTHR, THREAD_READY);
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, CURTHR);
-    intr_restore(saved_intr_state);
-    set_thread_state(child, THREAD_RUNNING);
+    // if there are too many threads, give back the cloned memory space
+    if (tid < 0) {
+        memory_space_free(child_mtag);
+        return tid;
+    }
 
     // set tid of the child proc
     child_proc->tid = tid;
 
-    // set child_thread process
-    thread_set_process(tid, child_proc);
-    
-    // switch memory spaces
-    memory_space_switch(child_mtag);
-
-    _thread_finish_fork(child, parent_tfr);
-
     // function executes w no errors
     return 0;
 }
 
+/**
+ * creates another thread in the current process
+ * 
+ * The new thread shares the memory space and open files of the current
+ * process and enters user mode with a copy of /tfr/. It is a child of the
+ * current thread, which can wait for it to exit using thread_join.
+ * 
+ * @param tfr           pointer to the initial user mode context of the thread
+ * 
+ * @return              returns the thread id of the new thread, or -EAGAIN
+ *                      if there are too many threads
+ */
+
+int thread_create_user(const struct trap_frame *tfr){
+    assert (CURTHR->proc != NULL);
+    return start_user_thread("user_thread", CURTHR->proc, tfr);
+}
+
 // function to get the current thread
 struct thread * cur_thread(void) {
-    return thrtab[MAIN_TID];
+    return &main_thread;
 }
 
 void * cur_stack_base(void) {
@@ -288,72 +503,192 @@ int running_thread(void) {
     return CURTHR->id;
 }
 
+int running_hart(void) {
+    return THIS_CPU->hartid;
+}
+
 void thread_init(void) {
+    struct cpu * const cpu = &cputab[BOOT_HART];
+    int i;
+
+    for (i = 0; i < NCPU; i++) {
+        spinlock_init(&cputab[i].lock, "rq", SPINLOCK_ORDER_RQ);
+        cputab[i].hartid = i;
+    }
+
+    cpu->online = 1;
+    cpu->curr = &main_thread;
+    cpu->idle = &idle_thread;
+
+    idtab_init(&thrtab);
+
+    if (idtab_insert(&thrtab, MAIN_TID, &main_thread) != 0 ||
+        idtab_insert(&thrtab, idle_thread.id, &idle_thread) != 0)
+    {
+        panic("thread_init: thrtab");
+    }
+
     init_main_thread();
     init_idle_thread();
     set_running_thread(&main_thread);
     thrmgr_initialized = 1;
 }
 
+void * thread_create_idle(int hartid) {
+    struct thread_stack_anchor * stack_anchor;
+    struct cpu * const cpu = &cputab[hartid];
+    void * stack_page;
+    struct thread * idle;
+    int saved_intr_state;
+
+    trace("%s(hartid=%d)", __func__, hartid);
+
+    assert (0 <= hartid && hartid < NCPU && hartid != BOOT_HART);
+
+    idle = kcalloc(1, sizeof(struct thread));
+
+    stack_page = memory_alloc_page();
+    stack_anchor = stack_page + PAGE_SIZE;
+    stack_anchor -= 1;
+    stack_anchor->thread = idle;
+    stack_anchor->reserved = 0;
+
+    // The hart starts out running its idle thread, the same way the boot hart
+    // starts out running the main thread.
+
+    idle->id = IDLE_TID(hartid);
+    idle->name = "idle";
+    idle->parent = &main_thread;
+    idle->stack_base = stack_anchor;
+    idle->stack_size = idle->stack_base - stack_page;
+    idle->state = THREAD_RUNNING;
+    idle->cpu = cpu;
+    idle->on_cpu = 1;
+    condition_init(&idle->child_exit, "idle.child_exit");
+
+    cpu->curr = idle;
+    cpu->idle = idle;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&thrtab_lock);
+
+    if (idtab_insert(&thrtab, idle->id, idle) != 0)
+        panic("thread_create_idle: thrtab");
+
+    spin_release(&thrtab_lock);
+    intr_restore(saved_intr_state);
+
+    return stack_anchor;
+}
+
+void thread_start_hart(void) {
+    struct cpu * const cpu = THIS_CPU;
+
+    trace("%s() on hart %d", __func__, cpu->hartid);
+
+    assert (CURTHR == cpu->idle);
+
+    intr_disable();
+    spin_acquire(&cpu->lock);
+    CURTHR->exec_start = timer_get_mtime();
+    cpu->online = 1;
+    spin_release(&cpu->lock);
+    intr_enable();
+
+    idle_thread_func(NULL);
+}
+
 int thread_spawn(const char * name, void (*start)(void *), void * arg) {
     struct thread_stack_anchor * stack_anchor;
     void * stack_page;
     struct thread * child;
+    struct cpu * cpu;
     int saved_intr_state;
     int tid;
 
     trace("%s(name=\"%s\") in %s", __func__, name, CURTHR->name);
 
-    // Find a free thread slot.
-
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
-    
-    if (tid == NTHR)
-        panic("Too many threads");
-    
     // Allocate a struct thread and a stack
 
-    child = kmalloc(sizeof(struct thread));
+    child = alloc_thread();
+    stack_page = (child != NULL) ? memory_try_alloc_page() : NULL;
+
+    if (stack_page == NULL) {
+        if (child != NULL)
+            free_thread(child);
+        return -EAGAIN;
+    }
 
-    stack_page = memory_alloc_page();
     stack_anchor = stack_page + PAGE_SIZE;
     stack_anchor -= 1;
     stack_anchor->thread = child;
     stack_anchor->reserved = 0;
 
-
-    thrtab[tid] = child;
-
-    child->id = tid;
     child->name = name;
     child->parent = CURTHR;
     child->proc = CURTHR->proc;
     child->stack_base = stack_anchor;
     child->stack_size = child->stack_base - stack_page;
-    set_thread_state(child, THREAD_READY);
+    condition_init(&child->child_exit, "child_exit");
 
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, child);
-    intr_restore(saved_intr_state);
+    // The thread must be set up before it is visible to other harts.
 
     _thread_setup(child, child->stack_base, start, arg);
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&thrtab_lock);
+    tid = add_thread(child);
+    spin_release(&thrtab_lock);
+
+    if (tid < 0) {
+        intr_restore(saved_intr_state);
+        memory_free_page(stack_page);
+        free_thread(child);
+        return tid;
+    }
+
+    cpu = select_cpu();
+
+    spin_acquire(&cpu->lock);
+    child->cpu = cpu;
+    place_thread(cpu, child, 0);
+    set_thread_state(child, THREAD_READY);
+    enqueue_thread(cpu, child);
+    spin_release(&cpu->lock);
+
+    intr_restore(saved_intr_state);
     
     return tid;
 }
 
 void thread_exit(void) {
+    struct condition * parent_exit;
+
     if (CURTHR == &main_thread)
         halt_success();
     
-    set_thread_state(CURTHR, THREAD_EXITED);
+    intr_disable();
 
-    // Signal parent in case it is waiting for us to exit
+    // Our parent checks for exited children with thrtab_lock held, and keeps
+    // holding it until it is on its child_exit wait list, so a wake-up cannot
+    // get lost between the two. Holding thrtab_lock also keeps our parent from
+    // being recycled while we signal it.
 
+    spin_acquire(&thrtab_lock);
+    set_thread_state(CURTHR, THREAD_EXITED);
     assert(CURTHR->parent != NULL);
-    condition_broadcast(&CURTHR->parent->child_exit);
+    parent_exit = &CURTHR->parent->child_exit;
+
+    // Signal parent in case it is waiting for us to exit. The parent may run
+    // (on another hart) before we are done switching away, so it waits for
+    // on_cpu to be cleared before freeing our struct thread (see
+    // recycle_thread). Our stack is freed by the thread that runs after us.
+
+    spin_acquire(&parent_exit->lock);
+    broadcast_locked(parent_exit);
+    spin_acquire(&THIS_CPU->lock);
+    spin_release(&parent_exit->lock);
+    spin_release(&thrtab_lock);
 
     suspend_self(); // should not return
     panic("thread_exit() failed");
@@ -372,105 +707,227 @@ void thread_jump_to_user(uintptr_t usp, uintptr_t upc) {
 }
 
 void thread_yield(void) {
+    int saved_intr_state;
+
     trace("%s() in %s", __func__, CURTHR->name);
 
     // assert (intr_enabled());
     assert (CURTHR->state == THREAD_RUNNING);
 
+    saved_intr_state = intr_disable();
+    spin_acquire(&THIS_CPU->lock);
     suspend_self();
+    spin_release(&THIS_CPU->lock); // we may be on another hart now
+    intr_restore(saved_intr_state);
 }
 
-int thread_join_any(void) {
-    int childcnt = 0;
-    int tid;
+uint64_t thread_tick(void) {
+    struct thread * const thr = CURTHR;
+    struct cpu * const cpu = THIS_CPU;
+    uint64_t deadline = UINT64_MAX;
+    struct thread * head;
+    uint64_t slice;
+    uint64_t wait;
+    uint64_t ran;
+    uint64_t now;
+    int i;
+
+    spin_acquire(&cpu->lock);
+
+    now = timer_get_mtime();
+    update_curr(now);
+    head = cpu->ready_list.head;
+
+    // Nothing to preempt for if only the idle thread is waiting, so the tick
+    // can be stopped until another thread is made ready here. Conversely, the
+    // idle thread is preempted as soon as anything else is ready.
+
+    if (head == NULL || head == cpu->idle)
+        goto done;
+    
+    if (thr == cpu->idle) {
+        thr->need_resched = 1;
+        deadline = now;
+        goto done;
+    }
 
-    trace("%s() in %s", __func__, CURTHR->name);
+    // The running thread's share of the scheduling period shrinks as more
+    // threads become ready, but never below the minimum granularity.
 
-    // See if there are any children of the current thread, and if they have
-    // already exited. If so, call thread_wait_one() to finish up.
+    slice = SCHED_LATENCY / (cpu->nr_ready + 1);
+    if (slice < SCHED_MIN_GRANULARITY)
+        slice = SCHED_MIN_GRANULARITY;
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL && thrtab[tid]->parent == CURTHR) {
-            if (thrtab[tid]->state == THREAD_EXITED)
-                return thread_join(tid);
-            childcnt++;
-        }
+    ran = thr->sum_runtime - thr->slice_start;
+
+    if (slice <= ran ||
+        (SCHED_MIN_GRANULARITY <= ran && head->vruntime < thr->vruntime))
+    {
+        thr->need_resched = 1;
+        deadline = now;
+        goto done;
     }
 
-    // If the current thread has no children, this is a bug. We could also
-    // return -EINVAL if we want to allow the calling thread to recover.
+    // Otherwise, the earliest the thread can be preempted is when its slice
+    // runs out, or, if sooner, when it has run for the minimum granularity and
+    // its virtual runtime has passed that of the first waiting thread.
+
+    deadline = now + (slice - ran);
+
+    wait = (ran < SCHED_MIN_GRANULARITY) ? SCHED_MIN_GRANULARITY - ran : 0;
 
-    if (childcnt == 0)
-        panic("thread_wait called by childless thread");
+    if (thr->vruntime <= head->vruntime &&
+        wait < head->vruntime - thr->vruntime + 1)
+    {
+        wait = head->vruntime - thr->vruntime + 1;
+    }
     
+    if (now + wait < deadline)
+        deadline = now + wait;
+
+done:
+    cpu->tick_stopped = (deadline == UINT64_MAX);
+
+    // Idle harts with a stopped tick only look for work to steal when woken.
+    // Until its next tick, this hart runs at most one ready thread, the one it
+    // switches to if the running thread is preempted now. If more are ready,
+    // wake one idle hart to steal one of the others. Later ticks wake another
+    // if threads are still left waiting.
+
+    if ((thr->need_resched ? 1 : 0) < cpu->nr_ready) {
+        for (i = 0; i < NCPU; i++) {
+            if (cputab[i].online && cputab[i].tick_stopped &&
+                cputab[i].curr == cputab[i].idle)
+            {
+                smp_send_ipi(cputab[i].hartid);
+                break;
+            }
+        }
+    }
 
-    // Wait for some child to exit. An exiting thread signals its parent's
-    // child_exit condition.
+    spin_release(&cpu->lock);
+    return deadline;
+}
 
-    condition_wait(&CURTHR->child_exit);
+int thread_preempt_pending(void) {
+    return CURTHR->need_resched;
+}
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL &&
-            thrtab[tid]->parent == CURTHR &&
-            thrtab[tid]->state == THREAD_EXITED)
-        {
-            recycle_thread(tid);
-            return tid;
+int thread_join_any(void) {
+    struct thread * child;
+    int saved_intr_state;
+    int tid;
+
+    trace("%s() in %s", __func__, CURTHR->name);
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&thrtab_lock);
+
+    for (;;) {
+        // See if there are any children of the current thread, and if they
+        // have already exited. If so, recycle the first one we find.
+
+        // If the current thread has no children, this is a bug. We could also
+        // return -EINVAL if we want to allow the calling thread to recover.
+
+        if (CURTHR->children == NULL)
+            panic("thread_wait called by childless thread");
+
+        for (child = CURTHR->children; child != NULL; child = child->sibling) {
+            if (child->state == THREAD_EXITED) {
+                tid = child->id;
+                recycle_thread(tid);
+                spin_release(&thrtab_lock);
+                intr_restore(saved_intr_state);
+                return tid;
+            }
         }
-    }
 
-    panic("spurious child_exit signal");
+        // Wait for some child to exit. An exiting thread signals its parent's
+        // child_exit condition.
+
+        wait_child_exit();
+    }
 }
 
 // Wait for specific child thread to exit. Returns the thread id of the child.
 
 int thread_join(int tid) {
-    struct thread * const child = thrtab[tid];
+    struct thread * child;
+    int saved_intr_state;
 
     trace("%s(tid=%d)", __func__, tid);
 
-    if (tid <= 0 || NTHR <= tid)
+    if (tid <= 0 || IDTAB_MAXID <= tid)
         return -1;
 
     trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
 
+    saved_intr_state = intr_disable();
+    spin_acquire(&thrtab_lock);
+
+    child = idtab_get(&thrtab, tid);
+
     // Can only wait for child if we're the parent
 
-    if (child == NULL || child->parent != CURTHR)
+    if (child == NULL || child->parent != CURTHR) {
+        spin_release(&thrtab_lock);
+        intr_restore(saved_intr_state);
         return -1;
+    }
     
     // Wait for child to exit. Whenever a child exits, it signals its parent's
     // child_exit condition.
 
     while (child->state != THREAD_EXITED)
-        condition_wait(&CURTHR->child_exit);
+        wait_child_exit();
     
     recycle_thread(tid);
 
+    spin_release(&thrtab_lock);
+    intr_restore(saved_intr_state);
+
     return tid;
 }
 
 struct process * thread_process(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->proc;
+    struct thread * const thr = idtab_get(&thrtab, tid);
+
+    assert (thr != NULL);
+    return thr->proc;
+}
+
+void * thread_scratch_page(void) {
+    if (CURTHR->scratch == NULL)
+        CURTHR->scratch = memory_try_alloc_page();
+
+    return CURTHR->scratch;
 }
 
 void thread_set_process(int tid, struct process * proc) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    thrtab[tid]->proc = proc;
+    struct thread * const thr = idtab_get(&thrtab, tid);
+
+    assert (thr != NULL);
+    thr->proc = proc;
 }
 
 const char * thread_name(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->name;
+    struct thread * const thr = idtab_get(&thrtab, tid);
+
+    assert (thr != NULL);
+    return thr->name;
+}
+
+int thread_running(int tid) {
+    const struct thread * const thr = idtab_get(&thrtab, tid);
+
+    return (thr != NULL && thr->state == THREAD_RUNNING);
 }
 
 void condition_init(struct condition * cond, const char * name) {
     cond->name = name;
     tlclear(&cond->wait_list);
+    spinlock_init(&cond->lock, name, SPINLOCK_ORDER_COND);
 }
 
 void condition_wait(struct condition * cond) {
@@ -478,49 +935,116 @@ void condition_wait(struct condition * cond) {
 
     trace("%s(cond=<%s>) in %s", __func__, cond->name, CURTHR->name);
 
-    assert(CURTHR->state == THREAD_RUNNING);
-
-    // Insert current thread into condition wait list
-    
-    set_thread_state(CURTHR, THREAD_WAITING);
-    CURTHR->wait_cond = cond;
-    CURTHR->list_next = NULL;
-
     saved_intr_state = intr_disable();
-    tlinsert(&cond->wait_list, CURTHR);
+    spin_acquire(&cond->lock);
+    sched_wait(cond, NULL);
     intr_restore(saved_intr_state);
+}
 
-    suspend_self();
+void condition_wait_locked(struct condition * cond, struct spinlock * lk) {
+    trace("%s(cond=<%s>,lk=<%s>) in %s",
+        __func__, cond->name, lk->name, CURTHR->name);
+
+    assert (intr_disabled());
+
+    // sched_wait releases lk once we are on the wait list. A broadcaster
+    // holding lk after that is sure to find us there.
+
+    spin_acquire(&cond->lock);
+    sched_wait(cond, lk);
+    spin_acquire(lk);
+}
+
+int condition_wait_until (
+    struct condition * cond, struct spinlock * lk, uint64_t twake)
+{
+    struct timed_wait tw;
+
+    trace("%s(cond=<%s>,lk=<%s>,twake=%lu) in %s",
+        __func__, cond->name, lk->name, twake, CURTHR->name);
+
+    assert (intr_disabled());
+
+    if (twake <= timer_get_mtime())
+        return -ETIMEDOUT;
+
+    alarm_init(&tw.al, cond->name);
+    tw.al.func = &wait_timeout;
+    tw.thr = CURTHR;
+    tw.cond = cond;
+    tw.state = TIMED_WAIT_ARMED;
+
+    alarm_arm(&tw.al, twake);
+    spin_acquire(&cond->lock);
+
+    // The alarm may have gone off on another hart already.
+
+    if (tw.state == TIMED_WAIT_EXPIRED) {
+        spin_release(&cond->lock);
+        alarm_cancel(&tw.al); // wait for wait_timeout to be done with tw
+        return -ETIMEDOUT;
+    }
+
+    tw.state = TIMED_WAIT_WAITING;
+    sched_wait(cond, lk);
+
+    // Whoever woke us, make sure the alarm is no longer pending or running
+    // before tw goes out of scope.
+
+    alarm_cancel(&tw.al);
+    spin_acquire(lk);
+
+    return (tw.state == TIMED_WAIT_EXPIRED) ? -ETIMEDOUT : 0;
 }
 
 void condition_broadcast(struct condition * cond) {
     int saved_intr_state;
-    struct thread * thr;
 
-    // Fast path: if there are no threads waiting, return.
+    // Fast path: if there are no threads waiting, return. Waiters that must
+    // not be missed are on the list before they release the lock the caller
+    // holds (see condition_wait_locked).
 
     if (tlempty(&cond->wait_list))
         return;
 
-    // Mark all waiting threads runnable. This is *not* a constant-time
-    // operation, however, keeping having an enum thread_state member of struct
-    // thread for keeping track of thread state is useful for debugging.
+    ktrace(KTRACE_COND_BCAST, (uintptr_t)cond, 0);
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&cond->lock);
+    broadcast_locked(cond);
+    spin_release(&cond->lock);
+    intr_restore(saved_intr_state);
+}
+
+int condition_signal(struct condition * cond) {
+    struct thread * thr;
+    int saved_intr_state;
+    int tid = -1;
+
+    // Fast path, as in condition_broadcast
+
+    if (tlempty(&cond->wait_list))
+        return -1;
 
     saved_intr_state = intr_disable();
+    spin_acquire(&cond->lock);
 
-    for (thr = cond->wait_list.head; thr != NULL; thr = thr->list_next) {
+    // Waiters are appended to the wait list, so its head has waited longest.
+
+    thr = tlremove(&cond->wait_list);
+
+    if (thr != NULL) {
         assert (thr->state == THREAD_WAITING);
         assert (thr->wait_cond == cond);
-        set_thread_state(thr, THREAD_READY);
         thr->wait_cond = NULL;
+        tid = thr->id;
+        wake_thread(thr);
     }
 
-    // Append condition variable wait list to run list
-
-    tlappend(&ready_list, &cond->wait_list);
-    tlclear(&cond->wait_list);
-
+    spin_release(&cond->lock);
     intr_restore(saved_intr_state);
+
+    return tid;
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -532,6 +1056,7 @@ void init_main_thread(void) {
 
     main_thread.stack_base = _main_stack_anchor;
     main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
+    main_thread.cpu = &cputab[BOOT_HART];
 }
 
 void init_idle_thread(void) {
@@ -543,9 +1068,9 @@ void init_idle_thread(void) {
 
     idle_thread.stack_base = _idle_stack_anchor;
     idle_thread.stack_size = _idle_stack_anchor - _idle_stack_lowest;
+    idle_thread.cpu = &cputab[BOOT_HART];
     _thread_setup(&idle_thread, _idle_stack_anchor, idle_thread_func);
-    tlinsert(&ready_list, &idle_thread); // interrupts still disabled
-
+    rq_enqueue(idle_thread.cpu, &idle_thread); // interrupts still disabled
 }
 
 static void set_running_thread(struct thread * thr) {
@@ -569,75 +1094,363 @@ const char * thread_state_name(enum thread_state state) {
 };
 
 void recycle_thread(int tid) {
-    struct thread * const thr = thrtab[tid];
-    int ctid;
+    struct thread * const thr = idtab_get(&thrtab, tid);
+    struct thread * const parent = thr->parent;
+    struct thread ** link;
+    struct thread * child;
 
-    assert (0 < tid && tid < NTHR && thr != NULL);
+    assert (0 < tid && thr != NULL);
     assert (thr->state == THREAD_EXITED);
 
+    // The thread may still be switching away on another hart.
+
+    while (__atomic_load_n(&thr->on_cpu, __ATOMIC_ACQUIRE))
+        continue;
+
+    // Remove the thread from its parent's children
+
+    link = &parent->children;
+
+    while (*link != thr)
+        link = &(*link)->sibling;
+    
+    *link = thr->sibling;
+
     // Make our parent the parent of our children
 
-    for (ctid = 1; ctid < NTHR; ctid++) {
-        if (thrtab[ctid] != NULL && thrtab[ctid]->parent == thr)
-            thrtab[ctid]->parent = thr->parent;
+    while ((child = thr->children) != NULL) {
+        thr->children = child->sibling;
+        child->parent = parent;
+        child->sibling = parent->children;
+        parent->children = child;
     }
 
-    thrtab[tid] = NULL;
-    kfree(thr);
+    idtab_free(&thrtab, tid);
+    free_thread(thr);
+}
+
+struct thread * alloc_thread(void) {
+    struct thread * thr;
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&free_threads_lock);
+    thr = free_threads;
+
+    if (thr != NULL)
+        free_threads = thr->sibling;
+
+    spin_release(&free_threads_lock);
+    intr_restore(saved_intr_state);
+
+    if (thr != NULL)
+        memset(thr, 0, sizeof(struct thread));
+    else
+        thr = kcalloc(1, sizeof(struct thread));
+
+    return thr;
+}
+
+void free_thread(struct thread * thr) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&free_threads_lock);
+    thr->sibling = free_threads;
+    free_threads = thr;
+    spin_release(&free_threads_lock);
+    intr_restore(saved_intr_state);
+}
+
+void wait_child_exit(void) {
+    struct condition * const cond = &CURTHR->child_exit;
+
+    spin_acquire(&cond->lock);
+    sched_wait(cond, &thrtab_lock);
+    spin_acquire(&thrtab_lock);
+}
+
+int start_user_thread (
+    const char * name, struct process * proc,
+    const struct trap_frame * tfr)
+{
+    struct thread_stack_anchor * stack_anchor;
+    struct trap_frame * child_tfr;
+    void * stack_page;
+    struct thread * child;
+    struct cpu * cpu;
+    uint64_t min_vruntime;
+    uint64_t vruntime;
+    int saved_intr_state;
+    int tid;
+
+    // Allocate a struct thread and a stack
+
+    child = alloc_thread();
+    stack_page = (child != NULL) ? memory_try_alloc_page() : NULL;
+
+    if (stack_page == NULL) {
+        if (child != NULL)
+            free_thread(child);
+        return -EAGAIN;
+    }
+
+    stack_anchor = stack_page + PAGE_SIZE;
+    stack_anchor -= 1;
+    stack_anchor->thread = child;
+    stack_anchor->reserved = 0;
+
+    child->name = name;
+    child->parent = CURTHR;
+    child->proc = proc;
+    child->stack_base = stack_anchor;
+    child->stack_size = child->stack_base - stack_page;
+    condition_init(&child->child_exit, "child_exit");
+
+    // Place the trap frame just below the stack anchor. The child starts in
+    // _thread_finish_fork, which returns to user mode using it.
+
+    child_tfr = (struct trap_frame *)stack_anchor - 1;
+    memcpy(child_tfr, tfr, sizeof(struct trap_frame));
+
+    _thread_setup(child, child_tfr,
+        (void (*)(void *))&_thread_finish_fork, child_tfr);
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&thrtab_lock);
+    tid = add_thread(child);
+    spin_release(&thrtab_lock);
+
+    if (tid < 0) {
+        intr_restore(saved_intr_state);
+        memory_free_page(stack_page);
+        free_thread(child);
+        return tid;
+    }
+
+    // The child continues with the parent's virtual runtime, so forking does
+    // not give a process more than its share of the CPU.
+
+    spin_acquire(&THIS_CPU->lock);
+    update_curr(timer_get_mtime());
+    vruntime = CURTHR->vruntime;
+    min_vruntime = THIS_CPU->min_vruntime;
+    spin_release(&THIS_CPU->lock);
+
+    cpu = select_cpu();
+
+    spin_acquire(&cpu->lock);
+    child->cpu = cpu;
+    child->vruntime = migrate_vruntime(vruntime, min_vruntime, cpu);
+    set_thread_state(child, THREAD_READY);
+    enqueue_thread(cpu, child);
+    spin_release(&cpu->lock);
+
+    intr_restore(saved_intr_state);
+
+    return tid;
+}
+
+int add_thread(struct thread * thr) {
+    int tid;
+
+    tid = idtab_alloc(&thrtab, thr);
+
+    if (tid < 0)
+        return tid;
+
+    thr->id = tid;
+    thr->sibling = thr->parent->children;
+    thr->parent->children = thr;
+    return tid;
 }
 
 void suspend_self(void) {
+    struct cpu * const cpu = THIS_CPU;
     struct thread * susp_thread; // suspending thread
     struct thread * next_thread; // resuming thread
     struct thread * prev_thread; // previously thread
-    int saved_intr_state;
+    uint64_t now;
 
     trace("%s() in %s", __func__, CURTHR->name);
 
-    // The idle thread is always runnable, and the idle thread only calls
-    // suspend_self() if the ready_list is not empty.
-
-    assert (!tlempty(&ready_list));
+    assert (intr_disabled());
 
     susp_thread = CURTHR;
 
-    // Get a READY thread from the ready list and mark it running
+    // The idle thread is always runnable, so the ready list can only be empty
+    // if the idle thread itself is yielding. Nothing to switch to then.
 
-    saved_intr_state = intr_disable();
+    if (tlempty(&cpu->ready_list)) {
+        assert (susp_thread == cpu->idle);
+        susp_thread->need_resched = 0;
+        return;
+    }
+
+    // Charge the suspending thread for its time on the CPU; this also serves
+    // any pending preemption request.
+
+    now = timer_get_mtime();
+    update_curr(now);
+    susp_thread->need_resched = 0;
+    susp_thread->last_ran = now;
+
+    // If the suspending thread is blocking or exiting and only the idle thread
+    // is left to run here, try to pull work over from a busier hart first.
+
+    if (cpu->nr_ready == 0 && susp_thread != cpu->idle &&
+        susp_thread->state != THREAD_RUNNING)
+    {
+        steal_work(cpu, now);
+    }
 
-    next_thread = tlremove(&ready_list);
+    // Get a READY thread from the ready list and mark it running
+
+    next_thread = rq_dequeue(cpu);
     // console_printf("switching to: %s, from: %s\n", next_thread->name, susp_thread->name);
 
     assert(next_thread->state == THREAD_READY);
     set_thread_state(next_thread, THREAD_RUNNING);
     
     // If the current thread is still running, mark it ready-to-run and put it
-    // in the back of the ready-to-run list.
+    // back on the ready-to-run list. Other harts cannot pick it up before we
+    // are done switching away from it, since we hold our run queue lock.
 
     if (susp_thread->state == THREAD_RUNNING) {
         set_thread_state(susp_thread, THREAD_READY);
-        tlinsert(&ready_list, susp_thread);
+        rq_enqueue(cpu, susp_thread);
+        susp_thread->nivcsw += 1;
+
+        if (susp_thread->proc != NULL)
+            __atomic_fetch_add(&susp_thread->proc->nivcsw, 1,
+                __ATOMIC_RELAXED);
+    } else {
+        susp_thread->nvcsw += 1;
+
+        if (susp_thread->proc != NULL)
+            __atomic_fetch_add(&susp_thread->proc->nvcsw, 1,
+                __ATOMIC_RELAXED);
     }
 
-    intr_enable();
+    next_thread->exec_start = now;
+    next_thread->slice_start = next_thread->sum_runtime;
+    next_thread->cpu = cpu;
+    next_thread->on_cpu = 1;
+    cpu->curr = next_thread;
+
+    // Interrupts stay disabled across the switch, so a timer interrupt cannot
+    // preempt us halfway through it. The resumed thread restores its own
+    // interrupt state (new threads enable interrupts in _thread_setup glue).
+
+    // Threads without a process (the idle thread, ioring workers between
+    // requests) run in the main memory space, so that no hart keeps the root
+    // page table of an exited process loaded after it is freed.
 
     if (next_thread->proc != NULL)
         memory_space_switch(next_thread->proc->mtag);
+    else if (active_memory_space() != main_mtag)
+        memory_space_switch(main_mtag);
 
     trace("Thread <%s> calling _thread_swtch(<%s>)",
         CURTHR->name, next_thread->name);
+    ktrace(KTRACE_SWITCH, next_thread->id, susp_thread->state);
     
     prev_thread = _thread_swtch(next_thread);
 
     trace("_thread_swtch() returned in %s", CURTHR->name);
 
-    if (prev_thread->state == THREAD_EXITED) {
-        memory_free_page(prev_thread->stack_base - PAGE_SIZE);
-        prev_thread->stack_base = NULL;
-        prev_thread->stack_size = 0;
+    finish_switch(prev_thread);
+}
+
+void finish_switch(struct thread * prev) {
+    if (prev->state == THREAD_EXITED) {
+        memory_free_page(prev->stack_base - PAGE_SIZE);
+        prev->stack_base = NULL;
+        prev->stack_size = 0;
+
+        if (prev->scratch != NULL) {
+            memory_free_page(prev->scratch);
+            prev->scratch = NULL;
+        }
     }
 
-    intr_restore(saved_intr_state);
+    // The context of prev is saved and we are off its stack. Other harts may
+    // now run it, or free it if it exited.
+
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+}
+
+void thread_startup(struct thread * prev) {
+    finish_switch(prev);
+    spin_release(&THIS_CPU->lock);
+}
+
+void sched_wait(struct condition * cond, struct spinlock * lk) {
+    assert(CURTHR->state == THREAD_RUNNING);
+
+    // Insert current thread into condition wait list
+    
+    set_thread_state(CURTHR, THREAD_WAITING);
+    CURTHR->wait_cond = cond;
+    tlinsert(&cond->wait_list, CURTHR);
+    ktrace(KTRACE_COND_WAIT, (uintptr_t)cond, 0);
+
+    if (lk != NULL)
+        spin_release(lk);
+
+    // A thread that finds us on the wait list must take our run queue lock to
+    // wake us, so it cannot do so before we have switched away.
+
+    spin_acquire(&THIS_CPU->lock);
+    spin_release(&cond->lock);
+    suspend_self();
+    spin_release(&THIS_CPU->lock); // we may be on another hart now
+}
+
+// Called from the timer ISR with the timer lock held. tw stays valid while we
+// run: condition_wait_until calls alarm_cancel, which needs the timer lock,
+// before it returns.
+
+void wait_timeout(struct alarm * al) {
+    struct timed_wait * const tw = (struct timed_wait *)al;
+    struct condition * const cond = tw->cond;
+    struct thread * const thr = tw->thr;
+
+    spin_acquire(&cond->lock);
+
+    if (tw->state == TIMED_WAIT_ARMED)
+        tw->state = TIMED_WAIT_EXPIRED;
+    else if (thr->wait_cond == cond) {
+        debug("Wait of <%s:%d> on <%s> timed out",
+            thr->name, thr->id, cond->name);
+        tlunlink(&cond->wait_list, thr);
+        thr->wait_cond = NULL;
+        tw->state = TIMED_WAIT_EXPIRED;
+        wake_thread(thr);
+    }
+
+    spin_release(&cond->lock);
+}
+
+void broadcast_locked(struct condition * cond) {
+    struct thread * thr;
+    struct thread * next;
+
+    // Mark all waiting threads runnable. This is *not* a constant-time
+    // operation, however, keeping having an enum thread_state member of struct
+    // thread for keeping track of thread state is useful for debugging.
+
+    thr = cond->wait_list.head;
+    tlclear(&cond->wait_list);
+
+    while (thr != NULL) {
+        next = thr->list_next;
+        assert (thr->state == THREAD_WAITING);
+        assert (thr->wait_cond == cond);
+        thr->wait_cond = NULL;
+        wake_thread(thr);
+        thr = next;
+    }
 }
 
 void tlclear(struct thread_list * list) {
@@ -685,37 +1498,330 @@ struct thread * tlremove(struct thread_list * list) {
     return thr;
 }
 
-// Appends elements of l1 to the end of l0 and clears l1.
+void tlunlink(struct thread_list * list, struct thread * thr) {
+    struct thread * prev = NULL;
+    struct thread * cur;
+
+    for (cur = list->head; cur != thr; cur = cur->list_next) {
+        assert (cur != NULL);
+        prev = cur;
+    }
+
+    if (prev != NULL)
+        prev->list_next = thr->list_next;
+    else
+        list->head = thr->list_next;
+    
+    if (list->tail == thr)
+        list->tail = prev;
+    
+    thr->list_next = NULL;
+}
+
+void rq_enqueue(struct cpu * cpu, struct thread * thr) {
+    struct thread * prev;
+    struct thread * next;
+
+    if (thr == cpu->idle) {
+        tlinsert(&cpu->ready_list, thr);
+        return;
+    }
+
+    // Insert after the last thread whose virtual runtime is no greater than
+    // thr's, so threads with equal virtual runtime run in FIFO order. The list
+    // is usually short, so a linear scan is fine.
+
+    prev = NULL;
+    next = cpu->ready_list.head;
+
+    while (next != NULL && next != cpu->idle &&
+        next->vruntime <= thr->vruntime)
+    {
+        prev = next;
+        next = next->list_next;
+    }
+
+    thr->list_next = next;
+
+    if (prev != NULL)
+        prev->list_next = thr;
+    else
+        cpu->ready_list.head = thr;
+    
+    if (next == NULL)
+        cpu->ready_list.tail = thr;
+
+    cpu->nr_ready += 1;
+}
+
+// Removes /thr/ from the middle of a hart's ready list. /prev/ is the thread
+// preceding it in the list, or NULL if /thr/ is at the head.
+
+void rq_remove(struct cpu * cpu, struct thread * thr, struct thread * prev) {
+    if (prev != NULL)
+        prev->list_next = thr->list_next;
+    else
+        cpu->ready_list.head = thr->list_next;
+    
+    if (cpu->ready_list.tail == thr)
+        cpu->ready_list.tail = prev;
+    
+    thr->list_next = NULL;
+
+    if (thr != cpu->idle)
+        cpu->nr_ready -= 1;
+}
+
+struct thread * rq_dequeue(struct cpu * cpu) {
+    struct thread * thr;
+
+    thr = tlremove(&cpu->ready_list);
+
+    if (thr != NULL && thr != cpu->idle)
+        cpu->nr_ready -= 1;
+    
+    return thr;
+}
+
+void update_curr(uint64_t now) {
+    struct thread * const thr = CURTHR;
+    uint64_t delta;
+
+    // mtime is reset by timer_init, so it may go backwards once at boot.
+
+    if (now < thr->exec_start) {
+        thr->exec_start = now;
+        return;
+    }
+
+    delta = now - thr->exec_start;
+    thr->exec_start = now;
+    thr->sum_runtime += delta;
+
+    // Other threads of the process may be charging it on other harts.
+
+    if (thr->proc != NULL)
+        __atomic_fetch_add(&thr->proc->cpu_time, delta, __ATOMIC_RELAXED);
+
+    // The idle thread does not compete for the CPU, so its virtual runtime
+    // does not matter.
+
+    if (thr != THIS_CPU->idle)
+        thr->vruntime += delta;
+    
+    update_min_vruntime(THIS_CPU);
+}
+
+void update_min_vruntime(struct cpu * cpu) {
+    const struct thread * const curr = cpu->curr;
+    const struct thread * const head = cpu->ready_list.head;
+    uint64_t vruntime = UINT64_MAX;
+
+    if (curr != cpu->idle && curr->state == THREAD_RUNNING)
+        vruntime = curr->vruntime;
+    
+    if (head != NULL && head != cpu->idle && head->vruntime < vruntime)
+        vruntime = head->vruntime;
+    
+    if (vruntime != UINT64_MAX && cpu->min_vruntime < vruntime)
+        cpu->min_vruntime = vruntime;
+}
+
+// New threads start at min_vruntime so they cannot monopolize the CPU. Waking
+// threads get credit for at most half a scheduling period of sleep, which lets
+// I/O-bound threads run ahead of CPU-bound ones without starving them.
 
-void tlappend(struct thread_list * l0, struct thread_list * l1) {
-    if (l0->head != NULL) {
-        assert(l0->tail != NULL);
+void place_thread(struct cpu * cpu, struct thread * thr, int wakeup) {
+    uint64_t vruntime = cpu->min_vruntime;
+
+    if (wakeup) {
+        if (SCHED_LATENCY / 2 < vruntime)
+            vruntime -= SCHED_LATENCY / 2;
+        else
+            vruntime = 0;
+    }
+
+    if (thr->vruntime < vruntime)
+        thr->vruntime = vruntime;
+}
+
+// Virtual runtimes are only comparable within a run queue. A thread moving to
+// another hart keeps its lag (or lead) relative to min_vruntime.
+
+uint64_t migrate_vruntime (
+    uint64_t vruntime, uint64_t from_min, const struct cpu * to)
+{
+    int64_t lag;
+
+    lag = (int64_t)(vruntime - from_min);
+
+    if (lag < 0 && to->min_vruntime < (uint64_t)-lag)
+        return 0;
+    
+    return to->min_vruntime + lag;
+}
+
+void enqueue_thread(struct cpu * cpu, struct thread * thr) {
+    struct thread * const curr = cpu->curr;
+
+    rq_enqueue(cpu, thr);
+
+    // A remote hart restarts its tick when it takes the IPI (see intr.c).
+
+    if (cpu->tick_stopped) {
+        cpu->tick_stopped = 0;
+
+        if (cpu == THIS_CPU)
+            timer_restart_tick();
+        else
+            smp_send_ipi(cpu->hartid);
+    }
+
+    if (curr->need_resched)
+        return;
+
+    if (curr == cpu->idle ||
+        thr->vruntime + SCHED_MIN_GRANULARITY < curr->vruntime)
+    {
+        curr->need_resched = 1;
+
+        if (cpu != THIS_CPU)
+            smp_send_ipi(cpu->hartid);
+    }
+}
+
+void wake_thread(struct thread * thr) {
+    struct cpu * const cpu = thr->cpu;
+
+    spin_acquire(&cpu->lock);
+    set_thread_state(thr, THREAD_READY);
+    place_thread(cpu, thr, 1);
+    enqueue_thread(cpu, thr);
+    spin_release(&cpu->lock);
+}
+
+// Picks the online hart with the fewest runnable threads, preferring the
+// current hart on a tie.
+
+struct cpu * select_cpu(void) {
+    struct cpu * best = THIS_CPU;
+    int best_load;
+    int load;
+    int i;
+
+    best_load = best->nr_ready + (best->curr != best->idle);
+
+    for (i = 0; i < NCPU; i++) {
+        if (!cputab[i].online)
+            continue;
         
-        if (l1->head != NULL) {
-            assert(l1->tail != NULL);
-            l0->tail->list_next = l1->head;
-            l0->tail = l1->tail;
+        load = cputab[i].nr_ready + (cputab[i].curr != cputab[i].idle);
+
+        if (load < best_load) {
+            best = &cputab[i];
+            best_load = load;
         }
-    } else {
-        assert(l0->tail == NULL);
-        l0->head = l1->head;
-        l0->tail = l1->tail;
     }
 
-    l1->head = NULL;
-    l1->tail = NULL;
+    return best;
+}
+
+// Steals a ready thread for /cpu/ from the online hart with the most runnable
+// threads, provided it has at least one thread waiting behind the one it is
+// running. Threads are taken from the tail of the victim's ready list: they
+// have the largest virtual runtime, so they would wait longest there. Threads
+// that ran within the last SCHED_MIGRATION_COST are cache-hot on their hart
+// and are left alone. Returns 1 if a thread was moved to /cpu/'s run queue and
+// 0 otherwise. Must be called with interrupts disabled and the run queue lock
+// of /cpu/ held. The lock of the victim's run queue is only taken if it is free,
+// since we may not wait for a second run queue lock.
+
+int steal_work(struct cpu * cpu, uint64_t now) {
+    struct cpu * busiest = NULL;
+    struct thread * victim = NULL;
+    struct thread * victim_prev = NULL;
+    struct thread * prev;
+    struct thread * thr;
+    int busiest_load = 1;
+    int load;
+    int i;
+
+    for (i = 0; i < NCPU; i++) {
+        if (&cputab[i] == cpu || !cputab[i].online)
+            continue;
+        
+        load = cputab[i].nr_ready + (cputab[i].curr != cputab[i].idle);
+
+        if (busiest_load < load) {
+            busiest = &cputab[i];
+            busiest_load = load;
+        }
+    }
+
+    if (busiest == NULL || !spin_tryacquire(&busiest->lock))
+        return 0;
+    
+    // Check again now that the victim's run queue cannot change.
+
+    if (busiest->nr_ready + (busiest->curr != busiest->idle) < 2) {
+        spin_release(&busiest->lock);
+        return 0;
+    }
+
+    // Find the last thread on the list that is not cache-hot. A thread that
+    // has never run (last_ran is 0) has nothing in any cache.
+
+    prev = NULL;
+
+    for (thr = busiest->ready_list.head; thr != NULL; thr = thr->list_next) {
+        if (thr != busiest->idle &&
+            (thr->last_ran == 0 || SCHED_MIGRATION_COST <= now - thr->last_ran))
+        {
+            victim = thr;
+            victim_prev = prev;
+        }
+
+        prev = thr;
+    }
+
+    if (victim == NULL) {
+        spin_release(&busiest->lock);
+        cpu->nr_steals_hot += 1;
+        return 0;
+    }
+    
+    rq_remove(busiest, victim, victim_prev);
+    victim->vruntime =
+        migrate_vruntime(victim->vruntime, busiest->min_vruntime, cpu);
+    victim->cpu = cpu;
+    spin_release(&busiest->lock);
+
+    rq_enqueue(cpu, victim);
+
+    victim->nr_migrations += 1;
+    cpu->nr_steals += 1;
+
+    debug("Hart %d stole <%s:%d> from hart %d",
+        cpu->hartid, victim->name, victim->id, busiest->hartid);
+
+    return 1;
 }
 
 void idle_thread_func(void * arg __attribute__ ((unused))) {
+    struct cpu * const cpu = THIS_CPU; // idle threads never migrate
+
     // The idle thread sleeps using wfi if the ready list is empty. Note that we
     // need to disable interrupts before checking if the thread list is empty to
     // avoid a race condition where an ISR marks a thread ready to run between
-    // the call to tlempty() and the wfi instruction.
+    // the call to tlempty() and the wfi instruction. Threads made ready by
+    // other harts are announced with an IPI, which also wakes us from wfi.
+    // Before sleeping, the idle thread tries to steal work from other harts.
+    // A hart that found only cache-hot threads retries on its next tick.
 
     for (;;) {
         // If there are runnable threads, yield to them.
 
-        while (!tlempty(&ready_list))
+        while (!tlempty(&cpu->ready_list))
             thread_yield();
         
         // No runnable threads. Sleep using the wfi instruction. Note that we
@@ -724,7 +1830,14 @@ void idle_thread_func(void * arg __attribute__ ((unused))) {
         // ISR marks a thread ready before we call the wfi instruction.
 
         intr_disable();
-        if (tlempty(&ready_list))
+        spin_acquire(&cpu->lock);
+
+        if (tlempty(&cpu->ready_list))
+            steal_work(cpu, timer_get_mtime());
+        
+        spin_release(&cpu->lock);
+
+        if (tlempty(&cpu->ready_list))
             asm ("wfi");
         intr_enable();
     }
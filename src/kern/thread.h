@@ -5,6 +5,7 @@
 #define _THREAD_H_
 
 #include "trap.h"
+#include "spinlock.h"
 #include <stddef.h>
 
 struct process; // forward decl. 
@@ -24,6 +25,7 @@ struct thread_list {
 struct condition {
     const char * name;
 	struct thread_list wait_list;
+    struct spinlock lock; // protects wait_list
 };
 
 // EXPORTED GLOBAL VARIABLES
@@ -39,19 +41,42 @@ extern struct thread * cur_thread(void);
 extern void * cur_stack_base(void);
 
 // This function allocates new memory for the child process and sets up another thread struct.
+// The child thread returns to user mode with a copy of /parent_tfr/ when it is first scheduled.
 extern int thread_fork_to_user(struct process *child_proc, const struct trap_frame *parent_tfr);
 
-// This function begins be saving the currently running thread. Switches to the new child process thread and
-// back to the U mode interrupt handler
-extern void _thread_finish_fork(struct thread *child, const struct trap_frame *parent_tfr);
+// int thread_create_user(const struct trap_frame * tfr)
+// Creates another thread in the process of the current thread, sharing its
+// memory space and open files. The new thread is a child of the current thread
+// and enters user mode with a copy of /tfr/. Returns its thread id.
+
+extern int thread_create_user(const struct trap_frame * tfr);
 
 extern void thread_init(void);
 
+// void * thread_create_idle(int hartid)
+// Creates the idle thread of a secondary hart. Returns the stack anchor of the
+// idle thread's stack, on which the hart should start executing (see start.s).
+// Called by the boot hart before starting the secondary hart.
+
+extern void * thread_create_idle(int hartid);
+
+// void thread_start_hart(void)
+// Starts scheduling threads on a secondary hart. Must be called on the hart
+// being started, running as its idle thread (see thread_create_idle). Does not
+// return: the calling context becomes the idle loop of the hart.
+
+extern void thread_start_hart(void) __attribute__ ((noreturn));
+
 // int running_thread(void)
 // Returns the thread id of the currently running thread.
 
 int running_thread(void);
 
+// int running_hart(void)
+// Returns the hart ID of the hart we are running on.
+
+extern int running_hart(void);
+
 // int thread_spawn(const char * name, void (*start)(void *), void * arg)
 // Creates and starts a new thread. Argument /name/ is the name of the thread
 // (optional, may be NULL), /start/ is the thread entry point, and /arg/ is an
@@ -68,6 +93,26 @@ extern int thread_spawn(const char * name, void (*start)(void *), void * arg);
 
 extern void thread_yield(void);
 
+// uint64_t thread_tick(void)
+// Charges the CPU time used since the last call (or since the thread was
+// scheduled) to the running thread and decides whether it should be preempted.
+// Threads are scheduled in order of virtual runtime; a thread is preempted once
+// it has run for its share of the scheduling period (but at least the minimum
+// granularity) and another thread is waiting. Returns the time (in mtime
+// ticks) at which the scheduler next needs to be ticked on this hart, or
+// UINT64_MAX if only one thread is runnable on it and the tick may be stopped.
+// If a thread is later made ready on a hart whose tick is stopped, the
+// scheduler restarts it with timer_restart_tick. Called from timer_intr_handler
+// with interrupts disabled.
+
+extern uint64_t thread_tick(void);
+
+// int thread_preempt_pending(void)
+// Returns non-zero if the running thread should yield the CPU at the next
+// opportunity (see thread_tick).
+
+extern int thread_preempt_pending(void);
+
 // int thread_join_any(void) int thread_join(int tid) Waits for a child thread
 // of the current thread to exit. The thread_join_any function waits for any of
 // the current thread's children to exit, while thread_join waits for a specific
@@ -95,14 +140,31 @@ extern struct process * thread_process(int tid);
 
 extern void thread_set_process(int tid, struct process * proc);
 
+// void * thread_scratch_page(void)
+// Returns a page the running thread may use as scratch space, e.g. to bounce
+// data between a driver and user memory, or NULL if no page is free. The page
+// is allocated on first use and kept, without being cleared, until the thread
+// exits.
+
+extern void * thread_scratch_page(void);
+
 // Returns the name of a thread.
 
 extern const char * thread_name(int tid);
 
+// int thread_running(int tid)
+// Returns non-zero if thread /tid/ exists and is running on some hart. The
+// answer may be out of date by the time the caller looks at it, so it is only
+// a hint (see lock_acquire).
+
+extern int thread_running(int tid);
+
 // void condition_init(struct condition * cond, const char * name)
 // Initializes a condition variable. Argument /cond/ is a pointer to a struct
 // condition to initialize. Argument /name/ is the name of the thread, which may
-// be NULL. It is valid initialize a struct condition with all zeroes.
+// be NULL. It is valid initialize a struct condition with all zeroes, though
+// the lock protecting its wait list is then not checked against the lock order
+// (see spinlock.h).
 
 extern void condition_init(struct condition * cond, const char * name);
 
@@ -117,14 +179,48 @@ extern void condition_init(struct condition * cond, const char * name);
 
 extern void condition_wait(struct condition * cond);
 
+// void condition_wait_locked(struct condition * cond, struct spinlock * lk)
+// Like condition_wait, but for conditions signalled from code that runs on
+// other harts. The caller must have interrupts disabled and hold spinlock /lk/,
+// which protects the state the caller is waiting on. The lock is released once
+// the thread is on the wait list, and reacquired before condition_wait_locked
+// returns. The thread signalling the condition must hold /lk/ while changing
+// the state and calling condition_broadcast. Disabling interrupts alone is not
+// enough on a multiprocessor.
+
+extern void condition_wait_locked(struct condition * cond, struct spinlock * lk);
+
+// int condition_wait_until (
+//     struct condition * cond, struct spinlock * lk, uint64_t twake)
+// Like condition_wait_locked, but gives up waiting at time /twake/ (in timer
+// ticks, see timer_get_mtime). Returns 0 if the thread was woken by
+// condition_broadcast or condition_signal, and -ETIMEDOUT if /twake/ passed
+// first, in which case the thread was not on the wait list when the condition
+// was signalled. /lk/ may not be of a higher rank than SPINLOCK_ORDER_OUTER.
+
+extern int condition_wait_until (
+    struct condition * cond, struct spinlock * lk, uint64_t twake);
+
 // void condition_broadcast(struct condition * cond)
 
 // Wakes up all threads waiting on a condition. This function may be called from
 // an ISR. Calling condition_broadcast() does not cause a context switch from
-// the currently running thread.
-// Waiting threads are added to the ready-to-run list in the order they were
-// added to the wait queue.
+// the currently running thread, but may request that it (or the thread running
+// on the hart a woken thread last ran on) be preempted (see
+// thread_preempt_pending) if a woken thread should run first.
+// Waiting threads are added to the ready-to-run list of the hart they last ran
+// on in order of virtual runtime; threads with equal virtual runtime keep the
+// order in which they were added to the wait queue.
 
 extern void condition_broadcast(struct condition * cond);
 
+// int condition_signal(struct condition * cond)
+// Wakes up the thread that has been waiting longest on a condition, if any, and
+// returns its thread id, or -1 if no thread was waiting. Like
+// condition_broadcast, it may be called from an ISR. Useful when only one
+// waiter can make progress, e.g. to hand a lock to the next waiter without
+// waking all of them.
+
+extern int condition_signal(struct condition * cond);
+
 #endif // _THREAD_H_
@@ -6,6 +6,10 @@
 #include "csr.h"
 #include "intr.h"
 #include "halt.h" // for assert
+#include "smp.h"
+#include "spinlock.h"
+#include "prof.h"
+#include "ktrace.h"
 
 #include "config.h"
 #include <limits.h>
@@ -19,6 +23,22 @@
 
 #define TICK_PERIOD (TIMER_FREQ/TICK_FREQ)
 
+// The scheduler tick is not periodic: after each tick, the next one is set for
+// the scheduler's next preemption deadline (see thread_tick), but no sooner
+// than TICK_PERIOD later. While a hart runs a single thread or is idle, its
+// tick is stopped and the timer only interrupts it for alarms.
+
+// Sleeping alarms are kept in a hierarchical timing wheel of WHEEL_LEVELS
+// levels of WHEEL_SIZE slots each. A slot of level 0 spans one granule of
+// 2^WHEEL_GRAN_SHIFT timer ticks (102.4 us at 10 MHz), and a slot of level l
+// spans WHEEL_SIZE^l granules. With six levels, the wheel covers about 81 days;
+// alarms further out are parked in the last slot and re-filed when it comes up.
+
+#define WHEEL_GRAN_SHIFT 10
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 6
+
 
 
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
@@ -26,11 +46,44 @@
 
 char timer_initialized = 0;
 
+// timer_sstc[h] is set by start.s if hart h implements the Sstc extension.
+// Such a hart has its own S-mode timer compare register, stimecmp, which
+// raises a supervisor timer interrupt directly. Otherwise, we fall back to the
+// CLINT mtimecmp register and the M-mode relay (see enable_mmode_timer_intr).
+
+char timer_sstc[NCPU];
+
 // INTERNVAL GLOBAL VARIABLE DEFINITIONS
 //
 
-static struct alarm * sleep_list;
-static uint64_t next_tick;
+// The timing wheel is shared by all harts and protected by timer_lock. Each
+// hart has its own timer compare register and tick schedule, which only the
+// hart itself accesses, with interrupts disabled. next_tick[h] is UINT64_MAX
+// while hart h's tick is stopped.
+//
+// An alarm due in granule E is filed in the lowest level l whose slots reach
+// E from the current granule clk, that is, with E - clk < WHEEL_SIZE^(l+1), in
+// slot (E >> l*WHEEL_BITS) % WHEEL_SIZE. When clk advances past the start of a
+// slot, the alarms in it are either woken, if due, or re-filed in a lower
+// level. Alarms are always filed at E > clk, so the slots of level 0 hold
+// alarms due in distinct granules. pending has a bit set for each non-empty
+// slot, so that finding the next slot to process takes a few bit operations.
+
+static struct spinlock timer_lock =
+    SPINLOCK_INITIALIZER("timer", SPINLOCK_ORDER_TIMER);
+
+static struct {
+    uint64_t clk; // granule up to which slots have been processed
+    uint64_t pending[WHEEL_LEVELS]; // bit set if slot non-empty
+    struct alarm * slot[WHEEL_LEVELS][WHEEL_SIZE];
+} wheel;
+
+static uint64_t next_tick[NCPU];
+
+// next_sample[h] is when hart h takes its next profiling sample (see prof.c),
+// or UINT64_MAX while the profiler is off.
+
+static uint64_t next_sample[NCPU];
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -42,11 +95,37 @@ static inline void set_mtime(uint64_t val);
 static inline uint64_t get_mtcmp(void);
 static inline void set_mtcmp(uint64_t val);
 
+// Timing wheel operations; must be called with timer_lock held. wheel_insert
+// files an alarm and wheel_remove unlinks it from its slot, both in O(1).
+// wheel_advance wakes alarms that are due at /now/ and re-files the others in
+// the slots that have come up since the last call. wheel_next_event returns
+// the earliest time at which wheel_advance has work to do, or UINT64_MAX if
+// no alarms are pending.
+
+static void wheel_insert(struct alarm * al);
+static void wheel_remove(struct alarm * al);
+static void wheel_advance(uint64_t now);
+static uint64_t wheel_next_event(void);
+
+// Files an alarm in the timing wheel and moves this hart's timer interrupt up
+// if the alarm is due before it. Must be called with timer_lock held.
+
+static void arm_locked(struct alarm * al);
+
+// Sets off an alarm that wheel_advance has taken out of the wheel.
+
+static inline void fire_alarm(struct alarm * al, uint64_t now);
+
+static inline uint64_t rotr64(uint64_t x, unsigned int n);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
 void timer_init(void) {
     set_mtime(0);
+    wheel.clk = 0;
+    next_tick[running_hart()] = TICK_PERIOD;
+    next_sample[running_hart()] = UINT64_MAX;
     set_mtcmp(TICK_PERIOD);
     csrs_sie(RISCV_SIE_STIE);
     enable_mmode_timer_intr();
@@ -54,14 +133,25 @@ void timer_init(void) {
     timer_initialized = 1;
 }
 
+void timer_hart_init(void) {
+    const int h = running_hart();
+
+    next_tick[h] = get_mtime() + TICK_PERIOD;
+    next_sample[h] = UINT64_MAX;
+    set_mtcmp(next_tick[h]);
+    csrs_sie(RISCV_SIE_STIE);
+    enable_mmode_timer_intr();
+}
+
 void alarm_init(struct alarm * al, const char * name) {
     condition_init(&al->cond, name ? name : "alarm");
     al->twake = get_mtime();
     al->next = NULL;
+    al->pprev = NULL;
+    al->func = NULL;
 }
 
 void alarm_sleep(struct alarm * al, uint64_t tcnt) {
-    struct alarm * prev;
     int saved_intr_state;
     uint64_t now;
 
@@ -79,56 +169,23 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
     if (al->twake < now)
         return;
     
-    saved_intr_state = intr_disable();
-
-    if (sleep_list == NULL || al->twake <= sleep_list->twake) {
-        debug("[%lu] Inserting alarm %s at head of list", now, al->cond.name);
-        // Insert alarm at head of sleep list
-        al->next = sleep_list;
-        sleep_list = al;
-        // If current alarm occurs before next tick, update mtcmp
-
-        if (al->twake < next_tick) {
-            set_mtcmp(al->twake);
-            csrs_sie(RISCV_SIE_STIE);
-            enable_mmode_timer_intr();
-        }
-
+    ktrace(KTRACE_ALARM_SLEEP, al->twake, 0);
 
-    } else {
-        // Insert current alarm in list in order of wake-up time. Ideally, we
-        // should not keep interrupts disabled while we iterate through the
-        // list. The right way would be to restore interrupt state, find the
-        // place on the list where we want to insert, the disable interrupts and
-        // re-check the insert point.
-
-        for (prev = sleep_list; prev->next != NULL; prev = prev->next) {
-            if (al->twake <= prev->next->twake) {
-                debug("[%lu] Inserting alarm %s after %s",
-                    now, al->cond.name, prev->cond.name);
-                al->next = prev->next;
-                prev->next = al;
-                break;
-            }
-        }
-
-        // End of list, insert at tail
-        if (prev->next == NULL) {
-            debug("%[lu] Inserting alarm %s at tail", al->cond.name);
-            al->next = NULL;
-            prev->next = al;
-        }
-    }
+    saved_intr_state = intr_disable();
+    spin_acquire(&timer_lock);
 
-    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
+    arm_locked(al);
 
-    // Note: condition_wait must be *inside* intr_disable/intr_restore block to
-    // prevent a race condition where an alarm is signalled before we call
-    // condition_wait.
+    // Note: the wait must happen while timer_lock is held to prevent a race
+    // condition where an alarm is signalled (possibly by another hart) before
+    // we start waiting. condition_wait_locked releases the lock atomically.
 
-    condition_wait(&al->cond);
+    condition_wait_locked(&al->cond, &timer_lock);
 
+    spin_release(&timer_lock);
     intr_restore(saved_intr_state);
+
+    ktrace(KTRACE_ALARM_WAKE, al->twake, 0);
 }
 
 // Resets the alarm so that the next sleep increment is relative to the time
@@ -140,46 +197,337 @@ void alarm_reset(struct alarm * al) {
 
 // timer_handle_interrupt() is dispatched from intr_handler in intr.c
 
+void alarm_arm(struct alarm * al, uint64_t twake) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&timer_lock);
+
+    if (al->pprev != NULL)
+        wheel_remove(al);
+    
+    al->twake = twake;
+    arm_locked(al);
+
+    spin_release(&timer_lock);
+    intr_restore(saved_intr_state);
+}
+
+int alarm_cancel(struct alarm * al) {
+    int saved_intr_state;
+    int pending;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&timer_lock);
+
+    pending = (al->pprev != NULL);
+
+    if (pending)
+        wheel_remove(al);
+
+    spin_release(&timer_lock);
+    intr_restore(saved_intr_state);
+
+    return pending;
+}
+
 void timer_intr_handler(struct trap_frame * tfr) {
-    struct alarm * head = sleep_list;
-    struct alarm * next;
+    const int h = running_hart();
+    uint64_t next_event;
+    uint64_t deadline;
+    uint64_t period;
     uint64_t now;
 
+    spin_acquire(&timer_lock);
+
     now = get_mtime();
 
     trace("[%lu] %s()", now, __func__);
     debug("[%lu] mtcmp = %lu", now, get_mtcmp());
 
-    while (head != NULL && head->twake <= now) {
-        debug("[%lu] Broadcasting alarm for %s", now, head->cond.name);
-        condition_broadcast(&head->cond);
-        next = head->next;
-        head->next = NULL;
-        head = next;
+    wheel_advance(now);
+    next_event = wheel_next_event();
+
+    spin_release(&timer_lock);
+
+    // Only tick the scheduler if its tick is due. Charge the interrupted thread
+    // for the CPU time it used since the last tick. The scheduler decides
+    // whether it should be preempted (the actual switch happens in
+    // intr_handler once we return) and when it needs the next tick. Threads
+    // woken above are already on a run queue, so they are accounted for.
+
+    if (next_tick[h] <= now) {
+        deadline = thread_tick();
+
+        if (deadline == UINT64_MAX)
+            next_tick[h] = UINT64_MAX;
+        else if (deadline < now + TICK_PERIOD)
+            next_tick[h] = now + TICK_PERIOD;
+        else
+            next_tick[h] = deadline;
     }
 
-    if (next_tick < now)
-        next_tick += TICK_PERIOD;
+    // Take a profiling sample if one is due. Samples are scheduled on their
+    // own period, so they do not keep the scheduler tick running.
 
-    sleep_list = head;
+    period = __atomic_load_n(&prof_period, __ATOMIC_RELAXED);
 
-    if (head != NULL && head->twake < next_tick)
-        set_mtcmp(head->twake);
-    else
-        set_mtcmp(next_tick);
+    if (period == 0)
+        next_sample[h] = UINT64_MAX;
+    else if (next_sample[h] <= now) {
+        prof_sample(tfr, now);
+        next_sample[h] = now + period;
+    }
+
+    if (next_sample[h] < next_event)
+        next_event = next_sample[h];
 
+    if (next_event < next_tick[h])
+        set_mtcmp(next_event);
+    else
+        set_mtcmp(next_tick[h]);
 
     debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
     enable_mmode_timer_intr();
+}
+
+void timer_restart_tick(void) {
+    const int h = running_hart();
+    uint64_t period;
+    uint64_t next;
+    uint64_t now;
+
+    assert (intr_disabled());
+
+    period = __atomic_load_n(&prof_period, __ATOMIC_RELAXED);
 
+    if (next_tick[h] != UINT64_MAX &&
+        (period == 0 || next_sample[h] != UINT64_MAX))
+    {
+        return;
+    }
+    
+    now = get_mtime();
+
+    if (next_tick[h] == UINT64_MAX) {
+        next_tick[h] = now + TICK_PERIOD;
+        debug("[%lu] Restarting tick on hart %d", now, h);
+    }
+
+    if (period != 0 && next_sample[h] == UINT64_MAX)
+        next_sample[h] = now + period;
+
+    next = (next_sample[h] < next_tick[h]) ? next_sample[h] : next_tick[h];
+
+    if (next < get_mtcmp()) {
+        set_mtcmp(next);
+        csrs_sie(RISCV_SIE_STIE);
+        enable_mmode_timer_intr();
+    }
 }
 
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void arm_locked(struct alarm * al) {
+    debug("[%lu] Filing alarm %s for %lu",
+        get_mtime(), al->cond.name, al->twake);
+    wheel_insert(al);
+
+    // If the alarm is due before this hart's next timer interrupt, move the
+    // interrupt up. Other harts may have stopped their ticks and only learn of
+    // the alarm at their next interrupt, so this hart's interrupt is what
+    // guarantees it is handled on time. Whichever hart first takes a timer
+    // interrupt after the alarm expires advances the wheel and broadcasts the
+    // alarm's condition, which queues the sleeper on its hart and sends that
+    // hart an IPI if its tick was stopped.
+
+    if (al->twake < get_mtcmp()) {
+        set_mtcmp(al->twake);
+        csrs_sie(RISCV_SIE_STIE);
+        enable_mmode_timer_intr();
+    }
+
+    debug("Next timer interrupt set for %lu ticks", get_mtcmp());
+}
+
+void wheel_insert(struct alarm * al) {
+    uint64_t expires;
+    uint64_t delta;
+    int lvl;
+    int idx;
+
+    expires = al->twake >> WHEEL_GRAN_SHIFT;
+
+    if (expires <= wheel.clk)
+        expires = wheel.clk + 1;
+    
+    delta = expires - wheel.clk;
+
+    for (lvl = 0; lvl < WHEEL_LEVELS-1; lvl++)
+        if (delta < 1UL << (WHEEL_BITS * (lvl+1)))
+            break;
+    
+    // Too far out for the last level: park it in the furthest slot.
+
+    if (1UL << (WHEEL_BITS * WHEEL_LEVELS) <= delta)
+        expires = wheel.clk + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    
+    idx = (expires >> (WHEEL_BITS * lvl)) % WHEEL_SIZE;
+
+    al->next = wheel.slot[lvl][idx];
+    if (al->next != NULL)
+        al->next->pprev = &al->next;
+    al->pprev = &wheel.slot[lvl][idx];
+    wheel.slot[lvl][idx] = al;
+    wheel.pending[lvl] |= 1UL << idx;
+}
+
+void wheel_remove(struct alarm * al) {
+    struct alarm ** const pprev = al->pprev;
+    int lvl;
+    int idx;
+
+    *pprev = al->next;
+    if (al->next != NULL)
+        al->next->pprev = pprev;
+    al->next = NULL;
+    al->pprev = NULL;
+
+    // If the slot became empty, clear its pending bit. pprev points into
+    // wheel.slot if al was first in its slot.
+
+    if (*pprev == NULL &&
+        (char*)wheel.slot <= (char*)pprev &&
+        (char*)pprev < (char*)wheel.slot + sizeof(wheel.slot))
+    {
+        lvl = (pprev - &wheel.slot[0][0]) / WHEEL_SIZE;
+        idx = (pprev - &wheel.slot[0][0]) % WHEEL_SIZE;
+        wheel.pending[lvl] &= ~(1UL << idx);
+    }
+}
+
+void wheel_advance(uint64_t now) {
+    const uint64_t old_clk = wheel.clk;
+    const uint64_t new_clk = now >> WHEEL_GRAN_SHIFT;
+    struct alarm * al;
+    uint64_t mask;
+    uint64_t pend;
+    uint64_t o, n;
+    int lvl;
+    int idx;
+
+    if (old_clk < new_clk) {
+        wheel.clk = new_clk;
+
+        // At each level, process the slots that came up in (old_clk,new_clk].
+        // Alarms that are not due yet are re-filed relative to the new clk,
+        // which puts them in a lower level, in a slot still to come.
+
+        for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+            o = old_clk >> (WHEEL_BITS * lvl);
+            n = new_clk >> (WHEEL_BITS * lvl);
+
+            if (o == n)
+                break; // higher levels unchanged as well
+            
+            if (WHEEL_SIZE <= n - o)
+                mask = UINT64_MAX;
+            else
+                mask = rotr64((1UL << (n - o)) - 1, -(o+1) % WHEEL_SIZE);
+
+            pend = wheel.pending[lvl] & mask;
+
+            while (pend != 0) {
+                idx = __builtin_ctzll(pend);
+                pend &= pend - 1;
+
+                while ((al = wheel.slot[lvl][idx]) != NULL) {
+                    wheel_remove(al);
+
+                    if (al->twake <= now)
+                        fire_alarm(al, now);
+                    else
+                        wheel_insert(al);
+                }
+            }
+        }
+    }
+
+    // Alarms due later in the current granule are filed in the next granule's
+    // slot. Wake those that are due now.
+
+    idx = (wheel.clk + 1) % WHEEL_SIZE;
+    al = wheel.slot[0][idx];
+
+    while (al != NULL) {
+        struct alarm * const next = al->next;
+
+        if (al->twake <= now) {
+            wheel_remove(al);
+            fire_alarm(al, now);
+        }
+
+        al = next;
+    }
+}
+
+uint64_t wheel_next_event(void) {
+    uint64_t next_event = UINT64_MAX;
+    const struct alarm * al;
+    uint64_t pend;
+    uint64_t cur;
+    uint64_t t;
+    int lvl;
+    int k;
+
+    // Level 0: alarms in the first non-empty slot are all due in the same
+    // granule, so find the earliest of them exactly.
+
+    cur = wheel.clk;
+    pend = rotr64(wheel.pending[0], (cur+1) % WHEEL_SIZE);
+
+    if (pend != 0) {
+        k = __builtin_ctzll(pend);
+        al = wheel.slot[0][(cur+1+k) % WHEEL_SIZE];
+
+        for (; al != NULL; al = al->next)
+            if (al->twake < next_event)
+                next_event = al->twake;
+    }
+
+    // Higher levels: nothing is due before the first non-empty slot comes
+    // up, which is when its alarms need to be woken or re-filed.
+
+    for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+        cur = wheel.clk >> (WHEEL_BITS * lvl);
+        pend = rotr64(wheel.pending[lvl], (cur+1) % WHEEL_SIZE);
+
+        if (pend == 0)
+            continue;
+        
+        k = __builtin_ctzll(pend);
+        t = (cur+1+k) << (WHEEL_BITS * lvl + WHEEL_GRAN_SHIFT);
+
+        if (t < next_event)
+            next_event = t;
+    }
+
+    return next_event;
+}
+
+// Re-arms the M-mode timer interrupt, which the M-mode handler disarms when it
+// forwards an interrupt to S mode. Not needed with Sstc, which saves an ecall
+// on every timer reprogramming.
+
 void enable_mmode_timer_intr(void) {
+    if (timer_sstc[running_hart()])
+        return;
+    
     // see _mmode_trap_handler in trapasm.s
     asm ("ecall" ::: "memory");
 }
 
-#define MTIME_ADDR 0x200BFF8
 #define MTCMP_ADDR 0x2004000
 
 static inline uint64_t get_mtime(void) {
@@ -190,10 +538,39 @@ static inline void set_mtime(uint64_t val) {
     *(volatile uint64_t*)MTIME_ADDR = val;
 }
 
+// Each hart has its own mtimecmp register in the CLINT, and its own stimecmp
+// if it implements Sstc. The interrupt follows stimecmp in that case, so we
+// leave mtimecmp alone.
+
 static inline uint64_t get_mtcmp(void) {
-    return *(volatile uint64_t*)MTCMP_ADDR;
+    const int h = running_hart();
+
+    if (timer_sstc[h])
+        return csrr_stimecmp();
+    else
+        return *((volatile uint64_t*)MTCMP_ADDR + h);
 }
 
 static inline void set_mtcmp(uint64_t val) {
-    *(volatile uint64_t*)MTCMP_ADDR = val;
+    const int h = running_hart();
+
+    if (timer_sstc[h])
+        csrw_stimecmp(val);
+    else
+        *((volatile uint64_t*)MTCMP_ADDR + h) = val;
+}
+
+static inline void fire_alarm(struct alarm * al, uint64_t now) {
+    if (al->func != NULL) {
+        debug("[%lu] Calling alarm function for %s", now, al->cond.name);
+        al->func(al);
+    } else {
+        debug("[%lu] Broadcasting alarm for %s", now, al->cond.name);
+        condition_broadcast(&al->cond);
+    }
+}
+
+static inline uint64_t rotr64(uint64_t x, unsigned int n) {
+    n %= 64;
+    return (n == 0) ? x : (x >> n) | (x << (64 - n));
 }
@@ -9,11 +9,19 @@
 #include "trap.h" // for struct trap_frame
 
 #define TIMER_FREQ 10000000UL // from QEMU include/hw/intc/riscv_aclint.h
+#define MTIME_ADDR 0x200BFF8
+
+// When an alarm goes off, its condition is broadcast, or, if /func/ is set, func
+// is called instead. func is called from the timer ISR with the timer lock held
+// (rank SPINLOCK_ORDER_TIMER), so it must not sleep or take locks of a lower
+// rank.
 
 struct alarm {
     struct condition cond;
-    struct alarm * next;
+    struct alarm * next; // next alarm in timing wheel slot
+    struct alarm ** pprev; // link to us in timing wheel, NULL if not filed
     uint64_t twake;
+    void (*func)(struct alarm * al); // called on expiry instead of broadcast
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -22,6 +30,11 @@ struct alarm {
 extern char timer_initialized;
 extern void timer_init(void);
 
+// Starts the tick timer on a secondary hart. Must be called on the hart being
+// initialized, after timer_init has run on the boot hart.
+
+extern void timer_hart_init(void);
+
 // Initializes an alarm. The /name/ argument is optional.
 
 extern void alarm_init(struct alarm * al, const char * name);
@@ -37,8 +50,28 @@ extern void alarm_sleep(struct alarm * al, uint64_t tcnt);
 
 extern void alarm_reset(struct alarm * al);
 
+// Sets the alarm to go off at time /twake/ (in timer ticks, see
+// timer_get_mtime) without waiting for it. alarm_cancel takes a pending alarm
+// back and returns 1, or returns 0 if the alarm is not pending (it already
+// went off or was never set). Once alarm_cancel returns, the alarm's func is
+// not running and will not run. Neither function sleeps.
+
+extern void alarm_arm(struct alarm * al, uint64_t twake);
+extern int alarm_cancel(struct alarm * al);
+
 extern void timer_intr_handler(struct trap_frame * tfr); // called from intr.c
 
+// Restarts the scheduler tick on the current hart if it was stopped (see
+// thread_tick), and starts taking profiling samples if the profiler was turned
+// on (see prof.h). Must be called with interrupts disabled.
+
+extern void timer_restart_tick(void);
+
+// Returns the current value of the machine timer (mtime), which counts at
+// TIMER_FREQ ticks per second.
+
+static inline uint64_t timer_get_mtime(void);
+
 static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec);
 static inline void alarm_sleep_ms(struct alarm * al, unsigned long ms);
 static inline void alarm_sleep_us(struct alarm * al, unsigned long us);
@@ -46,6 +79,10 @@ static inline void alarm_sleep_us(struct alarm * al, unsigned long us);
 // INLINE FUNCTION DEFINITIONS
 //
 
+static inline uint64_t timer_get_mtime(void) {
+    return *(volatile uint64_t*)MTIME_ADDR;
+}
+
 static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec) {
     alarm_sleep(al, sec * TIMER_FREQ);
 }
@@ -7,6 +7,8 @@
         #     uint64_t sepc;
         # };
 
+        .equ    SYSCALL_TABLE_SIZE, 64  # must match syscall.c
+
         .macro  save_gprs_except_t6_and_sp
         # Saves all general purpose registers except sp and t6 to trap frame to
         # which sp points. (Save original sp and t6 before using this macro.)
@@ -168,6 +170,9 @@ trap_smode_cont:
  * 3. Dispatch to `trap_umode_cont` for processing.
  * 4. Restore state and `stvec` for U-mode and return to the original context using `sret`.
  *
+ * System calls that do not need a full trap frame skip steps 1 and 3 and are
+ * dispatched directly (see umode_syscall_fast).
+ *
  * @param void   No parameters.
  * @return       None.
  */
@@ -187,10 +192,27 @@ _trap_entry_from_umode:
         mv      tp, sp
         ld      sp, 15*8(sp)
 
-        # Save t6 and original sp to trap frame, then save rest
+        # Allocate a trap frame and save t6 in it, so we can use t6 to check
+        # for a system call that can take the fast path (see below).
 
         addi    sp, sp, -34*8   # allocate space for trap frame
         sd      t6, 31*8(sp)    # save t6 (x31) in trap frame
+
+        csrr    t6, scause
+        addi    t6, t6, -8      # environment call from U mode
+        bnez    t6, umode_trap_full
+        li      t6, SYSCALL_TABLE_SIZE
+        bgeu    a7, t6, umode_trap_full
+        la      t6, syscall_slow_mask   # from syscall.c
+        ld      t6, 0(t6)
+        srl     t6, t6, a7
+        andi    t6, t6, 1
+        beqz    t6, umode_syscall_fast
+
+umode_trap_full:
+
+        # Save original sp to trap frame, then save rest
+
         csrr    t6, sscratch    # read sscratch into t6
         sd      t6, 2*8(sp)     #
 
@@ -232,6 +254,71 @@ _trap_entry_from_umode:
 
         sret
 
+# Fast system call path. The system call handlers are C functions, which
+# preserve the callee-saved registers (s0-s11) themselves, and the user-side
+# system call stubs are C functions too, so their callers expect the other
+# caller-saved registers (t0-t6, a1-a7) to be clobbered. We therefore only save
+# ra, gp, the user sp, sepc and sstatus in the trap frame, and call the handler
+# in syscall_table (syscall.c) directly with the arguments still in a0-a3 and a
+# null trap frame pointer in a4. On the way out, the caller-saved registers are
+# cleared so that no kernel values leak to U mode. System calls that need the
+# full trap frame are marked in syscall_slow_mask and take the path above.
+
+umode_syscall_fast:
+        sd      ra, 1*8(sp)
+        sd      gp, 3*8(sp)
+        csrr    t6, sscratch    # user sp
+        sd      t6, 2*8(sp)
+        csrr    t6, sepc
+        addi    t6, t6, 4       # return past ecall instruction
+        sd      t6, 33*8(sp)
+        csrr    t6, sstatus
+        sd      t6, 32*8(sp)
+
+        la      t6, _trap_entry_from_smode
+        csrw    stvec, t6
+
+        la      t6, syscall_table       # from syscall.c
+        slli    t5, a7, 3
+        add     t6, t6, t5
+        ld      t6, 0(t6)
+        li      a4, 0
+        jalr    t6
+
+        # Result is in a0. Restore sstatus (with interrupts disabled) before
+        # pointing stvec back at _trap_entry_from_umode.
+
+        restore_sstatus_and_sepc
+
+        la      t6, _trap_entry_from_umode
+        csrw    stvec, t6
+        ld      t6, 2*8(sp)
+        csrw    sscratch, t6
+
+        ld      ra, 1*8(sp)
+        ld      gp, 3*8(sp)
+
+        li      t0, 0
+        li      t1, 0
+        li      t2, 0
+        li      t3, 0
+        li      t4, 0
+        li      t5, 0
+        li      t6, 0
+        li      a1, 0
+        li      a2, 0
+        li      a3, 0
+        li      a4, 0
+        li      a5, 0
+        li      a6, 0
+        li      a7, 0
+
+        mv      sp, tp
+        ld      sp, 15*8(sp)
+        csrrw   sp, sscratch, sp
+
+        sret
+
         # Execution of trap entry continues here. Jump to handlers.
 
 trap_umode_cont:
@@ -261,53 +348,86 @@ trap_umode_cont:
 #   3. When a M mode timer interrupt occurs, we set STIP and clear MTIE. S mode
 #      then needs to re-arm timer interrupts using (2).
 #
+# Harts that implement the Sstc extension do have an S mode timer (stimecmp),
+# and on those, S mode does not use this relay at all (see timer.c).
+#
+# Similarly, S mode cannot send interrupts to other harts directly. It writes
+# the target hart's CLINT msip register, which raises an M mode software
+# interrupt on that hart. We clear msip and forward the interrupt to S mode by
+# setting SSIP.
+#
+# mscratch points to a per-hart save area (see start.s), where we save the
+# registers we use other than t0, which we swap with mscratch.
 
 _mmode_trap_entry:
-        # Stash t0 away in mscratch
+        # Swap t0 with mscratch and save t1 and t2
+
+        csrrw   t0, mscratch, t0
+        sd      t1, 0*8(t0)
+        sd      t2, 1*8(t0)
+
+        csrr    t1, mcause
+        bgez    t1, mmode_excp_handler
 
-        csrw    mscratch, t0
+        slli    t1, t1, 1       # clear msb
+        srli    t1, t1, 1       #
 
-        csrr    t0, mcause
-        bgez    t0, mmode_excp_handler
+        li      t2, 7           # machine timer interrupt
+        beq     t1, t2, mmode_timer_intr_handler
+        li      t2, 3           # machine software interrupt
+        beq     t1, t2, mmode_soft_intr_handler
 
-        # If it's not a timer interrupt, panic
+        # Anything else is unexpected
 
-        addi    t0, t0, -7      # subtract 7
-        slli    t0, t0, 1       # clear msb
-        bnez    t0, unexpected_mmode_trap
+        j       unexpected_mmode_trap
 
-mmode_intr_handler:
+mmode_timer_intr_handler:
 
         # Set STIP, clear MTIE
 
-        li      t0, 0x20        # STIP
-        csrs    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrc    mie, t0
+        li      t1, 0x20        # STIP
+        csrs    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrc    mie, t1
+        j       mmode_trap_done
+
+mmode_soft_intr_handler:
+
+        # Clear our msip register, set SSIP
+
+        csrr    t1, mhartid
+        slli    t1, t1, 2
+        li      t2, 0x2000000   # CLINT msip registers
+        add     t1, t1, t2
+        sw      zero, 0(t1)
+        li      t1, 0x2         # SSIP
+        csrs    mip, t1
         j       mmode_trap_done
 
 mmode_excp_handler:
         # We support one S mode to M mode environment call, which is to re-arm
         # the timer interrupt.
 
-        addi    t0, t0, -9
-        bnez    t0, unexpected_mmode_trap
+        addi    t1, t1, -9
+        bnez    t1, unexpected_mmode_trap
 
         # Clear STIP, set MTIE
 
-        li      t0, 0x20        # STIP
-        csrc    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrs    mie, t0
+        li      t1, 0x20        # STIP
+        csrc    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrs    mie, t1
 
         # Advance mepc past ecall instruction
 
-        csrr    t0, mepc
-        addi    t0, t0, 4
-        csrw    mepc, t0
+        csrr    t1, mepc
+        addi    t1, t1, 4
+        csrw    mepc, t1
        
 mmode_trap_done:
-        csrr    t0, mscratch
+        ld      t1, 0*8(t0)
+        ld      t2, 1*8(t0)
+        csrrw   t0, mscratch, t0
         mret
 
 
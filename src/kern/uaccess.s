@@ -0,0 +1,89 @@
+# uaccess.s - Fault-tolerant copies to and from user memory
+#
+# The routines below access user memory without validating it first. Each has
+# an entry in _uaccess_extable giving the range of its instructions and a fixup
+# address. If a load or store in that range faults, smode_excp_handler (excp.c)
+# resumes execution at the fixup, which returns -EFAULT to the caller. The
+# routines are leaf functions and keep ra intact, so the fixup can simply
+# return. Callers check that the user range lies within user space (see
+# copy_from_user and friends in memory.h); mapped pages there are all user
+# pages, so only unmapped pages and missing permissions can fault.
+
+        .equ    EFAULT, 13      # must match error.h
+
+        .text
+
+# long _copy_user(void * dst, const void * src, size_t n)
+# Copies /n/ bytes from /src/ to /dst/, a doubleword at a time if both are
+# aligned. Returns 0, or -EFAULT if an access faulted.
+
+        .global _copy_user
+        .type   _copy_user, @function
+_copy_user:
+        or      t0, a0, a1
+        andi    t0, t0, 7
+        li      t1, 8
+        bnez    t0, 2f          # copy bytes if not both aligned
+1:
+        bltu    a2, t1, 2f
+        ld      t2, 0(a1)
+        sd      t2, 0(a0)
+        addi    a0, a0, 8
+        addi    a1, a1, 8
+        addi    a2, a2, -8
+        j       1b
+2:
+        beqz    a2, 3f
+        lbu     t2, 0(a1)
+        sb      t2, 0(a0)
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        j       2b
+3:
+        li      a0, 0
+        ret
+_copy_user_end:
+
+# long _strncpy_user(char * dst, const char * src, size_t n)
+# Copies a null-terminated string of at most /n/ bytes, including the null byte,
+# from /src/ to /dst/. Returns the length of the string, /n/ if there is no null
+# byte among the first /n/ bytes, or -EFAULT if an access faulted.
+
+        .global _strncpy_user
+        .type   _strncpy_user, @function
+_strncpy_user:
+        mv      a3, a2
+1:
+        beqz    a2, 2f
+        lbu     t2, 0(a1)
+        sb      t2, 0(a0)
+        beqz    t2, 3f
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        j       1b
+2:
+        mv      a0, a3          # not terminated
+        ret
+3:
+        sub     a0, a3, a2
+        ret
+_strncpy_user_end:
+
+uaccess_fault:
+        li      a0, -EFAULT
+        ret
+
+# Each entry is the start and end of a guarded instruction range and the address
+# to resume at if an instruction in the range faults.
+
+        .section .rodata
+        .balign 8
+
+        .global _uaccess_extable
+        .global _uaccess_extable_end
+_uaccess_extable:
+        .dword  _copy_user, _copy_user_end, uaccess_fault
+        .dword  _strncpy_user, _strncpy_user_end, uaccess_fault
+_uaccess_extable_end:
@@ -12,6 +12,7 @@
 #include "halt.h"
 #include "intr.h"
 #include "limits.h"
+#include "spinlock.h"
 
 // COMPILE-TIME CONSTANT DEFINITIONS
 //
@@ -20,8 +21,19 @@
 #define UART0_IOBASE 0x10000000
 #endif
 
+// SERIAL_RBUFSZ is the default size of the receive and transmit ring buffers
+// of a serial port; uart_attach_bufsz sets it per device. Sizes are rounded up
+// to a power of two.
+
 #ifndef SERIAL_RBUFSZ
-#define SERIAL_RBUFSZ 64
+#define SERIAL_RBUFSZ 1024
+#endif
+
+// UART_FIFO_DEPTH is the size of the receive and transmit FIFOs. When THRE is
+// set, the transmit FIFO is empty and this many bytes may be written at once.
+
+#ifndef UART_FIFO_DEPTH
+#define UART_FIFO_DEPTH 16
 #endif
 
 #ifndef UART_IRQ_PRIO
@@ -61,11 +73,20 @@ struct uart_regs {
 #define LSR_THRE (1 << 5)
 #define IER_DREIE (1 << 0)
 #define IER_THREIE (1 << 1)
+#define FCR_FIFOE (1 << 0)
+#define FCR_RXRST (1 << 1)
+#define FCR_TXRST (1 << 2)
+#define FCR_TRIG_8 (2 << 6) // receive interrupt at 8 bytes or on timeout
+
+// The receive ring has a single producer, the ISR, but readers may take data
+// from it without holding the device lock (see uart_read), so positions are
+// accessed atomically and readers claim data with a compare-and-swap.
 
 struct ringbuf {
-    uint16_t hpos; // head of queue (from where elements are removed)
-    uint16_t tpos; // tail of queue (where elements are inserted)
-    char data[SERIAL_RBUFSZ];
+    unsigned int hpos; // head of queue (from where elements are removed)
+    unsigned int tpos; // tail of queue (where elements are inserted)
+    unsigned int size; // power of two
+    char * data;
 };
 
 struct uart_device {
@@ -73,8 +94,14 @@ struct uart_device {
 	int irqno;
 
 	uint32_t rxovrcnt; // number of times OE was set
+	char rxoff; // ISR disabled receive interrupts because rxbuf was full
 
 	struct io_intf io_intf;
+
+	// Protects the ring buffers and the IER against the ISR, which may run
+	// on a different hart than the reader or writer.
+
+	struct spinlock lock;
 	
 	struct condition rxbnotempty;
 	struct condition txbnotfull;	
@@ -83,6 +110,11 @@ struct uart_device {
 	struct ringbuf txbuf;
 };
 
+// INTERNAL GLOBAL VARIABLES
+//
+
+static char com0_txintr_ready; // set once com0_isr is registered
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
@@ -94,17 +126,25 @@ static long uart_write(struct io_intf * io, const void * buf, unsigned long n);
 static void uart_isr(int irqno, void * driver_private);
 
 static int uart_open_ebusy(struct io_intf ** ioptr, void * aux);
+static void com0_isr(int irqno, void * aux);
 
+static void rbuf_alloc(struct ringbuf * rbuf, unsigned int size);
 static void rbuf_init(struct ringbuf * rbuf);
 static int rbuf_empty(const struct ringbuf * rbuf);
 static int rbuf_full(const struct ringbuf * rbuf);
 static void rbuf_put(struct ringbuf * rbuf, char c);
 static char rbuf_get(struct ringbuf * rbuf);
+static unsigned long rbuf_read (
+	struct ringbuf * rbuf, char * buf, unsigned long n);
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
 
 void uart_attach(void * mmio_base, int irqno) {
+	uart_attach_bufsz(mmio_base, irqno, SERIAL_RBUFSZ);
+}
+
+void uart_attach_bufsz(void * mmio_base, int irqno, unsigned int bufsz) {
 	static const struct io_ops uart_ops = {
 		.close = uart_close,
 		.read = uart_read,
@@ -113,10 +153,14 @@ void uart_attach(void * mmio_base, int irqno) {
 
 	struct uart_device * dev;
 
-	// UART0 is used for the console, so can't be opened
+	// UART0 is used for the console, so can't be opened. Its transmit
+	// interrupt drains the console log (see console.c).
 
 	if (mmio_base == (void*)UART0_IOBASE) {
 		device_register("ser", &uart_open_ebusy, NULL);
+		intr_register_isr(irqno, UART_IRQ_PRIO, com0_isr, NULL);
+		intr_enable_irq(irqno);
+		com0_txintr_ready = 1;
 		return;
 	}
 
@@ -128,9 +172,10 @@ void uart_attach(void * mmio_base, int irqno) {
 
 	condition_init(&dev->rxbnotempty, "rxnotempty");
 	condition_init(&dev->txbnotfull, "txnotfull");
+	spinlock_init(&dev->lock, "uart", SPINLOCK_ORDER_OUTER);
 
-	rbuf_init(&dev->rxbuf);
-	rbuf_init(&dev->txbuf);
+	rbuf_alloc(&dev->rxbuf, bufsz);
+	rbuf_alloc(&dev->txbuf, bufsz);
 
 	dev->regs->ier = 0;
     dev->regs->lcr = LCR_DLAB;
@@ -139,6 +184,7 @@ void uart_attach(void * mmio_base, int irqno) {
     dev->regs->dlm = 0x00;
     // fence o,o ?
     dev->regs->lcr = 0; // DLAB=0
+	dev->regs->fcr = FCR_FIFOE | FCR_RXRST | FCR_TXRST | FCR_TRIG_8;
 
 	intr_register_isr(irqno, UART_IRQ_PRIO, uart_isr, dev);
 	device_register("ser", &uart_open, dev);
@@ -156,9 +202,12 @@ int uart_open(struct io_intf ** ioptr, void * aux) {
 	
 	rbuf_init(&dev->rxbuf);
 	rbuf_init(&dev->txbuf);
+	dev->rxoff = 0;
 
-	// Read receive buffer register to clear it. Enable RX interrupts only.
+	// Clear the FIFOs and the receive buffer register. Enable RX interrupts
+	// only.
 
+	dev->regs->fcr = FCR_FIFOE | FCR_RXRST | FCR_TXRST | FCR_TRIG_8;
 	dev->regs->rbr; // forces a read
 	dev->regs->ier = IER_DREIE;
 
@@ -185,7 +234,8 @@ void uart_close(struct io_intf * io) {
 long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
-	char * p = buf; // position in buf to put next byte
+	int saved_intr_state;
+	unsigned long n;
 
 	trace("%s(buf=%p,bufsz=%ld)", __func__, buf, bufsz);
 	assert (io != NULL);
@@ -198,36 +248,40 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 	if (bufsz == 0)
 		return 0;
 
-	// Wait until ring buffer contains some data. An optimization here might
-	// be to try to read some data without disabling interrupts first, and
-	// only disabling them and waiting on the condition if we need to.
-	// 
-	// Check your understanding: why do we need to disable interrupts? Can we
-	// call condition_wait(&dev->rxavail) without disabling interrupts?
-	// 
-	// Could we implement this as a busy-wait?
-	// 
+	// If data is already buffered, take it without disabling interrupts or
+	// taking the lock. We only need the lock to wait for data or to turn
+	// receive interrupts back on after the ISR turned them off.
 
-	intr_disable();
+	n = rbuf_read(&dev->rxbuf, buf, bufsz);
 
-	while (rbuf_empty(&dev->rxbuf))
-		condition_wait(&dev->rxbnotempty);
+	if (n != 0 && !__atomic_load_n(&dev->rxoff, __ATOMIC_RELAXED))
+		return n;
 
-	intr_enable();
-
-	while (!rbuf_empty(&dev->rxbuf) && p - (char*)buf < bufsz)
-		*p++ = rbuf_get(&dev->rxbuf);
+	// Interrupts must be disabled while we hold the lock, since the ISR
+	// takes it too. Receive interrupts are enabled before we wait, as the
+	// ISR may have found the buffer full just before we emptied it.
 	
+	saved_intr_state = intr_disable();
+	spin_acquire(&dev->lock);
+
+	dev->rxoff = 0;
 	dev->regs->ier |= IER_DREIE; // enable receive interrupts
+
+	while (n == 0 && (n = rbuf_read(&dev->rxbuf, buf, bufsz)) == 0)
+		condition_wait_locked(&dev->rxbnotempty, &dev->lock);
+
+	spin_release(&dev->lock);
+	intr_restore(saved_intr_state);
 	
-	return p - (char*)buf;
+	return n;
 }
 
 long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
 	const char * p = buf; // position in buf to get next byte
-	
+	int saved_intr_state;
+
 	trace("%s(n=%ld)", __func__, n);
 	assert (io != NULL);
 
@@ -236,47 +290,75 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	if (LONG_MAX < n)
 		n = LONG_MAX;
 
-	// Wait until there is room in the transmit ring buffer.
+	// Fill the transmit ring buffer, waiting for the ISR to make room when
+	// it is full. The lock is released while we wait.
+
+	saved_intr_state = intr_disable();
+	spin_acquire(&dev->lock);
 
 	while (p - (char*)buf < n) {
-		intr_disable();
-		while (rbuf_full(&dev->txbuf))
-			condition_wait(&dev->txbnotfull);
-		intr_enable();
+		while (rbuf_full(&dev->txbuf)) {
+			dev->regs->ier |= IER_THREIE;
+			condition_wait_locked(&dev->txbnotfull, &dev->lock);
+		}
 
 		while (!rbuf_full(&dev->txbuf) && p - (char*)buf < n)
 			rbuf_put(&dev->txbuf, *p++);
-		
-		dev->regs->ier |= IER_THREIE;
 	}
 
+	dev->regs->ier |= IER_THREIE;
+
+	spin_release(&dev->lock);
+	intr_restore(saved_intr_state);
+
 	return p - (char*)buf;
 }
 
+// The ISR moves as many bytes as the FIFOs allow: it empties the receive FIFO
+// into rxbuf and, if the transmit FIFO is empty, refills it from txbuf.
+
 void uart_isr(int irqno, void * aux) {
 	struct uart_device * const dev = aux;
-	const uint_fast8_t line_status = dev->regs->lsr;
+	uint_fast8_t line_status;
+	int received = 0;
+	int i;
 
-	if (line_status & LSR_OE)
-		dev->rxovrcnt += 1;
-	
-	if (line_status & LSR_DR) {
-		if (!rbuf_full(&dev->rxbuf)) {
-			if (rbuf_empty(&dev->rxbuf))
-				condition_broadcast(&dev->rxbnotempty);
-			rbuf_put(&dev->rxbuf, dev->regs->rbr);
-		} else
+	spin_acquire(&dev->lock);
+
+	for (;;) {
+		line_status = dev->regs->lsr;
+
+		if (line_status & LSR_OE)
+			dev->rxovrcnt += 1;
+
+		if (!(line_status & LSR_DR))
+			break;
+
+		if (rbuf_full(&dev->rxbuf)) {
 			dev->regs->ier &= ~IER_DREIE;
+			__atomic_store_n(&dev->rxoff, 1, __ATOMIC_RELAXED);
+			break;
+		}
+
+		rbuf_put(&dev->rxbuf, dev->regs->rbr);
+		received = 1;
 	}
 
+	if (received)
+		condition_broadcast(&dev->rxbnotempty);
+
 	if (line_status & LSR_THRE) {
-		if (!rbuf_empty(&dev->txbuf)) {
-			if (rbuf_full(&dev->txbuf))
-				condition_broadcast(&dev->txbnotfull);
+		if (rbuf_full(&dev->txbuf))
+			condition_broadcast(&dev->txbnotfull);
+
+		for (i = 0; i < UART_FIFO_DEPTH && !rbuf_empty(&dev->txbuf); i++)
 			dev->regs->thr = rbuf_get(&dev->txbuf);
-		} else
+
+		if (rbuf_empty(&dev->txbuf))
 			dev->regs->ier &= ~IER_THREIE;
 	}
+
+	spin_release(&dev->lock);
 }
 
 int uart_open_ebusy (
@@ -286,39 +368,75 @@ int uart_open_ebusy (
 	return -EBUSY;
 }
 
+void rbuf_alloc(struct ringbuf * rbuf, unsigned int size) {
+    rbuf->size = 1;
+
+    while (rbuf->size < size)
+        rbuf->size *= 2;
+
+    rbuf->data = kmalloc(rbuf->size);
+    rbuf_init(rbuf);
+}
+
 void rbuf_init(struct ringbuf * rbuf) {
     rbuf->hpos = 0;
     rbuf->tpos = 0;
 }
 
 int rbuf_empty(const struct ringbuf * rbuf) {
-    return (rbuf->hpos == rbuf->tpos);
+    return (__atomic_load_n(&rbuf->hpos, __ATOMIC_RELAXED) ==
+        __atomic_load_n(&rbuf->tpos, __ATOMIC_RELAXED));
 }
 
 int rbuf_full(const struct ringbuf * rbuf) {
-    return ((uint16_t)(rbuf->tpos - rbuf->hpos) == SERIAL_RBUFSZ);
+    return (rbuf->tpos - __atomic_load_n(&rbuf->hpos, __ATOMIC_ACQUIRE) ==
+        rbuf->size);
 }
 
 void rbuf_put(struct ringbuf * rbuf, char c) {
-    uint_fast16_t tpos;
+    unsigned int tpos;
 
     tpos = rbuf->tpos;
-    rbuf->data[tpos % SERIAL_RBUFSZ] = c;
-    asm volatile ("" ::: "memory");
-    rbuf->tpos = tpos + 1;
+    rbuf->data[tpos & (rbuf->size - 1)] = c;
+    __atomic_store_n(&rbuf->tpos, tpos + 1, __ATOMIC_RELEASE);
 }
 
 char rbuf_get(struct ringbuf * rbuf) {
-    uint_fast16_t hpos;
+    unsigned int hpos;
     char c;
 
     hpos = rbuf->hpos;
-    c = rbuf->data[hpos % SERIAL_RBUFSZ];
-    asm volatile ("" ::: "memory");
-    rbuf->hpos = hpos + 1;
+    c = rbuf->data[hpos & (rbuf->size - 1)];
+    __atomic_store_n(&rbuf->hpos, hpos + 1, __ATOMIC_RELEASE);
     return c;
 }
 
+// Copies up to /n/ bytes from /rbuf/ to /buf/ and removes them from /rbuf/.
+// May run concurrently with rbuf_put and with other calls of rbuf_read. Bytes
+// are copied before they are claimed, and copied again if another reader
+// claimed them first. Returns the number of bytes read.
+
+unsigned long rbuf_read(struct ringbuf * rbuf, char * buf, unsigned long n) {
+    unsigned int hpos, tpos;
+    unsigned long cnt, i;
+
+    hpos = __atomic_load_n(&rbuf->hpos, __ATOMIC_RELAXED);
+
+    do {
+        tpos = __atomic_load_n(&rbuf->tpos, __ATOMIC_ACQUIRE);
+        cnt = tpos - hpos;
+
+        if (n < cnt)
+            cnt = n;
+
+        for (i = 0; i < cnt; i++)
+            buf[i] = rbuf->data[(hpos + i) & (rbuf->size - 1)];
+    } while (cnt != 0 && !__atomic_compare_exchange_n(&rbuf->hpos, &hpos,
+        hpos + cnt, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return cnt;
+}
+
 // The functions below provide polled uart input and output. They are used
 // by the console functions to produce output from pritnf().
 
@@ -339,6 +457,7 @@ void com0_init(void) {
 	// The com0_putc and com0_getc functions assume DLAB=0.
 
 	UART0.lcr = 0;
+	UART0.fcr = FCR_FIFOE | FCR_RXRST | FCR_TXRST;
 }
 
 void com0_putc(char c) {
@@ -355,4 +474,28 @@ char com0_getc(void) {
 		continue;
 	
 	return UART0.rbr;
-}
\ No newline at end of file
+}
+
+int com0_start_tx(void) {
+	if (!com0_txintr_ready)
+		return 0;
+
+	UART0.ier = IER_THREIE;
+	return 1;
+}
+
+void com0_stop_tx(void) {
+	UART0.ier = 0;
+}
+
+int com0_tx_room(void) {
+	return (UART0.lsr & LSR_THRE) ? UART_FIFO_DEPTH : 0;
+}
+
+void com0_tx(char c) {
+	UART0.thr = c;
+}
+
+void com0_isr(int irqno, void * __attribute__ ((unused)) aux) {
+	console_tx_intr();
+}
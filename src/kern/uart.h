@@ -4,7 +4,12 @@
 #ifndef _UART_H_
 #define _UART_H_
 
+// uart_attach_bufsz attaches a serial port whose receive and transmit ring
+// buffers hold /bufsz/ bytes each; uart_attach uses the default size,
+// SERIAL_RBUFSZ (see uart.c).
+
 extern void uart_attach(void * mmio_base, int irqno);
+extern void uart_attach_bufsz(void * mmio_base, int irqno, unsigned int bufsz);
 
 //           _UART_H_
 #endif
@@ -11,6 +11,8 @@
 #include "string.h"
 #include "thread.h"
 #include "lock.h"
+#include "spinlock.h"
+#include "ktrace.h"
 
 //           COMPILE-TIME PARAMETERS
 //          
@@ -84,6 +86,8 @@ struct vioblk_device {
     struct {
         //           signaled from ISR
         struct condition used_updated;
+        //           protects used_updated against the ISR on another hart
+        struct spinlock used_lock;
 
         //           We use a simple scheme of one transaction at a time.
 
@@ -110,7 +114,7 @@ struct vioblk_device {
     uint64_t bufblkno;
     //           Block buffer
     char * blkbuf;
-    struct lock io_lock;
+    struct rwlock io_lock;
 };
 
 //           INTERNAL FUNCTION DECLARATIONS
@@ -135,6 +139,8 @@ static int vioblk_ioctl (
 
 static void vioblk_isr(int irqno, void * aux);
 
+static void vioblk_wait_used(struct vioblk_device * dev);
+
 // define a struct that contains pointers to our driver functions
 
 static const struct io_ops vioblk_io_ops = {
@@ -206,7 +212,7 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     dev = kmalloc(sizeof(struct vioblk_device) + blksz);
     memset(dev, 0, sizeof(struct vioblk_device));
 
-    lock_init(&dev->io_lock, "vioblk_io_lock");
+    rwlock_init(&dev->io_lock, "vioblk_io_lock");
     //           FIXME Finish initialization of vioblk device here
     //-----------------------------------------------------------------------------
     // initialize device fields
@@ -222,6 +228,8 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     dev->regs->queue_num = 0;
 
     condition_init(&dev->vq.used_updated, "used_updated");
+    spinlock_init(&dev->vq.used_lock, "used_lock",
+        SPINLOCK_ORDER_OUTER);
 
     dev->blkbuf = kmalloc(blksz * sizeof(char));
     assert(dev->blkbuf != NULL);
@@ -284,11 +292,11 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 int vioblk_open(struct io_intf ** ioptr, void * aux) {
     struct vioblk_device * dev = (struct vioblk_device *)aux;
 
-    lock_acquire(&dev->io_lock); // acquire the lock
+    rwlock_acquire_write(&dev->io_lock); // acquire the lock
 
     // check if the device is already opened
     if (dev->opened) {
-        lock_release(&dev->io_lock);
+        rwlock_release_write(&dev->io_lock);
         return -EBUSY;
     }
 
@@ -318,7 +326,7 @@ int vioblk_open(struct io_intf ** ioptr, void * aux) {
     dev->opened = 1;
 
     // console_printf("device opened\n");
-    lock_release(&dev->io_lock);
+    rwlock_release_write(&dev->io_lock);
     return 0;
 }
 
@@ -335,7 +343,7 @@ int vioblk_open(struct io_intf ** ioptr, void * aux) {
 void vioblk_close(struct io_intf * io) {
     struct vioblk_device *dev = (void *)io - offsetof(struct vioblk_device, io_intf);
 
-    lock_acquire(&dev->io_lock);
+    rwlock_acquire_write(&dev->io_lock);
 
     // reset the avail ring 
     dev->vq.avail.idx = 0;
@@ -347,7 +355,7 @@ void vioblk_close(struct io_intf * io) {
     // reset the device position to the beginning
     virtio_reset_virtq(dev->regs, dev->regs->queue_num);
 
-    lock_release(&dev->io_lock);
+    rwlock_release_write(&dev->io_lock);
 
     dev->opened = 0;
 }
@@ -372,7 +380,7 @@ long vioblk_read (
     struct vioblk_device * dev = (void *)io - offsetof(struct vioblk_device, io_intf);
     long total_read = 0;
 
-    lock_acquire(&dev->io_lock);
+    rwlock_acquire_write(&dev->io_lock);
 
     while (total_read < bufsz) {
         if (dev->pos >= dev->size) break;
@@ -412,11 +420,11 @@ long vioblk_read (
         __sync_synchronize(); // mem barrier
 
         // notify the avail ring
+        ktrace(KTRACE_BLK_SUBMIT, sector_index, VIRTIO_BLK_T_IN);
         virtio_notify_avail(dev->regs, 0);
 
-        uint64_t intr_state = intr_disable();
-        condition_wait(&dev->vq.used_updated);
-        intr_restore(intr_state);
+        vioblk_wait_used(dev);
+        ktrace(KTRACE_BLK_COMPLETE, sector_index, VIRTIO_BLK_T_IN);
 
         // data cooked; copy it back
         memcpy(buf + total_read, dev->blkbuf + sector_offset, bytes_this_read);
@@ -425,7 +433,7 @@ long vioblk_read (
         total_read += bytes_this_read;
     }
 
-    lock_release(&dev->io_lock);
+    rwlock_release_write(&dev->io_lock);
     return total_read;
 }
 
@@ -455,11 +463,11 @@ long vioblk_write (
         return -EINVAL;
     }
 
-    lock_acquire(&dev->io_lock); // acquire lock
+    rwlock_acquire_write(&dev->io_lock); // acquire lock
 
     // very similar to read
     while (total_written < n) {
-        if (dev->pos >= dev->size) return 0;
+        if (dev->pos >= dev->size) break;
 
         // check how many bytes we can write to this file
         // take into consideration partial writes
@@ -499,11 +507,11 @@ long vioblk_write (
             __sync_synchronize(); // mem barrier
 
             // notify the avail ring
+            ktrace(KTRACE_BLK_SUBMIT, sector_index, VIRTIO_BLK_T_IN);
             virtio_notify_avail(dev->regs, 0);
 
-            uint64_t intr_state = intr_disable();
-            condition_wait(&dev->vq.used_updated);
-            intr_restore(intr_state);
+            vioblk_wait_used(dev);
+            ktrace(KTRACE_BLK_COMPLETE, sector_index, VIRTIO_BLK_T_IN);
         }
 
         memcpy(dev->blkbuf + sector_offset, buf + total_written, bytes_this_write);
@@ -532,17 +540,17 @@ long vioblk_write (
         __sync_synchronize(); // mem barrier
 
         // notify the avail ring
+        ktrace(KTRACE_BLK_SUBMIT, sector_index, VIRTIO_BLK_T_OUT);
         virtio_notify_avail(dev->regs, 0);
 
-        uint64_t intr_state = intr_disable();
-        condition_wait(&dev->vq.used_updated);
-        intr_restore(intr_state);
+        vioblk_wait_used(dev);
+        ktrace(KTRACE_BLK_COMPLETE, sector_index, VIRTIO_BLK_T_OUT);
 
         dev->pos += bytes_this_write; 
         total_written += bytes_this_write;
     }
 
-    lock_release(&dev->io_lock);
+    rwlock_release_write(&dev->io_lock);
     return total_written;
 }
 
@@ -554,26 +562,35 @@ int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
 
     int result;
 
-    lock_acquire(&dev->io_lock);
-    
+    // Only SETPOS changes the device state, so the query requests take the
+    // lock in read mode and may run concurrently.
+
     switch (cmd) {
     case IOCTL_GETLEN:
+        rwlock_acquire_read(&dev->io_lock);
         result = vioblk_getlen(dev, arg);
+        rwlock_release_read(&dev->io_lock);
         break;
     case IOCTL_GETPOS:
+        rwlock_acquire_read(&dev->io_lock);
         result = vioblk_getpos(dev, arg);
+        rwlock_release_read(&dev->io_lock);
         break;
     case IOCTL_SETPOS:
+        rwlock_acquire_write(&dev->io_lock);
         result = vioblk_setpos(dev, arg);
+        rwlock_release_write(&dev->io_lock);
         break;
     case IOCTL_GETBLKSZ:
+        rwlock_acquire_read(&dev->io_lock);
         result = vioblk_getblksz(dev, arg);
+        rwlock_release_read(&dev->io_lock);
         break;
     default:
-        return -ENOTSUP;
+        result = -ENOTSUP;
+        break;
     }
 
-    lock_release(&dev->io_lock);
     return result;
 }
 
@@ -591,13 +608,35 @@ void vioblk_isr(int irqno, void * aux) {
 
     // handle virtqueue interrupts
     if (interrupt_status & 0x1) {
+        spin_acquire(&dev->vq.used_lock);
         condition_broadcast(&dev->vq.used_updated);   
+        spin_release(&dev->vq.used_lock);
         // write to acknowledge register
         dev->regs->interrupt_ack = interrupt_status;
         __sync_synchronize();
     }
 }
 
+// void vioblk_wait_used(struct vioblk_device * dev);
+//
+// Sleeps until the device has consumed every request placed in the avail ring.
+// The check and the wait happen under used_lock, so a completion signalled by
+// the ISR (on any hart) between notifying the device and going to sleep is not
+// lost.
+
+void vioblk_wait_used(struct vioblk_device * dev) {
+    int intr_state;
+
+    intr_state = intr_disable();
+    spin_acquire(&dev->vq.used_lock);
+
+    while (dev->vq.used.idx != dev->vq.avail.idx)
+        condition_wait_locked(&dev->vq.used_updated, &dev->vq.used_lock);
+
+    spin_release(&dev->vq.used_lock);
+    intr_restore(intr_state);
+}
+
 // int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr);
 //
 // Ioctl helper function which provides the device size in bytes. arg dev points
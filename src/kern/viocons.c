@@ -0,0 +1,693 @@
+// viocons.c - VirtIO console
+//
+// Each port of a virtio console device is registered as a "cons" device.
+// Ports have a receive and a transmit virtqueue with VIOCONS_QLEN page-sized
+// buffers each, so bulk output moves in page-sized transfers and several
+// transfers may be in flight at once. If the device offers multiple ports
+// (VIRTIO_CONSOLE_F_MULTIPORT), ports come and go through messages on the
+// control queues; otherwise only port 0 exists.
+//
+
+#ifdef VIOCONS_TRACE
+#define TRACE
+#endif
+
+#ifdef VIOCONS_DEBUG
+#define DEBUG
+#endif
+
+#include "virtio.h"
+#include "intr.h"
+#include "halt.h"
+#include "heap.h"
+#include "memory.h"
+#include "io.h"
+#include "device.h"
+#include "error.h"
+#include "string.h"
+#include "thread.h"
+#include "spinlock.h"
+#include "console.h"
+#include "limits.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// VIOCONS_NPORTS is the largest number of ports used on a device.
+// VIOCONS_QLEN is the length of each virtqueue, and so the number of buffers
+// of a port in each direction. Buffers are PAGE_SIZE bytes and allocated when
+// the port is first opened.
+
+#ifndef VIOCONS_NPORTS
+#define VIOCONS_NPORTS 4
+#endif
+
+#ifndef VIOCONS_QLEN
+#define VIOCONS_QLEN 8 // must be a power of two
+#endif
+
+#define VIOCONS_IRQ_PRIO 2
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// VirtIO console device feature bits (number, *not* mask)
+
+#define VIRTIO_CONSOLE_F_SIZE           0
+#define VIRTIO_CONSOLE_F_MULTIPORT      1
+#define VIRTIO_CONSOLE_F_EMERG_WRITE    2
+
+// Control message events
+
+#define VIRTIO_CONSOLE_DEVICE_READY     0
+#define VIRTIO_CONSOLE_DEVICE_ADD       1
+#define VIRTIO_CONSOLE_DEVICE_REMOVE    2
+#define VIRTIO_CONSOLE_PORT_READY       3
+#define VIRTIO_CONSOLE_CONSOLE_PORT     4
+#define VIRTIO_CONSOLE_RESIZE           5
+#define VIRTIO_CONSOLE_PORT_OPEN        6
+#define VIRTIO_CONSOLE_PORT_NAME        7
+
+// Virtqueue numbers. Port 0 uses queues 0 and 1, the control queues are 2 and
+// 3, and port n > 0 uses queues 2n+2 and 2n+3.
+
+#define CTRL_RXQ 2
+#define CTRL_TXQ 3
+#define PORT_RXQ(n) ((n) == 0 ? 0 : 2*(n)+2)
+#define PORT_TXQ(n) ((n) == 0 ? 1 : 2*(n)+3)
+
+// Control receive buffers also hold the port name that may follow a
+// PORT_NAME message, which we do not use; longer names are truncated.
+
+#define CTRL_BUFSZ 64
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct virtio_console_control {
+    uint32_t id; // port number
+    uint16_t event;
+    uint16_t value;
+};
+
+// A virtqueue with VIOCONS_QLEN single-buffer descriptors. Descriptor i always
+// refers to buffer i of its queue. last_used is the index of the next used
+// ring entry we have not yet processed. The descriptor table must be 16-byte
+// aligned.
+
+struct __attribute__ ((aligned (16))) viocons_vq {
+    struct virtq_desc desc[VIOCONS_QLEN];
+
+    union {
+        struct virtq_avail avail;
+        char _avail_filler[VIRTQ_AVAIL_SIZE(VIOCONS_QLEN)];
+    };
+
+    union {
+        volatile struct virtq_used used;
+        char _used_filler[VIRTQ_USED_SIZE(VIOCONS_QLEN)];
+    };
+
+    uint16_t last_used;
+};
+
+struct viocons_port {
+    struct viocons_device * dev;
+    struct io_intf io_intf;
+    uint16_t id;
+    char present; // announced by device (always for port 0 without multiport)
+    char opened;
+
+    struct viocons_vq rxq;
+    struct viocons_vq txq;
+    char * rxbufs[VIOCONS_QLEN]; // pages, allocated on first open
+    char * txbufs[VIOCONS_QLEN];
+
+    // Received data is consumed from the buffer of used ring entry
+    // rxq.last_used, starting at rxpos. The buffer is returned to the device
+    // when it has been consumed.
+
+    uint32_t rxpos;
+
+    // Transmit descriptors not in use are on a free list linked through their
+    // next fields.
+
+    int16_t tx_free;
+    uint16_t tx_pending; // buffers given to device and not yet used
+
+    struct condition rx_ready; // broadcast when rxq used ring advances
+    struct condition tx_done; // broadcast when txq used ring advances
+};
+
+struct viocons_device {
+    volatile struct virtio_mmio_regs * regs;
+    uint16_t irqno;
+    uint16_t nports;
+    char multiport;
+
+    // Protects all virtqueues and port state against the ISR, which may run
+    // on a different hart.
+
+    struct spinlock lock;
+
+    struct viocons_vq ctrl_rxq;
+    struct viocons_vq ctrl_txq;
+    char ctrl_rxbufs[VIOCONS_QLEN][CTRL_BUFSZ];
+    struct virtio_console_control ctrl_txbufs[VIOCONS_QLEN];
+    uint16_t ctrl_txidx; // next control transmit buffer to use
+
+    struct viocons_port ports[];
+};
+
+// Buffer addresses of a pair of virtqueues, as passed to vq_init.
+
+struct viocons_bufs {
+    char * rx[VIOCONS_QLEN];
+    char * tx[VIOCONS_QLEN];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int viocons_open(struct io_intf ** ioptr, void * aux);
+static void viocons_close(struct io_intf * io);
+
+static long viocons_read (
+    struct io_intf * restrict io,
+    void * restrict buf,
+    unsigned long bufsz);
+
+static long viocons_write (
+    struct io_intf * restrict io,
+    const void * restrict buf,
+    unsigned long n);
+
+static void viocons_isr(int irqno, void * aux);
+
+static void vq_init(struct viocons_vq * vq, char * const bufs[],
+    uint32_t bufsz, uint16_t flags);
+static void vq_attach(struct viocons_device * dev, int qid,
+    struct viocons_vq * vq);
+static void vq_put(struct viocons_vq * vq, uint16_t id);
+
+static void ctrl_send (
+    struct viocons_device * dev, uint32_t id, uint16_t event, uint16_t value);
+static void ctrl_recv(struct viocons_device * dev);
+static void port_reclaim_tx(struct viocons_port * port);
+
+static const struct io_ops viocons_io_ops = {
+    .close = viocons_close,
+    .read = viocons_read,
+    .write = viocons_write
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// Attaches a VirtIO console device. Declared and called directly from
+// virtio.c.
+
+void viocons_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
+    virtio_featset_t enabled_features, wanted_features, needed_features;
+    struct viocons_bufs bufs;
+    struct viocons_device * dev;
+    struct viocons_port * port;
+    int saved_intr_state;
+    int multiport;
+    int nports;
+    int result;
+    int i;
+
+    assert (regs->device_id == VIRTIO_ID_CONSOLE);
+
+    // Signal device that we found a driver
+
+    regs->status |= VIRTIO_STAT_DRIVER;
+    // fence o,io
+    __sync_synchronize();
+
+    virtio_featset_init(needed_features);
+    virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_CONSOLE_F_MULTIPORT);
+    result = virtio_negotiate_features(regs,
+        enabled_features, wanted_features, needed_features);
+
+    if (result != 0) {
+        kprintf("%p: virtio feature negotiation failed\n", regs);
+        return;
+    }
+
+    multiport = virtio_featset_test(enabled_features,
+        VIRTIO_CONSOLE_F_MULTIPORT);
+    nports = 1;
+
+    if (multiport && 1 < regs->config.console.max_nr_ports) {
+        nports = regs->config.console.max_nr_ports;
+        if (VIOCONS_NPORTS < nports)
+            nports = VIOCONS_NPORTS;
+    }
+
+    debug("%p: virtio console with %d ports", regs, nports);
+
+    dev = kcalloc(1, sizeof(struct viocons_device) +
+        nports * sizeof(struct viocons_port));
+
+    dev->regs = regs;
+    dev->irqno = irqno;
+    dev->nports = nports;
+    dev->multiport = multiport;
+    spinlock_init(&dev->lock, "viocons", SPINLOCK_ORDER_OUTER);
+
+    for (i = 0; i < nports; i++) {
+        port = &dev->ports[i];
+        port->dev = dev;
+        port->id = i;
+        port->present = !multiport;
+        port->io_intf.ops = &viocons_io_ops;
+        condition_init(&port->rx_ready, "viocons.rx");
+        condition_init(&port->tx_done, "viocons.tx");
+
+        // Buffers are attached when the port is first opened.
+
+        vq_attach(dev, PORT_RXQ(i), &port->rxq);
+        vq_attach(dev, PORT_TXQ(i), &port->txq);
+        device_register("cons", &viocons_open, port);
+    }
+
+    if (multiport) {
+        for (i = 0; i < VIOCONS_QLEN; i++) {
+            bufs.rx[i] = dev->ctrl_rxbufs[i];
+            bufs.tx[i] = (char*)&dev->ctrl_txbufs[i];
+        }
+
+        vq_init(&dev->ctrl_rxq, bufs.rx, CTRL_BUFSZ, VIRTQ_DESC_F_WRITE);
+        vq_init(&dev->ctrl_txq, bufs.tx,
+            sizeof(struct virtio_console_control), 0);
+        vq_attach(dev, CTRL_RXQ, &dev->ctrl_rxq);
+        vq_attach(dev, CTRL_TXQ, &dev->ctrl_txq);
+
+        for (i = 0; i < VIOCONS_QLEN; i++)
+            vq_put(&dev->ctrl_rxq, i);
+    }
+
+    intr_register_isr(irqno, VIOCONS_IRQ_PRIO, viocons_isr, dev);
+    intr_enable_irq(irqno);
+
+    regs->status |= VIRTIO_STAT_DRIVER_OK;
+    // fence o,oi
+    __sync_synchronize();
+
+    // The device announces its ports in reply to DEVICE_READY. The ISR may
+    // already be running on another hart.
+
+    if (multiport) {
+        saved_intr_state = intr_disable();
+        spin_acquire(&dev->lock);
+        virtio_notify_avail(regs, CTRL_RXQ);
+        ctrl_send(dev, 0, VIRTIO_CONSOLE_DEVICE_READY, 1);
+        spin_release(&dev->lock);
+        intr_restore(saved_intr_state);
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int viocons_open(struct io_intf ** ioptr, void * aux) {
+    struct viocons_port * const port = aux;
+    struct viocons_device * const dev = port->dev;
+    struct viocons_bufs bufs;
+    int saved_intr_state;
+    int result = 0;
+    int i;
+
+    trace("%s(port=%d)", __func__, port->id);
+
+    // Allocate buffers outside the lock. If another thread opening the port
+    // installs its buffers first, ours are freed again below. Fails with
+    // -EAGAIN if there are not enough free pages.
+
+    if (port->rxbufs[0] == NULL) {
+        for (i = 0; i < VIOCONS_QLEN; i++) {
+            bufs.rx[i] = memory_try_alloc_page();
+            bufs.tx[i] = memory_try_alloc_page();
+
+            if (bufs.rx[i] == NULL || bufs.tx[i] == NULL) {
+                if (bufs.rx[i] != NULL)
+                    memory_free_page(bufs.rx[i]);
+                if (bufs.tx[i] != NULL)
+                    memory_free_page(bufs.tx[i]);
+
+                while (0 < i--) {
+                    memory_free_page(bufs.rx[i]);
+                    memory_free_page(bufs.tx[i]);
+                }
+
+                return -EAGAIN;
+            }
+        }
+    } else
+        bufs.rx[0] = NULL;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&dev->lock);
+
+    if (!port->present)
+        result = -ENODEV;
+    else if (port->opened)
+        result = -EBUSY;
+
+    if (result == 0 && port->rxbufs[0] == NULL && bufs.rx[0] != NULL) {
+        for (i = 0; i < VIOCONS_QLEN; i++) {
+            port->rxbufs[i] = bufs.rx[i];
+            port->txbufs[i] = bufs.tx[i];
+        }
+
+        bufs.rx[0] = NULL;
+        vq_init(&port->rxq, port->rxbufs, PAGE_SIZE, VIRTQ_DESC_F_WRITE);
+        vq_init(&port->txq, port->txbufs, PAGE_SIZE, 0);
+
+        for (i = 0; i < VIOCONS_QLEN; i++)
+            vq_put(&port->rxq, i);
+
+        virtio_notify_avail(dev->regs, PORT_RXQ(port->id));
+
+        for (i = 0; i < VIOCONS_QLEN; i++)
+            port->txq.desc[i].next = (i+1 < VIOCONS_QLEN) ? i+1 : -1;
+
+        port->tx_free = 0;
+    }
+
+    if (result == 0) {
+        port->opened = 1;
+
+        if (dev->multiport)
+            ctrl_send(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+    }
+
+    spin_release(&dev->lock);
+    intr_restore(saved_intr_state);
+
+    if (bufs.rx[0] != NULL) {
+        for (i = 0; i < VIOCONS_QLEN; i++) {
+            memory_free_page(bufs.rx[i]);
+            memory_free_page(bufs.tx[i]);
+        }
+    }
+
+    if (result != 0)
+        return result;
+
+    *ioptr = &port->io_intf;
+    port->io_intf.refcnt = 1;
+    return 0;
+}
+
+// Waits until all output has been taken by the device. Received data not yet
+// read is kept for the next open.
+
+void viocons_close(struct io_intf * io) {
+    struct viocons_port * const port =
+        (void*)io - offsetof(struct viocons_port, io_intf);
+    struct viocons_device * const dev = port->dev;
+    int saved_intr_state;
+
+    trace("%s(port=%d)", __func__, port->id);
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&dev->lock);
+
+    port_reclaim_tx(port);
+
+    while (port->tx_pending != 0) {
+        condition_wait_locked(&port->tx_done, &dev->lock);
+        port_reclaim_tx(port);
+    }
+
+    port->opened = 0;
+
+    if (dev->multiport)
+        ctrl_send(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 0);
+
+    spin_release(&dev->lock);
+    intr_restore(saved_intr_state);
+}
+
+// Waits for data if none has been received, then returns as much of it as fits
+// in /buf/, from one or more receive buffers.
+
+long viocons_read (
+    struct io_intf * restrict io,
+    void * restrict buf,
+    unsigned long bufsz)
+{
+    struct viocons_port * const port =
+        (void*)io - offsetof(struct viocons_port, io_intf);
+    struct viocons_device * const dev = port->dev;
+    struct viocons_vq * const vq = &port->rxq;
+    volatile struct virtq_used_elem * elem;
+    int saved_intr_state;
+    unsigned long n = 0;
+    unsigned long cnt;
+    int notify = 0;
+
+    trace("%s(buf=%p,bufsz=%ld)", __func__, buf, bufsz);
+
+    if (LONG_MAX < bufsz)
+        bufsz = LONG_MAX;
+
+    if (bufsz == 0)
+        return 0;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&dev->lock);
+
+    for (;;) {
+        while (n < bufsz && vq->last_used != vq->used.idx) {
+            __sync_synchronize(); // read used ring entry after index
+            elem = &vq->used.ring[vq->last_used % VIOCONS_QLEN];
+            cnt = elem->len - port->rxpos;
+
+            if (bufsz - n < cnt)
+                cnt = bufsz - n;
+
+            memcpy(buf + n, port->rxbufs[elem->id] + port->rxpos, cnt);
+            n += cnt;
+            port->rxpos += cnt;
+
+            if (port->rxpos == elem->len) {
+                vq_put(vq, elem->id);
+                vq->last_used += 1;
+                port->rxpos = 0;
+                notify = 1;
+            }
+        }
+
+        if (n != 0)
+            break;
+
+        condition_wait_locked(&port->rx_ready, &dev->lock);
+    }
+
+    if (notify)
+        virtio_notify_avail(dev->regs, PORT_RXQ(port->id));
+
+    spin_release(&dev->lock);
+    intr_restore(saved_intr_state);
+
+    return n;
+}
+
+// Copies data into free transmit buffers, a page at a time, and hands them to
+// the device. Waits only when all buffers are in flight; returns once all data
+// has been queued.
+
+long viocons_write (
+    struct io_intf * restrict io,
+    const void * restrict buf,
+    unsigned long n)
+{
+    struct viocons_port * const port =
+        (void*)io - offsetof(struct viocons_port, io_intf);
+    struct viocons_device * const dev = port->dev;
+    struct viocons_vq * const vq = &port->txq;
+    int saved_intr_state;
+    unsigned long pos = 0;
+    unsigned long cnt;
+    int id;
+
+    trace("%s(n=%ld)", __func__, n);
+
+    if (LONG_MAX < n)
+        n = LONG_MAX;
+
+    saved_intr_state = intr_disable();
+    spin_acquire(&dev->lock);
+
+    while (pos < n) {
+        port_reclaim_tx(port);
+
+        if (port->tx_free < 0) {
+            virtio_notify_avail(dev->regs, PORT_TXQ(port->id));
+            condition_wait_locked(&port->tx_done, &dev->lock);
+            continue;
+        }
+
+        id = port->tx_free;
+        port->tx_free = vq->desc[id].next;
+
+        cnt = n - pos;
+
+        if (PAGE_SIZE < cnt)
+            cnt = PAGE_SIZE;
+
+        memcpy(port->txbufs[id], buf + pos, cnt);
+        vq->desc[id].len = cnt;
+        vq_put(vq, id);
+        port->tx_pending += 1;
+        pos += cnt;
+    }
+
+    virtio_notify_avail(dev->regs, PORT_TXQ(port->id));
+
+    spin_release(&dev->lock);
+    intr_restore(saved_intr_state);
+
+    return pos;
+}
+
+void viocons_isr(int irqno, void * aux) {
+    struct viocons_device * const dev = aux;
+    struct viocons_port * port;
+    uint32_t status;
+    int i;
+
+    status = dev->regs->interrupt_status;
+    dev->regs->interrupt_ack = status;
+    __sync_synchronize();
+
+    spin_acquire(&dev->lock);
+
+    if (dev->multiport)
+        ctrl_recv(dev);
+
+    // Used ring updates are processed by the threads waiting for them.
+
+    for (i = 0; i < dev->nports; i++) {
+        port = &dev->ports[i];
+        condition_broadcast(&port->rx_ready);
+        condition_broadcast(&port->tx_done);
+    }
+
+    spin_release(&dev->lock);
+}
+
+// Sets up /vq/ with descriptor i referring to the /bufsz/-byte buffer at
+// /bufs[i]/.
+
+void vq_init(struct viocons_vq * vq, char * const bufs[],
+    uint32_t bufsz, uint16_t flags)
+{
+    int i;
+
+    for (i = 0; i < VIOCONS_QLEN; i++) {
+        vq->desc[i].addr = (uint64_t)bufs[i];
+        vq->desc[i].len = bufsz;
+        vq->desc[i].flags = flags;
+        vq->desc[i].next = 0;
+    }
+}
+
+void vq_attach(struct viocons_device * dev, int qid, struct viocons_vq * vq) {
+    virtio_attach_virtq(dev->regs, qid, VIOCONS_QLEN, (uint64_t)vq->desc,
+        (uint64_t)&vq->used, (uint64_t)&vq->avail);
+    virtio_enable_virtq(dev->regs, qid);
+}
+
+// Makes descriptor /id/ available to the device. The caller notifies the
+// device.
+
+void vq_put(struct viocons_vq * vq, uint16_t id) {
+    vq->avail.ring[vq->avail.idx % VIOCONS_QLEN] = id;
+    __sync_synchronize(); // entry before index
+    vq->avail.idx += 1;
+}
+
+// Sends a control message. Called with the device lock held. Control messages
+// are rare, so we reuse transmit buffers round-robin and assume the device has
+// consumed a buffer by the time we come back to it.
+
+void ctrl_send (
+    struct viocons_device * dev, uint32_t id, uint16_t event, uint16_t value)
+{
+    const uint16_t idx = dev->ctrl_txidx++ % VIOCONS_QLEN;
+
+    dev->ctrl_txbufs[idx].id = id;
+    dev->ctrl_txbufs[idx].event = event;
+    dev->ctrl_txbufs[idx].value = value;
+    vq_put(&dev->ctrl_txq, idx);
+    virtio_notify_avail(dev->regs, CTRL_TXQ);
+}
+
+// Processes control messages from the device. Called with the device lock
+// held.
+
+void ctrl_recv(struct viocons_device * dev) {
+    struct viocons_vq * const vq = &dev->ctrl_rxq;
+    const struct virtio_console_control * msg;
+    struct viocons_port * port;
+    uint16_t idx;
+    int n = 0;
+
+    while (vq->last_used != vq->used.idx) {
+        __sync_synchronize(); // read used ring entry after index
+        idx = vq->used.ring[vq->last_used % VIOCONS_QLEN].id;
+        msg = (void*)dev->ctrl_rxbufs[idx];
+        port = (msg->id < dev->nports) ? &dev->ports[msg->id] : NULL;
+
+        debug("viocons: port %u event %u value %u",
+            (unsigned)msg->id, (unsigned)msg->event, (unsigned)msg->value);
+
+        switch (msg->event) {
+        case VIRTIO_CONSOLE_DEVICE_ADD:
+            if (port != NULL)
+                port->present = 1;
+            ctrl_send(dev, msg->id, VIRTIO_CONSOLE_PORT_READY, port != NULL);
+            break;
+        case VIRTIO_CONSOLE_DEVICE_REMOVE:
+            if (port != NULL)
+                port->present = 0;
+            break;
+        case VIRTIO_CONSOLE_CONSOLE_PORT:
+            if (port != NULL)
+                ctrl_send(dev, msg->id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+            break;
+        default:
+            break;
+        }
+
+        vq_put(vq, idx);
+        vq->last_used += 1;
+        n += 1;
+    }
+
+    if (n != 0)
+        virtio_notify_avail(dev->regs, CTRL_RXQ);
+}
+
+// Returns the transmit buffers the device has used to the free list. Called
+// with the device lock held.
+
+void port_reclaim_tx(struct viocons_port * port) {
+    struct viocons_vq * const vq = &port->txq;
+    uint16_t id;
+
+    while (vq->last_used != vq->used.idx) {
+        __sync_synchronize(); // read used ring entry after index
+        id = vq->used.ring[vq->last_used % VIOCONS_QLEN].id;
+        vq->desc[id].next = port->tx_free;
+        port->tx_free = id;
+        port->tx_pending -= 1;
+        vq->last_used += 1;
+    }
+}
@@ -107,6 +107,13 @@ struct virtio_mmio_regs {
             uint32_t max_secure_erase_seg;
             uint32_t secure_erase_sector_alignment;
         } blk;
+        //           Console device config
+        struct {
+            uint16_t cols;
+            uint16_t rows;
+            uint32_t max_nr_ports;
+            uint32_t emerg_wr;
+        } console;
         uint8_t raw[0];
     } config;
 };
@@ -0,0 +1,43 @@
+//           ioring.c - Batched asynchronous system calls
+//          
+
+#include "ioring.h"
+#include "syscall.h"
+#include "string.h"
+
+//           EXPORTED FUNCTION DEFINITIONS
+//           
+
+int ring_init(struct ring * ring) {
+	memset(ring, 0, sizeof(struct ring));
+	return _ring_setup(ring);
+}
+
+struct ring_sqe * ring_get_sqe(struct ring * ring) {
+	const unsigned int tail = ring->sq_tail;
+
+	if (tail - ring->sq_head == RING_ENTRIES)
+		return NULL;
+
+	ring->sq_tail = tail + 1;
+	return &ring->sq[tail % RING_ENTRIES];
+}
+
+int ring_submit(struct ring * ring, unsigned int min_complete) {
+	return _ring_enter(ring->sq_tail - ring->sq_head, min_complete);
+}
+
+struct ring_cqe * ring_peek_cqe(struct ring * ring) {
+	const unsigned int head = ring->cq_head;
+
+	// The kernel fills in an entry before it advances cq_tail past it.
+
+	if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cq[head % RING_ENTRIES];
+}
+
+void ring_cqe_seen(struct ring * ring) {
+	__atomic_store_n(&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,86 @@
+// ioring.h - Batched asynchronous system calls
+//
+// An ioring is a pair of rings in user memory that a process shares with the
+// kernel. The process queues requests (struct ring_sqe) on the submission ring
+// and hands them to the kernel with a single _ring_enter call. Kernel worker
+// threads carry them out concurrently and post a result (struct ring_cqe) on
+// the completion ring for each. Completions may arrive out of order; /data/ is
+// copied from the request to its completion to match them up.
+//
+// A request names a system call by its SYSCALL_* number (see scnum.h) and
+// carries its first three arguments. Only SYSCALL_READ, SYSCALL_WRITE,
+// SYSCALL_READV, SYSCALL_WRITEV, SYSCALL_IOCTL, SYSCALL_FSOPEN, SYSCALL_CLOSE,
+// SYSCALL_USLEEP and SYSCALL_NANOSLEEP are supported; others complete with
+// -EINVAL. Buffers and
+// strings must stay valid until the request completes.
+//
+// The layout of struct ring is shared with the kernel (kern/ioring.c). Indices
+// run freely and are reduced modulo RING_ENTRIES: the submission ring holds the
+// requests in [sq_head,sq_tail), and the completion ring the results in
+// [cq_head,cq_tail). The process only writes sq_tail and cq_head, the kernel
+// only sq_head and cq_tail.
+//
+
+#ifndef _IORING_H_
+#define _IORING_H_
+
+#include "scnum.h"
+
+// EXPORTED CONSTANTS
+//
+
+#define RING_ENTRIES 32 // must be a power of two
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct ring_sqe {
+    unsigned long op; // SYSCALL_* number
+    unsigned long arg[3]; // system call arguments
+    unsigned long data; // copied to completion
+};
+
+struct ring_cqe {
+    unsigned long data; // from request
+    long result; // system call return value
+};
+
+struct ring {
+    volatile unsigned int sq_head;
+    volatile unsigned int sq_tail;
+    volatile unsigned int cq_head;
+    volatile unsigned int cq_tail;
+    struct ring_sqe sq[RING_ENTRIES];
+    struct ring_cqe cq[RING_ENTRIES];
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// int ring_init(struct ring * ring)
+// Clears /ring/ and registers it with the kernel as the process's ioring (see
+// _ring_setup). Returns 0 on success or a negative error code.
+
+extern int ring_init(struct ring * ring);
+
+// struct ring_sqe * ring_get_sqe(struct ring * ring)
+// Returns the next free submission ring entry, or NULL if the ring is full.
+// The entry is queued by ring_submit.
+
+extern struct ring_sqe * ring_get_sqe(struct ring * ring);
+
+// int ring_submit(struct ring * ring, unsigned int min_complete)
+// Hands all entries obtained from ring_get_sqe to the kernel, and waits until
+// at least /min_complete/ completions are available. Returns the number of
+// entries the kernel accepted (see _ring_enter).
+
+extern int ring_submit(struct ring * ring, unsigned int min_complete);
+
+// struct ring_cqe * ring_peek_cqe(struct ring * ring)
+// Returns the oldest completion not yet consumed, or NULL if there is none.
+// ring_cqe_seen consumes it.
+
+extern struct ring_cqe * ring_peek_cqe(struct ring * ring);
+extern void ring_cqe_seen(struct ring * ring);
+
+#endif // _IORING_H_
@@ -0,0 +1,48 @@
+// lockstat.c - Print lock contention statistics
+//
+// Reads the table of the "lockstat" device once and writes it to ser1. The
+// device only exists in kernels built with -DLOCK_STATS (see kern/lock.h).
+//
+
+#include "syscall.h"
+#include "string.h"
+
+#define LOCKSTAT_BUFSZ 8192
+
+void main(void) {
+    static char buf[LOCKSTAT_BUFSZ];
+    long len, n, pos;
+    int result;
+
+    result = _devopen(0, "lockstat", 0);
+
+    if (result < 0) {
+        _msgout("lockstat: _devopen lockstat failed");
+        _exit();
+    }
+
+    result = _devopen(1, "ser", 1);
+
+    if (result < 0) {
+        _msgout("lockstat: _devopen ser1 failed");
+        _exit();
+    }
+
+    len = _read(0, buf, sizeof(buf));
+
+    if (len < 0) {
+        _msgout("lockstat: _read failed");
+        _exit();
+    }
+
+    for (pos = 0; pos < len; pos += n) {
+        n = _write(1, buf + pos, len - pos);
+
+        if (n <= 0) {
+            _msgout("lockstat: _write failed");
+            _exit();
+        }
+    }
+
+    _exit();
+}
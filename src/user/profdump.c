@@ -0,0 +1,54 @@
+// profdump.c - Copy profiler samples to a serial port
+//
+// Reads struct prof_sample records (see kern/prof.h) from the "prof" device
+// and writes them unchanged to ser2 until the machine is stopped. On the host,
+// put the pty QEMU connected to the third serial port in raw mode and save its
+// output, for example with
+//
+//     stty -F /dev/pts/N raw && cat /dev/pts/N > prof.bin
+//
+// then symbolize it with util/profsym.
+//
+
+#include "syscall.h"
+#include "string.h"
+
+#define PROFDUMP_BUFSZ 4096
+
+void main(void) {
+    static char buf[PROFDUMP_BUFSZ];
+    long len, n, pos;
+    int result;
+
+    result = _devopen(0, "prof", 0);
+
+    if (result < 0) {
+        _msgout("profdump: _devopen prof failed");
+        _exit();
+    }
+
+    result = _devopen(1, "ser", 2);
+
+    if (result < 0) {
+        _msgout("profdump: _devopen ser2 failed");
+        _exit();
+    }
+
+    for (;;) {
+        len = _read(0, buf, sizeof(buf));
+
+        if (len < 0) {
+            _msgout("profdump: _read failed");
+            _exit();
+        }
+
+        for (pos = 0; pos < len; pos += n) {
+            n = _write(1, buf + pos, len - pos);
+
+            if (n <= 0) {
+                _msgout("profdump: _write failed");
+                _exit();
+            }
+        }
+    }
+}
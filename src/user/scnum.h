@@ -14,12 +14,24 @@
 #define SYSCALL_READ    21
 #define SYSCALL_WRITE   22
 #define SYSCALL_IOCTL   23
+#define SYSCALL_READV   24
+#define SYSCALL_WRITEV  25
+#define SYSCALL_PREAD   26
+#define SYSCALL_PWRITE  27
 
 #define SYSCALL_EXEC    30
 #define SYSCALL_FORK    31
+#define SYSCALL_THREAD_CREATE   32
 
 #define SYSCALL_USLEEP  40
 #define SYSCALL_WAIT    41
+#define SYSCALL_NANOSLEEP   42
+
+#define SYSCALL_FUTEX_WAIT  50
+#define SYSCALL_FUTEX_WAKE  51
+
+#define SYSCALL_RING_SETUP  60
+#define SYSCALL_RING_ENTER  61
 
 
 #endif // _SCNUM_H_
@@ -0,0 +1,54 @@
+// stats.h - System call and process statistics
+//
+// Reading sizeof(struct stats) bytes from the "stats" device returns a struct
+// stats: a snapshot of the number and latency of calls to each system call, and
+// of the CPU time and context switches of each process. Smaller reads return
+// the snapshot in pieces; a new one is taken when the last was read to its end.
+// Counters run from boot, so a monitor subtracts successive snapshots to get
+// rates (see top.c).
+//
+// Latency is measured from system call dispatch to return, so it includes any
+// time the caller spent blocked. hist[0] counts calls that took less than 1 us
+// and hist[b] calls that took [2^(b-1),2^b) us, with the last bucket also
+// counting all longer calls. Times are in timer ticks of 100 ns.
+//
+// The layout of struct stats is shared with the kernel (kern/stats.c).
+//
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+// EXPORTED CONSTANTS
+//
+
+#define STATS_NSYSCALLS 64 // system call numbers, see scnum.h
+#define STATS_NBUCKETS 24 // latency histogram buckets
+#define STATS_NPROC 32 // most processes in a snapshot
+#define STATS_TICKS_PER_US 10
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct stats_syscall {
+    unsigned long count; // calls returned
+    unsigned long time; // total latency, in timer ticks
+    unsigned long hist[STATS_NBUCKETS];
+};
+
+struct stats_proc {
+    int pid;
+    int nthr; // threads that have not exited
+    unsigned long cpu_time; // in timer ticks
+    unsigned long nvcsw; // times its threads blocked or exited
+    unsigned long nivcsw; // times its threads were preempted or yielded
+};
+
+struct stats {
+    unsigned long time; // when snapshot was taken, in timer ticks
+    unsigned int ncpu; // harts running threads
+    unsigned int nproc; // entries of proc used, lowest pids first
+    struct stats_syscall syscall[STATS_NSYSCALLS];
+    struct stats_proc proc[STATS_NPROC];
+};
+
+#endif // _STATS_H_
@@ -12,11 +12,88 @@ extern int _close(int fd);
 extern long _read(int fd, void * buf, size_t bufsz);
 extern long _write(int fd, const void * buf, size_t len);
 extern int _ioctl(int fd, const int cmd, void * arg);
+
+// long _pread(int fd, void * buf, size_t bufsz, unsigned long pos)
+// long _pwrite(int fd, const void * buf, size_t len, unsigned long pos)
+// Like _read and _write, but transfer at position /pos/ in the file and leave
+// the file position unchanged. Processes sharing an open file can use them
+// without seeking first.
+
+extern long _pread(int fd, void * buf, size_t bufsz, unsigned long pos);
+extern long _pwrite(int fd, const void * buf, size_t len, unsigned long pos);
+
+// long _readv(int fd, const struct iovec * iov, int iovcnt)
+// long _writev(int fd, const struct iovec * iov, int iovcnt)
+// Read into or write from the /iovcnt/ buffers in /iov/, in order, in one
+// system call. Stop early at a short transfer. Return the total number of
+// bytes transferred, or a negative error code if there was none. At most
+// IOV_MAX buffers may be given.
+
+#define IOV_MAX 16
+
+struct iovec {
+    void * iov_base;
+    size_t iov_len;
+};
+
+extern long _readv(int fd, const struct iovec * iov, int iovcnt);
+extern long _writev(int fd, const struct iovec * iov, int iovcnt);
 extern int _devopen(int fd, const char * name, int instno);
 extern int _fsopen(int fd, const char * name);
 extern int _exec(int fd);
 extern int _fork(void);
+
+// int _thread_create(void (*entry)(void *), void * stack, void * arg)
+// Starts a new thread in the calling process, running entry(arg) on the stack
+// whose (16-byte aligned) top is /stack/. The thread shares the memory and open
+// files of the process and exits when /entry/ returns or calls _exit. Returns
+// the thread id of the new thread, which the caller can pass to _wait.
+// The process ends when its last thread exits.
+
+extern int _thread_create(void (*entry)(void *), void * stack, void * arg);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
 
+// int _nanosleep(unsigned long ns)
+// Sleeps for at least /ns/ nanoseconds, rounded up to the timer resolution
+// (100 ns). Returns -EINVAL if /ns/ is 0.
+
+extern int _nanosleep(unsigned long ns);
+
+// unsigned long _clock_gettime(void)
+// Returns the time in nanoseconds since boot, from a monotonic clock. Reads
+// the time CSR directly, so it does not enter the kernel.
+
+extern unsigned long _clock_gettime(void);
+
+// int _futex_wait(volatile int * addr, int val)
+// Sleeps until woken by _futex_wake on the same address, provided *addr still
+// equals /val/ when the kernel checks it. Returns -EAGAIN at once if it does
+// not. May return spuriously, so callers must recheck their condition.
+
+extern int _futex_wait(volatile int * addr, int val);
+
+// int _futex_wake(volatile int * addr, int n)
+// Wakes up to /n/ threads waiting in _futex_wait on /addr/.
+
+extern int _futex_wake(volatile int * addr, int n);
+
+struct ring; // ioring.h
+
+// int _ring_setup(struct ring * ring)
+// Registers /ring/ as the ioring of the calling process (see ioring.h). Returns
+// 0, -EINVAL if /ring/ is misaligned, -EFAULT if it is not in user memory, or
+// -EBUSY if the process already has a ring.
+
+extern int _ring_setup(struct ring * ring);
+
+// int _ring_enter(unsigned int to_submit, unsigned int min_complete)
+// Hands up to /to_submit/ requests from the submission ring to the kernel, then
+// waits until at least /min_complete/ completions are available or no more are
+// pending. Requests are only taken while there is room for their completions.
+// Returns the number of requests taken, -EINVAL if there is no ring, or -EFAULT
+// if the kernel could not access the ring.
+
+extern int _ring_enter(unsigned int to_submit, unsigned int min_complete);
+
 #endif // _SYSCALL_H_
@@ -0,0 +1,134 @@
+// test_ioring.c - Test _ring_setup, _ring_enter and the ring library
+//
+// Sets up a ring and checks:
+//
+//   - a second _ring_setup fails with -EBUSY;
+//   - NSLEEP usleep requests submitted together all complete, each once; the
+//     time they took shows whether the workers ran them concurrently;
+//   - a read through the ring returns the same bytes as _pread;
+//   - a read into an invalid buffer and an unsupported system call complete
+//     with an error instead of affecting the kernel.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "error.h"
+#include "ioring.h"
+#include "io.h"
+
+#define NSLEEP 8
+#define SLEEP_US 20000
+
+static struct ring ring __attribute__ ((aligned(8)));
+static char ring_buf[64];
+static char direct_buf[64];
+
+static void fail(const char * msg) {
+    _msgout(msg);
+    _msgout("test_ioring: FAILED");
+    _exit();
+}
+
+// Submits one request and returns its result.
+
+static long run_one(unsigned long op,
+    unsigned long a0, unsigned long a1, unsigned long a2)
+{
+    struct ring_sqe * sqe;
+    struct ring_cqe * cqe;
+    long result;
+
+    sqe = ring_get_sqe(&ring);
+    sqe->op = op;
+    sqe->arg[0] = a0;
+    sqe->arg[1] = a1;
+    sqe->arg[2] = a2;
+    sqe->data = op;
+
+    if (ring_submit(&ring, 1) != 1)
+        fail("test_ioring: ring_submit failed");
+
+    cqe = ring_peek_cqe(&ring);
+
+    if (cqe == NULL || cqe->data != op)
+        fail("test_ioring: missing completion");
+
+    result = cqe->result;
+    ring_cqe_seen(&ring);
+    return result;
+}
+
+void main(void) {
+    unsigned long start, elapsed;
+    struct ring_sqe * sqe;
+    struct ring_cqe * cqe;
+    int seen[NSLEEP];
+    char msg[80];
+    long len;
+    int i, n;
+
+    if (ring_init(&ring) != 0)
+        fail("test_ioring: ring_init failed");
+
+    if (_ring_setup(&ring) != -EBUSY)
+        fail("test_ioring: second _ring_setup did not fail with -EBUSY");
+
+    // Concurrent sleeps
+
+    for (i = 0; i < NSLEEP; i++) {
+        sqe = ring_get_sqe(&ring);
+        sqe->op = SYSCALL_USLEEP;
+        sqe->arg[0] = SLEEP_US;
+        sqe->data = i;
+        seen[i] = 0;
+    }
+
+    start = _clock_gettime();
+
+    if (ring_submit(&ring, NSLEEP) != NSLEEP)
+        fail("test_ioring: ring_submit did not take all sleeps");
+
+    elapsed = _clock_gettime() - start;
+
+    for (n = 0; (cqe = ring_peek_cqe(&ring)) != NULL; n++) {
+        if (NSLEEP <= cqe->data || seen[cqe->data] || cqe->result != 0)
+            fail("test_ioring: bad sleep completion");
+
+        seen[cqe->data] = 1;
+        ring_cqe_seen(&ring);
+    }
+
+    if (n != NSLEEP)
+        fail("test_ioring: wrong number of sleep completions");
+
+    snprintf(msg, sizeof(msg), "test_ioring: %d sleeps of %d us took %lu us",
+        NSLEEP, SLEEP_US, elapsed / 1000);
+    _msgout(msg);
+
+    // Read through the ring and directly
+
+    if (_fsopen(0, "testfile.txt") < 0)
+        fail("test_ioring: _fsopen failed");
+
+    len = run_one(SYSCALL_READ, 0, (unsigned long)ring_buf, sizeof(ring_buf));
+
+    if (len <= 0)
+        fail("test_ioring: read through ring failed");
+
+    if (_pread(0, direct_buf, len, 0) != len ||
+        memcmp(ring_buf, direct_buf, len) != 0)
+    {
+        fail("test_ioring: read through ring returned wrong data");
+    }
+
+    // Errors
+
+    if (run_one(SYSCALL_READ, 0, 16, sizeof(ring_buf)) >= 0)
+        fail("test_ioring: read into invalid buffer did not fail");
+
+    if (run_one(SYSCALL_FORK, 0, 0, 0) != -EINVAL)
+        fail("test_ioring: unsupported system call did not fail");
+
+    _msgout("test_ioring: passed");
+    _exit();
+}
@@ -0,0 +1,108 @@
+// test_pio.c - Test _pread, _pwrite, _readv and _writev
+//
+// Works on testfile.txt, which is at least 30 bytes long. Checks that _pread
+// and _pwrite transfer at the given position and leave the file position
+// alone, that _writev and _readv transfer their buffers in order and advance
+// the file position by the total, and that bad arguments are rejected.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "io.h"
+
+static void fail(const char * msg) {
+    _msgout(msg);
+    _msgout("test_pio: FAILED");
+    _exit();
+}
+
+static uint64_t getpos(int fd) {
+    uint64_t pos;
+
+    if (_ioctl(fd, IOCTL_GETPOS, &pos) < 0)
+        fail("test_pio: IOCTL_GETPOS failed");
+
+    return pos;
+}
+
+static void setpos(int fd, uint64_t pos) {
+    if (_ioctl(fd, IOCTL_SETPOS, &pos) < 0)
+        fail("test_pio: IOCTL_SETPOS failed");
+}
+
+void main(void) {
+    char one[4], two[4], buf[16];
+    struct iovec iov[IOV_MAX + 1];
+    int fd;
+
+    fd = _fsopen(0, "testfile.txt");
+
+    if (fd < 0)
+        fail("test_pio: _fsopen failed");
+
+    // _pwrite and _pread at a position
+
+    if (_pwrite(fd, "ABCD", 4, 10) != 4)
+        fail("test_pio: _pwrite failed");
+
+    if (getpos(fd) != 0)
+        fail("test_pio: _pwrite moved the file position");
+
+    if (_pread(fd, buf, 4, 10) != 4 || memcmp(buf, "ABCD", 4) != 0)
+        fail("test_pio: _pread did not read what _pwrite wrote");
+
+    if (getpos(fd) != 0)
+        fail("test_pio: _pread moved the file position");
+
+    // _writev and _readv at the file position
+
+    setpos(fd, 20);
+    iov[0].iov_base = "one";
+    iov[0].iov_len = 3;
+    iov[1].iov_base = "";
+    iov[1].iov_len = 0;
+    iov[2].iov_base = "-two";
+    iov[2].iov_len = 4;
+
+    if (_writev(fd, iov, 3) != 7)
+        fail("test_pio: _writev failed");
+
+    if (getpos(fd) != 27)
+        fail("test_pio: _writev did not advance the file position");
+
+    if (_pread(fd, buf, 7, 20) != 7 || memcmp(buf, "one-two", 7) != 0)
+        fail("test_pio: _writev wrote the wrong data");
+
+    setpos(fd, 20);
+    iov[0].iov_base = one;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = two;
+    iov[1].iov_len = 4;
+
+    if (_readv(fd, iov, 2) != 7)
+        fail("test_pio: _readv failed");
+
+    if (memcmp(one, "one", 3) != 0 || memcmp(two, "-two", 4) != 0)
+        fail("test_pio: _readv read the wrong data");
+
+    if (getpos(fd) != 27)
+        fail("test_pio: _readv did not advance the file position");
+
+    // Bad arguments
+
+    if (_pread(fd, (void *)16, 4, 0) >= 0)
+        fail("test_pio: _pread into a bad buffer did not fail");
+
+    if (_readv(fd, iov, IOV_MAX + 1) >= 0)
+        fail("test_pio: _readv with too many buffers did not fail");
+
+    if (_readv(fd, (void *)16, 1) >= 0)
+        fail("test_pio: _readv with a bad iovec array did not fail");
+
+    if (_pread(-1, buf, 4, 0) >= 0)
+        fail("test_pio: _pread on a bad descriptor did not fail");
+
+    _close(fd);
+    _msgout("test_pio: passed");
+    _exit();
+}
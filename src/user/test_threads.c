@@ -0,0 +1,130 @@
+// test_threads.c - Test _thread_create, joining threads and process teardown
+//
+// Starts NTHR threads that each write to a global array, to a variable on the
+// main thread's stack and to their own stack, then joins them with _wait and
+// checks that all writes are visible, which they only are if the threads share
+// the address space. Then starts two threads that outlive the main thread: the
+// main thread exits first, one straggler returns from its entry function and
+// the last calls _exit, which tears down the process. The stragglers print a
+// message when they exit, so the output shows that the process lived on after
+// its main thread.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "error.h"
+
+#define NTHR 4
+#define NSTRAGGLER 2
+#define STACK_SIZE 4096
+
+struct worker_arg {
+    int id;
+    volatile int * sum; // on the main thread's stack
+    int local; // copied from the worker's stack
+};
+
+static struct worker_arg args[NTHR];
+static volatile int seen[NTHR];
+static char stacks[NTHR + NSTRAGGLER][STACK_SIZE] __attribute__ ((aligned(16)));
+
+static void worker(void * aux) {
+    struct worker_arg * const arg = aux;
+    volatile int local = arg->id * 10;
+
+    seen[arg->id] = arg->id + 1;
+    __atomic_fetch_add(arg->sum, arg->id + 1, __ATOMIC_RELAXED);
+    arg->local = local;
+}
+
+static void straggler(void * aux) {
+    const int id = (int)(long)aux;
+    char msg[64];
+
+    _usleep(100000 * (id + 1)); // let the main thread exit first
+
+    snprintf(msg, sizeof(msg), "test_threads: straggler %d exiting", id);
+    _msgout(msg);
+
+    if (id == NSTRAGGLER - 1)
+        _exit(); // last thread of the process
+
+    // Otherwise return to _thread_start, which calls _exit
+}
+
+void main(void) {
+    volatile int sum = 0;
+    int tid[NTHR];
+    char msg[64];
+    int i, result;
+
+    // Stacks must be 16-byte aligned and in user memory
+
+    result = _thread_create(worker, stacks[0] + STACK_SIZE - 8, &args[0]);
+
+    if (result != -EINVAL) {
+        _msgout("test_threads: misaligned stack not rejected");
+        _exit();
+    }
+
+    result = _thread_create(worker, (void *)16, &args[0]);
+
+    if (result != -EINVAL) {
+        _msgout("test_threads: stack outside user memory not rejected");
+        _exit();
+    }
+
+    // Start and join workers
+
+    for (i = 0; i < NTHR; i++) {
+        args[i].id = i;
+        args[i].sum = &sum;
+        args[i].local = -1;
+        tid[i] = _thread_create(worker, stacks[i] + STACK_SIZE, &args[i]);
+
+        if (tid[i] < 0) {
+            _msgout("test_threads: _thread_create failed");
+            _exit();
+        }
+    }
+
+    for (i = 0; i < NTHR; i++) {
+        if (_wait(tid[i]) < 0) {
+            _msgout("test_threads: _wait failed");
+            _exit();
+        }
+    }
+
+    for (i = 0; i < NTHR; i++) {
+        if (seen[i] != i + 1 || args[i].local != i * 10) {
+            snprintf(msg, sizeof(msg),
+                "test_threads: worker %d writes not seen", i);
+            _msgout(msg);
+            _msgout("test_threads: FAILED");
+            _exit();
+        }
+    }
+
+    if (sum != NTHR * (NTHR + 1) / 2) {
+        _msgout("test_threads: writes to main stack not seen");
+        _msgout("test_threads: FAILED");
+        _exit();
+    }
+
+    _msgout("test_threads: workers joined");
+
+    // Exit with threads still running
+
+    for (i = 0; i < NSTRAGGLER; i++) {
+        result = _thread_create(straggler,
+            stacks[NTHR + i] + STACK_SIZE, (void *)(long)i);
+
+        if (result < 0) {
+            _msgout("test_threads: _thread_create failed");
+            _exit();
+        }
+    }
+
+    _msgout("test_threads: main thread exiting");
+    _exit();
+}
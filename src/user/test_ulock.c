@@ -0,0 +1,103 @@
+// test_ulock.c - Test _futex_wait, _futex_wake and ulock
+//
+// Starts NTHR threads that each increment a shared counter ITERS times under a
+// ulock. Each increment is a separate load and store, so updates are lost
+// unless the lock excludes the other threads. Every 64th increment, the holder
+// sleeps while holding the lock, so that the other threads find it contended
+// and wait in _futex_wait. Also checks that _futex_wait returns -EAGAIN at
+// once if the value has changed, and that ulock_tryacquire fails on a held
+// lock.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "error.h"
+#include "ulock.h"
+
+#define NTHR 4
+#define ITERS 1000
+#define STACK_SIZE 4096
+
+static struct ulock lock = ULOCK_INITIALIZER;
+static volatile int counter;
+static char stacks[NTHR][STACK_SIZE] __attribute__ ((aligned(16)));
+
+static void incr(void * arg) {
+    int i, val;
+
+    for (i = 0; i < ITERS; i++) {
+        ulock_acquire(&lock);
+        val = counter;
+
+        if (i % 64 == 0)
+            _usleep(100);
+
+        counter = val + 1;
+        ulock_release(&lock);
+    }
+}
+
+void main(void) {
+    volatile int word = 1;
+    char msg[64];
+    int tid[NTHR];
+    int i;
+
+    // _futex_wait must not sleep if the value has changed
+
+    if (_futex_wait(&word, 0) != -EAGAIN) {
+        _msgout("_futex_wait did not return -EAGAIN");
+        _exit();
+    }
+
+    // Waking with no waiters succeeds
+
+    if (_futex_wake(&word, 1) != 0) {
+        _msgout("_futex_wake failed");
+        _exit();
+    }
+
+    // ulock_tryacquire on a held lock
+
+    ulock_acquire(&lock);
+
+    if (ulock_tryacquire(&lock)) {
+        _msgout("ulock_tryacquire acquired a held lock");
+        _exit();
+    }
+
+    ulock_release(&lock);
+
+    if (!ulock_tryacquire(&lock)) {
+        _msgout("ulock_tryacquire failed on a free lock");
+        _exit();
+    }
+
+    ulock_release(&lock);
+
+    // Contended increments
+
+    for (i = 0; i < NTHR; i++) {
+        tid[i] = _thread_create(incr, stacks[i] + STACK_SIZE, NULL);
+
+        if (tid[i] < 0) {
+            _msgout("_thread_create failed");
+            _exit();
+        }
+    }
+
+    for (i = 0; i < NTHR; i++)
+        _wait(tid[i]);
+
+    snprintf(msg, sizeof(msg), "counter = %d, expected %d",
+        counter, NTHR * ITERS);
+    _msgout(msg);
+
+    if (counter != NTHR * ITERS) {
+        _msgout("test_ulock: FAILED");
+        _exit();
+    }
+
+    _msgout("test_ulock: passed");
+    _exit();
+}
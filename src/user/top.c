@@ -0,0 +1,211 @@
+// top.c - Show system call and process statistics on ser1
+//
+// Reads a snapshot from the "stats" device (see stats.h) every TOP_INTERVAL_US
+// and redraws ser1 with the rates since the previous one. For each process, it
+// shows its CPU time as a percentage of one hart (PCPU) and its context
+// switches per second. For each system call that returned in the interval,
+// busiest first, it shows calls per second, the mean latency, and the 50th and
+// 99th percentile latencies, rounded up to the histogram bucket they fall in.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "stats.h"
+#include "scnum.h"
+
+#define TOP_INTERVAL_US 1000000
+#define TOP_TICKS_PER_SEC (STATS_TICKS_PER_US * 1000000UL)
+
+static void show(const struct stats * prev, const struct stats * cur);
+static void show_procs(const struct stats * prev, const struct stats * cur);
+static void show_syscalls(const struct stats * prev, const struct stats * cur);
+static unsigned long percentile (
+    const struct stats_syscall * prev, const struct stats_syscall * cur,
+    unsigned long count, unsigned int pct);
+static void out(const char * fmt, ...);
+
+static const char * const syscall_names[STATS_NSYSCALLS] = {
+    [SYSCALL_EXIT] = "exit",
+    [SYSCALL_MSGOUT] = "msgout",
+    [SYSCALL_DEVOPEN] = "devopen",
+    [SYSCALL_FSOPEN] = "fsopen",
+    [SYSCALL_CLOSE] = "close",
+    [SYSCALL_READ] = "read",
+    [SYSCALL_WRITE] = "write",
+    [SYSCALL_IOCTL] = "ioctl",
+    [SYSCALL_READV] = "readv",
+    [SYSCALL_WRITEV] = "writev",
+    [SYSCALL_PREAD] = "pread",
+    [SYSCALL_PWRITE] = "pwrite",
+    [SYSCALL_EXEC] = "exec",
+    [SYSCALL_FORK] = "fork",
+    [SYSCALL_THREAD_CREATE] = "thread_create",
+    [SYSCALL_USLEEP] = "usleep",
+    [SYSCALL_WAIT] = "wait",
+    [SYSCALL_NANOSLEEP] = "nanosleep",
+    [SYSCALL_FUTEX_WAIT] = "futex_wait",
+    [SYSCALL_FUTEX_WAKE] = "futex_wake",
+    [SYSCALL_RING_SETUP] = "ring_setup",
+    [SYSCALL_RING_ENTER] = "ring_enter"
+};
+
+static struct stats snap[2];
+static char screen[4096];
+static size_t screen_len;
+
+void main(void) {
+    int cur = 0;
+    long len;
+    int n;
+    int result;
+
+    result = _devopen(0, "stats", 0);
+
+    if (result < 0) {
+        _msgout("top: _devopen stats failed");
+        _exit();
+    }
+
+    result = _devopen(1, "ser", 1);
+
+    if (result < 0) {
+        _msgout("top: _devopen ser1 failed");
+        _exit();
+    }
+
+    for (n = 0; ; n++) {
+        len = _read(0, &snap[cur], sizeof(struct stats));
+
+        if (len != sizeof(struct stats)) {
+            _msgout("top: _read failed");
+            _exit();
+        }
+
+        if (n != 0) {
+            show(&snap[1-cur], &snap[cur]);
+            _write(1, screen, screen_len);
+        }
+
+        cur = 1 - cur;
+        _usleep(TOP_INTERVAL_US);
+    }
+}
+
+void show(const struct stats * prev, const struct stats * cur) {
+    screen_len = 0;
+    out("\033[H\033[2J"); // home cursor, clear screen
+    out("top - %u harts, %lu s since boot\r\n\r\n",
+        cur->ncpu, cur->time / TOP_TICKS_PER_SEC);
+
+    show_procs(prev, cur);
+    out("\r\n");
+    show_syscalls(prev, cur);
+}
+
+// Processes are listed in pid order in both snapshots, so they can be matched
+// up in one pass. A pid only in the current snapshot is a new process.
+
+void show_procs(const struct stats * prev, const struct stats * cur) {
+    const unsigned long interval = cur->time - prev->time;
+    const struct stats_proc * p;
+    const struct stats_proc * q;
+    unsigned long cpu, nvcsw, nivcsw;
+    unsigned int i, j = 0;
+
+    out("  PID  THR  PCPU  VCSW/s IVCSW/s   TIME(s)\r\n");
+
+    for (i = 0; i < cur->nproc; i++) {
+        p = &cur->proc[i];
+
+        while (j < prev->nproc && prev->proc[j].pid < p->pid)
+            j += 1;
+
+        q = (j < prev->nproc && prev->proc[j].pid == p->pid) ?
+            &prev->proc[j] : NULL;
+
+        cpu = p->cpu_time - (q ? q->cpu_time : 0);
+        nvcsw = p->nvcsw - (q ? q->nvcsw : 0);
+        nivcsw = p->nivcsw - (q ? q->nivcsw : 0);
+
+        out("%5d %4d %5lu %7lu %7lu %9lu\r\n",
+            p->pid, p->nthr, 100 * cpu / interval,
+            nvcsw * TOP_TICKS_PER_SEC / interval,
+            nivcsw * TOP_TICKS_PER_SEC / interval,
+            p->cpu_time / TOP_TICKS_PER_SEC);
+    }
+}
+
+void show_syscalls(const struct stats * prev, const struct stats * cur) {
+    const unsigned long interval = cur->time - prev->time;
+    unsigned long count[STATS_NSYSCALLS];
+    int order[STATS_NSYSCALLS];
+    const struct stats_syscall * p;
+    const struct stats_syscall * q;
+    const char * name;
+    int n = 0;
+    int nr, i;
+
+    // Insertion sort of the system calls made in the interval, by count
+
+    for (nr = 0; nr < STATS_NSYSCALLS; nr++) {
+        count[nr] = cur->syscall[nr].count - prev->syscall[nr].count;
+
+        if (count[nr] == 0)
+            continue;
+
+        for (i = n; 0 < i && count[order[i-1]] < count[nr]; i--)
+            order[i] = order[i-1];
+
+        order[i] = nr;
+        n += 1;
+    }
+
+    out("SYSCALL         CALLS/s  AVG(us)  P50(us)  P99(us)\r\n");
+
+    for (i = 0; i < n; i++) {
+        nr = order[i];
+        p = &cur->syscall[nr];
+        q = &prev->syscall[nr];
+        name = syscall_names[nr] ? syscall_names[nr] : "?";
+
+        out("%14s %8lu %8lu %8lu %8lu\r\n",
+            name, count[nr] * TOP_TICKS_PER_SEC / interval,
+            (p->time - q->time) / count[nr] / STATS_TICKS_PER_US,
+            percentile(q, p, count[nr], 50),
+            percentile(q, p, count[nr], 99));
+    }
+}
+
+// Returns the upper bound, in us, of the histogram bucket holding the /pct/th
+// percentile of the /count/ calls between the two snapshots.
+
+unsigned long percentile (
+    const struct stats_syscall * prev, const struct stats_syscall * cur,
+    unsigned long count, unsigned int pct)
+{
+    unsigned long sum = 0;
+    int b;
+
+    for (b = 0; b < STATS_NBUCKETS - 1; b++) {
+        sum += cur->hist[b] - prev->hist[b];
+
+        if (100 * sum >= pct * count)
+            break;
+    }
+
+    return 1UL << b;
+}
+
+void out(const char * fmt, ...) {
+    va_list ap;
+    size_t n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(screen + screen_len, sizeof(screen) - screen_len, fmt, ap);
+    va_end(ap);
+
+    screen_len += n;
+
+    if (sizeof(screen) - 1 < screen_len)
+        screen_len = sizeof(screen) - 1;
+}
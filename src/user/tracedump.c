@@ -0,0 +1,50 @@
+// tracedump.c - Copy trace events to a serial port
+//
+// Reads struct ktrace_event records (see kern/ktrace.h) from the "ktrace"
+// device and writes them unchanged to ser2 until the machine is stopped. Save
+// them on the host as described in profdump.c, then decode them with
+// util/ktracedump.
+//
+
+#include "syscall.h"
+#include "string.h"
+
+#define TRACEDUMP_BUFSZ 4096
+
+void main(void) {
+    static char buf[TRACEDUMP_BUFSZ];
+    long len, n, pos;
+    int result;
+
+    result = _devopen(0, "ktrace", 0);
+
+    if (result < 0) {
+        _msgout("tracedump: _devopen ktrace failed");
+        _exit();
+    }
+
+    result = _devopen(1, "ser", 2);
+
+    if (result < 0) {
+        _msgout("tracedump: _devopen ser2 failed");
+        _exit();
+    }
+
+    for (;;) {
+        len = _read(0, buf, sizeof(buf));
+
+        if (len < 0) {
+            _msgout("tracedump: _read failed");
+            _exit();
+        }
+
+        for (pos = 0; pos < len; pos += n) {
+            n = _write(1, buf + pos, len - pos);
+
+            if (n <= 0) {
+                _msgout("tracedump: _write failed");
+                _exit();
+            }
+        }
+    }
+}
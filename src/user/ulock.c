@@ -0,0 +1,49 @@
+//           ulock.c - User-space mutual exclusion lock
+//          
+
+#include "ulock.h"
+#include "syscall.h"
+
+//           EXPORTED FUNCTION DEFINITIONS
+//           
+
+void ulock_init(struct ulock * lk) {
+	lk->state = 0;
+}
+
+void ulock_acquire(struct ulock * lk) {
+	int c = 0;
+
+	// Fast path: the lock is free.
+
+	if (__atomic_compare_exchange_n(&lk->state, &c, 1,
+		0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+
+	// Mark the lock contended so the holder knows to wake us, then sleep
+	// until we are the one who changes it from free to contended. Since we
+	// cannot tell whether other threads are still waiting, we keep the lock
+	// marked contended once we own it.
+
+	if (c != 2)
+		c = __atomic_exchange_n(&lk->state, 2, __ATOMIC_ACQUIRE);
+
+	while (c != 0) {
+		_futex_wait(&lk->state, 2);
+		c = __atomic_exchange_n(&lk->state, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+int ulock_tryacquire(struct ulock * lk) {
+	int c = 0;
+
+	return __atomic_compare_exchange_n(&lk->state, &c, 1,
+		0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void ulock_release(struct ulock * lk) {
+	if (__atomic_exchange_n(&lk->state, 0, __ATOMIC_RELEASE) == 2)
+		_futex_wake(&lk->state, 1);
+}
@@ -0,0 +1,34 @@
+// ulock.h - User-space mutual exclusion lock
+//
+// A ulock is a mutex built on _futex_wait and _futex_wake. Acquiring a free
+// lock or releasing a lock no other thread is waiting for takes a single
+// atomic instruction and no system call; a thread only enters the kernel to
+// sleep on a contended lock or to wake a sleeping waiter. A zero-initialized
+// ulock is unlocked.
+//
+
+#ifndef _ULOCK_H_
+#define _ULOCK_H_
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct ulock {
+    volatile int state; // 0 free, 1 held, 2 held and possibly contended
+};
+
+#define ULOCK_INITIALIZER { .state = 0 }
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+extern void ulock_init(struct ulock * lk);
+extern void ulock_acquire(struct ulock * lk);
+
+// int ulock_tryacquire(struct ulock * lk)
+// Acquires the lock if it is free and returns 1; otherwise returns 0 at once.
+
+extern int ulock_tryacquire(struct ulock * lk);
+extern void ulock_release(struct ulock * lk);
+
+#endif // _ULOCK_H_
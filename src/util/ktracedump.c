@@ -0,0 +1,379 @@
+// ktracedump.c - Decode kernel trace events
+//
+// Usage: ktracedump [-t] < trace.bin
+//
+// Reads struct ktrace_event records (see kern/ktrace.h), as copied out of the
+// machine by user/tracedump, and sorts them by time. With -t, prints each event
+// on a line of the timeline, with the time in microseconds since the first
+// event:
+//
+//     1234.5 hart 0 tid 3 switch to tid 1 (waiting)
+//
+// Then prints the time each thread spent running, reconstructed from the
+// switch events, and histograms of the latency of block requests (submit to
+// complete), of how late sleeping threads woke up, and of each system call
+// (enter to exit), in power-of-two buckets of microseconds.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../kern/ktrace.h"
+#include "../user/scnum.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define TIMER_FREQ 10000000UL // mtime rate, as in kern/timer.h
+#define NTID 32768 // tids are int16_t
+#define NHARTS 256 // harts are uint8_t
+#define NBUCKETS 32
+#define NSYSCALLS 64 // SYSCALL_TABLE_SIZE in kern/syscall.c
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct hist {
+    const char * name;
+    uint64_t count;
+    uint64_t bucket[NBUCKETS];
+};
+
+// A thread has at most one block request and one system call in progress.
+
+struct thread_state {
+    uint64_t blk_time; // time of pending block request
+    uint64_t syscall_time; // time of pending system call
+    int syscall_nr; // -2 if none pending
+    char blk_pending;
+    char seen;
+    uint64_t run_time;
+    uint64_t nswitch;
+};
+
+// The thread running on a hart, from the last switch on it.
+
+struct hart_state {
+    uint64_t start; // 0 if no switch seen yet
+    int tid;
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const char * const syscall_names[NSYSCALLS] = {
+    [SYSCALL_EXIT] = "exit",
+    [SYSCALL_MSGOUT] = "msgout",
+    [SYSCALL_DEVOPEN] = "devopen",
+    [SYSCALL_FSOPEN] = "fsopen",
+    [SYSCALL_CLOSE] = "close",
+    [SYSCALL_READ] = "read",
+    [SYSCALL_WRITE] = "write",
+    [SYSCALL_IOCTL] = "ioctl",
+    [SYSCALL_READV] = "readv",
+    [SYSCALL_WRITEV] = "writev",
+    [SYSCALL_PREAD] = "pread",
+    [SYSCALL_PWRITE] = "pwrite",
+    [SYSCALL_EXEC] = "exec",
+    [SYSCALL_FORK] = "fork",
+    [SYSCALL_THREAD_CREATE] = "thread_create",
+    [SYSCALL_USLEEP] = "usleep",
+    [SYSCALL_WAIT] = "wait",
+    [SYSCALL_NANOSLEEP] = "nanosleep",
+    [SYSCALL_FUTEX_WAIT] = "futex_wait",
+    [SYSCALL_FUTEX_WAKE] = "futex_wake",
+    [SYSCALL_RING_SETUP] = "ring_setup",
+    [SYSCALL_RING_ENTER] = "ring_enter"
+};
+
+static const char * const state_names[] = {
+    "uninitialized", "stopped", "waiting", "running", "ready", "exited"
+};
+
+static struct thread_state threads[NTID];
+static struct hist blk_hist[2] = { { "block reads" }, { "block writes" } };
+static struct hist wake_hist = { "sleep wake-up lateness" };
+static struct hist syscall_hist[NSYSCALLS];
+static struct hart_state harts[NHARTS];
+static uint64_t t0;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void print_event(const struct ktrace_event * ev);
+static void account_event(const struct ktrace_event * ev);
+static void hist_add(struct hist * h, uint64_t ticks);
+static void hist_print(const struct hist * h);
+static const char * syscall_name(int nr);
+static double to_us(uint64_t ticks);
+static int compare_event_ptrs(const void * a, const void * b);
+static void * xrealloc(void * ptr, size_t size);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int main(int argc, char * argv[]) {
+    const struct ktrace_event ** order;
+    struct ktrace_event * evs = NULL;
+    struct hart_state * hart;
+    struct thread_state * thr;
+    size_t nevs = 0;
+    size_t cap = 0;
+    int timeline = 0;
+    size_t i;
+    int opt;
+    int nr;
+    int tid;
+
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        switch (opt) {
+        case 't':
+            timeline = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t] < trace.bin\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (;;) {
+        if (nevs == cap) {
+            cap = cap ? 2*cap : 4096;
+            evs = xrealloc(evs, cap * sizeof(struct ktrace_event));
+        }
+
+        if (fread(&evs[nevs], sizeof(struct ktrace_event), 1, stdin) != 1)
+            break;
+
+        if (evs[nevs].event < KTRACE_SWITCH ||
+            KTRACE_SYSCALL_EXIT < evs[nevs].event)
+        {
+            fprintf(stderr, "%s: bad event, input out of sync?\n", argv[0]);
+            return 1;
+        }
+
+        nevs += 1;
+    }
+
+    if (nevs == 0)
+        return 0;
+
+    // Each hart's events are in order, but the device does not merge them.
+
+    order = xrealloc(NULL, nevs * sizeof(struct ktrace_event *));
+
+    for (i = 0; i < nevs; i++)
+        order[i] = &evs[i];
+
+    qsort(order, nevs, sizeof(struct ktrace_event *), compare_event_ptrs);
+    t0 = order[0]->time;
+
+    for (nr = 0; nr < NSYSCALLS; nr++)
+        syscall_hist[nr].name = syscall_name(nr);
+
+    for (tid = 0; tid < NTID; tid++)
+        threads[tid].syscall_nr = -2;
+
+    for (i = 0; i < nevs; i++) {
+        if (timeline)
+            print_event(order[i]);
+        account_event(order[i]);
+    }
+
+    if (timeline)
+        printf("\n");
+
+    // Threads still running at the end of the trace ran until its last event.
+
+    for (i = 0; i < NHARTS; i++) {
+        hart = &harts[i];
+
+        if (hart->start != 0)
+            threads[hart->tid].run_time += order[nevs-1]->time - hart->start;
+    }
+
+    printf("%6s %12s %8s\n", "tid", "run (us)", "switches");
+
+    for (tid = 0; tid < NTID; tid++) {
+        thr = &threads[tid];
+
+        if (thr->seen)
+            printf("%6d %12.1f %8lu\n", tid, to_us(thr->run_time),
+                (unsigned long)thr->nswitch);
+    }
+
+    hist_print(&blk_hist[0]);
+    hist_print(&blk_hist[1]);
+    hist_print(&wake_hist);
+
+    for (nr = 0; nr < NSYSCALLS; nr++)
+        hist_print(&syscall_hist[nr]);
+
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void print_event(const struct ktrace_event * ev) {
+    printf("%12.1f hart %u tid %d ", to_us(ev->time - t0), ev->hart, ev->tid);
+
+    switch (ev->event) {
+    case KTRACE_SWITCH:
+        printf("switch to tid %d (%s)\n", (int)ev->arg[0],
+            (ev->arg[1] < 6) ? state_names[ev->arg[1]] : "?");
+        break;
+    case KTRACE_COND_WAIT:
+        printf("wait 0x%lx\n", (unsigned long)ev->arg[0]);
+        break;
+    case KTRACE_COND_BCAST:
+        printf("broadcast 0x%lx\n", (unsigned long)ev->arg[0]);
+        break;
+    case KTRACE_BLK_SUBMIT:
+        printf("block %s sector %lu submit\n", ev->arg[1] ? "write" : "read",
+            (unsigned long)ev->arg[0]);
+        break;
+    case KTRACE_BLK_COMPLETE:
+        printf("block %s sector %lu complete\n", ev->arg[1] ? "write" : "read",
+            (unsigned long)ev->arg[0]);
+        break;
+    case KTRACE_ALARM_SLEEP:
+        printf("sleep until %.1f\n",
+            (t0 <= ev->arg[0]) ? to_us(ev->arg[0] - t0) : 0.0);
+        break;
+    case KTRACE_ALARM_WAKE:
+        printf("wake\n");
+        break;
+    case KTRACE_SYSCALL_ENTER:
+        printf("%s(0x%lx)\n", syscall_name((int64_t)ev->arg[0]),
+            (unsigned long)ev->arg[1]);
+        break;
+    case KTRACE_SYSCALL_EXIT:
+        printf("%s = %ld\n", syscall_name((int64_t)ev->arg[0]),
+            (long)ev->arg[1]);
+        break;
+    }
+}
+
+void account_event(const struct ktrace_event * ev) {
+    struct thread_state * const thr = &threads[ev->tid & (NTID-1)];
+    struct hart_state * const hart = &harts[ev->hart];
+    const int nr = (int64_t)ev->arg[0];
+
+    thr->seen = 1;
+
+    switch (ev->event) {
+    case KTRACE_SWITCH:
+        if (hart->start != 0)
+            thr->run_time += ev->time - hart->start;
+
+        hart->start = ev->time;
+        hart->tid = ev->arg[0] & (NTID-1);
+        threads[hart->tid].seen = 1;
+        threads[hart->tid].nswitch += 1;
+        break;
+    case KTRACE_BLK_SUBMIT:
+        thr->blk_time = ev->time;
+        thr->blk_pending = 1;
+        break;
+    case KTRACE_BLK_COMPLETE:
+        if (thr->blk_pending)
+            hist_add(&blk_hist[ev->arg[1] != 0], ev->time - thr->blk_time);
+        thr->blk_pending = 0;
+        break;
+    case KTRACE_ALARM_WAKE:
+        if (ev->arg[0] <= ev->time)
+            hist_add(&wake_hist, ev->time - ev->arg[0]);
+        break;
+    case KTRACE_SYSCALL_ENTER:
+        thr->syscall_time = ev->time;
+        thr->syscall_nr = nr;
+        break;
+    case KTRACE_SYSCALL_EXIT:
+        if (thr->syscall_nr == nr && 0 <= nr && nr < NSYSCALLS)
+            hist_add(&syscall_hist[nr], ev->time - thr->syscall_time);
+        thr->syscall_nr = -2;
+        break;
+    }
+}
+
+void hist_add(struct hist * h, uint64_t ticks) {
+    uint64_t us = ticks / (TIMER_FREQ / 1000000);
+    int b = 0;
+
+    while (us != 0 && b < NBUCKETS-1) {
+        us >>= 1;
+        b += 1;
+    }
+
+    h->bucket[b] += 1;
+    h->count += 1;
+}
+
+// Prints a histogram with a bar of up to 40 stars per bucket, from the first to
+// the last bucket used. Bucket b counts latencies in [2^(b-1), 2^b) us.
+
+void hist_print(const struct hist * h) {
+    uint64_t max = 0;
+    int first, last;
+    int b;
+
+    if (h->count == 0)
+        return;
+
+    for (b = 0; b < NBUCKETS; b++)
+        if (max < h->bucket[b])
+            max = h->bucket[b];
+
+    for (first = 0; h->bucket[first] == 0; first++)
+        continue;
+    for (last = NBUCKETS-1; h->bucket[last] == 0; last--)
+        continue;
+
+    printf("\n%s (us): %lu\n", h->name, (unsigned long)h->count);
+
+    for (b = first; b <= last; b++) {
+        printf("%10lu -> %-10lu : %-8lu |%-40.*s|\n",
+            b ? 1UL << (b-1) : 0UL, (1UL << b) - 1,
+            (unsigned long)h->bucket[b],
+            (int)(40 * h->bucket[b] / max),
+            "****************************************");
+    }
+}
+
+const char * syscall_name(int nr) {
+    if (nr < 0 || NSYSCALLS <= nr || syscall_names[nr] == NULL)
+        return "nosys";
+    else
+        return syscall_names[nr];
+}
+
+double to_us(uint64_t ticks) {
+    return ticks / (TIMER_FREQ / 1e6);
+}
+
+// Orders events by time, keeping events with the same time in input order.
+
+int compare_event_ptrs(const void * a, const void * b) {
+    const struct ktrace_event * const ea = *(const struct ktrace_event **)a;
+    const struct ktrace_event * const eb = *(const struct ktrace_event **)b;
+
+    if (ea->time != eb->time)
+        return (ea->time > eb->time) - (ea->time < eb->time);
+    else
+        return (ea > eb) - (ea < eb);
+}
+
+void * xrealloc(void * ptr, size_t size) {
+    ptr = realloc(ptr, size ? size : 1);
+
+    if (ptr == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+
+    return ptr;
+}
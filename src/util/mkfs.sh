@@ -1 +1 @@
-./mkfs ../kern/kfs.raw ../user/bin/init_fib_fib ../user/bin/init_fib_rule30 ../user/bin/init_trek_rule30 ../user/bin/fib ../user/bin/trek ../user/bin/rule30 ../user/bin/test_refcnt ../user/bin/test_locking ../user/bin/test_extra_credit testfile.txt
\ No newline at end of file
+./mkfs ../kern/kfs.raw ../user/bin/init_fib_fib ../user/bin/init_fib_rule30 ../user/bin/init_trek_rule30 ../user/bin/fib ../user/bin/trek ../user/bin/rule30 ../user/bin/test_refcnt ../user/bin/test_locking ../user/bin/test_extra_credit ../user/bin/test_ulock ../user/bin/test_threads ../user/bin/test_ioring ../user/bin/test_pio ../user/bin/profdump ../user/bin/tracedump ../user/bin/top ../user/bin/lockstat ../user/bin/bench_syscall testfile.txt
\ No newline at end of file
@@ -0,0 +1,305 @@
+// profsym.c - Symbolize profiler samples as folded stacks
+//
+// Usage: profsym kernel.elf [user.elf | pid=user.elf ...] < prof.bin
+//
+// Reads struct prof_sample records (see kern/prof.h), as copied out of the
+// machine by user/profdump, and prints one line per distinct stack in the
+// folded format read by flamegraph.pl:
+//
+//     pid 3;main;fib;fib 42
+//
+// The first frame names the process (or the thread, for kernel threads), the
+// others are functions from the outermost to the one interrupted, followed by
+// the number of samples. S-mode pcs are looked up in kernel.elf. U-mode pcs are
+// looked up in the program given for the sample's pid, or else in the program
+// given without a pid. All user programs are linked at the same address, so
+// only the right program gives the right names. Addresses without a symbol are
+// printed in hex.
+//
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../kern/prof.h"
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct sym {
+    uint64_t addr;
+    uint64_t size; // 0 if unknown
+    const char * name;
+};
+
+struct image {
+    int pid; // -1 for the default user program and the kernel
+    struct sym * syms; // sorted by address
+    size_t nsyms;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void load_image(struct image * img, const char * path);
+static const char * lookup(const struct image * img, uint64_t addr);
+static void format_stack(char * buf, size_t bufsz,
+    const struct prof_sample * s, const struct image * img);
+static int compare_syms(const void * a, const void * b);
+static int compare_strs(const void * a, const void * b);
+static void * xrealloc(void * ptr, size_t size);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int main(int argc, char * argv[]) {
+    struct image * uimgs;
+    struct image kimg;
+    const struct image * img;
+    struct prof_sample s;
+    char ** stacks = NULL;
+    size_t nstacks = 0;
+    size_t cap = 0;
+    char buf[4096];
+    const char * eq;
+    size_t i, j;
+    int nuimgs;
+    int k;
+
+    if (argc < 2) {
+        fprintf(stderr,
+            "Usage: %s kernel.elf [user.elf | pid=user.elf ...] < prof.bin\n",
+            argv[0]);
+        return 1;
+    }
+
+    kimg.pid = -1;
+    load_image(&kimg, argv[1]);
+
+    nuimgs = argc - 2;
+    uimgs = xrealloc(NULL, (nuimgs + 1) * sizeof(struct image));
+
+    for (k = 0; k < nuimgs; k++) {
+        eq = strchr(argv[k+2], '=');
+
+        if (eq != NULL) {
+            uimgs[k].pid = atoi(argv[k+2]);
+            load_image(&uimgs[k], eq+1);
+        } else {
+            uimgs[k].pid = -1;
+            load_image(&uimgs[k], argv[k+2]);
+        }
+    }
+
+    while (fread(&s, sizeof(s), 1, stdin) == 1) {
+        if (s.depth == 0 || PROF_DEPTH < s.depth) {
+            fprintf(stderr, "%s: bad sample, input out of sync?\n", argv[0]);
+            return 1;
+        }
+
+        img = NULL;
+
+        if (s.smode)
+            img = &kimg;
+        else {
+            for (k = 0; k < nuimgs; k++) {
+                if (uimgs[k].pid == s.pid)
+                    img = &uimgs[k];
+                else if (uimgs[k].pid == -1 && img == NULL)
+                    img = &uimgs[k];
+            }
+        }
+
+        format_stack(buf, sizeof(buf), &s, img);
+
+        if (nstacks == cap) {
+            cap = cap ? 2*cap : 1024;
+            stacks = xrealloc(stacks, cap * sizeof(char *));
+        }
+
+        stacks[nstacks] = strdup(buf);
+        nstacks += 1;
+    }
+
+    // Print each distinct stack with the number of samples that had it.
+
+    qsort(stacks, nstacks, sizeof(char *), compare_strs);
+
+    for (i = 0; i < nstacks; i = j) {
+        for (j = i+1; j < nstacks && strcmp(stacks[i], stacks[j]) == 0; j++)
+            continue;
+        printf("%s %zu\n", stacks[i], j - i);
+    }
+
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Loads the function symbols of an ELF64 file.
+
+void load_image(struct image * img, const char * path) {
+    const Elf64_Shdr * shdrs;
+    const Elf64_Ehdr * ehdr;
+    const Elf64_Sym * syms;
+    const char * strtab;
+    size_t nsyms;
+    char * data;
+    FILE * fp;
+    long len;
+    size_t i;
+    int k;
+
+    img->syms = NULL;
+    img->nsyms = 0;
+
+    fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = xrealloc(NULL, len);
+
+    if (fread(data, 1, len, fp) != (size_t)len) {
+        perror(path);
+        exit(1);
+    }
+
+    fclose(fp);
+
+    ehdr = (const Elf64_Ehdr *)data;
+
+    if ((size_t)len < sizeof(Elf64_Ehdr) ||
+        memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64)
+    {
+        fprintf(stderr, "%s: not an ELF64 file\n", path);
+        exit(1);
+    }
+
+    shdrs = (const Elf64_Shdr *)(data + ehdr->e_shoff);
+
+    for (k = 0; k < ehdr->e_shnum; k++) {
+        if (shdrs[k].sh_type != SHT_SYMTAB)
+            continue;
+
+        syms = (const Elf64_Sym *)(data + shdrs[k].sh_offset);
+        nsyms = shdrs[k].sh_size / sizeof(Elf64_Sym);
+        strtab = data + shdrs[shdrs[k].sh_link].sh_offset;
+        img->syms = xrealloc(NULL, nsyms * sizeof(struct sym));
+
+        for (i = 0; i < nsyms; i++) {
+            if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC ||
+                syms[i].st_value == 0)
+            {
+                continue;
+            }
+
+            img->syms[img->nsyms].addr = syms[i].st_value;
+            img->syms[img->nsyms].size = syms[i].st_size;
+            img->syms[img->nsyms].name = strtab + syms[i].st_name;
+            img->nsyms += 1;
+        }
+
+        break;
+    }
+
+    if (img->nsyms == 0)
+        fprintf(stderr, "%s: no function symbols\n", path);
+
+    qsort(img->syms, img->nsyms, sizeof(struct sym), compare_syms);
+}
+
+// Returns the name of the function containing /addr/, or NULL.
+
+const char * lookup(const struct image * img, uint64_t addr) {
+    size_t lo = 0;
+    size_t hi;
+    size_t mid;
+
+    if (img == NULL)
+        return NULL;
+
+    // Find the last symbol at or below addr.
+
+    hi = img->nsyms;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if (img->syms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    if (img->syms[lo-1].size != 0 &&
+        img->syms[lo-1].addr + img->syms[lo-1].size <= addr)
+    {
+        return NULL;
+    }
+
+    return img->syms[lo-1].name;
+}
+
+// Formats the stack of a sample, outermost frame first. Return addresses point
+// after the call, which may be the start of the next function, so they are
+// looked up one byte back.
+
+void format_stack(char * buf, size_t bufsz,
+    const struct prof_sample * s, const struct image * img)
+{
+    const char * name;
+    uint64_t addr;
+    size_t pos;
+    int i;
+
+    if (s->pid >= 0)
+        pos = snprintf(buf, bufsz, "pid %d", s->pid);
+    else
+        pos = snprintf(buf, bufsz, "tid %d", s->tid);
+
+    for (i = s->depth - 1; i >= 0 && pos < bufsz; i--) {
+        addr = (i == 0) ? s->pc[i] : s->pc[i] - 1;
+        name = lookup(img, addr);
+
+        if (name != NULL)
+            pos += snprintf(buf + pos, bufsz - pos, ";%s", name);
+        else
+            pos += snprintf(buf + pos, bufsz - pos, ";0x%lx",
+                (unsigned long)s->pc[i]);
+    }
+}
+
+int compare_syms(const void * a, const void * b) {
+    const struct sym * const sa = a;
+    const struct sym * const sb = b;
+
+    return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+int compare_strs(const void * a, const void * b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+void * xrealloc(void * ptr, size_t size) {
+    ptr = realloc(ptr, size ? size : 1);
+
+    if (ptr == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+
+    return ptr;
+}